@@ -0,0 +1,112 @@
+// Compares the fadbad types with the SIMD dual numbers in spii/dual.h
+// for terms with different numbers of scalars.
+//
+
+#include <iostream>
+#include <random>
+
+#include <spii/auto_diff_term.h>
+using namespace spii;
+
+#include "hastighet.h"
+
+// A residual similar to a camera projection error, mixing products,
+// divisions and transcendental functions of all scalars.
+template<int N>
+struct Residual
+{
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		R numerator = 0;
+		R denominator = 1.0;
+		for (int i = 0; i < N; ++i) {
+			numerator += x[i] * x[(i + 1) % N] + sin(x[i]);
+			denominator += 0.1 * x[i] * x[i];
+		}
+		R r = numerator / denominator - 1.0;
+		return r * r + exp(0.01 * x[0]);
+	}
+};
+
+template<int N>
+struct SimdResidual
+	: public Residual<N>
+{
+	static const bool use_simd_dual = true;
+};
+
+template<typename Functor, int N>
+class DualBenchmark :
+	public hastighet::Test
+{
+public:
+	AutoDiffTerm<Functor, N> term;
+	std::vector<std::vector<double>> points;
+	double gradient[N];
+	double hessian[N * N];
+	double out;
+
+	DualBenchmark()
+	{
+		std::mt19937 prng(unsigned(1));
+		std::normal_distribution<double> normal;
+		points.resize(1000);
+		for (auto& point: points) {
+			for (int i = 0; i < N; ++i) {
+				point.push_back(normal(prng));
+			}
+		}
+		out = 0;
+	}
+
+	void gradients()
+	{
+		for (auto& point: points) {
+			double* variables[] = {point.data()};
+			out += term.evaluate_flat(variables, gradient, nullptr, false);
+		}
+	}
+
+	void hessians()
+	{
+		for (auto& point: points) {
+			double* variables[] = {point.data()};
+			out += term.evaluate_flat(variables, gradient, hessian, false);
+		}
+	}
+};
+
+typedef DualBenchmark<Residual<3>, 3>       Fadbad3;
+typedef DualBenchmark<SimdResidual<3>, 3>   Simd3;
+typedef DualBenchmark<Residual<6>, 6>       Fadbad6;
+typedef DualBenchmark<SimdResidual<6>, 6>   Simd6;
+typedef DualBenchmark<Residual<9>, 9>       Fadbad9;
+typedef DualBenchmark<SimdResidual<9>, 9>   Simd9;
+typedef DualBenchmark<Residual<12>, 12>     Fadbad12;
+typedef DualBenchmark<SimdResidual<12>, 12> Simd12;
+
+BENCHMARK_F(Fadbad3, gradient)  { gradients(); }
+BENCHMARK_F(Simd3, gradient)    { gradients(); }
+BENCHMARK_F(Fadbad3, hessian)   { hessians(); }
+BENCHMARK_F(Simd3, hessian)     { hessians(); }
+
+BENCHMARK_F(Fadbad6, gradient)  { gradients(); }
+BENCHMARK_F(Simd6, gradient)    { gradients(); }
+BENCHMARK_F(Fadbad6, hessian)   { hessians(); }
+BENCHMARK_F(Simd6, hessian)     { hessians(); }
+
+BENCHMARK_F(Fadbad9, gradient)  { gradients(); }
+BENCHMARK_F(Simd9, gradient)    { gradients(); }
+BENCHMARK_F(Fadbad9, hessian)   { hessians(); }
+BENCHMARK_F(Simd9, hessian)     { hessians(); }
+
+BENCHMARK_F(Fadbad12, gradient) { gradients(); }
+BENCHMARK_F(Simd12, gradient)   { gradients(); }
+BENCHMARK_F(Fadbad12, hessian)  { hessians(); }
+BENCHMARK_F(Simd12, hessian)    { hessians(); }
+
+int main(int argc, char** argv)
+{
+	hastighet::Benchmarker::RunAllTests(argc, argv);
+}
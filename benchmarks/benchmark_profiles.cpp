@@ -0,0 +1,681 @@
+//
+// Performance profiles [1] of the solvers over the test problem
+// suites in tests/ (Moré et al., test_opt, UCTP, the large problems
+// from Andrei and the NIST problems).
+//
+// Every solver configuration is run on every problem and the number
+// of function evaluations, the number of iterations, the wall time
+// and the final gradient norm are recorded. For each of the three
+// costs, the performance profile of configuration s is
+//
+//   rho_s(tau) = |{p : r_ps <= tau}| / |P|,
+//
+// where r_ps is the cost of s on p divided by the lowest cost of any
+// configuration on p. A run counts as solving the problem if
+//
+//   f(x0) - f(x) >= (1 - tolerance) (f(x0) - f_best),
+//
+// where f_best is the lowest value found by any configuration;
+// otherwise r_ps is infinite. Configurations that are not run on a
+// problem (e.g. Newton on some of the large problems or derivative-
+// free solvers on many variables) do not solve it.
+//
+//   benchmark_profiles [options]
+//
+//   --filter TEXT     Only run problems whose name contains TEXT.
+//   --solvers A,B,... Only run these configurations.
+//   --tolerance T     Tolerance of the convergence test (default 1e-6).
+//   --large-sizes     Also run the large problems with 10000 variables.
+//   --json FILE       Write all runs and profiles as JSON to FILE.
+//
+// The NIST data files are read from nist/ (copied to the binary
+// directory by the build).
+//
+// [1] E. D. Dolan and J. J. Moré, "Benchmarking optimization
+//     software with performance profiles", Mathematical Programming
+//     91(2):201-213, 2002.
+//
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/solver.h>
+using namespace spii;
+
+//
+// Solver configurations.
+//
+
+struct Configuration
+{
+	std::string name;
+	// Whether the solver uses the Hessian.
+	bool second_order;
+	// Largest number of variables the solver is run with.
+	std::size_t maximum_variables;
+	std::function<std::unique_ptr<Solver>()> create;
+};
+
+template<typename SolverClass>
+std::unique_ptr<SolverClass> create_gradient_solver()
+{
+	std::unique_ptr<SolverClass> solver(new SolverClass);
+	solver->maximum_iterations = 10000;
+	solver->function_improvement_tolerance = 0;
+	solver->argument_improvement_tolerance = 0;
+	solver->gradient_tolerance = 1e-7;
+	return solver;
+}
+
+std::vector<Configuration> create_configurations()
+{
+	const auto unlimited = std::numeric_limits<std::size_t>::max();
+	std::vector<Configuration> configurations;
+
+	configurations.push_back({"newton", true, unlimited, []() -> std::unique_ptr<Solver>
+	{
+		return create_gradient_solver<NewtonSolver>();
+	}});
+
+	configurations.push_back({"newton_wolfe", true, unlimited, []() -> std::unique_ptr<Solver>
+	{
+		auto solver = create_gradient_solver<NewtonSolver>();
+		solver->line_search_type = Solver::WOLFE;
+		return solver;
+	}});
+
+	configurations.push_back({"newton_iterative", true, unlimited, []() -> std::unique_ptr<Solver>
+	{
+		auto solver = create_gradient_solver<NewtonSolver>();
+		solver->factorization_method = NewtonSolver::FactorizationMethod::ITERATIVE;
+		return solver;
+	}});
+
+	#ifdef USE_SYM_ILDL
+		configurations.push_back({"newton_sym_ildl", true, unlimited, []() -> std::unique_ptr<Solver>
+		{
+			auto solver = create_gradient_solver<NewtonSolver>();
+			solver->factorization_method = NewtonSolver::FactorizationMethod::SYM_ILDL;
+			return solver;
+		}});
+	#endif
+
+	configurations.push_back({"lbfgs", false, unlimited, []() -> std::unique_ptr<Solver>
+	{
+		auto solver = create_gradient_solver<LBFGSSolver>();
+		solver->lbfgs_history_size = 40;
+		return solver;
+	}});
+
+	configurations.push_back({"lbfgs_wolfe", false, unlimited, []() -> std::unique_ptr<Solver>
+	{
+		auto solver = create_gradient_solver<LBFGSSolver>();
+		solver->lbfgs_history_size = 40;
+		solver->line_search_type = Solver::WOLFE;
+		return solver;
+	}});
+
+	configurations.push_back({"nelder_mead", false, 20, []() -> std::unique_ptr<Solver>
+	{
+		std::unique_ptr<NelderMeadSolver> solver(new NelderMeadSolver);
+		solver->maximum_iterations = 100000;
+		solver->area_tolerance   = 0;
+		solver->length_tolerance = 1e-20;
+		return solver;
+	}});
+
+	configurations.push_back({"pattern", false, 20, []() -> std::unique_ptr<Solver>
+	{
+		std::unique_ptr<PatternSolver> solver(new PatternSolver);
+		solver->maximum_iterations = 500000;
+		solver->area_tolerance = 1e-18;
+		solver->function_improvement_tolerance = 1e-12;
+		return solver;
+	}});
+
+	return configurations;
+}
+
+//
+// Problems and runs.
+//
+
+struct Run
+{
+	std::string problem;
+	std::string configuration;
+	std::size_t variables;
+	bool exception = false;
+	int exit_condition = SolverResults::NA;
+	int evaluations = 0;
+	int iterations = 0;
+	double time = 0;
+	double initial_value = 0;
+	double final_value = 0;
+	double initial_gradient_norm = 0;
+	double final_gradient_norm = 0;
+	bool solved = false;
+};
+
+struct Problem
+{
+	std::string suite;
+	std::string name;
+	std::function<void()> run;
+};
+
+std::vector<Problem>& problems()
+{
+	static std::vector<Problem> all_problems;
+	return all_problems;
+}
+
+bool register_problem(const std::string& suite, const std::string& name, const std::function<void()>& run)
+{
+	problems().push_back({suite, name, run});
+	return true;
+}
+
+// State of the problem currently being run.
+const Configuration* current_configuration = nullptr;
+std::string current_suite;
+std::string current_problem;
+int current_run_number = 0;
+std::vector<Run> runs;
+
+double gradient_norm(const Function& function, Eigen::VectorXd* x, double* value)
+{
+	Eigen::VectorXd gradient;
+	function.copy_user_to_global(x);
+	*value = function.evaluate(*x, &gradient);
+	return gradient.size() > 0 ? gradient.lpNorm<Eigen::Infinity>() : 0.0;
+}
+
+// Solves the function with solver and records the run. Called by
+// the run_test functions of the suites.
+void record_run(const Function& function, const Solver& solver)
+{
+	Run run;
+	run.problem = current_suite + "/" + current_problem;
+	if (current_run_number > 0) {
+		run.problem += "#" + std::to_string(current_run_number + 1);
+	}
+	current_run_number++;
+	run.configuration = current_configuration->name;
+	run.variables = function.get_number_of_scalars();
+
+	Eigen::VectorXd x(run.variables);
+	run.initial_gradient_norm = gradient_norm(function, &x, &run.initial_value);
+
+	if (run.variables > current_configuration->maximum_variables) {
+		// Not run; does not solve the problem.
+		run.exception = true;
+		runs.push_back(run);
+		return;
+	}
+
+	int evaluations_before = function.evaluations_with_gradient
+	                       + function.evaluations_without_gradient;
+	try {
+		SolverResults results;
+		solver.solve(function, &results);
+		run.exit_condition = results.exit_condition;
+		run.iterations = results.iterations;
+		run.time = results.total_time - results.log_time;
+	}
+	catch (std::exception&) {
+		run.exception = true;
+	}
+	run.evaluations = function.evaluations_with_gradient
+	                + function.evaluations_without_gradient
+	                - evaluations_before;
+
+	run.final_gradient_norm = gradient_norm(function, &x, &run.final_value);
+	runs.push_back(run);
+}
+
+std::unique_ptr<Solver> create_solver()
+{
+	auto solver = current_configuration->create();
+	solver->log_function = [](const std::string&) { };
+	return solver;
+}
+
+//
+// Interface expected by the suites.
+//
+
+#define TEST(Category, Name)                                       \
+	void Category ## _ ## Name();                                  \
+	const bool Category ## _ ## Name ## _registered =              \
+		register_problem(current_suite, #Name, Category ## _ ## Name); \
+	void Category ## _ ## Name()
+
+#define TEST_CASE_NAME_(prefix, line) prefix ## line
+#define TEST_CASE_NAME(prefix, line) TEST_CASE_NAME_(prefix, line)
+#define TEST_CASE(name, tags)                                      \
+	void TEST_CASE_NAME(test_case_, __LINE__)();                   \
+	const bool TEST_CASE_NAME(test_case_registered_, __LINE__) =   \
+		register_problem(current_suite, name, TEST_CASE_NAME(test_case_, __LINE__)); \
+	void TEST_CASE_NAME(test_case_, __LINE__)()
+
+// The suites check the solutions; here, the convergence test below
+// is used for all of them. The checked expressions are still
+// evaluated, since they are often the only use of a variable.
+#define EXPECT_LT(a, b) ((void)(a), (void)(b))
+#define EXPECT_TRUE(a)  ((void)(a))
+#define CHECK(a)        ((void)(a))
+#define INFO(message)   ((void)0)
+
+template<typename Functor, int dimension>
+double run_test(double* var, const Solver* solver = 0)
+{
+	Function f;
+	f.add_variable(var, dimension);
+	f.add_term(std::make_shared<AutoDiffTerm<Functor, dimension>>(), var);
+
+	auto own_solver = create_solver();
+	if (solver == 0) {
+		solver = own_solver.get();
+	}
+	record_run(f, *solver);
+	return f.evaluate();
+}
+
+std::vector<int> large_sizes = {100, 1000};
+
+void run_test(const std::function<void(std::vector<double>&, Function*)>& create_f,
+              const std::function<std::vector<double>(int)>& start,
+              bool test_newton = true)
+{
+	auto problem = current_problem;
+	for (int n: large_sizes) {
+		auto this_start = start(n);
+		Function f;
+		f.hessian_is_enabled = current_configuration->second_order;
+		create_f(this_start, &f);
+
+		current_problem = problem + "-" + std::to_string(n);
+		current_run_number = 0;
+		if (current_configuration->second_order && !test_newton) {
+			// Does not solve the problem.
+			Run run;
+			run.problem = current_suite + "/" + current_problem;
+			run.configuration = current_configuration->name;
+			run.variables = f.get_number_of_scalars();
+			run.exception = true;
+			runs.push_back(run);
+			continue;
+		}
+		record_run(f, *create_solver());
+	}
+	current_problem = problem;
+}
+
+// current_suite is set before each suite is included, so that the
+// problems are registered with the correct suite.
+const bool more_et_al_suite = (current_suite = "more_et_al", true);
+#include "../tests/suite_more_et_al.h"
+const bool test_opt_suite = (current_suite = "test_opt", true);
+#include "../tests/suite_test_opt.h"
+const bool uctp_suite = (current_suite = "uctp", true);
+#include "../tests/suite_uctp.h"
+
+// The large suite reuses some model names.
+namespace andrei {
+const bool andrei_suite = (current_suite = "andrei", true);
+#include "../tests/large_suite_andrei.h"
+}
+
+#include "../tests/nist_problem.h"
+
+template<typename Model, int num_variables>
+void run_nist_problem(const std::string& filename)
+{
+	NISTProblem problem(filename);
+
+	// A problem for each starting point provided by the data file.
+	auto name = current_problem;
+	for (int start = 0; start < problem.initial_parameters.rows(); ++start) {
+		Eigen::VectorXd parameters = problem.initial_parameters.row(start);
+
+		Function function;
+		function.hessian_is_enabled = current_configuration->second_order;
+		function.add_variable(parameters.data(), num_variables);
+		for (int i = 0; i < problem.predictor.rows(); ++i) {
+			double x = problem.predictor(i, 0);
+			double y = problem.response(i, 0);
+			function.add_term(std::make_shared<AutoDiffTerm<Model, num_variables>>(x, y),
+			                  parameters.data());
+		}
+
+		current_problem = name + "-start" + std::to_string(start + 1);
+		current_run_number = 0;
+		record_run(function, *create_solver());
+	}
+	current_problem = name;
+}
+
+namespace nist {
+const bool nist_suite = (current_suite = "nist", true);
+#define NIST_PROBLEM(Category, Problem, n)                         \
+	const bool Problem ## _registered = register_problem(         \
+		current_suite, #Problem,                                   \
+		[]() { run_nist_problem<Problem, n>("nist/" #Problem ".dat"); });
+#include "../tests/suite_nist.h"
+}
+
+//
+// Performance profiles.
+//
+
+struct Metric
+{
+	std::string name;
+	std::function<double(const Run&)> cost;
+};
+
+struct Profile
+{
+	std::string metric;
+	std::vector<double> taus;
+	// rho[s][i] is the fraction of problems configuration s solves
+	// within a factor taus[i] of the best configuration.
+	std::vector<std::vector<double>> rho;
+	std::vector<std::string> configurations;
+};
+
+// Marks the runs solving their problem according to the convergence
+// test in the top of the file.
+void evaluate_convergence(std::vector<Run>* runs, double tolerance)
+{
+	std::map<std::string, double> best_value;
+	for (const auto& run: *runs) {
+		if (!run.exception && std::isfinite(run.final_value)) {
+			auto entry = best_value.find(run.problem);
+			if (entry == best_value.end() || run.final_value < entry->second) {
+				best_value[run.problem] = run.final_value;
+			}
+		}
+	}
+
+	for (auto& run: *runs) {
+		auto entry = best_value.find(run.problem);
+		if (run.exception || entry == best_value.end() || !std::isfinite(run.final_value)) {
+			run.solved = false;
+			continue;
+		}
+		double decrease      = run.initial_value - run.final_value;
+		double best_decrease = run.initial_value - entry->second;
+		run.solved = decrease >= (1.0 - tolerance) * best_decrease;
+	}
+}
+
+Profile compute_profile(const std::vector<Run>& runs,
+                        const std::vector<std::string>& configurations,
+                        const Metric& metric)
+{
+	const double infinity = std::numeric_limits<double>::infinity();
+
+	// ratio[problem][configuration]
+	std::map<std::string, std::map<std::string, double>> costs;
+	for (const auto& run: runs) {
+		costs[run.problem][run.configuration] = run.solved ? metric.cost(run) : infinity;
+	}
+
+	std::map<std::string, std::vector<double>> ratios;
+	double max_ratio = 1.0;
+	for (const auto& problem: costs) {
+		double best = infinity;
+		for (const auto& entry: problem.second) {
+			best = std::min(best, entry.second);
+		}
+		for (const auto& configuration: configurations) {
+			auto entry = problem.second.find(configuration);
+			double ratio = infinity;
+			if (entry != problem.second.end() && best < infinity) {
+				ratio = entry->second / best;
+			}
+			ratios[configuration].push_back(ratio);
+			if (ratio < infinity) {
+				max_ratio = std::max(max_ratio, ratio);
+			}
+		}
+	}
+
+	Profile profile;
+	profile.metric = metric.name;
+	profile.configurations = configurations;
+	for (double tau = 1.0; ; tau *= std::sqrt(2.0)) {
+		profile.taus.push_back(std::min(tau, max_ratio));
+		if (tau >= max_ratio) {
+			break;
+		}
+	}
+
+	for (const auto& configuration: configurations) {
+		const auto& r = ratios[configuration];
+		std::vector<double> rho;
+		for (double tau: profile.taus) {
+			auto count = std::count_if(r.begin(), r.end(), [tau](double ratio) { return ratio <= tau; });
+			rho.push_back(r.empty() ? 0.0 : double(count) / r.size());
+		}
+		profile.rho.push_back(rho);
+	}
+	return profile;
+}
+
+void print_profile(std::ostream& out, const Profile& profile)
+{
+	using namespace std;
+	out << "\nPerformance profile: " << profile.metric << "\n";
+	out << setw(18) << left << "tau";
+	for (const auto& configuration: profile.configurations) {
+		out << setw(17) << right << configuration;
+	}
+	out << "\n";
+	for (size_t i = 0; i < profile.taus.size(); ++i) {
+		out << setw(18) << left << setprecision(4) << profile.taus[i];
+		for (size_t s = 0; s < profile.configurations.size(); ++s) {
+			out << setw(17) << right << fixed << setprecision(3) << profile.rho[s][i];
+		}
+		out.unsetf(ios::floatfield);
+		out << "\n";
+	}
+}
+
+std::string json_string(const std::string& str)
+{
+	std::string out = "\"";
+	for (auto c: str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+// JSON has no infinity or NaN.
+std::string json_number(double value)
+{
+	if (!std::isfinite(value)) {
+		return "null";
+	}
+	std::stringstream sout;
+	sout.precision(12);
+	sout << value;
+	return sout.str();
+}
+
+void write_json(std::ostream& out,
+                const std::vector<Run>& runs,
+                const std::vector<Profile>& profiles,
+                double tolerance)
+{
+	out << "{\n";
+	out << "  \"tolerance\": " << json_number(tolerance) << ",\n";
+	out << "  \"runs\": [\n";
+	for (std::size_t i = 0; i < runs.size(); ++i) {
+		const auto& run = runs[i];
+		out << "    {\"problem\": " << json_string(run.problem)
+		    << ", \"configuration\": " << json_string(run.configuration)
+		    << ", \"variables\": " << run.variables
+		    << ", \"failed\": " << (run.exception ? "true" : "false")
+		    << ", \"exit_condition\": " << run.exit_condition
+		    << ", \"evaluations\": " << run.evaluations
+		    << ", \"iterations\": " << run.iterations
+		    << ", \"time\": " << json_number(run.time)
+		    << ", \"initial_value\": " << json_number(run.initial_value)
+		    << ", \"final_value\": " << json_number(run.final_value)
+		    << ", \"initial_gradient_norm\": " << json_number(run.initial_gradient_norm)
+		    << ", \"final_gradient_norm\": " << json_number(run.final_gradient_norm)
+		    << ", \"solved\": " << (run.solved ? "true" : "false")
+		    << "}" << (i + 1 < runs.size() ? "," : "") << "\n";
+	}
+	out << "  ],\n";
+	out << "  \"profiles\": {\n";
+	for (std::size_t p = 0; p < profiles.size(); ++p) {
+		const auto& profile = profiles[p];
+		out << "    " << json_string(profile.metric) << ": {\"tau\": [";
+		for (std::size_t i = 0; i < profile.taus.size(); ++i) {
+			out << (i > 0 ? ", " : "") << json_number(profile.taus[i]);
+		}
+		out << "], \"rho\": {";
+		for (std::size_t s = 0; s < profile.configurations.size(); ++s) {
+			out << (s > 0 ? ", " : "") << json_string(profile.configurations[s]) << ": [";
+			for (std::size_t i = 0; i < profile.taus.size(); ++i) {
+				out << (i > 0 ? ", " : "") << json_number(profile.rho[s][i]);
+			}
+			out << "]";
+		}
+		out << "}}" << (p + 1 < profiles.size() ? "," : "") << "\n";
+	}
+	out << "  }\n";
+	out << "}\n";
+}
+
+int main(int argc, char** argv)
+{
+	using namespace std;
+
+	string filter;
+	string json_filename;
+	string solvers;
+	double tolerance = 1e-6;
+
+	for (int a = 1; a < argc; ++a) {
+		string arg = argv[a];
+		bool has_value = a + 1 < argc;
+		if (arg == "--filter" && has_value) {
+			filter = argv[++a];
+		}
+		else if (arg == "--solvers" && has_value) {
+			solvers = string(",") + argv[++a] + ",";
+		}
+		else if (arg == "--tolerance" && has_value) {
+			tolerance = atof(argv[++a]);
+		}
+		else if (arg == "--large-sizes") {
+			large_sizes.push_back(10000);
+		}
+		else if (arg == "--json" && has_value) {
+			json_filename = argv[++a];
+		}
+		else {
+			cerr << "Invalid argument: \"" << arg << "\"" << endl;
+			return 2;
+		}
+	}
+
+	vector<string> configuration_names;
+	auto configurations = create_configurations();
+	for (const auto& configuration: configurations) {
+		if (solvers.empty() || solvers.find("," + configuration.name + ",") != string::npos) {
+			configuration_names.push_back(configuration.name);
+		}
+	}
+
+	for (const auto& problem: problems()) {
+		string name = problem.suite + "/" + problem.name;
+		if (name.find(filter) == string::npos) {
+			continue;
+		}
+		cout << setw(40) << left << name << flush;
+		for (const auto& configuration: configurations) {
+			if (find(configuration_names.begin(), configuration_names.end(), configuration.name)
+			    == configuration_names.end()) {
+				continue;
+			}
+			current_configuration = &configuration;
+			current_suite = problem.suite;
+			current_problem = problem.name;
+			current_run_number = 0;
+			auto runs_before = runs.size();
+			try {
+				problem.run();
+			}
+			catch (std::exception& e) {
+				cout << " error: " << e.what();
+				break;
+			}
+			int evaluations = 0;
+			for (auto i = runs_before; i < runs.size(); ++i) {
+				evaluations += runs[i].evaluations;
+			}
+			cout << " " << configuration.name << ":" << evaluations << flush;
+		}
+		cout << endl;
+	}
+
+	// Problems with an error (e.g. missing data) for one configuration
+	// are removed for all of them.
+	map<string, size_t> runs_per_problem;
+	for (const auto& run: runs) {
+		runs_per_problem[run.problem]++;
+	}
+	runs.erase(remove_if(runs.begin(), runs.end(), [&](const Run& run)
+		{
+			return runs_per_problem[run.problem] != configuration_names.size();
+		}), runs.end());
+
+	evaluate_convergence(&runs, tolerance);
+
+	vector<Metric> metrics = {
+		{"evaluations", [](const Run& run) { return max(1.0, double(run.evaluations)); }},
+		{"iterations",  [](const Run& run) { return max(1.0, double(run.iterations)); }},
+		{"time",        [](const Run& run) { return max(1e-6, run.time); }}
+	};
+
+	vector<Profile> profiles;
+	for (const auto& metric: metrics) {
+		profiles.push_back(compute_profile(runs, configuration_names, metric));
+		print_profile(cout, profiles.back());
+	}
+
+	cout << "\n" << setw(18) << left << "Solved";
+	for (const auto& configuration: configuration_names) {
+		auto solved = count_if(runs.begin(), runs.end(), [&](const Run& run)
+			{
+				return run.configuration == configuration && run.solved;
+			});
+		cout << setw(17) << right << (to_string(solved) + "/" + to_string(runs_per_problem.empty() ? 0 : runs.size() / configuration_names.size()));
+	}
+	cout << "\n";
+
+	if (!json_filename.empty()) {
+		ofstream fout(json_filename.c_str());
+		write_json(fout, runs, profiles, tolerance);
+	}
+}
@@ -8,26 +8,9 @@
 #include <spii/solver.h>
 using namespace spii;
 
+#include "benchmark_terms.h"
 #include "hastighet.h"
 
-// One term in the negative log-likelihood function for
-// a one-dimensional Gaussian distribution.
-struct NegLogLikelihood
-{
-	double sample;
-	NegLogLikelihood(double sample)
-	{
-		this->sample = sample;
-	}
-
-	template<typename R>
-	R operator()(const R* const mu, const R* const sigma) const
-	{
-		R diff = (*mu - sample) / *sigma;
-		return 0.5 * diff*diff + log(*sigma);
-	}
-};
-
 template<typename SolverClass>
 class LikelihoodBenchmark :
 	public hastighet::Test
@@ -85,21 +68,6 @@ BENCHMARK_F(LikelihoodBenchmarkLBFGSSolver, solver_1_lbfgs_iter)
 	solver.solve(f, &results);
 }
 
-struct LennardJonesTerm
-{
-	template<typename R>
-	R operator()(const R* const p1, const R* const p2) const
-	{
-		R dx = p1[0] - p2[0];
-		R dy = p1[1] - p2[1];
-		R dz = p1[2] - p2[2];
-		R r2 = dx*dx + dy*dy + dz*dz;
-		R r6  = r2*r2*r2;
-		R r12 = r6*r6;
-		return 1.0 / r12 - 2.0 / r6;
-	}
-};
-
 template<typename SolverClass>
 class LennardJonesBenchmark :
 	public hastighet::Test
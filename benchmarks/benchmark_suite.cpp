@@ -0,0 +1,747 @@
+//
+// Benchmark suite measuring how Function::evaluate and the solvers
+// scale with the problem size and the number of threads.
+//
+// Every combination of workload, problem size, operation and number
+// of threads is run repeatedly and the median, percentiles and a 95%
+// confidence interval for the median are reported.
+//
+//   benchmark_suite [options] [baseline file]
+//
+//   --quick          Smaller problem sizes.
+//   --threads N      Largest number of threads (default: all cores).
+//   --min-time S     Minimum time in seconds spent on each case.
+//   --filter TEXT    Only run cases whose name contains TEXT.
+//   --json FILE      Write all results as JSON to FILE.
+//   --save           Save the medians as the new baseline.
+//   --threshold R    Relative slowdown counted as a regression
+//                    (default 0.1).
+//
+// The baseline file has the same format as for the other benchmarks
+// (default: benchmark_suite.baseline). A case has regressed if the
+// lower end of its confidence interval is slower than the baseline by
+// more than the threshold. The program then returns 1.
+//
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <spii/auto_diff_term.h>
+#include <spii/function.h>
+#include <spii/interval_term.h>
+#include <spii/solver.h>
+using namespace spii;
+
+#include "benchmark_terms.h"
+#include "hastighet.h"
+
+//
+// Terms of the workloads. The other terms are shared with the other
+// benchmarks (see benchmark_terms.h).
+//
+
+// Data term of the denoising problem.
+struct DenoisingDataTerm
+{
+	double observed;
+	DenoisingDataTerm(double observed)
+	{
+		this->observed = observed;
+	}
+
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		R diff = *x - observed;
+		return 0.5 * diff * diff;
+	}
+};
+
+// Robust smoothness term between neighbouring pixels.
+struct DenoisingSmoothnessTerm
+{
+	template<typename R>
+	R operator()(const R* const x1, const R* const x2) const
+	{
+		R diff = *x1 - *x2;
+		return 10.0 * log(1.0 + diff * diff);
+	}
+};
+
+//
+// Workloads.
+//
+
+// A function together with storage for its variables.
+struct Problem
+{
+	Function function;
+	std::vector<double> variables;
+	std::vector<double> start;
+
+	// Restores the variables to the starting point.
+	void reset()
+	{
+		std::copy(start.begin(), start.end(), variables.begin());
+	}
+};
+
+// Maximum likelihood estimation of a Gaussian from size samples. The
+// terms support interval arithmetic for the global solver.
+void create_likelihood(int size, Problem* problem)
+{
+	std::mt19937 prng(unsigned(1));
+	std::normal_distribution<double> normal;
+	auto randn = std::bind(normal, prng);
+
+	problem->variables = {4.0, 1.0};
+	double* mu    = &problem->variables[0];
+	double* sigma = &problem->variables[1];
+	problem->function.add_variable(mu, 1);
+	problem->function.add_variable(sigma, 1);
+
+	for (int i = 0; i < size; ++i) {
+		double sample = 3.0*randn() + 5.0;
+		problem->function.add_term(std::make_shared<IntervalTerm<NegLogLikelihood, 1, 1>>(sample), mu, sigma);
+	}
+}
+
+// Lennard-Jones potential of size points.
+void create_lennard_jones(int size, Problem* problem)
+{
+	std::mt19937 prng(unsigned(1));
+	std::normal_distribution<double> normal;
+	auto randn = std::bind(normal, prng);
+
+	auto n = int(std::ceil(std::pow(double(size), 1.0/3.0)));
+
+	// Initial position is a cubic grid with random pertubations.
+	problem->variables.resize(3 * size);
+	for (int i = 0; i < size; ++i) {
+		int x =  i % n;
+		int y = (i / n) % n;
+		int z = (i / n) / n;
+
+		double* point = &problem->variables[3 * i];
+		problem->function.add_variable(point, 3);
+		point[0] = x + 0.05 * randn();
+		point[1] = y + 0.05 * randn();
+		point[2] = z + 0.05 * randn();
+	}
+
+	for (int i = 0; i < size; ++i) {
+		for (int j = i + 1; j < size; ++j) {
+			problem->function.add_term(
+				std::make_shared<AutoDiffTerm<LennardJonesTerm, 3, 3>>(),
+				&problem->variables[3 * i],
+				&problem->variables[3 * j]);
+		}
+	}
+}
+
+// Bundle adjustment with size points seen by four out of size / 25
+// cameras each. The observations are generated from known cameras
+// and points, which are then perturbed.
+void create_bundle(int size, Problem* problem)
+{
+	std::mt19937 prng(unsigned(1));
+	std::normal_distribution<double> normal;
+	auto randn = std::bind(normal, prng);
+
+	const int num_cameras = std::max(4, size / 25);
+	const int num_points  = size;
+	const int observations_per_point = 4;
+
+	problem->variables.resize(9 * num_cameras + 3 * num_points);
+	double* cameras = &problem->variables[0];
+	double* points  = &problem->variables[9 * num_cameras];
+
+	for (int i = 0; i < num_cameras; ++i) {
+		double* camera = cameras + 9 * i;
+		camera[0] = 0.1 * randn();
+		camera[1] = 0.1 * randn();
+		camera[2] = 0.1 * randn();
+		camera[3] = randn();
+		camera[4] = randn();
+		camera[5] = -10.0;
+		camera[6] = 500.0;
+		camera[7] = 0.0;
+		camera[8] = 0.0;
+		problem->function.add_variable(camera, 9);
+	}
+	for (int i = 0; i < num_points; ++i) {
+		double* point = points + 3 * i;
+		point[0] = randn();
+		point[1] = randn();
+		point[2] = randn();
+		problem->function.add_variable(point, 3);
+	}
+
+	for (int i = 0; i < num_points; ++i) {
+		for (int j = 0; j < observations_per_point; ++j) {
+			double* camera = cameras + 9 * ((i + j * (num_cameras / 4 + 1)) % num_cameras);
+			double* point  = points + 3 * i;
+			double observed[2];
+			project(camera, point, observed);
+			problem->function.add_term(
+				std::make_shared<AutoDiffTerm<SnavelyReprojectionError, 9, 3>>(
+					observed[0] + randn(),
+					observed[1] + randn()),
+				camera,
+				point);
+		}
+	}
+
+	for (int i = 0; i < num_cameras; ++i) {
+		for (int k = 0; k < 6; ++k) {
+			cameras[9 * i + k] += 0.01 * randn();
+		}
+	}
+	for (auto i = 9 * num_cameras; i < problem->variables.size(); ++i) {
+		problem->variables[i] += 0.01 * randn();
+	}
+}
+
+// Denoising of a size × size image with a robust smoothness term.
+void create_denoising(int size, Problem* problem)
+{
+	std::mt19937 prng(unsigned(1));
+	std::normal_distribution<double> normal;
+	auto randn = std::bind(normal, prng);
+
+	problem->variables.resize(size * size);
+	auto pixel = [&](int x, int y) { return &problem->variables[y * size + x]; };
+
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			double clean = (x < size / 2) == (y < size / 2) ? 1.0 : 0.0;
+			double observed = clean + 0.2 * randn();
+			*pixel(x, y) = observed;
+			problem->function.add_variable(pixel(x, y), 1);
+			problem->function.add_term(
+				std::make_shared<AutoDiffTerm<DenoisingDataTerm, 1>>(observed),
+				pixel(x, y));
+		}
+	}
+
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			if (x + 1 < size) {
+				problem->function.add_term(
+					std::make_shared<AutoDiffTerm<DenoisingSmoothnessTerm, 1, 1>>(),
+					pixel(x, y),
+					pixel(x + 1, y));
+			}
+			if (y + 1 < size) {
+				problem->function.add_term(
+					std::make_shared<AutoDiffTerm<DenoisingSmoothnessTerm, 1, 1>>(),
+					pixel(x, y),
+					pixel(x, y + 1));
+			}
+		}
+	}
+}
+
+struct Workload
+{
+	std::string name;
+	std::vector<int> sizes;
+	std::vector<int> quick_sizes;
+	std::function<void(int, Problem*)> create;
+};
+
+//
+// Operations.
+//
+
+// Dense Hessians are not computed for more variables than this.
+const std::size_t maximum_dense_variables = 2000;
+// Derivative-free solvers and the global solver are only run for
+// at most this many variables.
+const std::size_t maximum_small_variables = 10;
+
+struct Operation
+{
+	std::string name;
+	bool (*applicable)(std::size_t number_of_variables);
+	// Returns a function performing the operation once. Everything
+	// that should not be timed is done before it is returned.
+	std::function<std::function<void()>(Problem*)> prepare;
+};
+
+bool always(std::size_t)
+{
+	return true;
+}
+
+bool small_dense(std::size_t n)
+{
+	return n <= maximum_dense_variables;
+}
+
+bool tiny(std::size_t n)
+{
+	return n <= maximum_small_variables;
+}
+
+template<typename SolverClass>
+std::function<void()> prepare_solver(Problem* problem, int maximum_iterations)
+{
+	auto solver = std::make_shared<SolverClass>();
+	auto results = std::make_shared<SolverResults>();
+	solver->log_function = [](const std::string&) { };
+	solver->maximum_iterations = maximum_iterations;
+	return [=]()
+	{
+		problem->reset();
+		solver->solve(problem->function, results.get());
+	};
+}
+
+std::vector<Operation> create_operations()
+{
+	std::vector<Operation> operations;
+
+	operations.push_back({"value", always, [](Problem* problem) -> std::function<void()>
+	{
+		auto x = std::make_shared<Eigen::VectorXd>(problem->function.get_number_of_scalars());
+		problem->function.copy_user_to_global(x.get());
+		return [=]() { problem->function.evaluate(*x); };
+	}});
+
+	operations.push_back({"gradient", always, [](Problem* problem) -> std::function<void()>
+	{
+		auto n = problem->function.get_number_of_scalars();
+		auto x = std::make_shared<Eigen::VectorXd>(n);
+		auto g = std::make_shared<Eigen::VectorXd>(n);
+		problem->function.copy_user_to_global(x.get());
+		return [=]() { problem->function.evaluate(*x, g.get()); };
+	}});
+
+	operations.push_back({"dense_hessian", small_dense, [](Problem* problem) -> std::function<void()>
+	{
+		auto n = problem->function.get_number_of_scalars();
+		auto x = std::make_shared<Eigen::VectorXd>(n);
+		auto g = std::make_shared<Eigen::VectorXd>(n);
+		auto H = std::make_shared<Eigen::MatrixXd>(n, n);
+		problem->function.copy_user_to_global(x.get());
+		return [=]() { problem->function.evaluate(*x, g.get(), H.get()); };
+	}});
+
+	operations.push_back({"sparse_hessian", always, [](Problem* problem) -> std::function<void()>
+	{
+		auto n = problem->function.get_number_of_scalars();
+		auto x = std::make_shared<Eigen::VectorXd>(n);
+		auto g = std::make_shared<Eigen::VectorXd>(n);
+		auto H = std::make_shared<Eigen::SparseMatrix<double>>();
+		problem->function.copy_user_to_global(x.get());
+		problem->function.create_sparse_hessian(H.get());
+		return [=]() { problem->function.evaluate(*x, g.get(), H.get()); };
+	}});
+
+	operations.push_back({"newton_5_iterations", always, [](Problem* problem)
+	{
+		return prepare_solver<NewtonSolver>(problem, 5);
+	}});
+
+	operations.push_back({"lbfgs_25_iterations", always, [](Problem* problem)
+	{
+		return prepare_solver<LBFGSSolver>(problem, 25);
+	}});
+
+	operations.push_back({"nelder_mead_100_iterations", tiny, [](Problem* problem)
+	{
+		return prepare_solver<NelderMeadSolver>(problem, 100);
+	}});
+
+	operations.push_back({"pattern_100_iterations", tiny, [](Problem* problem)
+	{
+		return prepare_solver<PatternSolver>(problem, 100);
+	}});
+
+	operations.push_back({"global_100_iterations", tiny, [](Problem* problem) -> std::function<void()>
+	{
+		auto solver = std::make_shared<GlobalSolver>();
+		auto results = std::make_shared<SolverResults>();
+		solver->log_function = [](const std::string&) { };
+		solver->maximum_iterations = 100;
+		IntervalVector start_box;
+		for (auto value: problem->start) {
+			// Keeps the box on the same side of zero as the start,
+			// e.g. for the standard deviation of the likelihood.
+			double radius = std::max(0.5 * std::abs(value), 1.0);
+			if (value > 0) {
+				start_box.emplace_back(std::max(value - radius, 0.5 * value), value + radius);
+			}
+			else {
+				start_box.emplace_back(value - radius, value + radius);
+			}
+		}
+		return [=]()
+		{
+			problem->reset();
+			solver->solve_global(problem->function, start_box, results.get());
+		};
+	}});
+
+	return operations;
+}
+
+//
+// Statistics.
+//
+
+struct Statistics
+{
+	std::size_t samples = 0;
+	double median = 0, mean = 0, standard_deviation = 0;
+	double min = 0, max = 0;
+	double p10 = 0, p25 = 0, p75 = 0, p90 = 0;
+	// Distribution-free 95% confidence interval for the median.
+	double median_low = 0, median_high = 0;
+};
+
+// Linear interpolation between the closest ranks of sorted.
+double percentile(const std::vector<double>& sorted, double p)
+{
+	double rank = p * (sorted.size() - 1);
+	auto below = std::size_t(std::floor(rank));
+	auto above = std::min(below + 1, sorted.size() - 1);
+	double t = rank - below;
+	return (1 - t) * sorted[below] + t * sorted[above];
+}
+
+Statistics compute_statistics(std::vector<double> times)
+{
+	spii_assert(!times.empty());
+	std::sort(times.begin(), times.end());
+	Statistics statistics;
+	auto n = times.size();
+	statistics.samples = n;
+	statistics.min = times.front();
+	statistics.max = times.back();
+	statistics.median = percentile(times, 0.50);
+	statistics.p10    = percentile(times, 0.10);
+	statistics.p25    = percentile(times, 0.25);
+	statistics.p75    = percentile(times, 0.75);
+	statistics.p90    = percentile(times, 0.90);
+
+	for (auto t: times) {
+		statistics.mean += t;
+	}
+	statistics.mean /= n;
+	for (auto t: times) {
+		statistics.standard_deviation += (t - statistics.mean) * (t - statistics.mean);
+	}
+	if (n > 1) {
+		statistics.standard_deviation = std::sqrt(statistics.standard_deviation / (n - 1));
+	}
+
+	// The number of samples below the median is Binomial(n, 1/2),
+	// which gives the ranks of the confidence interval.
+	double half_width = 1.96 * std::sqrt(double(n)) / 2.0;
+	auto low  = std::max(0.0, std::floor(n / 2.0 - half_width));
+	auto high = std::min(double(n - 1), std::ceil(n / 2.0 + half_width));
+	statistics.median_low  = times[std::size_t(low)];
+	statistics.median_high = times[std::size_t(high)];
+	return statistics;
+}
+
+// Runs body repeatedly until at least min_time seconds have passed
+// and min_samples samples are collected.
+Statistics measure(const std::function<void()>& body, double min_time)
+{
+	const std::size_t min_samples = 10;
+	const std::size_t max_samples = 10000;
+
+	typedef std::chrono::steady_clock Clock;
+	// Warm-up.
+	body();
+
+	std::vector<double> times;
+	double total_time = 0;
+	while ((total_time < min_time || times.size() < min_samples)
+	       && times.size() < max_samples) {
+		auto start_time = Clock::now();
+		body();
+		auto end_time = Clock::now();
+		double elapsed_time = std::chrono::duration<double>(end_time - start_time).count();
+		times.push_back(elapsed_time);
+		total_time += elapsed_time;
+	}
+	return compute_statistics(times);
+}
+
+//
+// Running and reporting.
+//
+
+struct Result
+{
+	std::string name;
+	std::string workload;
+	int size;
+	std::size_t variables;
+	std::string operation;
+	int threads;
+	Statistics statistics;
+	// Median time with one thread divided by the median time.
+	double speedup = 1.0;
+	double baseline = -1;
+	bool regression = false;
+};
+
+std::vector<int> thread_counts(int max_threads)
+{
+	std::vector<int> counts;
+	for (int threads = 1; threads < max_threads; threads *= 2) {
+		counts.push_back(threads);
+	}
+	counts.push_back(max_threads);
+	return counts;
+}
+
+std::string json_string(const std::string& str)
+{
+	std::string out = "\"";
+	for (auto c: str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out + "\"";
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results, int max_threads, double threshold)
+{
+	out.precision(9);
+	out << "{\n";
+	out << "  \"max_threads\": " << max_threads << ",\n";
+	out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "  \"threshold\": " << threshold << ",\n";
+	out << "  \"results\": [\n";
+	for (std::size_t i = 0; i < results.size(); ++i) {
+		const auto& result = results[i];
+		const auto& s = result.statistics;
+		out << "    {\"name\": " << json_string(result.name)
+		    << ", \"workload\": " << json_string(result.workload)
+		    << ", \"size\": " << result.size
+		    << ", \"variables\": " << result.variables
+		    << ", \"operation\": " << json_string(result.operation)
+		    << ", \"threads\": " << result.threads
+		    << ", \"samples\": " << s.samples
+		    << ", \"median\": " << s.median
+		    << ", \"mean\": " << s.mean
+		    << ", \"standard_deviation\": " << s.standard_deviation
+		    << ", \"min\": " << s.min
+		    << ", \"max\": " << s.max
+		    << ", \"percentiles\": {\"10\": " << s.p10
+		    << ", \"25\": " << s.p25
+		    << ", \"50\": " << s.median
+		    << ", \"75\": " << s.p75
+		    << ", \"90\": " << s.p90 << "}"
+		    << ", \"median_ci95\": [" << s.median_low << ", " << s.median_high << "]"
+		    << ", \"speedup\": " << result.speedup
+		    << ", \"efficiency\": " << result.speedup / result.threads;
+		if (result.baseline > 0) {
+			out << ", \"baseline\": " << result.baseline
+			    << ", \"relative_to_baseline\": " << s.median / result.baseline
+			    << ", \"regression\": " << (result.regression ? "true" : "false");
+		}
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+int main(int argc, char** argv)
+{
+	using namespace std;
+	using namespace Petter;
+
+	bool quick = false;
+	bool save = false;
+	int max_threads = max(1u, thread::hardware_concurrency());
+	double min_time = 0.25;
+	double threshold = 0.1;
+	string filter;
+	string json_filename;
+	string baseline_filename = "benchmark_suite.baseline";
+
+	for (int a = 1; a < argc; ++a) {
+		string arg = argv[a];
+		bool has_value = a + 1 < argc;
+		if (arg == "--quick") {
+			quick = true;
+		}
+		else if (arg == "--save") {
+			save = true;
+		}
+		else if (arg == "--threads" && has_value) {
+			max_threads = max(1, atoi(argv[++a]));
+		}
+		else if (arg == "--min-time" && has_value) {
+			min_time = atof(argv[++a]);
+		}
+		else if (arg == "--threshold" && has_value) {
+			threshold = atof(argv[++a]);
+		}
+		else if (arg == "--filter" && has_value) {
+			filter = argv[++a];
+		}
+		else if (arg == "--json" && has_value) {
+			json_filename = argv[++a];
+		}
+		else if (!arg.empty() && arg[0] == '-') {
+			cerr << "Invalid argument: \"" << arg << "\"" << endl;
+			return 2;
+		}
+		else {
+			baseline_filename = arg;
+		}
+	}
+
+	#ifndef USE_OPENMP
+		// Function::evaluate is single-threaded.
+		max_threads = 1;
+	#endif
+
+	map<string, double> baselines;
+	ifstream fin(baseline_filename.c_str());
+	while (fin) {
+		string name;
+		double seconds;
+		fin >> name >> seconds;
+		if (fin) {
+			baselines[name] = seconds;
+		}
+	}
+
+	vector<Workload> workloads = {
+		{"likelihood",    {1000, 10000, 100000}, {1000, 10000}, create_likelihood},
+		{"lennard_jones", {27, 64, 125},         {27, 64},      create_lennard_jones},
+		{"bundle",        {100, 1000, 10000},    {100, 1000},   create_bundle},
+		{"denoising",     {16, 64, 256},         {16, 64},      create_denoising}
+	};
+	auto operations = create_operations();
+
+	vector<Result> results;
+	bool any_regression = false;
+	bool any_error = false;
+
+	for (const auto& workload: workloads) {
+		for (int size: quick ? workload.quick_sizes : workload.sizes) {
+			Problem problem;
+			workload.create(size, &problem);
+			problem.start = problem.variables;
+			auto n = problem.function.get_number_of_scalars();
+
+			for (const auto& operation: operations) {
+				if (!operation.applicable(n)) {
+					continue;
+				}
+				double single_thread_median = -1;
+				for (int threads: thread_counts(max_threads)) {
+					Result result;
+					result.workload  = workload.name;
+					result.size      = size;
+					result.variables = n;
+					result.operation = operation.name;
+					result.threads   = threads;
+					result.name = workload.name + "/" + to_string(size) + "/"
+					            + operation.name + "/threads=" + to_string(threads);
+					if (result.name.find(filter) == string::npos) {
+						continue;
+					}
+					cout << setw(60) << left << result.name << " " << flush;
+
+					try {
+						problem.reset();
+						problem.function.set_number_of_threads(threads);
+						auto body = operation.prepare(&problem);
+						result.statistics = measure(body, min_time);
+						problem.reset();
+					}
+					catch (std::exception& e) {
+						cout << RED << "error: " << e.what() << NORMAL << endl;
+						any_error = true;
+						continue;
+					}
+
+					const auto& s = result.statistics;
+					if (threads == 1) {
+						single_thread_median = s.median;
+					}
+					if (single_thread_median > 0) {
+						result.speedup = single_thread_median / s.median;
+					}
+
+					auto baseline_entry = baselines.find(result.name);
+					if (baseline_entry != baselines.end()) {
+						result.baseline = baseline_entry->second;
+						result.regression = s.median_low > (1.0 + threshold) * result.baseline;
+					}
+
+					cout << "\r";
+					if (result.regression) {
+						cout << RED;
+					}
+					cout << setw(60) << left << result.name << " "
+					     << setw(14) << hastighet::Benchmarker::timeToString(s.median)
+					     << "[" << hastighet::Benchmarker::timeToString(s.p10)
+					     << " " << hastighet::Benchmarker::timeToString(s.p90) << "]";
+					if (threads > 1 && single_thread_median > 0) {
+						printf(" %5.2fx", result.speedup);
+					}
+					if (result.baseline > 0) {
+						printf(" %4.0f%% of baseline", 100.0 * s.median / result.baseline);
+						if (result.regression) {
+							cout << " REGRESSION";
+						}
+					}
+					cout << NORMAL << endl;
+
+					any_regression = any_regression || result.regression;
+					results.push_back(result);
+				}
+			}
+		}
+	}
+
+	if (!json_filename.empty()) {
+		ofstream fout(json_filename.c_str());
+		write_json(fout, results, max_threads, threshold);
+	}
+
+	if (save) {
+		cerr << "Saving new baseline\n";
+		for (const auto& result: results) {
+			baselines[result.name] = result.statistics.median;
+		}
+		ofstream fout(baseline_filename.c_str());
+		fout.precision(9);
+		for (const auto& entry: baselines) {
+			fout << entry.first << " " << entry.second << endl;
+		}
+	}
+	else if (any_regression) {
+		cerr << "Performance regression beyond " << 100 * threshold << "% of the baseline.\n";
+		return 1;
+	}
+
+	return any_error ? 1 : 0;
+}
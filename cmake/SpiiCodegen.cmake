@@ -0,0 +1,30 @@
+# Generation of derivative code for terms (see include/spii/codegen.h).
+#
+#   spii_generate_terms(TARGET GENERATOR_SOURCE OUTPUT_HEADER)
+#
+# Builds GENERATOR_SOURCE, which should call write_generated_terms
+# with its first argument as the file name, and runs it at build time
+# to create OUTPUT_HEADER in the binary directory. TARGET depends on
+# the header and can include it by name.
+function(spii_generate_terms TARGET GENERATOR_SOURCE OUTPUT_HEADER)
+	get_filename_component(GENERATOR_NAME ${GENERATOR_SOURCE} NAME_WE)
+	set(GENERATED_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}/generated)
+	set(GENERATED_HEADER ${GENERATED_DIRECTORY}/${OUTPUT_HEADER})
+
+	if (NOT TARGET ${GENERATOR_NAME})
+		add_executable(${GENERATOR_NAME} ${GENERATOR_SOURCE})
+		target_link_libraries(${GENERATOR_NAME} spii)
+		set_property(TARGET ${GENERATOR_NAME} PROPERTY FOLDER "Generators")
+	endif ()
+
+	add_custom_command(
+		OUTPUT ${GENERATED_HEADER}
+		COMMAND ${CMAKE_COMMAND} -E make_directory ${GENERATED_DIRECTORY}
+		COMMAND ${GENERATOR_NAME} ${GENERATED_HEADER}
+		DEPENDS ${GENERATOR_NAME}
+		COMMENT "Generating derivative code in ${OUTPUT_HEADER}")
+	add_custom_target(${TARGET}_generated_terms DEPENDS ${GENERATED_HEADER})
+
+	add_dependencies(${TARGET} ${TARGET}_generated_terms)
+	target_include_directories(${TARGET} PRIVATE ${GENERATED_DIRECTORY})
+endfunction()
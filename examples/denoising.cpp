@@ -58,6 +58,11 @@ public:
 		return evaluate(x, gradient);
 	}
 
+	bool has_constant_hessian() const override
+	{
+		return true;
+	}
+
 private:
 	double a, b;
 };
@@ -23,6 +23,11 @@ public:
 	{
 		return w[0]*w[0] + w[1]*w[1];
 	}
+
+	bool has_constant_hessian() const
+	{
+		return true;
+	}
 };
 
 // yi * (w^T * xi + b) ≤ -1.0.
@@ -2,12 +2,28 @@
 #ifndef SPII_AUTO_DIFF_CHANGE_OF_VARIABLES_H
 #define SPII_AUTO_DIFF_CHANGE_OF_VARIABLES_H
 
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include <spii-thirdparty/fadiff.h>
 
 #include <spii/change_of_variables.h>
 
 namespace spii {
 
+// Whether a class T has a member function
+//
+//    void derivatives(double* dx, double* d2x, const double* t) const
+//
+// computing the derivatives of an elementwise change of variables.
+template<class T>
+static auto test_elementwise_derivatives(int) -> decltype(std::declval<const T>().derivatives((double*)0, (double*)0, (const double*)0), void());
+template<class>
+static char test_elementwise_derivatives(long);
+template<class T>
+struct has_elementwise_derivatives : std::is_void<decltype(test_elementwise_derivatives<T>(0))>{};
+
 template<typename Change>
 class AutoDiffChangeOfVariables :
 	public ChangeOfVariables
@@ -82,8 +98,57 @@ public:
 		}
 	}
 
-	void update_hessian() const;
+	virtual bool is_elementwise() const
+	{
+		return has_elementwise_derivatives<Change>::value;
+	}
+
+	virtual void derivatives(double* jacobian,
+	                         double* hessians,
+	                         const double* t_input) const
+	{
+		derivatives(jacobian, hessians, t_input, has_elementwise_derivatives<Change>());
+	}
+
 private:
+	// Elementwise changes compute their derivatives for all
+	// elements at once.
+	void derivatives(double* jacobian,
+	                 double* hessians,
+	                 const double* t_input,
+	                 std::true_type) const
+	{
+		change->derivatives(jacobian, hessians, t_input);
+	}
+
+	void derivatives(double* jacobian,
+	                 double* hessians,
+	                 const double* t_input,
+	                 std::false_type) const
+	{
+		int n_x = x_dimension();
+		int n_t = t_dimension();
+
+		std::vector<fadbad::F<fadbad::F<double>>> x(n_x);
+		std::vector<fadbad::F<fadbad::F<double>>> t(n_t);
+		for (int j = 0; j < n_t; ++j) {
+			t[j] = t_input[j];
+			t[j].x().diff(j, n_t);
+			t[j].diff(j, n_t);
+		}
+
+		change->t_to_x(&x[0], &t[0]);
+
+		for (int i = 0; i < n_x; ++i) {
+			for (int j = 0; j < n_t; ++j) {
+				jacobian[i + n_x * j] = x[i].d(j).x();
+				for (int k = 0; k < n_t; ++k) {
+					hessians[n_t * n_t * i + j + n_t * k] = x[i].d(j).d(k);
+				}
+			}
+		}
+	}
+
 	Change* change;
 };
 
@@ -2,6 +2,7 @@
 #ifndef SPII_AUTO_DIFF_TERM_H
 #define SPII_AUTO_DIFF_TERM_H
 
+#include <algorithm>
 #include <memory>
 #include <type_traits>
 #include <typeinfo>
@@ -10,6 +11,8 @@
 #include <spii-thirdparty/badiff.h>
 #include <spii-thirdparty/fadiff.h>
 
+#include <spii/dual.h>
+
 #include <spii/term.h>
 
 namespace spii {
@@ -110,6 +113,33 @@ struct HasReadTest2{};
 static_assert(has_read<HasReadTest1, std::istream&>::value  == true,  "HasReadTest1 failed.");
 static_assert(has_read<HasReadTest2, std::istream&>::value  == false, "HasReadTest2 failed.");
 
+// Same thing, but for a bool has_constant_hessian() const member
+// function.
+template<class T>
+static auto test_has_constant_hessian(int) -> decltype(std::declval<const T>().has_constant_hessian(), void());
+template<class>
+static char test_has_constant_hessian(long);
+template<class T>
+struct has_has_constant_hessian : std::is_void<decltype(test_has_constant_hessian<T>(0))>{};
+// Test has_has_constant_hessian.
+struct HasConstantHessianTest1{ bool has_constant_hessian() const { return true; } };
+struct HasConstantHessianTest2{};
+static_assert(has_has_constant_hessian<HasConstantHessianTest1>::value == true,  "HasConstantHessianTest1 failed.");
+static_assert(has_has_constant_hessian<HasConstantHessianTest2>::value == false, "HasConstantHessianTest2 failed.");
+
+// Whether a class T has a static member use_simd_dual that is true.
+template<class T>
+static auto test_use_simd_dual(int) -> std::integral_constant<bool, T::use_simd_dual>;
+template<class>
+static std::false_type test_use_simd_dual(long);
+template<class T>
+struct uses_simd_dual : decltype(test_use_simd_dual<T>(0)){};
+// Test uses_simd_dual.
+struct UseSimdDualTest1{ static const bool use_simd_dual = true; };
+struct UseSimdDualTest2{};
+static_assert(uses_simd_dual<UseSimdDualTest1>::value == true,  "UseSimdDualTest1 failed.");
+static_assert(uses_simd_dual<UseSimdDualTest2>::value == false, "UseSimdDualTest2 failed.");
+
 template<typename Functor>
 typename std::enable_if<has_write<Functor, std::ostream&>::value, void>::type 
     call_write_if_exists(std::ostream& out, const Functor& functor)
@@ -133,6 +163,24 @@ typename std::enable_if< ! has_read<Functor, std::istream&>::value, void>::type
     call_read_if_exists(std::istream& in, const Functor& functor)
 {
 }
+
+// A functor may declare that it is linear or quadratic in its
+// variables, i.e. that its Hessian is constant, with a member
+//
+//	bool has_constant_hessian() const { return true; }
+//
+template<typename Functor>
+typename std::enable_if<has_has_constant_hessian<Functor>::value, bool>::type
+    call_has_constant_hessian_if_exists(const Functor& functor)
+{
+	return functor.has_constant_hessian();
+}
+template<typename Functor>
+typename std::enable_if< ! has_has_constant_hessian<Functor>::value, bool>::type
+    call_has_constant_hessian_if_exists(const Functor& functor)
+{
+	return false;
+}
  
 
 
@@ -175,6 +223,240 @@ T differentiate_functor(
 	return f.x();
 }
 
+// Writes zeros to all derivatives of x, including those of nested
+// dual numbers, without making x dependent on anything. fadbad leaves
+// them uninitialized, and a scalar that is never seeded would
+// otherwise be copied around with uninitialized memory.
+inline void zero_derivatives(double*)
+{
+}
+
+template<typename T, unsigned int N>
+void zero_derivatives(fadbad::F<T, N>* x)
+{
+	const T value = x->x();
+	x->diff(0);
+	for (unsigned int k = 0; k < N; ++k) {
+		x->d(k) = T(0.0);
+		zero_derivatives(&x->d(k));
+	}
+	*x = value;
+}
+
+// The derivative number ("slot") of every scalar of a term with D
+// scalars, for evaluate_flat_functor. The scalars of inactive
+// variables are not differentiated; the gradient and Hessian only
+// contain the active ones (see Term::evaluate_flat_active). If
+// upper_only is true, the Hessian blocks below the diagonal are not
+// written.
+template<int D>
+struct DerivativeSlots
+{
+	// active may be null, meaning that all variables are active.
+	DerivativeSlots(const int* dimensions,
+	                int number_of_variables,
+	                const bool* active,
+	                bool upper_only_)
+		: number_of_slots(0),
+		  upper_only(upper_only_)
+	{
+		int i = 0;
+		for (int var = 0; var < number_of_variables; ++var) {
+			for (int k = 0; k < dimensions[var]; ++k, ++i) {
+				if (active == nullptr || active[var]) {
+					variable[number_of_slots] = var;
+					slot[i] = number_of_slots++;
+				}
+				else {
+					slot[i] = -1;
+				}
+			}
+		}
+		spii_assert(i == D, "DerivativeSlots: dimensions do not sum to ", D, ".");
+	}
+
+	// Makes x depend on derivative number slot[i], if any. The check
+	// against D is redundant, but lets the compiler prove that
+	// fadbad::F<T, D>::diff stays within bounds.
+	template<typename T>
+	void seed(fadbad::F<T, D>* x, int i) const
+	{
+		zero_derivatives(x);
+		const int s = slot[i];
+		for (unsigned k = 0; k < D; ++k) {
+			if (static_cast<int>(k) == s) {
+				x->diff(k);
+			}
+		}
+	}
+
+	// Whether Hessian element (s, t) has to be written.
+	bool is_needed(int s, int t) const
+	{
+		return ! upper_only || variable[s] <= variable[t];
+	}
+
+	// The slot of every scalar, or -1.
+	int slot[D];
+	// The variable of every slot.
+	int variable[D];
+	int number_of_slots;
+	bool upper_only;
+};
+
+// Same as differentiate_functor, but scalar i is only differentiated
+// if slots.slot[i] >= 0, and gets derivative number slots.slot[i].
+template<typename Functor, typename T, int D>
+T differentiate_functor_slots(
+	const Functor& functor,
+	const T* x_in,
+	const DerivativeSlots<D>& slots,
+	T* df)
+{
+	using namespace fadbad;
+
+	F<T, D> x[D];
+	for (int i = 0; i < D; ++i) {
+		x[i] = x_in[i];
+		slots.seed(&x[i], i);
+	}
+	F<T, D> f(functor(x));
+
+	for (int s = 0; s < slots.number_of_slots; ++s) {
+		df[s] = f.d(s);
+	}
+
+	return f.x();
+}
+
+// Evaluates a functor taking all D scalars of a term after each
+// other and writes the derivatives in the flat layout used by
+// Term::evaluate_flat, with the derivatives of slot s at position s.
+// hessian may be null.
+template<typename Functor, int D>
+double evaluate_flat_functor(
+	const Functor& functor,
+	const double* x,
+	const DerivativeSlots<D>& slots,
+	double* gradient,
+	double* hessian)
+{
+	using namespace fadbad;
+
+	if (hessian == nullptr) {
+		F<double, D> vars[D];
+		for (int i = 0; i < D; ++i) {
+			vars[i] = x[i];
+			slots.seed(&vars[i], i);
+		}
+
+		F<double, D> f(functor(vars));
+
+		for (int s = 0; s < slots.number_of_slots; ++s) {
+			gradient[s] = f.d(s);
+		}
+		return f.x();
+	}
+
+	F<double, D> vars[D];
+	F<double, D>   df[D];
+	for (int i = 0; i < D; ++i) {
+		vars[i] = x[i];
+		slots.seed(&vars[i], i);
+	}
+
+	F<double, D> f(
+		differentiate_functor_slots<Functor, F<double, D>, D>(
+			functor,
+			vars,
+			slots,
+			df)
+		);
+
+	const int n = slots.number_of_slots;
+	for (int s = 0; s < n; ++s) {
+		gradient[s] = df[s].x();
+	}
+	for (int t = 0; t < n; ++t) {
+		for (int s = 0; s < n; ++s) {
+			if (slots.is_needed(s, t)) {
+				hessian[s + n * t] = df[s].d(t);
+			}
+		}
+	}
+
+	return f.x();
+}
+
+// Same as above, with the dual numbers of spii/dual.h.
+template<typename Functor, int D>
+double evaluate_flat_simd_dual(
+	const Functor& functor,
+	const double* x,
+	const DerivativeSlots<D>& slots,
+	double* gradient,
+	double* hessian)
+{
+	if (hessian == nullptr) {
+		Dual<D> vars[D];
+		for (int i = 0; i < D; ++i) {
+			vars[i] = slots.slot[i] >= 0 ? Dual<D>(x[i], slots.slot[i]) : Dual<D>(x[i]);
+		}
+
+		Dual<D> f(functor(vars));
+
+		for (int s = 0; s < slots.number_of_slots; ++s) {
+			gradient[s] = f.d(s);
+		}
+		return f.x();
+	}
+
+	SecondOrderDual<D> vars[D];
+	for (int i = 0; i < D; ++i) {
+		vars[i] = slots.slot[i] >= 0 ? SecondOrderDual<D>(x[i], slots.slot[i]) : SecondOrderDual<D>(x[i]);
+	}
+
+	SecondOrderDual<D> f(functor(vars));
+
+	const int n = slots.number_of_slots;
+	for (int s = 0; s < n; ++s) {
+		gradient[s] = f.d(s);
+	}
+	for (int t = 0; t < n; ++t) {
+		for (int s = 0; s < n; ++s) {
+			if (slots.is_needed(s, t)) {
+				hessian[s + n * t] = f.dd(s, t);
+			}
+		}
+	}
+	return f.x();
+}
+
+// Selects the dual number type for evaluate_flat_functor depending
+// on uses_simd_dual (see spii/dual.h).
+template<typename Functor, int D>
+double evaluate_flat_functor(
+	const Functor& functor,
+	const double* x,
+	const DerivativeSlots<D>& slots,
+	double* gradient,
+	double* hessian,
+	std::false_type)
+{
+	return evaluate_flat_functor<Functor, D>(functor, x, slots, gradient, hessian);
+}
+template<typename Functor, int D>
+double evaluate_flat_functor(
+	const Functor& functor,
+	const double* x,
+	const DerivativeSlots<D>& slots,
+	double* gradient,
+	double* hessian,
+	std::true_type)
+{
+	return evaluate_flat_simd_dual<Functor, D>(functor, x, slots, gradient, hessian);
+}
+
 //
 // 1-variable specialization
 //
@@ -200,6 +482,11 @@ public:
 		call_write_if_exists(out, functor);
 	}
 
+	virtual bool has_constant_hessian() const override
+	{
+		return call_has_constant_hessian_if_exists(functor);
+	}
+
 	virtual double evaluate(double * const * const variables) const override
 	{
 		return functor(variables[0]);
@@ -277,6 +564,27 @@ public:
 		#endif
 	}
 
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		const int dimensions[] = {D0};
+		DerivativeSlots<D0> slots(dimensions, 1, nullptr, upper_only);
+		return evaluate_flat_functor<Functor, D0>(functor, variables[0], slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const override
+	{
+		const int dimensions[] = {D0};
+		DerivativeSlots<D0> slots(dimensions, 1, active, upper_only);
+		return evaluate_flat_functor<Functor, D0>(functor, variables[0], slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
 protected:
 	Functor functor;
 };
@@ -328,6 +636,11 @@ public:
 		call_write_if_exists(out, functor);
 	}
 
+	virtual bool has_constant_hessian() const override
+	{
+		return call_has_constant_hessian_if_exists(functor);
+	}
+
 	virtual double evaluate(double * const * const variables) const override
 	{
 		return functor(variables[0], variables[1]);
@@ -367,6 +680,59 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<false>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_upper_hessian(double * const * const variables,
+	                                      std::vector<Eigen::VectorXd>* gradient,
+	                                      std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<true>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		double x[D0 + D1];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+
+		typedef Functor2_to_1<Functor, D0, D1> Functor21;
+		Functor21 functor21(functor);
+		const int dimensions[] = {D0, D1};
+		DerivativeSlots<D0 + D1> slots(dimensions, 2, nullptr, upper_only);
+		return evaluate_flat_functor<Functor21, D0 + D1>(functor21, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const override
+	{
+		const int dimensions[] = {D0, D1};
+		DerivativeSlots<D0 + D1> slots(dimensions, 2, active, upper_only);
+
+		double x[D0 + D1];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+
+		typedef Functor2_to_1<Functor, D0, D1> Functor21;
+		Functor21 functor21(functor);
+		return evaluate_flat_functor<Functor21, D0 + D1>(functor21, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+protected:
+
+	// Computes the gradient and Hessian. If upper_only is true, the
+	// blocks below the diagonal are not written.
+	template<bool upper_only>
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
 	{
 		using namespace fadbad;
 		#ifdef USE_BF_DIFFERENTIATION
@@ -406,8 +772,10 @@ public:
 				(*gradient)[1](i) = vars1[i].d(0).x();
 
 				// D1 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
+				if ( ! upper_only) {
+					for (int j = 0; j < D0; ++j) {
+						(*hessian)[1][0](i, j) = vars1[i].d(0).d(j);
+					}
 				}
 
 				// D1 and D1
@@ -460,8 +828,10 @@ public:
 				(*gradient)[1](i) = df[i + offset1].x();;
 
 				// D1 and D0
-				for (int j = 0; j < D0; ++j) {
-					(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+				if ( ! upper_only) {
+					for (int j = 0; j < D0; ++j) {
+						(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+					}
 				}
 
 				// D1 and D1
@@ -474,7 +844,6 @@ public:
 		#endif
 	}
 
-protected:
 	Functor functor;
 };
 
@@ -527,6 +896,11 @@ public:
 		call_write_if_exists(out, this->functor);
 	}
 
+	virtual bool has_constant_hessian() const override
+	{
+		return call_has_constant_hessian_if_exists(this->functor);
+	}
+
 	virtual double evaluate(double * const * const variables) const override
 	{
 		return functor(variables[0], variables[1], variables[2]);
@@ -578,6 +952,61 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<false>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_upper_hessian(double * const * const variables,
+	                                      std::vector<Eigen::VectorXd>* gradient,
+	                                      std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<true>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		double x[D0 + D1 + D2];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+		std::copy(variables[2], variables[2] + D2, x + D0 + D1);
+
+		typedef Functor3_to_1<Functor, D0, D1, D2> Functor31;
+		Functor31 functor31(functor);
+		const int dimensions[] = {D0, D1, D2};
+		DerivativeSlots<D0 + D1 + D2> slots(dimensions, 3, nullptr, upper_only);
+		return evaluate_flat_functor<Functor31, D0 + D1 + D2>(functor31, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const override
+	{
+		const int dimensions[] = {D0, D1, D2};
+		DerivativeSlots<D0 + D1 + D2> slots(dimensions, 3, active, upper_only);
+
+		double x[D0 + D1 + D2];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+		std::copy(variables[2], variables[2] + D2, x + D0 + D1);
+
+		typedef Functor3_to_1<Functor, D0, D1, D2> Functor31;
+		Functor31 functor31(functor);
+		return evaluate_flat_functor<Functor31, D0 + D1 + D2>(functor31, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+protected:
+
+	// Computes the gradient and Hessian. If upper_only is true, the
+	// blocks below the diagonal are not written.
+	template<bool upper_only>
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
 	{
 		using namespace fadbad;
 		typedef F<double, D0 + D1 + D2> Dual;
@@ -634,8 +1063,10 @@ public:
 			(*gradient)[1](i) = df[i + offset1].x();;
 
 			// D1 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+			if ( ! upper_only) {
+				for (int j = 0; j < D0; ++j) {
+					(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+				}
 			}
 
 			// D1 and D1
@@ -653,13 +1084,17 @@ public:
 			(*gradient)[2](i) = df[i + offset2].x();;
 
 			// D2 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[2][0](i, j) = df[i + offset2].d(j);
+			if ( ! upper_only) {
+				for (int j = 0; j < D0; ++j) {
+					(*hessian)[2][0](i, j) = df[i + offset2].d(j);
+				}
 			}
 
 			// D2 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
+			if ( ! upper_only) {
+				for (int j = 0; j < D1; ++j) {
+					(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
+				}
 			}
 
 			// D2 and D2
@@ -671,7 +1106,6 @@ public:
 		return f.x();
 	}
 
-protected:
 	Functor functor;
 };
 
@@ -724,6 +1158,11 @@ public:
 		call_write_if_exists(out, this->functor);
 	}
 
+	virtual bool has_constant_hessian() const override
+	{
+		return call_has_constant_hessian_if_exists(this->functor);
+	}
+
 	virtual double evaluate(double * const * const variables) const override
 	{
 		return functor(variables[0], variables[1], variables[2], variables[3]);
@@ -786,6 +1225,63 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<false>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_upper_hessian(double * const * const variables,
+	                                      std::vector<Eigen::VectorXd>* gradient,
+	                                      std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<true>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		double x[D0 + D1 + D2 + D3];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+		std::copy(variables[2], variables[2] + D2, x + D0 + D1);
+		std::copy(variables[3], variables[3] + D3, x + D0 + D1 + D2);
+
+		typedef Functor4_to_1<Functor, D0, D1, D2, D3> Functor41;
+		Functor41 functor41(functor);
+		const int dimensions[] = {D0, D1, D2, D3};
+		DerivativeSlots<D0 + D1 + D2 + D3> slots(dimensions, 4, nullptr, upper_only);
+		return evaluate_flat_functor<Functor41, D0 + D1 + D2 + D3>(functor41, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const override
+	{
+		const int dimensions[] = {D0, D1, D2, D3};
+		DerivativeSlots<D0 + D1 + D2 + D3> slots(dimensions, 4, active, upper_only);
+
+		double x[D0 + D1 + D2 + D3];
+		std::copy(variables[0], variables[0] + D0, x);
+		std::copy(variables[1], variables[1] + D1, x + D0);
+		std::copy(variables[2], variables[2] + D2, x + D0 + D1);
+		std::copy(variables[3], variables[3] + D3, x + D0 + D1 + D2);
+
+		typedef Functor4_to_1<Functor, D0, D1, D2, D3> Functor41;
+		Functor41 functor41(functor);
+		return evaluate_flat_functor<Functor41, D0 + D1 + D2 + D3>(functor41, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+protected:
+
+	// Computes the gradient and Hessian. If upper_only is true, the
+	// blocks below the diagonal are not written.
+	template<bool upper_only>
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
 	{
 		using namespace fadbad;
 		typedef F<double, D0 + D1 + D2 + D3> Dual;
@@ -852,8 +1348,10 @@ public:
 			(*gradient)[1](i) = df[i + offset1].x();;
 
 			// D1 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+			if ( ! upper_only) {
+				for (int j = 0; j < D0; ++j) {
+					(*hessian)[1][0](i, j) = df[i + offset1].d(j);;
+				}
 			}
 
 			// D1 and D1
@@ -876,13 +1374,17 @@ public:
 			(*gradient)[2](i) = df[i + offset2].x();;
 
 			// D2 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[2][0](i, j) = df[i + offset2].d(j);
+			if ( ! upper_only) {
+				for (int j = 0; j < D0; ++j) {
+					(*hessian)[2][0](i, j) = df[i + offset2].d(j);
+				}
 			}
 
 			// D2 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
+			if ( ! upper_only) {
+				for (int j = 0; j < D1; ++j) {
+					(*hessian)[2][1](i, j) = df[i + offset2].d(j + offset1);
+				}
 			}
 
 			// D2 and D2
@@ -900,18 +1402,24 @@ public:
 			(*gradient)[3](i) = df[i + offset3].x();;
 
 			// D3 and D0
-			for (int j = 0; j < D0; ++j) {
-				(*hessian)[3][0](i, j) = df[i + offset3].d(j);
+			if ( ! upper_only) {
+				for (int j = 0; j < D0; ++j) {
+					(*hessian)[3][0](i, j) = df[i + offset3].d(j);
+				}
 			}
 
 			// D3 and D1
-			for (int j = 0; j < D1; ++j) {
-				(*hessian)[3][1](i, j) = df[i + offset3].d(j + offset1);
+			if ( ! upper_only) {
+				for (int j = 0; j < D1; ++j) {
+					(*hessian)[3][1](i, j) = df[i + offset3].d(j + offset1);
+				}
 			}
 
 			// D3 and D2
-			for (int j = 0; j < D2; ++j) {
-				(*hessian)[3][2](i, j) = df[i + offset3].d(j + offset2);
+			if ( ! upper_only) {
+				for (int j = 0; j < D2; ++j) {
+					(*hessian)[3][2](i, j) = df[i + offset3].d(j + offset2);
+				}
 			}
 
 			// D3 and D3
@@ -923,7 +1431,6 @@ public:
 		return f.x();
 	}
 
-protected:
 	Functor functor;
 };
 
@@ -985,83 +1492,52 @@ static_assert(IntSum<5, 2>::value == 5 + 2, "Sum test failed.");
 static_assert(IntSum<5, 2, 3>::value == 5 + 2 + 3, "Sum test failed.");
 static_assert(IntSum<5, 2, 3, 5>::value == 5 + 2 + 3 + 5, "Sum test failed.");
 
-// Calls functor with dual numbers.
-//
-template <typename Functor, typename R, int... D>
-struct DualFunctorCaller;
+// IntPrefixSum<I, D...>::value is the sum of the first I elements
+// of D, i.e. the offset of variable I among all scalars.
+template<std::size_t I, int... D>
+struct IntPrefixSum;
 
-template <typename Functor, typename R, int D0, int... DN>
-struct DualFunctorCaller<Functor, R, D0, DN...>
+template<int D0, int... DN>
+struct IntPrefixSum<0, D0, DN...>
 {
-	R call(const Functor& functor,
-	       double * const * const variables)
-	{
-		return call_internal(functor, variables, 0);
-	}
-
-	template <typename... T>
-	R call_internal(const Functor& functor,
-	                double * const * const variables,
-		            int offset,
-	                T&... previous_arguments)
-	{
-		R x[D0];
-		for (int i = 0; i < D0; ++i) {
-			x[i] = (*variables)[i];
-			x[i].diff(i + offset);
-		}
-
-		DualFunctorCaller<Functor, R, DN...> next_caller;
-		return next_caller.call_internal(functor, variables + 1, offset + D0, previous_arguments..., x);
-	}
+	static const int value = 0;
 };
 
-template <typename Functor, typename R>
-struct DualFunctorCaller<Functor, R>
+template<std::size_t I, int D0, int... DN>
+struct IntPrefixSum<I, D0, DN...>
 {
-	template <typename... T>
-	R call_internal(const Functor& functor,
-	                double * const * const variables,
-		            int offset,
-	                T&... arguments)
-	{
-		return functor(arguments...);
-	}
+	static const int value = D0 + IntPrefixSum<I - 1, DN...>::value;
 };
 
-//
-// Extracts gradient from a dual number.
-//
-template <typename R, int... D>
-struct DualGradientExtractor;
+static_assert(IntPrefixSum<0, 5, 2, 3>::value == 0, "Prefix sum test failed.");
+static_assert(IntPrefixSum<1, 5, 2, 3>::value == 5, "Prefix sum test failed.");
+static_assert(IntPrefixSum<2, 5, 2, 3>::value == 5 + 2, "Prefix sum test failed.");
 
-template <typename R, int D0, int... DN>
-struct DualGradientExtractor<R, D0, DN...>
+// Same as Functor2_to_1 etc., but for any number of variables.
+template<typename Functor, int... D>
+class FunctorN_to_1
 {
-	void extract(R& dual,
-	             Eigen::VectorXd* gradient,
-				 int offset = 0)
+public:
+	FunctorN_to_1(const Functor& functor_in)
+		: functor(functor_in)
 	{
-		for (int i = 0; i < D0; ++i) {
-			(*gradient)[i] = dual.d(i + offset);
-		}
+	}
 
-		DualGradientExtractor<R, DN...> next_extractor;
-		return next_extractor.extract(dual, gradient + 1, offset + D0);
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return call(x, std::make_index_sequence<sizeof...(D)>());
 	}
-};
 
-template <typename R>
-struct DualGradientExtractor<R>
-{
-	void extract(R& dual,
-	             Eigen::VectorXd* gradient,
-	             int offset)
+private:
+	template<typename R, std::size_t... I>
+	R call(const R* const x, std::index_sequence<I...>) const
 	{
-		// We are done.
+		return functor((x + IntPrefixSum<I, D...>::value)...);
 	}
-};
 
+	const Functor& functor;
+};
 
 template<typename Functor, int... D>
 class AutoDiffTerm
@@ -1083,6 +1559,11 @@ public:
 		call_write_if_exists(out, this->functor);
 	}
 
+	virtual bool has_constant_hessian() const override
+	{
+		return call_has_constant_hessian_if_exists(functor);
+	}
+
 	virtual double evaluate(double * const * const variables) const override
 	{
 		DoubleFunctorCaller<Functor, D...> caller;
@@ -1093,29 +1574,117 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double, IntSum<D...>::value> Dual;
-		DualFunctorCaller<Functor, Dual, D...> caller;
-		auto f = caller.call(this->functor, variables);
+		double flat_gradient[number_of_scalars];
+		double value = evaluate_flat(variables, flat_gradient, nullptr, false);
 
-		DualGradientExtractor<Dual, D...> extractor;
-		extractor.extract(f, &((*gradient)[0]));
+		int offset = 0;
+		for (int var = 0; var < sizeof...(D); ++var) {
+			for (int i = 0; i < dimensions[var]; ++i) {
+				(*gradient)[var](i) = flat_gradient[offset + i];
+			}
+			offset += dimensions[var];
+		}
 
-		return f.x();
+		return value;
 	}
 
-
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
 	{
-		check(false, to_string(typeid(*this).name(), ": hessian not implemented."));
-		return 0;
+		return evaluate_hessian<false>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_upper_hessian(double * const * const variables,
+	                                      std::vector<Eigen::VectorXd>* gradient,
+	                                      std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override
+	{
+		return evaluate_hessian<true>(variables, gradient, hessian);
+	}
+
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		double x[number_of_scalars];
+		int offset = 0;
+		for (int var = 0; var < sizeof...(D); ++var) {
+			std::copy(variables[var], variables[var] + dimensions[var], x + offset);
+			offset += dimensions[var];
+		}
+
+		typedef FunctorN_to_1<Functor, D...> FunctorN1;
+		FunctorN1 functorN1(functor);
+		DerivativeSlots<number_of_scalars> slots(dimensions, sizeof...(D), nullptr, upper_only);
+		return evaluate_flat_functor<FunctorN1, number_of_scalars>(functorN1, x, slots, gradient, hessian, uses_simd_dual<Functor>());
+	}
+
+	// Only the active variables are seeded, so all derivative
+	// computations involving only inactive variables are skipped.
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const override
+	{
+		DerivativeSlots<number_of_scalars> slots(dimensions, sizeof...(D), active, upper_only);
+
+		double x[number_of_scalars];
+		int offset = 0;
+		for (int var = 0; var < sizeof...(D); ++var) {
+			std::copy(variables[var], variables[var] + dimensions[var], x + offset);
+			offset += dimensions[var];
+		}
+
+		typedef FunctorN_to_1<Functor, D...> FunctorN1;
+		FunctorN1 functorN1(functor);
+		return evaluate_flat_functor<FunctorN1, number_of_scalars>(functorN1, x, slots, gradient, hessian, uses_simd_dual<Functor>());
 	}
 
 protected:
+	template<bool upper_only>
+	double evaluate_hessian(double * const * const variables,
+	                        std::vector<Eigen::VectorXd>* gradient,
+	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+	{
+		double flat_gradient[number_of_scalars];
+		double flat_hessian[number_of_scalars * number_of_scalars];
+		double value = evaluate_flat(variables, flat_gradient, flat_hessian, upper_only);
+
+		int offset0 = 0;
+		for (int var0 = 0; var0 < sizeof...(D); ++var0) {
+			for (int i = 0; i < dimensions[var0]; ++i) {
+				(*gradient)[var0](i) = flat_gradient[offset0 + i];
+			}
+
+			int offset1 = 0;
+			for (int var1 = 0; var1 < sizeof...(D); ++var1) {
+				if (! upper_only || var0 <= var1) {
+					for (int i = 0; i < dimensions[var0]; ++i) {
+						for (int j = 0; j < dimensions[var1]; ++j) {
+							(*hessian)[var0][var1](i, j) =
+								flat_hessian[(offset0 + i) + number_of_scalars * (offset1 + j)];
+						}
+					}
+				}
+				offset1 += dimensions[var1];
+			}
+			offset0 += dimensions[var0];
+		}
+
+		return value;
+	}
+
+	static const int number_of_scalars = IntSum<D...>::value;
+	static constexpr int dimensions[sizeof...(D)] = {D...};
+
 	Functor functor;
 };
 
+template<typename Functor, int... D>
+constexpr int AutoDiffTerm<Functor, D...>::dimensions[sizeof...(D)];
+
 }  // namespace spii
 
 
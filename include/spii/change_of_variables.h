@@ -2,7 +2,10 @@
 #ifndef SPII_CHANGE_OF_VARIABLES_H
 #define SPII_CHANGE_OF_VARIABLES_H
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <vector>
 using std::size_t;
 
 namespace spii {
@@ -28,7 +31,70 @@ public:
 	virtual void update_gradient(double* t_gradient,
 	                             const double* t_input,
 	                             const double* x_gradient) const = 0;
-	void update_hessian() const;
+
+	// Whether x_i only depends on t_i (and the dimensions are equal).
+	virtual bool is_elementwise() const
+	{
+		return false;
+	}
+
+	// Computes the derivatives of x(t), used for the second-order
+	// chain rule when computing Hessians.
+	//
+	// If is_elementwise(), dx_i/dt_i is written to jacobian[i] and
+	// d²x_i/dt_i² to hessians[i]. Otherwise, jacobian is the
+	// x_dimension × t_dimension Jacobian (column-major) and hessians
+	// contains the Hessians (t_dimension × t_dimension) of x_1, ...,
+	// x_n after each other.
+	//
+	// The default uses central finite differences of t_to_x, which is
+	// slower and less accurate than computing the derivatives exactly.
+	virtual void derivatives(double* jacobian,
+	                         double* hessians,
+	                         const double* t_input) const
+	{
+		const int n = x_dimension();
+		const int m = t_dimension();
+		std::vector<double> t(t_input, t_input + m);
+		std::vector<double> h(m);
+		for (int j = 0; j < m; ++j) {
+			// Close to optimal for second differences.
+			h[j] = 1e-4 * std::max(1.0, std::abs(t[j]));
+		}
+
+		std::vector<double> x_plus(n), x_minus(n);
+		std::vector<double> x_pp(n), x_pm(n), x_mp(n), x_mm(n);
+		for (int j = 0; j < m; ++j) {
+			t[j] = t_input[j] + h[j];
+			t_to_x(&x_plus[0], &t[0]);
+			t[j] = t_input[j] - h[j];
+			t_to_x(&x_minus[0], &t[0]);
+			t[j] = t_input[j];
+			for (int i = 0; i < n; ++i) {
+				jacobian[i + j * n] = (x_plus[i] - x_minus[i]) / (2 * h[j]);
+			}
+
+			for (int k = 0; k <= j; ++k) {
+				auto evaluate = [&](double sj, double sk, std::vector<double>* x)
+				{
+					t[j] += sj * h[j];
+					t[k] += sk * h[k];
+					t_to_x(&(*x)[0], &t[0]);
+					t[j] = t_input[j];
+					t[k] = t_input[k];
+				};
+				evaluate( 1,  1, &x_pp);
+				evaluate( 1, -1, &x_pm);
+				evaluate(-1,  1, &x_mp);
+				evaluate(-1, -1, &x_mm);
+				for (int i = 0; i < n; ++i) {
+					double d2x = (x_pp[i] - x_pm[i] - x_mp[i] + x_mm[i]) / (4 * h[j] * h[k]);
+					hessians[i * m * m + j + k * m] = d2x;
+					hessians[i * m * m + k + j * m] = d2x;
+				}
+			}
+		}
+	}
 };
 
 }  // namespace spii
@@ -0,0 +1,104 @@
+#ifndef SPII_CODEGEN_H
+#define SPII_CODEGEN_H
+//
+// Offline generation of derivative code for terms. A functor written
+// for AutoDiffTerm is recorded once on a Tape (see tape.h). Its value,
+// gradient and Hessian are then differentiated symbolically, and
+// emitted as straight-line C++ in a class deriving from SizedTerm:
+//
+//    // generate_terms.cpp, run at build time.
+//    int main(int argc, char* argv[])
+//    {
+//        std::vector<std::string> classes;
+//        classes.push_back(generate_auto_diff_term_code<2, 3>("MyTerm", MyFunctor{}));
+//        write_generated_terms(argv[1], classes);
+//    }
+//
+//    // In the program, after #include "my_terms.h":
+//    function.add_term(std::make_shared<MyTerm>(), x, y);
+//
+// Common subexpressions are only computed once, and derivatives that
+// are structurally zero or one are simplified away. The generated
+// code only depends on spii/term.h.
+//
+// cmake/SpiiCodegen.cmake contains spii_generate_terms, which builds
+// and runs such a generator program and adds the resulting header to
+// a target.
+//
+// As for Tape, the generated code is only correct if the control flow
+// of the functor does not depend on the values of the variables. Data
+// members of the functor are compiled into the code as constants,
+// unless they are recorded as parameters (see generate_term_code).
+//
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <spii/spii.h>
+#include <spii/tape.h>
+
+namespace spii {
+
+// Generates a class with name class_name from a recorded tape. The
+// first inputs of the tape are the scalars of the variables, with the
+// dimensions given. The last number_of_parameters inputs are
+// parameters, which are passed to the constructor of the generated
+// class as a const double*.
+SPII_API std::string generate_term_code(const std::string& class_name,
+                                        const Tape& tape,
+                                        const std::vector<int>& dimensions,
+                                        int number_of_parameters = 0);
+
+// Writes generated classes to a header file. The file is not touched
+// if its contents would not change, to avoid unnecessary recompilation.
+SPII_API void write_generated_terms(const std::string& file_name,
+                                    const std::vector<std::string>& classes);
+
+namespace detail
+{
+	template<typename Functor, std::size_t... I>
+	TapeValue call_with_variables(const Functor& functor,
+	                              TapeValue* x,
+	                              const int* offsets,
+	                              std::index_sequence<I...>)
+	{
+		return functor((x + offsets[I])...);
+	}
+}
+
+// Records functor, which should take variables with dimensions D...,
+// and generates a class with name class_name. The functor is
+// evaluated at trace_point (all ones by default) while recording.
+template<int... D, typename Functor>
+std::string generate_auto_diff_term_code(const std::string& class_name,
+                                         const Functor& functor,
+                                         std::vector<double> trace_point = {})
+{
+	const std::vector<int> dimensions = {D...};
+	std::vector<int> offsets;
+	int n = 0;
+	for (auto d: dimensions) {
+		offsets.push_back(n);
+		n += d;
+	}
+	if (trace_point.empty()) {
+		trace_point.resize(n, 1.0);
+	}
+	spii_assert(trace_point.size() == n, "generate_auto_diff_term_code: wrong size of trace point.");
+
+	Tape tape;
+	std::vector<TapeValue> x;
+	for (int i = 0; i < n; ++i) {
+		x.push_back(tape.add_input(trace_point[i]));
+	}
+	tape.set_output(detail::call_with_variables(functor,
+	                                            x.data(),
+	                                            offsets.data(),
+	                                            std::make_index_sequence<sizeof...(D)>()));
+	return generate_term_code(class_name, tape, dimensions);
+}
+
+}  // namespace spii
+
+#endif
@@ -0,0 +1,456 @@
+#ifndef SPII_DUAL_H
+#define SPII_DUAL_H
+//
+// Forward mode dual numbers with a fixed number of derivatives,
+// stored in aligned arrays padded to a multiple of the SIMD width.
+// All derivative updates are done by a few kernels in spii::simd,
+// which use AVX-512 or AVX(2) when the compiler targets them (e.g.
+// with -march=native, see the NATIVE option in CMakeLists.txt) and
+// plain loops otherwise.
+//
+// Dual<N> holds the value and the gradient. SecondOrderDual<N> also
+// holds the full Hessian, which is updated directly with the chain
+// rule instead of nesting two levels of first order numbers.
+//
+// AutoDiffTerm uses these types instead of fadbad for functors with
+// the member
+//
+//	static const bool use_simd_dual = true;
+//
+// for Term::evaluate_flat, which Function uses for gradients and
+// Hessians. The other evaluate functions still use fadbad, so the
+// functor has to work with both. Apart from the arithmetic operators
+// and comparisons, the functions defined at the end of this file are
+// available.
+//
+
+#include <cmath>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX__)
+	#include <immintrin.h>
+#endif
+
+namespace spii {
+
+namespace simd
+{
+#if defined(__AVX512F__)
+	const int width = 8;
+	typedef __m512d Packet;
+	inline Packet load(const double* p)            { return _mm512_loadu_pd(p); }
+	inline void store(double* p, Packet a)         { _mm512_storeu_pd(p, a); }
+	inline Packet broadcast(double a)              { return _mm512_set1_pd(a); }
+	inline Packet add(Packet a, Packet b)          { return _mm512_add_pd(a, b); }
+	inline Packet mul(Packet a, Packet b)          { return _mm512_mul_pd(a, b); }
+	inline Packet muladd(Packet a, Packet b, Packet c) { return _mm512_fmadd_pd(a, b, c); }
+#elif defined(__AVX__)
+	const int width = 4;
+	typedef __m256d Packet;
+	inline Packet load(const double* p)            { return _mm256_loadu_pd(p); }
+	inline void store(double* p, Packet a)         { _mm256_storeu_pd(p, a); }
+	inline Packet broadcast(double a)              { return _mm256_set1_pd(a); }
+	inline Packet add(Packet a, Packet b)          { return _mm256_add_pd(a, b); }
+	inline Packet mul(Packet a, Packet b)          { return _mm256_mul_pd(a, b); }
+	#ifdef __FMA__
+		inline Packet muladd(Packet a, Packet b, Packet c) { return _mm256_fmadd_pd(a, b, c); }
+	#else
+		inline Packet muladd(Packet a, Packet b, Packet c) { return _mm256_add_pd(_mm256_mul_pd(a, b), c); }
+	#endif
+#else
+	// Plain loops over pairs, which compilers vectorize with SSE2.
+	const int width = 2;
+	struct Packet
+	{
+		double v[2];
+	};
+	inline Packet load(const double* p)            { return {{p[0], p[1]}}; }
+	inline void store(double* p, Packet a)         { p[0] = a.v[0]; p[1] = a.v[1]; }
+	inline Packet broadcast(double a)              { return {{a, a}}; }
+	inline Packet add(Packet a, Packet b)          { return {{a.v[0] + b.v[0], a.v[1] + b.v[1]}}; }
+	inline Packet mul(Packet a, Packet b)          { return {{a.v[0] * b.v[0], a.v[1] * b.v[1]}}; }
+	inline Packet muladd(Packet a, Packet b, Packet c) { return add(mul(a, b), c); }
+#endif
+
+	// The kernels below require n to be a multiple of width. The
+	// arrays should be aligned for speed, but unaligned loads are
+	// used, so functors may store dual numbers in e.g. std::vector.
+
+	inline void set_zero(int n, double* out)
+	{
+		const Packet zero = broadcast(0.0);
+		for (int i = 0; i < n; i += width) {
+			store(out + i, zero);
+		}
+	}
+
+	// out = a*x
+	inline void scale(int n, double a, const double* x, double* out)
+	{
+		const Packet pa = broadcast(a);
+		for (int i = 0; i < n; i += width) {
+			store(out + i, mul(pa, load(x + i)));
+		}
+	}
+
+	// out = a*x + b*y
+	inline void axpby(int n, double a, const double* x, double b, const double* y, double* out)
+	{
+		const Packet pa = broadcast(a);
+		const Packet pb = broadcast(b);
+		for (int i = 0; i < n; i += width) {
+			store(out + i, muladd(pa, load(x + i), mul(pb, load(y + i))));
+		}
+	}
+
+	// out += a*x + b*y
+	inline void add_axpby(int n, double a, const double* x, double b, const double* y, double* out)
+	{
+		const Packet pa = broadcast(a);
+		const Packet pb = broadcast(b);
+		for (int i = 0; i < n; i += width) {
+			store(out + i, muladd(pa, load(x + i), muladd(pb, load(y + i), load(out + i))));
+		}
+	}
+}
+
+constexpr int dual_padded_size(int n)
+{
+	return (n + simd::width - 1) / simd::width * simd::width;
+}
+
+template<int N>
+class Dual
+{
+public:
+	static const int padded_size = dual_padded_size(N);
+
+	Dual(double value = 0.0)
+		: v(value)
+	{
+		simd::set_zero(padded_size, g);
+	}
+
+	// Creates independent variable number i.
+	Dual(double value, int i)
+		: Dual(value)
+	{
+		g[i] = 1.0;
+	}
+
+	double x() const
+	{
+		return v;
+	}
+
+	double d(int i) const
+	{
+		return g[i];
+	}
+
+	// a*this + c
+	Dual affine(double a, double c) const
+	{
+		Dual r{Uninitialized()};
+		r.v = a * v + c;
+		simd::scale(padded_size, a, g, r.g);
+		return r;
+	}
+
+	// this + alpha*b
+	Dual combine(const Dual& b, double alpha) const
+	{
+		Dual r{Uninitialized()};
+		r.v = v + alpha * b.v;
+		simd::axpby(padded_size, 1.0, g, alpha, b.g, r.g);
+		return r;
+	}
+
+	Dual multiply(const Dual& b) const
+	{
+		Dual r{Uninitialized()};
+		r.v = v * b.v;
+		simd::axpby(padded_size, b.v, g, v, b.g, r.g);
+		return r;
+	}
+
+	// f(this), given the value and the first two derivatives of f.
+	Dual unary(double f0, double f1, double f2) const
+	{
+		Dual r{Uninitialized()};
+		r.v = f0;
+		simd::scale(padded_size, f1, g, r.g);
+		return r;
+	}
+
+	Dual& operator += (const Dual& rhs) { return *this = combine(rhs, 1.0); }
+	Dual& operator -= (const Dual& rhs) { return *this = combine(rhs, -1.0); }
+	Dual& operator *= (const Dual& rhs) { return *this = multiply(rhs); }
+	Dual& operator /= (const Dual& rhs) { return *this = *this / rhs; }
+
+private:
+	struct Uninitialized {};
+	explicit Dual(Uninitialized)
+	{ }
+
+	double v;
+	alignas(simd::width * sizeof(double)) double g[padded_size];
+};
+
+template<int N>
+class SecondOrderDual
+{
+public:
+	static const int padded_size = dual_padded_size(N);
+
+	SecondOrderDual(double value = 0.0)
+		: v(value)
+	{
+		simd::set_zero(padded_size, g);
+		simd::set_zero(N * padded_size, h);
+	}
+
+	// Creates independent variable number i.
+	SecondOrderDual(double value, int i)
+		: SecondOrderDual(value)
+	{
+		g[i] = 1.0;
+	}
+
+	double x() const
+	{
+		return v;
+	}
+
+	double d(int i) const
+	{
+		return g[i];
+	}
+
+	// Second derivative with respect to variables i and j.
+	double dd(int i, int j) const
+	{
+		return h[i * padded_size + j];
+	}
+
+	SecondOrderDual affine(double a, double c) const
+	{
+		SecondOrderDual r{Uninitialized()};
+		r.v = a * v + c;
+		simd::scale(padded_size, a, g, r.g);
+		simd::scale(N * padded_size, a, h, r.h);
+		return r;
+	}
+
+	SecondOrderDual combine(const SecondOrderDual& b, double alpha) const
+	{
+		SecondOrderDual r{Uninitialized()};
+		r.v = v + alpha * b.v;
+		simd::axpby(padded_size, 1.0, g, alpha, b.g, r.g);
+		simd::axpby(N * padded_size, 1.0, h, alpha, b.h, r.h);
+		return r;
+	}
+
+	// H(ab) = b H(a) + a H(b) + g(a) g(b)^T + g(b) g(a)^T.
+	SecondOrderDual multiply(const SecondOrderDual& b) const
+	{
+		SecondOrderDual r{Uninitialized()};
+		r.v = v * b.v;
+		simd::axpby(padded_size, b.v, g, v, b.g, r.g);
+		simd::axpby(N * padded_size, b.v, h, v, b.h, r.h);
+		for (int i = 0; i < N; ++i) {
+			simd::add_axpby(padded_size, g[i], b.g, b.g[i], g, r.h + i * padded_size);
+		}
+		return r;
+	}
+
+	// H(f(a)) = f'(a) H(a) + f''(a) g(a) g(a)^T.
+	SecondOrderDual unary(double f0, double f1, double f2) const
+	{
+		SecondOrderDual r{Uninitialized()};
+		r.v = f0;
+		simd::scale(padded_size, f1, g, r.g);
+		for (int i = 0; i < N; ++i) {
+			simd::axpby(padded_size, f1, h + i * padded_size, f2 * g[i], g, r.h + i * padded_size);
+		}
+		return r;
+	}
+
+	SecondOrderDual& operator += (const SecondOrderDual& rhs) { return *this = combine(rhs, 1.0); }
+	SecondOrderDual& operator -= (const SecondOrderDual& rhs) { return *this = combine(rhs, -1.0); }
+	SecondOrderDual& operator *= (const SecondOrderDual& rhs) { return *this = multiply(rhs); }
+	SecondOrderDual& operator /= (const SecondOrderDual& rhs) { return *this = *this / rhs; }
+
+private:
+	struct Uninitialized {};
+	explicit SecondOrderDual(Uninitialized)
+	{ }
+
+	double v;
+	alignas(simd::width * sizeof(double)) double g[padded_size];
+	alignas(simd::width * sizeof(double)) double h[N * padded_size];
+};
+
+template<typename T>
+struct is_simd_dual : std::false_type {};
+template<int N>
+struct is_simd_dual<Dual<N>> : std::true_type {};
+template<int N>
+struct is_simd_dual<SecondOrderDual<N>> : std::true_type {};
+
+template<typename T>
+using enable_if_simd_dual = typename std::enable_if<is_simd_dual<T>::value, T>::type;
+template<typename T>
+using enable_if_simd_dual_bool = typename std::enable_if<is_simd_dual<T>::value, bool>::type;
+
+template<typename T> enable_if_simd_dual<T> operator + (const T& a, const T& b) { return a.combine(b, 1.0); }
+template<typename T> enable_if_simd_dual<T> operator - (const T& a, const T& b) { return a.combine(b, -1.0); }
+template<typename T> enable_if_simd_dual<T> operator * (const T& a, const T& b) { return a.multiply(b); }
+template<typename T> enable_if_simd_dual<T> operator / (const T& a, const T& b)
+{
+	const double v = b.x();
+	return a.multiply(b.unary(1.0 / v, -1.0 / (v * v), 2.0 / (v * v * v)));
+}
+
+template<typename T> enable_if_simd_dual<T> operator + (const T& a, double c) { return a.affine(1.0, c); }
+template<typename T> enable_if_simd_dual<T> operator + (double c, const T& a) { return a.affine(1.0, c); }
+template<typename T> enable_if_simd_dual<T> operator - (const T& a, double c) { return a.affine(1.0, -c); }
+template<typename T> enable_if_simd_dual<T> operator - (double c, const T& a) { return a.affine(-1.0, c); }
+template<typename T> enable_if_simd_dual<T> operator * (const T& a, double c) { return a.affine(c, 0.0); }
+template<typename T> enable_if_simd_dual<T> operator * (double c, const T& a) { return a.affine(c, 0.0); }
+template<typename T> enable_if_simd_dual<T> operator / (const T& a, double c) { return a.affine(1.0 / c, 0.0); }
+template<typename T> enable_if_simd_dual<T> operator / (double c, const T& a)
+{
+	const double v = a.x();
+	return a.unary(c / v, -c / (v * v), 2.0 * c / (v * v * v));
+}
+
+template<typename T> enable_if_simd_dual<T> operator + (const T& a) { return a; }
+template<typename T> enable_if_simd_dual<T> operator - (const T& a) { return a.affine(-1.0, 0.0); }
+
+// Comparisons only use the values.
+#define SPII_DUAL_COMPARISON(op)                                                                                \
+	template<typename T> enable_if_simd_dual_bool<T> operator op (const T& a, const T& b) { return a.x() op b.x(); } \
+	template<typename T> enable_if_simd_dual_bool<T> operator op (const T& a, double b)   { return a.x() op b; }     \
+	template<typename T> enable_if_simd_dual_bool<T> operator op (double a, const T& b)   { return a op b.x(); }
+SPII_DUAL_COMPARISON(==)
+SPII_DUAL_COMPARISON(!=)
+SPII_DUAL_COMPARISON(<)
+SPII_DUAL_COMPARISON(<=)
+SPII_DUAL_COMPARISON(>)
+SPII_DUAL_COMPARISON(>=)
+#undef SPII_DUAL_COMPARISON
+
+template<typename T> enable_if_simd_dual<T> sqr(const T& a)
+{
+	const double v = a.x();
+	return a.unary(v * v, 2.0 * v, 2.0);
+}
+
+template<typename T> enable_if_simd_dual<T> pow(const T& a, double c)
+{
+	// The derivatives that vanish are exactly zero. Otherwise,
+	// c * pow(v, c - 1) would be 0 * inf = NaN at v = 0.
+	const double v = a.x();
+	if (c == 0.0) {
+		return a.unary(1.0, 0.0, 0.0);
+	}
+	else if (c == 1.0) {
+		return a.unary(v, 1.0, 0.0);
+	}
+	else if (c == 2.0) {
+		return a.unary(v * v, 2.0 * v, 2.0);
+	}
+	// Computed separately to avoid inf * 0 at v = 0.
+	return a.unary(std::pow(v, c), c * std::pow(v, c - 1.0), c * (c - 1.0) * std::pow(v, c - 2.0));
+}
+
+template<typename T> enable_if_simd_dual<T> sqrt(const T& a)
+{
+	const double v = a.x();
+	const double s = std::sqrt(v);
+	return a.unary(s, 0.5 / s, -0.25 / (s * v));
+}
+
+template<typename T> enable_if_simd_dual<T> exp(const T& a)
+{
+	const double e = std::exp(a.x());
+	return a.unary(e, e, e);
+}
+
+template<typename T> enable_if_simd_dual<T> log(const T& a)
+{
+	const double v = a.x();
+	return a.unary(std::log(v), 1.0 / v, -1.0 / (v * v));
+}
+
+template<typename T> enable_if_simd_dual<T> pow(const T& a, const T& b)
+{
+	return exp(b * log(a));
+}
+
+template<typename T> enable_if_simd_dual<T> pow(double c, const T& b)
+{
+	return exp(b * std::log(c));
+}
+
+template<typename T> enable_if_simd_dual<T> sin(const T& a)
+{
+	const double s = std::sin(a.x());
+	const double c = std::cos(a.x());
+	return a.unary(s, c, -s);
+}
+
+template<typename T> enable_if_simd_dual<T> cos(const T& a)
+{
+	const double s = std::sin(a.x());
+	const double c = std::cos(a.x());
+	return a.unary(c, -s, -c);
+}
+
+template<typename T> enable_if_simd_dual<T> tan(const T& a)
+{
+	const double t = std::tan(a.x());
+	const double d = 1.0 + t * t;
+	return a.unary(t, d, 2.0 * t * d);
+}
+
+template<typename T> enable_if_simd_dual<T> asin(const T& a)
+{
+	const double v = a.x();
+	const double w = 1.0 - v * v;
+	const double d = 1.0 / std::sqrt(w);
+	return a.unary(std::asin(v), d, v * d / w);
+}
+
+template<typename T> enable_if_simd_dual<T> acos(const T& a)
+{
+	const double v = a.x();
+	const double w = 1.0 - v * v;
+	const double d = 1.0 / std::sqrt(w);
+	return a.unary(std::acos(v), -d, -v * d / w);
+}
+
+template<typename T> enable_if_simd_dual<T> atan(const T& a)
+{
+	const double v = a.x();
+	const double d = 1.0 / (1.0 + v * v);
+	return a.unary(std::atan(v), d, -2.0 * v * d * d);
+}
+
+template<typename T> enable_if_simd_dual<T> tanh(const T& a)
+{
+	const double t = std::tanh(a.x());
+	const double d = 1.0 - t * t;
+	return a.unary(t, d, -2.0 * t * d);
+}
+
+template<typename T> enable_if_simd_dual<T> abs(const T& a)
+{
+	const double v = a.x();
+	return a.unary(std::abs(v), v > 0 ? 1.0 : (v < 0 ? -1.0 : 0.0), 0.0);
+}
+
+}  // namespace spii
+
+#endif
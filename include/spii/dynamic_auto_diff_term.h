@@ -34,8 +34,10 @@
 //  auto term_1_2 = make_differentiable<Dynamic, Dynamic>(Functor{}, 1, 2);
 //
 
+#include <algorithm>
 #include <type_traits>
 #include <typeinfo>
+#include <vector>
 
 #include <spii-thirdparty/badiff.h>
 #include <spii-thirdparty/fadiff.h>
@@ -75,6 +77,221 @@ T dynamic_differentiate_functor(
 	return f.x();
 }
 
+// Terms with at most this many scalars in total are differentiated
+// with dual numbers of fixed capacity, which are stored on the stack.
+static const int dynamic_max_small_gradient_dimension = 16;
+static const int dynamic_max_small_hessian_dimension  = 8;
+
+// Memory used when evaluating dynamic terms. There is one per
+// thread, and it is reused by all evaluations on that thread, so
+// that no memory is allocated once it has grown large enough.
+struct DynamicArena
+{
+	std::vector<double> point;
+	std::vector<double> gradient;
+	std::vector<fadbad::F<double>> duals;
+
+	static DynamicArena& get()
+	{
+		static thread_local DynamicArena arena;
+		return arena;
+	}
+
+	// Returns n variables x[i] with derivative i set. Derivative
+	// storage from the previous evaluation is kept if it has the
+	// same size.
+	fadbad::F<double>* independent_variables(const double* x, int n)
+	{
+		if (duals.size() < n) {
+			duals.resize(n);
+		}
+		for (int i = 0; i < n; ++i) {
+			if (duals[i].size() != n) {
+				// Releases the derivative storage.
+				duals[i] = 0.0;
+			}
+			duals[i].x() = x[i];
+			duals[i].diff(i, n);
+		}
+		return duals.data();
+	}
+};
+
+// Differentiates a functor taking all n scalars of a term after each
+// other, with dual numbers of capacity N >= n. Writes the derivatives
+// in the flat layout used by Term::evaluate_flat. hessian may be null.
+template<int N, typename Functor>
+double dynamic_evaluate_flat_small(
+	const Functor& functor,
+	int n,
+	const double* x,
+	double* gradient,
+	double* hessian)
+{
+	using namespace fadbad;
+
+	if (hessian == nullptr) {
+		F<double, N> vars[N];
+		for (int i = 0; i < n; ++i) {
+			vars[i] = x[i];
+			vars[i].diff(i);
+		}
+
+		F<double, N> f(functor(vars));
+
+		for (int i = 0; i < n; ++i) {
+			gradient[i] = f.d(i);
+		}
+		return f.x();
+	}
+
+	// The variables after n are never read by the functor.
+	F<double, N> vars[N];
+	F<double, N>   df[N];
+	for (int i = 0; i < n; ++i) {
+		vars[i] = x[i];
+		vars[i].diff(i);
+	}
+
+	F<double, N> f(
+		differentiate_functor<Functor, F<double, N>, N>(
+			functor,
+			vars,
+			df)
+		);
+
+	for (int i = 0; i < n; ++i) {
+		gradient[i] = df[i].x();
+	}
+	for (int j = 0; j < n; ++j) {
+		for (int i = 0; i < n; ++i) {
+			hessian[i + n * j] = df[i].d(j);
+		}
+	}
+
+	return f.x();
+}
+
+// Evaluates a functor taking all n scalars of a term after each other.
+// Small terms use dual numbers with fixed capacity; larger terms take
+// their variables from the thread's arena. Hessians of terms larger
+// than dynamic_max_small_hessian_dimension are not computed here.
+template<typename Functor>
+double dynamic_evaluate_flat(
+	const Functor& functor,
+	int n,
+	const double* x,
+	double* gradient,
+	double* hessian)
+{
+	if (hessian) {
+		spii_assert(n <= dynamic_max_small_hessian_dimension);
+		if (n <= 4) {
+			return dynamic_evaluate_flat_small<4>(functor, n, x, gradient, hessian);
+		}
+		return dynamic_evaluate_flat_small<8>(functor, n, x, gradient, hessian);
+	}
+
+	if (n <= 4) {
+		return dynamic_evaluate_flat_small<4>(functor, n, x, gradient, nullptr);
+	}
+	else if (n <= 8) {
+		return dynamic_evaluate_flat_small<8>(functor, n, x, gradient, nullptr);
+	}
+	else if (n <= dynamic_max_small_gradient_dimension) {
+		return dynamic_evaluate_flat_small<16>(functor, n, x, gradient, nullptr);
+	}
+
+	typedef fadbad::F<double> Dual;
+	auto vars = DynamicArena::get().independent_variables(x, n);
+	Dual f{functor(vars)};
+	for (int i = 0; i < n; ++i) {
+		gradient[i] = f.d(i);
+	}
+	return f.x();
+}
+
+// Returns storage for a point with n scalars from the thread's arena.
+inline double* dynamic_point_storage(int n)
+{
+	auto& point = DynamicArena::get().point;
+	if (point.size() < n) {
+		point.resize(n);
+	}
+	return point.data();
+}
+
+// Returns storage for a gradient with n scalars from the thread's arena.
+inline double* dynamic_gradient_storage(int n)
+{
+	auto& gradient = DynamicArena::get().gradient;
+	if (gradient.size() < n) {
+		gradient.resize(n);
+	}
+	return gradient.data();
+}
+
+// Calls a functor with 2–4 variables with all scalars after each other.
+template<typename Functor>
+class DynamicFunctor2_to_1
+{
+public:
+	DynamicFunctor2_to_1(const Functor& functor_in, int d0_)
+		: functor(functor_in), d0(d0_)
+	{
+	}
+
+	template<typename R>
+	R operator()(R* x) const
+	{
+		return functor(x, x + d0);
+	}
+
+private:
+	const Functor& functor;
+	const int d0;
+};
+
+template<typename Functor>
+class DynamicFunctor3_to_1
+{
+public:
+	DynamicFunctor3_to_1(const Functor& functor_in, int d0_, int d1_)
+		: functor(functor_in), d0(d0_), d1(d1_)
+	{
+	}
+
+	template<typename R>
+	R operator()(R* x) const
+	{
+		return functor(x, x + d0, x + d0 + d1);
+	}
+
+private:
+	const Functor& functor;
+	const int d0, d1;
+};
+
+template<typename Functor>
+class DynamicFunctor4_to_1
+{
+public:
+	DynamicFunctor4_to_1(const Functor& functor_in, int d0_, int d1_, int d2_)
+		: functor(functor_in), d0(d0_), d1(d1_), d2(d2_)
+	{
+	}
+
+	template<typename R>
+	R operator()(R* x) const
+	{
+		return functor(x, x + d0, x + d0 + d1, x + d0 + d1 + d2);
+	}
+
+private:
+	const Functor& functor;
+	const int d0, d1, d2;
+};
+
 template<typename Functor>
 class AutoDiffTerm<Functor, Dynamic> :
 	public Term
@@ -115,21 +332,10 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double> Dual;
-		std::vector<Dual> vars(d0);
-
-		for (int i = 0; i < d0; ++i) {
-			vars[i] = variables[0][i];
-			vars[i].diff(i, d0);
-		}
-
-		Dual f{functor(vars.data())};
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		return f.x();
+		double* flat_gradient = dynamic_gradient_storage(d0);
+		double value = evaluate_flat(variables, flat_gradient, nullptr, false);
+		std::copy(flat_gradient, flat_gradient + d0, (*gradient)[0].data());
+		return value;
 	}
 
 	virtual double evaluate(double * const * const variables,
@@ -163,6 +369,18 @@ public:
 		return f.x();
 	}
 
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		if (hessian && d0 > dynamic_max_small_hessian_dimension) {
+			// Large terms use the evaluate above.
+			return Term::evaluate_flat(variables, gradient, hessian, upper_only);
+		}
+		return dynamic_evaluate_flat(functor, d0, variables[0], gradient, hessian);
+	}
+
 protected:
 	const int d0;
 	Functor functor;
@@ -216,32 +434,11 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double> Dual;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, d0 + d1);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, d0 + d1);
-		}
-
-		Dual f{functor(vars0.data(), vars1.data())};
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		return f.x();
+		double* flat_gradient = dynamic_gradient_storage(d0 + d1);
+		double value = evaluate_flat(variables, flat_gradient, nullptr, false);
+		std::copy(flat_gradient, flat_gradient + d0, (*gradient)[0].data());
+		std::copy(flat_gradient + d0, flat_gradient + d0 + d1, (*gradient)[1].data());
+		return value;
 	}
 
 	virtual double evaluate(double * const * const variables,
@@ -297,6 +494,25 @@ public:
 		return f.x().x();
 	}
 
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		const int n = d0 + d1;
+		if (hessian && n > dynamic_max_small_hessian_dimension) {
+			// Large terms use reverse mode via the evaluate above.
+			return Term::evaluate_flat(variables, gradient, hessian, upper_only);
+		}
+
+		double* x = dynamic_point_storage(n);
+		std::copy(variables[0], variables[0] + d0, x);
+		std::copy(variables[1], variables[1] + d1, x + d0);
+
+		DynamicFunctor2_to_1<Functor> flat_functor(functor, d0);
+		return dynamic_evaluate_flat(flat_functor, n, x, gradient, hessian);
+	}
+
 protected:
 	const int d0, d1;
 	Functor functor;
@@ -350,44 +566,12 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double> Dual;
-		const int number_of_vars = d0 + d1 + d2;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, number_of_vars);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, number_of_vars);
-		}
-
-		std::vector<Dual> vars2(d2);
-		int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2, number_of_vars);
-		}
-
-		Dual f(functor(vars0.data(), vars1.data(), vars2.data()));
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		return f.x();
+		double* flat_gradient = dynamic_gradient_storage(d0 + d1 + d2);
+		double value = evaluate_flat(variables, flat_gradient, nullptr, false);
+		std::copy(flat_gradient, flat_gradient + d0, (*gradient)[0].data());
+		std::copy(flat_gradient + d0, flat_gradient + d0 + d1, (*gradient)[1].data());
+		std::copy(flat_gradient + d0 + d1, flat_gradient + d0 + d1 + d2, (*gradient)[2].data());
+		return value;
 	}
 
 	virtual double evaluate(double * const * const variables,
@@ -480,6 +664,26 @@ public:
 		return f.x().x();
 	}
 
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		const int n = d0 + d1 + d2;
+		if (hessian && n > dynamic_max_small_hessian_dimension) {
+			// Large terms use reverse mode via the evaluate above.
+			return Term::evaluate_flat(variables, gradient, hessian, upper_only);
+		}
+
+		double* x = dynamic_point_storage(n);
+		std::copy(variables[0], variables[0] + d0, x);
+		std::copy(variables[1], variables[1] + d1, x + d0);
+		std::copy(variables[2], variables[2] + d2, x + d0 + d1);
+
+		DynamicFunctor3_to_1<Functor> flat_functor(functor, d0, d1);
+		return dynamic_evaluate_flat(flat_functor, n, x, gradient, hessian);
+	}
+
 protected:
 	const int d0, d1, d2;
 	Functor functor;
@@ -534,55 +738,13 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient) const override
 	{
-		typedef fadbad::F<double> Dual;
-		const int number_of_vars = d0 + d1 + d2 + d3;
-
-		std::vector<Dual> vars0(d0);
-		for (int i = 0; i < d0; ++i) {
-			vars0[i] = variables[0][i];
-			vars0[i].diff(i, number_of_vars);
-		}
-
-		std::vector<Dual> vars1(d1);
-		int offset1 = d0;
-		for (int i = 0; i < d1; ++i) {
-			vars1[i] = variables[1][i];
-			vars1[i].diff(i + offset1, number_of_vars);
-		}
-
-		std::vector<Dual> vars2(d2);
-		int offset2 = d0 + d1;
-		for (int i = 0; i < d2; ++i) {
-			vars2[i] = variables[2][i];
-			vars2[i].diff(i + offset2, number_of_vars);
-		}
-
-		std::vector<Dual> vars3(d3);
-		int offset3 = d0 + d1 + d2;
-		for (int i = 0; i < d3; ++i) {
-			vars3[i] = variables[3][i];
-			vars3[i].diff(i + offset3, number_of_vars);
-		}
-
-		Dual f(functor(vars0.data(), vars1.data(), vars2.data(), vars3.data()));
-
-		for (int i = 0; i < d0; ++i) {
-			(*gradient)[0](i) = f.d(i);
-		}
-
-		for (int i = 0; i < d1; ++i) {
-			(*gradient)[1](i) = f.d(i + offset1);
-		}
-
-		for (int i = 0; i < d2; ++i) {
-			(*gradient)[2](i) = f.d(i + offset2);
-		}
-
-		for (int i = 0; i < d3; ++i) {
-			(*gradient)[3](i) = f.d(i + offset3);
-		}
-
-		return f.x();
+		double* flat_gradient = dynamic_gradient_storage(d0 + d1 + d2 + d3);
+		double value = evaluate_flat(variables, flat_gradient, nullptr, false);
+		std::copy(flat_gradient, flat_gradient + d0, (*gradient)[0].data());
+		std::copy(flat_gradient + d0, flat_gradient + d0 + d1, (*gradient)[1].data());
+		std::copy(flat_gradient + d0 + d1, flat_gradient + d0 + d1 + d2, (*gradient)[2].data());
+		std::copy(flat_gradient + d0 + d1 + d2, flat_gradient + d0 + d1 + d2 + d3, (*gradient)[3].data());
+		return value;
 	}
 
 	virtual double evaluate(double * const * const variables,
@@ -721,6 +883,27 @@ public:
 		return f.x().x();
 	}
 
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const override
+	{
+		const int n = d0 + d1 + d2 + d3;
+		if (hessian && n > dynamic_max_small_hessian_dimension) {
+			// Large terms use reverse mode via the evaluate above.
+			return Term::evaluate_flat(variables, gradient, hessian, upper_only);
+		}
+
+		double* x = dynamic_point_storage(n);
+		std::copy(variables[0], variables[0] + d0, x);
+		std::copy(variables[1], variables[1] + d1, x + d0);
+		std::copy(variables[2], variables[2] + d2, x + d0 + d1);
+		std::copy(variables[3], variables[3] + d3, x + d0 + d1 + d2);
+
+		DynamicFunctor4_to_1<Functor> flat_functor(functor, d0, d1, d2);
+		return dynamic_evaluate_flat(flat_functor, n, x, gradient, hessian);
+	}
+
 protected:
 	const int d0, d1, d2, d3;
 	Functor functor;
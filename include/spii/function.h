@@ -12,9 +12,12 @@
 //
 
 #include <cstddef>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 using std::size_t;
 
 #include <Eigen/SparseCore>
@@ -23,8 +26,10 @@ using std::size_t;
 #include <spii/auto_diff_change_of_variables.h>
 #include <spii/change_of_variables.h>
 #include <spii/interval.h>
+#include <spii/memory_usage.h>
 #include <spii/term.h>
 #include <spii/term_factory.h>
+#include <spii/term_stream.h>
 
 namespace spii {
 
@@ -51,6 +56,16 @@ struct AddedTerm
 	std::vector<size_t> added_variables_indices;
 	// Temporary storage for a point.
 	mutable std::vector<double*> temp_variables;
+	// Offsets of the variables in the flat gradient and Hessian of
+	// the term (see Term::evaluate_flat). The last element is the
+	// sum of all variable dimensions.
+	mutable std::vector<int> flat_offsets;
+	// Whether each variable is active, i.e. not constant, and the
+	// offsets of the variables in the flat gradient and Hessian from
+	// Term::evaluate_flat_active (-1 for inactive variables). The last
+	// element is the sum of all active variable dimensions.
+	mutable const bool* active;
+	mutable std::vector<int> active_offsets;
 };
 
 template<typename T>
@@ -78,6 +93,11 @@ public:
 	// setting only affects the amount of temporary space allocated.
 	bool hessian_is_enabled = true;
 
+	// Times every term evaluation and groups the times by the type of
+	// the term (see get_term_profile). Timing a term costs about as
+	// much as evaluating a cheap one, so this is off by default.
+	bool term_profiling_enabled = false;
+
 	Function();
 	~Function();
 	// Copying may be expensive for large functions.
@@ -89,6 +109,10 @@ public:
 	Function& operator += (const Function&);
 	Function& operator += (double constant_value);
 
+	// Identifies a term in the function. The handle of a term stays
+	// the same when other terms are added or removed.
+	typedef std::size_t TermHandle;
+
 	// Adds a new term to the function. Will throw an error if a variable
 	// is already added to the function and it does not match the
 	// dimensionality required by the Term.
@@ -97,21 +121,38 @@ public:
 	//
 	// Adding the same term twice with different variables is safe
 	// (and a good thing to do).
-	void add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments);
+	//
+	// If all variables have already been added, the allocated storage
+	// and the cached sparsity pattern are updated with the new term
+	// instead of being recomputed at the next evaluation.
+	TermHandle add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments);
 
 	template<typename... PointerToDouble>
-	void add_term(std::shared_ptr<const Term> term, PointerToDouble... args)
+	TermHandle add_term(std::shared_ptr<const Term> term, PointerToDouble... args)
 	{
-		add_term(term, {args...});
+		return add_term(term, {args...});
 	}
 
 	template<typename MyTerm, typename... PointerToDouble>
-	void add_term(PointerToDouble... args)
+	TermHandle add_term(PointerToDouble... args)
 	{
-		add_term(std::make_shared<MyTerm>(), {args...});
+		return add_term(std::make_shared<MyTerm>(), {args...});
 	}
 
-	// Returns the current number of terms contained in the function.
+	// Removes a term from the function. Its variables are kept. The
+	// last term added takes the place of the removed term, so the
+	// order of terms() changes. Like adding a term, this updates the
+	// allocated storage and the cached sparsity pattern.
+	void remove_term(TermHandle term);
+
+	// Adds terms that are not kept in memory, but loaded in chunks
+	// during each evaluation (see term_stream.h). All variables of
+	// the streamed terms must already have been added. Streamed terms
+	// do not support Hessians.
+	void add_term_stream(std::shared_ptr<const TermStream> stream);
+
+	// Returns the current number of terms contained in the function
+	// (not counting streamed terms).
 	size_t get_number_of_terms() const;
 
 	// Provides a way of iterating over the terms in the function.
@@ -163,6 +204,22 @@ public:
 	// NOTE: After calling this function, the global indexing of
 	//       variables will change permanently.
 	void set_constant(double* variable, bool is_constant);
+	// Same as above for several variables, but the global indexing is
+	// only recomputed once. If the set of constant variables becomes
+	// the same as at the last evaluation, the allocated storage is
+	// reused, and create_sparse_hessian reuses the sparsity pattern
+	// from the last few sets of constant variables.
+	void set_constant(const std::vector<double*>& variables, bool is_constant);
+
+	// Sets lower and upper bounds for the scalars of a variable. Use
+	// ±infinity for scalars without a bound. Bounds are only
+	// supported by LBFGSSolver, and can not be combined with a change
+	// of variables.
+	void set_bounds(double* variable, const double* lower, const double* upper);
+	// Returns true if any variable that is not constant has bounds.
+	bool has_bounds() const;
+	// Returns the bounds of all scalars in the global vector.
+	void get_bounds(Eigen::VectorXd* lower, Eigen::VectorXd* upper) const;
 
 	// Returns the current number of variables the function contains.
 	size_t get_number_of_variables() const;
@@ -185,19 +242,40 @@ public:
 	double evaluate(const Eigen::VectorXd& x,
 	                Eigen::VectorXd* gradient) const;
 
+	// How the symmetric Hessian matrix is stored.
+	enum class HessianStorage
+	{
+		FULL,  // All elements.
+		LOWER  // Only the lower triangle (with the diagonal); the
+		       // elements above the diagonal are zero (dense) or not
+		       // present (sparse). This is the part read by Eigen's
+		       // LLT and SimplicialLLT and about half the work.
+	};
+
 	// Evaluate the function and compute the gradient and Hessian matrix
 	// at the point x. Dense version.
 	double evaluate(const Eigen::VectorXd& x,
 	                Eigen::VectorXd* gradient,
-	                Eigen::MatrixXd* hessian) const;
+	                Eigen::MatrixXd* hessian,
+	                HessianStorage storage = HessianStorage::FULL) const;
 
 	// Same functionality as above, but for a sparse Hessian.
 	double evaluate(const Eigen::VectorXd& x,
 	                Eigen::VectorXd* gradient,
-	                Eigen::SparseMatrix<double>* hessian) const;
+	                Eigen::SparseMatrix<double>* hessian,
+	                HessianStorage storage = HessianStorage::FULL) const;
 
 	Interval<double> evaluate(const std::vector<Interval<double>>& x) const;
 
+	// Evaluates the function at every column of X. The values are
+	// stored in values and, if gradients is not nullptr, the
+	// gradients in the columns of gradients. Each term is evaluated
+	// at all points before moving on to the next one, which is
+	// faster than evaluating the points one at a time.
+	void evaluate_many(const Eigen::MatrixXd& X,
+	                   Eigen::VectorXd* values,
+	                   Eigen::MatrixXd* gradients = nullptr) const;
+
 	// Copies variables from a global vector x to the storage
 	// provided by the user.
 	void copy_global_to_user(const Eigen::VectorXd& x) const;
@@ -207,7 +285,8 @@ public:
 	void copy_user_to_global(Eigen::VectorXd* x) const;
 
 	// Create a sparse matrix with the correct sparsity pattern.
-	void create_sparse_hessian(Eigen::SparseMatrix<double>* H) const;
+	void create_sparse_hessian(Eigen::SparseMatrix<double>* H,
+	                           HessianStorage storage = HessianStorage::FULL) const;
 
 	// Used to record the time of some operations. Each time an operation
 	// is performed, the time taken is added to the appropiate variable.
@@ -215,16 +294,109 @@ public:
 	mutable int evaluations_with_gradient       = 0;
 	mutable double allocation_time              = 0.0;
 	mutable double evaluate_time                = 0.0;
+	mutable double evaluate_with_gradient_time  = 0.0;
 	mutable double evaluate_with_hessian_time   = 0.0;
 	mutable double write_gradient_hessian_time  = 0.0;
 	mutable double copy_time                    = 0.0;
 
+	// Evaluation statistics of all terms of one type.
+	struct TermTypeProfile
+	{
+		// The name used by TermFactory and the serializer.
+		std::string name;
+		std::size_t number_of_terms = 0;
+		// Evaluations of the value only, of the value and gradient,
+		// and of the value, gradient and Hessian, and the total time
+		// spent in each. Terms with constant Hessians are evaluated
+		// with gradients.
+		std::uint64_t value_evaluations    = 0;
+		std::uint64_t gradient_evaluations = 0;
+		std::uint64_t hessian_evaluations  = 0;
+		double value_time    = 0.0;
+		double gradient_time = 0.0;
+		double hessian_time  = 0.0;
+
+		std::uint64_t evaluations() const
+		{
+			return value_evaluations + gradient_evaluations + hessian_evaluations;
+		}
+		double total_time() const
+		{
+			return value_time + gradient_time + hessian_time;
+		}
+		double mean_time() const
+		{
+			return evaluations() > 0 ? total_time() / evaluations() : 0.0;
+		}
+	};
+
+	struct TermProfile
+	{
+		// Sorted with the most expensive type first.
+		std::vector<TermTypeProfile> term_types;
+
+		// Time each thread has spent in the term loops.
+		std::vector<double> thread_time;
+		// Sums over all term loops of the time of the slowest thread
+		// and the mean time of the threads.
+		int number_of_loops = 0;
+		double max_thread_time  = 0.0;
+		double mean_thread_time = 0.0;
+
+		// How much longer the loops took than with perfectly
+		// balanced threads; 1 is perfect balance.
+		double load_imbalance() const
+		{
+			return mean_thread_time > 0 ? max_thread_time / mean_thread_time : 1.0;
+		}
+	};
+
+	// Returns the statistics recorded while term_profiling_enabled was
+	// set. Streamed terms are not included.
+	TermProfile get_term_profile() const;
+	void clear_term_profile();
+
 	// Prints the recorded timing information.
 	void print_timing_information(std::ostream& out) const;
 
+	// Bytes used by the internal structures of the function, now and
+	// at most since it was created (see memory_usage.h). The terms
+	// themselves are not counted.
+	MemoryUsage get_memory_usage() const;
+
+	// How a solver evaluates the function. Evaluating only the value
+	// uses the same storage as GRADIENT.
+	enum class Evaluation {GRADIENT, DENSE_HESSIAN, SPARSE_HESSIAN};
+	// Predicts the peak memory usage of evaluating the function
+	// repeatedly, before any evaluation. The storage used by
+	// evaluate_many is not included.
+	MemoryUsage estimate_memory_usage(Evaluation evaluation) const;
+
 	void write_to_stream(std::ostream& out) const;
 	void read_from_stream(std::istream& in, std::vector<double>* user_space, const TermFactory& factory);
 
+	// Same as above, but with the binary format described in
+	// function_serializer.h. The data read can be memory-mapped
+	// (see read_binary_file). Terms without data are only created
+	// once per type and shared. If share_terms_with_data is true, the
+	// same is done for terms with the same type and data.
+	void write_to_binary_stream(std::ostream& out) const;
+	void read_from_binary(const char* data,
+	                      std::size_t size,
+	                      std::vector<double>* user_space,
+	                      const TermFactory& factory,
+	                      bool share_terms_with_data = false);
+	// Same as above, but only the variables are read. The terms are
+	// streamed from data in chunks of terms_per_chunk terms during
+	// each evaluation (see add_term_stream). The function keeps a
+	// copy of data. factory must outlive the function.
+	void read_from_binary_streamed(std::shared_ptr<const char> data,
+	                               std::size_t size,
+	                               std::vector<double>* user_space,
+	                               const TermFactory& factory,
+	                               std::size_t terms_per_chunk,
+	                               bool share_terms_with_data = false);
+
 private:
 
 	// Present here because it is called by a templated function above.
@@ -3,6 +3,7 @@
 #define SPII_FUNCTION_SERIALIZER_H
 
 #include <iostream>
+#include <string>
 #include <vector>
 
 #include <spii/spii.h>
@@ -42,6 +43,68 @@ private:
 
 SPII_API std::ostream& operator << (std::ostream& out, const Serialize& serializer);
 SPII_API std::istream& operator >> (std::istream& in,  Serialize& serializer);
+
+// Binary format. Much faster to read and write than the text format
+// above, but it stores numbers exactly as in memory (little-endian)
+// and can only be read by programs built with the same compiler.
+//
+// Only the variables and the structure of the function are binary.
+// The data of each term is the text written by Term::write, and is
+// parsed with Term::read (through TermFactory::create) when the term
+// is created. Terms with a lot of data are therefore not much
+// cheaper to read or smaller than in the text format. All terms are
+// created when the file is read; read_binary_file_streamed can be
+// used to create them as they are needed instead.
+//
+// Version 1 consists of the following sections, each starting at a
+// multiple of 8 bytes. Strings are stored as a uint64 length followed
+// by the characters.
+//
+//    char[8]         "spii-bin"
+//    uint32          version
+//    uint32          0
+//    string          compiler-dependent type name format
+//    uint64          number of term types
+//    uint64          number of variables
+//    uint64          number of scalars
+//    uint64          number of terms
+//    uint64          total number of term variables
+//    uint64          size of the term data
+//    double          constant
+//    string[]        names of the term types
+//    uint64[]        variable dimensions
+//    uint8[]         whether each variable is constant
+//    double[]        values of the variables
+//    uint32[]        type of each term
+//    uint64[]        offsets into the term variables (one per term + 1)
+//    uint64[]        term variables (indices of variables)
+//    uint64[]        offsets into the term data (one per term + 1)
+//    char[]          term data, as written by Term::write
+//
+// Writes a function to a file in the binary format.
+SPII_API void write_binary_file(const std::string& file_name, const Function& function);
+// Reads a function from a file in the binary format. The file is
+// memory-mapped. The values of the variables are stored in user_space.
+// Terms without data are created once per type. If
+// share_terms_with_data is true, terms with the same type and data
+// are also created only once, at the cost of hashing all term data.
+SPII_API void read_binary_file(const std::string& file_name,
+                               Function* function,
+                               std::vector<double>* user_space,
+                               const TermFactory& factory,
+                               bool share_terms_with_data = false);
+// Reads the variables of a function from a file in the binary format.
+// The terms are not read into memory but streamed from the mapped file
+// during each evaluation, terms_per_chunk terms at a time. Terms with
+// data are parsed from the file again in every evaluation (with
+// share_terms_with_data, once per chunk). The file stays mapped as
+// long as the function uses it.
+SPII_API void read_binary_file_streamed(const std::string& file_name,
+                                        Function* function,
+                                        std::vector<double>* user_space,
+                                        const TermFactory& factory,
+                                        std::size_t terms_per_chunk = 65536,
+                                        bool share_terms_with_data = false);
 }
 
 #endif
@@ -28,11 +28,23 @@
 // Note that LargeAutoDiffTerm will be slower than AutoDiffTerm
 // for small number of variables.
 //
+// If the control flow of the functor does not depend on the values
+// of the variables, call
+//
+//    my_term.use_recorded_tape();
+//
+// before the term is evaluated. The operations of the functor are then
+// recorded once into a Tape, and all derivatives are computed by
+// sweeping over the recording. This also enables the Hessian.
+//
+#include <algorithm>
+#include <mutex>
 #include <vector>
 
 #include <spii-thirdparty/badiff.h>
 #include <spii-thirdparty/fadiff.h>
 
+#include <spii/tape.h>
 #include <spii/term.h>
 
 namespace spii {
@@ -64,8 +76,22 @@ class LargeAutoDiffTerm final : public Term {
 		return functor(dimensions, variables);
 	}
 
+	// Records the functor on a tape at the first evaluation and
+	// computes all derivatives from it. Only valid if the control flow
+	// of the functor does not depend on the values of the variables.
+	void use_recorded_tape(bool use = true) { use_tape = use; }
+
 	double evaluate(double* const* const variables,
 	                std::vector<Eigen::VectorXd>* gradient) const override {
+		if (use_tape) {
+			// Reused between calls, as in evaluate_flat.
+			static thread_local std::vector<double> flat_gradient;
+			flat_gradient.resize(total_size);
+			double value = evaluate_flat(variables, flat_gradient.data(), nullptr, false);
+			copy_from_flat(flat_gradient.data(), gradient);
+			return value;
+		}
+
 		using R = fadbad::B<double>;
 
 		std::vector<R> x_data(total_size);
@@ -98,13 +124,105 @@ class LargeAutoDiffTerm final : public Term {
 	double evaluate(double* const* const variables,
 	                std::vector<Eigen::VectorXd>* gradient,
 	                std::vector<std::vector<Eigen::MatrixXd>>* hessian) const override {
-		throw std::runtime_error("Hessian not implemented for LargeAutoDiffTerm.");
+		if (!use_tape) {
+			throw std::runtime_error("Hessian not implemented for LargeAutoDiffTerm without a recorded tape.");
+		}
+
+		static thread_local std::vector<double> flat_gradient;
+		static thread_local std::vector<double> flat_hessian;
+		flat_gradient.resize(total_size);
+		flat_hessian.resize(total_size * total_size);
+		double value = evaluate_flat(variables, flat_gradient.data(), flat_hessian.data(), false);
+		copy_from_flat(flat_gradient.data(), gradient);
+		int offset0 = 0;
+		for (int var0 = 0; var0 < dimensions.size(); ++var0) {
+			int offset1 = 0;
+			for (int var1 = 0; var1 < dimensions.size(); ++var1) {
+				for (int j = 0; j < dimensions[var1]; ++j) {
+					for (int i = 0; i < dimensions[var0]; ++i) {
+						(*hessian)[var0][var1](i, j) = flat_hessian[(offset0 + i) + total_size * (offset1 + j)];
+					}
+				}
+				offset1 += dimensions[var1];
+			}
+			offset0 += dimensions[var0];
+		}
+		return value;
+	}
+
+	double evaluate_flat(double* const* const variables,
+	                     double* gradient,
+	                     double* hessian,
+	                     bool upper_only) const override {
+		if (!use_tape) {
+			return Term::evaluate_flat(variables, gradient, hessian, upper_only);
+		}
+
+		static thread_local std::vector<double> x;
+		x.resize(total_size);
+		copy_to_flat(variables, x.data());
+		const Tape& tape = recorded_tape(x.data());
+		if (hessian) {
+			return tape.hessian(x.data(), gradient, hessian);
+		}
+		return tape.gradient(x.data(), gradient);
+	}
+
+	// Computes the product of the Hessian and v, where v and the
+	// result have all variables after each other. Requires a
+	// recorded tape.
+	double hessian_vector_product(double* const* const variables,
+	                              const double* v,
+	                              double* gradient,
+	                              double* hessian_times_v) const {
+		spii_assert(use_tape, "hessian_vector_product requires a recorded tape.");
+		std::vector<double> x(total_size);
+		copy_to_flat(variables, x.data());
+		return recorded_tape(x.data()).hessian_vector_product(x.data(), v, gradient, hessian_times_v);
 	}
 
  private:
+	void copy_to_flat(double* const* const variables, double* x) const {
+		for (int i = 0; i < dimensions.size(); ++i) {
+			x = std::copy(variables[i], variables[i] + dimensions[i], x);
+		}
+	}
+
+	void copy_from_flat(const double* flat_gradient, std::vector<Eigen::VectorXd>* gradient) const {
+		for (int i = 0; i < dimensions.size(); ++i) {
+			for (int j = 0; j < dimensions[i]; ++j) {
+				(*gradient)[i][j] = *flat_gradient++;
+			}
+		}
+	}
+
+	// Records the tape at the first call. x is only used to evaluate
+	// the functor while recording.
+	const Tape& recorded_tape(const double* x) const {
+		std::call_once(tape_recorded, [&]() {
+			std::vector<TapeValue> x_data;
+			x_data.reserve(total_size);
+			for (int i = 0; i < total_size; ++i) {
+				x_data.push_back(tape.add_input(x[i]));
+			}
+			std::vector<TapeValue*> x_pointers(dimensions.size());
+			int pos = 0;
+			for (int i = 0; i < dimensions.size(); ++i) {
+				x_pointers[i] = &x_data[pos];
+				pos += dimensions[i];
+			}
+			tape.set_output(functor(dimensions, x_pointers.data()));
+		});
+		return tape;
+	}
+
 	const Functor functor;
 	const std::vector<int> dimensions;
 	const int total_size;
+
+	bool use_tape = false;
+	mutable std::once_flag tape_recorded;
+	mutable Tape tape;
 };
 }
 
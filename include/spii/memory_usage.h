@@ -0,0 +1,107 @@
+#ifndef SPII_MEMORY_USAGE_H
+#define SPII_MEMORY_USAGE_H
+//
+// MemoryUsage lists the bytes used by the internal structures of a
+// Function or a solver, for finding out what needs the memory of a
+// large problem:
+//
+//    std::cerr << function.get_memory_usage();
+//    solver.solve(function, &results);
+//    std::cerr << results.memory_usage;
+//
+// Solver::estimate_memory_usage predicts the usage of a solve before
+// it starts, e.g. for deciding how much memory a job needs.
+//
+// Only the large structures and their containers are counted; small
+// objects and the allocator's overhead are not.
+//
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+
+#include <spii/spii.h>
+
+namespace spii {
+
+struct SPII_API MemoryUsage
+{
+	struct Structure
+	{
+		std::string name;
+		std::size_t current = 0;
+		std::size_t peak    = 0;
+	};
+	// In the order they were first recorded.
+	std::vector<Structure> structures;
+	// The largest total recorded at one time. At most the sum of the
+	// peaks of all structures.
+	std::size_t peak_total = 0;
+
+	// Sets the current size of a structure and updates the peaks.
+	void record(const std::string& name, std::size_t bytes);
+	// Adds all structures of other, with prefix added to their names.
+	// The totals are added as well.
+	void add(const MemoryUsage& other, const std::string& prefix);
+
+	std::size_t current_total() const;
+	// Zero for structures that have not been recorded.
+	std::size_t current(const std::string& name) const;
+	std::size_t peak(const std::string& name) const;
+};
+
+SPII_API std::ostream& operator<<(std::ostream& out, const MemoryUsage& usage);
+
+// Bytes allocated on the heap by an object, not counting the object
+// itself.
+template<typename T>
+std::size_t heap_size(const T&)
+{
+	return 0;
+}
+
+inline std::size_t heap_size(const Eigen::VectorXd& v)
+{
+	return v.size() * sizeof(double);
+}
+
+inline std::size_t heap_size(const Eigen::MatrixXd& A)
+{
+	return A.size() * sizeof(double);
+}
+
+inline std::size_t heap_size(const Eigen::SparseMatrix<double>& A)
+{
+	std::size_t bytes = A.data().allocatedSize() * (sizeof(double) + sizeof(int));
+	bytes += (A.outerSize() + 1) * sizeof(int);
+	if (! A.isCompressed()) {
+		bytes += A.outerSize() * sizeof(int);
+	}
+	return bytes;
+}
+
+inline std::size_t heap_size(const std::vector<bool>& v)
+{
+	return v.capacity() / 8;
+}
+
+template<typename T>
+std::size_t heap_size(const std::vector<T>& v)
+{
+	std::size_t bytes = v.capacity() * sizeof(T);
+	if (! std::is_trivially_destructible<T>::value) {
+		for (const auto& element: v) {
+			bytes += heap_size(element);
+		}
+	}
+	return bytes;
+}
+
+}  // namespace spii
+
+#endif
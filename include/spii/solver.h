@@ -8,9 +8,15 @@
 // using the settings in the Solver.
 //
 
+#include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 #include <spii/spii.h>
 #include <spii/function.h>
@@ -40,6 +46,9 @@ struct SPII_API SolverResults
 		       exit_condition == ARGUMENT_TOLERANCE;
 	}
 
+	// The number of iterations performed.
+	int iterations = 0;
+
 	double startup_time                = 0;
 	double function_evaluation_time    = 0;
 	double stopping_criteria_time      = 0;
@@ -48,8 +57,14 @@ struct SPII_API SolverResults
 	double linear_solver_time          = 0;
 	double backtracking_time           = 0;
 	double log_time                    = 0;
+	double checkpoint_time             = 0;
 	double total_time                  = 0;
 
+	// Bytes used by the solver and the function during the last
+	// solve. The structures of the function have names starting
+	// with "Function: ".
+	MemoryUsage memory_usage;
+
 	// The minimum value of the function being minimized is
 	// in this interval. These members are only set by global
 	// optmization solvers.
@@ -64,6 +79,9 @@ SPII_API std::ostream& operator<<(std::ostream& out, const SolverResults& result
 //
 // Note: All pointers in the struct may be
 //       nullptr, depending on the solver.
+//
+// Note: NewtonSolver with iterative factorization only
+//       stores the lower triangle of the Hessian.
 struct CallbackInformation
 {
 	double objective_value = std::numeric_limits<double>::quiet_NaN();
@@ -78,12 +96,53 @@ struct CallbackInformation
 };
 
 
+// Information kept between calls to Solver::solve, so that a solver
+// can continue where it stopped when the function has only changed
+// slightly, e.g. when terms have been added or removed (see
+// Function::remove_term):
+//
+//    SolverState state;
+//    for (...) {
+//        // Change the function.
+//        solver.solve(function, &results, &state);
+//    }
+//
+// The state is cleared by the solver if the number of scalars of the
+// function changes.
+struct SPII_API SolverState
+{
+	// The number of scalars of the function the state belongs to.
+	std::size_t number_of_scalars = 0;
+	// The maximum norm of the gradient at the start of the first
+	// solve. The gradient tolerance is relative to this value instead
+	// of to the gradient at the start of every solve.
+	double initial_gradient_norm = std::numeric_limits<double>::quiet_NaN();
+
+	// Used by LBFGSSolver. The curvature pairs, the most recent first,
+	// and the length of the last step.
+	std::vector<Eigen::VectorXd> lbfgs_s;
+	std::vector<Eigen::VectorXd> lbfgs_y;
+	double lbfgs_step_length = std::numeric_limits<double>::quiet_NaN();
+
+	// Used by NewtonSolver. The sparse Cholesky factorization with its
+	// analyzed pattern, and the shift tau added to the diagonal of the
+	// Hessian in the last iteration (iterative factorization).
+	struct SparseFactorization;
+	std::shared_ptr<SparseFactorization> sparse_factorization;
+	double newton_tau = 0;
+
+	void clear();
+};
+
 // Used to call Solver::BKP_dense.
 class SPII_API FactorizationCache;
 
 // Used to call Solver::check_exit_conditions.
 struct CheckExitConditionsCache;
 
+// See trace.h.
+class SPII_API Trace;
+
 #ifdef _WIN32
 	SPII_API_EXTERN_TEMPLATE template class SPII_API std::function<void(const std::string&)>;
 	SPII_API_EXTERN_TEMPLATE template class SPII_API std::function<bool(const CallbackInformation&)>;
@@ -97,6 +156,14 @@ public:
 	Solver(const Solver&) = default;
 
 	virtual void solve(const Function& function, SolverResults* results) const = 0;
+	// Same as above, but the solver starts from state and updates it.
+	// Solvers without any state to keep ignore it.
+	virtual void solve(const Function& function, SolverResults* results, SolverState* state) const;
+
+	// Predicts the memory usage of solving function with the current
+	// settings, before solve is called. The predicted peaks are upper
+	// bounds for most structures; see the solvers for exceptions.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const;
 
 	// Function called every time the solver emits a log message.
 	// Default: print to std::cerr.
@@ -110,6 +177,25 @@ public:
 	// Maximum number of iterations.
 	int maximum_iterations = 100;
 
+	// If not empty, the solver writes its complete state to this file
+	// every checkpoint_interval iterations, so that a long solve can
+	// be resumed after being interrupted. The file is written by a
+	// background thread to a temporary file, which then replaces the
+	// previous checkpoint. Supported by LBFGSSolver (without bounds)
+	// and GlobalSolver; the other solvers throw.
+	std::string checkpoint_file;
+	int checkpoint_interval = 10;
+	// If true and checkpoint_file exists, the solver continues from
+	// the checkpoint instead of from the current point. The iterates
+	// are bit-identical to those of an uninterrupted solve, provided
+	// that the function evaluations are (e.g. with one thread).
+	bool resume_from_checkpoint = false;
+
+	// If not null, the solver records the time spent in each
+	// iteration and phase to this trace (see trace.h).
+	// Default: null.
+	Trace* trace = nullptr;
+
 	// Gradient tolerance. The solver terminates if
 	// ||g|| / ||g0|| < tol, where ||.|| is the maximum
 	// norm.
@@ -219,6 +305,15 @@ public:
 	FactorizationMethod factorization_method = FactorizationMethod::MESCHACH;
 
 	virtual void solve(const Function& function, SolverResults* results) const override;
+	// Keeps the analyzed sparsity pattern of the Hessian (if it has not
+	// changed) and starts the iterative factorization from the last
+	// shift tau.
+	virtual void solve(const Function& function, SolverResults* results, SolverState* state) const override;
+
+	// The sparse estimate analyzes the sparsity pattern of the
+	// Hessian to find the size of the Cholesky factor. The memory
+	// used by sym-ildl is not estimated.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
 };
 
 // L-BFGS. Requires only first-order derivatives
@@ -235,7 +330,20 @@ public:
 	// value, L-BFGS will discard its history and restart.
 	double lbfgs_restart_tolerance = 1e-6;
 
+	// If the function has bounds (see Function::set_bounds), they
+	// are handled directly as in L-BFGS-B (Byrd, Lu, Nocedal and
+	// Zhu, 1995): each step goes to the generalized Cauchy point,
+	// followed by a minimization over the free variables and a
+	// projected backtracking line search.
 	virtual void solve(const Function& function, SolverResults* results) const override;
+	// Starts from the curvature pairs in state instead of a steepest
+	// descent step. Not used for functions with bounds.
+	virtual void solve(const Function& function, SolverResults* results, SolverState* state) const override;
+
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
+
+private:
+	void solve_with_bounds(const Function& function, SolverResults* results) const;
 };
 
 // Nelder-Mead requires no derivatives. It generally
@@ -255,7 +363,25 @@ public:
 	// norm.
 	double length_tolerance = 1e-12;
 
+	// Number of threads used to evaluate points of the simplex.
+	// If larger than 1, the initial simplex and all trial points
+	// of an iteration (reflection, expansion and contractions) are
+	// evaluated concurrently, each thread using its own copy of the
+	// function. This pays off for expensive black-box terms.
+	// Default: 1 (serial).
+	int number_of_threads = 1;
+
+	// Number of worst vertices replaced in each iteration. Values
+	// larger than 1 give more trial points per iteration to
+	// evaluate concurrently.
+	// Default: 1 (standard Nelder-Mead).
+	int number_of_replaced_vertices = 1;
+
+	using Solver::solve;
 	virtual void solve(const Function& function, SolverResults* results) const override;
+
+	// Copies of the function are estimated with their current size.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
 };
 
 // For most problems, there is no reason to choose
@@ -269,7 +395,30 @@ public:
 	// norm.
 	double area_tolerance = 1e-12;
 
+	// Number of threads used to evaluate the 2n trial points of
+	// each poll step, each thread using its own copy of the
+	// function.
+	// Default: 1 (serial).
+	int number_of_threads = 1;
+
+	// If true, the poll step stops as soon as a trial point with
+	// sufficient decrease has been found. Otherwise, all 2n trial
+	// points are evaluated and the best one is chosen.
+	// Default: true.
+	bool opportunistic_polling = true;
+
+	// Stores the function value of every evaluated mesh point, so
+	// that no point is evaluated twice. The memory used grows with
+	// the number of evaluations times the dimension.
+	// Default: false.
+	bool cache_mesh_points = false;
+
+	using Solver::solve;
 	virtual void solve(const Function& function, SolverResults* results) const override;
+
+	// The mesh point cache is estimated to store a point for every
+	// iteration and direction, which is a lot more than typical.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
 };
 
 // (Experimental) Global optimization using interval
@@ -284,7 +433,11 @@ public:
 	
 	// Does not do anything. The global solver requires the
 	// extended interface above.
+	using Solver::solve;
 	virtual void solve(const Function& function, SolverResults* results) const override;
+
+	// Estimates the usage of solve_global.
+	virtual MemoryUsage estimate_memory_usage(const Function& function) const override;
 };
 
 
@@ -303,6 +456,105 @@ public:
 };
 
 
+// Evaluates a function at several points concurrently. Since a
+// Function may not be evaluated by multiple threads at the same
+// time, every thread evaluates its own copy of the function.
+// With a single thread, the original function is used directly
+// and evaluates all points in one pass (Function::evaluate_many).
+struct ParallelEvaluatorInternal;
+class SPII_API ParallelEvaluator
+{
+public:
+	ParallelEvaluator(const Function& function, int number_of_threads);
+	// Adds the evaluation counters and timings of the copies to
+	// the original function.
+	~ParallelEvaluator();
+	ParallelEvaluator(const ParallelEvaluator&)      = delete;
+	void operator = (const ParallelEvaluator&) = delete;
+
+	int get_number_of_threads() const;
+
+	// Evaluates the function at every point and stores the
+	// results in values (resized to points.size()).
+	void evaluate(const std::vector<const Eigen::VectorXd*>& points,
+	              std::vector<double>* values) const;
+
+	// Same as above, but no new evaluations are started after
+	// stop(value) has returned true. The points are started in
+	// order, and points that were never evaluated get the value
+	// NaN.
+	void evaluate(const std::vector<const Eigen::VectorXd*>& points,
+	              std::vector<double>* values,
+	              const std::function<bool(double)>& stop) const;
+
+private:
+	ParallelEvaluatorInternal* data;
+};
+
+// The binary data of a solver checkpoint (see Solver::checkpoint_file).
+// Values are stored in the byte order of the machine; a marker in the
+// header prevents reading a checkpoint on another architecture.
+class SPII_API Checkpoint
+{
+public:
+	enum SolverType : std::uint32_t {LBFGS = 1, GLOBAL = 2};
+
+	// Starts a new, empty checkpoint.
+	Checkpoint(SolverType solver_type);
+	// Reads a checkpoint from a file. Throws if the file is not a
+	// checkpoint of the given solver type.
+	Checkpoint(const std::string& file_name, SolverType solver_type);
+
+	template<typename T>
+	void write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Checkpoint::write: type can not be copied.");
+		auto bytes = reinterpret_cast<const char*>(&value);
+		data.insert(data.end(), bytes, bytes + sizeof(T));
+	}
+	void write(const Eigen::VectorXd& vector);
+
+	template<typename T>
+	T read()
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Checkpoint::read: type can not be copied.");
+		T value;
+		read_bytes(reinterpret_cast<char*>(&value), sizeof(T));
+		return value;
+	}
+	void read(Eigen::VectorXd* vector);
+
+	// Throws if not all data has been read.
+	void finish_reading() const;
+
+	std::vector<char> data;
+
+private:
+	void read_bytes(char* destination, std::size_t size);
+	std::size_t position;
+};
+
+// Writes checkpoints to a file from a background thread, so that the
+// solver does not wait for the disk. If the solver is faster than the
+// disk, only the most recent checkpoint is written.
+struct CheckpointWriterInternal;
+class SPII_API CheckpointWriter
+{
+public:
+	CheckpointWriter(const std::string& file_name);
+	// Waits for the last checkpoint to be written.
+	~CheckpointWriter();
+	CheckpointWriter(const CheckpointWriter&)  = delete;
+	void operator = (const CheckpointWriter&) = delete;
+
+	void write(Checkpoint&& checkpoint);
+	// Waits for the last checkpoint to be written and rethrows any
+	// error from the background thread.
+	void finish();
+
+	CheckpointWriterInternal* data;
+};
+
 struct CheckExitConditionsCache
 {
 public:
@@ -0,0 +1,197 @@
+#ifndef SPII_TAPE_H
+#define SPII_TAPE_H
+//
+// Tape records the operations of a function once, as a linear list
+// of instructions. The function, its gradient and Hessian-vector
+// products can then be evaluated at new points by sweeping over the
+// list, without any operator overloading.
+//
+// The operations are recorded by evaluating the function with
+// TapeValue as the scalar type:
+//
+//    Tape tape;
+//    std::vector<TapeValue> x;
+//    for (int i = 0; i < n; ++i) {
+//        x.push_back(tape.add_input(x0[i]));
+//    }
+//    tape.set_output(functor(x.data()));
+//
+//    double value = tape.gradient(x1, gradient);
+//
+// The recording is only valid at other points if the control flow
+// of the function does not depend on its input. Comparisons between
+// TapeValues are allowed, but use the values at the recorded point.
+//
+
+#include <cstddef>
+#include <vector>
+
+#include <spii/spii.h>
+
+namespace spii {
+
+class Tape;
+
+class SPII_API TapeValue
+{
+public:
+	TapeValue(double value_ = 0.0)
+		: tape(nullptr), index(-1), value(value_)
+	{ }
+
+	// The value at the recorded point.
+	double get_value() const
+	{
+		return value;
+	}
+
+	// Whether the value is a constant, i.e. not recorded on a tape.
+	bool is_constant() const
+	{
+		return tape == nullptr;
+	}
+
+	TapeValue& operator += (const TapeValue& rhs);
+	TapeValue& operator -= (const TapeValue& rhs);
+	TapeValue& operator *= (const TapeValue& rhs);
+	TapeValue& operator /= (const TapeValue& rhs);
+
+private:
+	friend class Tape;
+	// The tape this value is recorded on, or null if the value
+	// is a constant.
+	Tape* tape;
+	int index;
+	double value;
+};
+
+class SPII_API Tape
+{
+public:
+	enum class Operation : unsigned char
+	{
+		input,
+		constant,
+		// Binary operations.
+		add,
+		subtract,
+		multiply,
+		divide,
+		power,
+		// Unary operations.
+		negate,
+		power_constant,
+		sin,
+		cos,
+		tan,
+		asin,
+		acos,
+		atan,
+		exp,
+		log,
+		sqrt,
+		tanh,
+		abs
+	};
+
+	struct Instruction
+	{
+		Operation operation;
+		// Operands (indices of earlier instructions).
+		int a, b;
+		// The constant value, the input number or the exponent
+		// for power_constant.
+		double c;
+	};
+
+	Tape();
+
+	// Adds a new input. The inputs are numbered in the order
+	// they are added.
+	TapeValue add_input(double value);
+	// Sets the output of the recorded function.
+	void set_output(const TapeValue& output);
+
+	int number_of_inputs() const;
+	// The index of the instruction computing the output.
+	int get_output() const;
+	std::size_t number_of_instructions() const;
+	const std::vector<Instruction>& get_instructions() const;
+
+	// All functions below can be called from several threads at once.
+
+	// Evaluates the recorded function at x.
+	double evaluate(const double* x) const;
+	// Evaluates the recorded function and its gradient at x.
+	double gradient(const double* x, double* gradient) const;
+	// Evaluates the recorded function, its gradient and the product
+	// of its Hessian with v at x.
+	double hessian_vector_product(const double* x,
+	                              const double* v,
+	                              double* gradient,
+	                              double* hessian_times_v) const;
+	// Evaluates the recorded function, its gradient and its Hessian
+	// (column-major) at x, with one Hessian-vector product per input.
+	double hessian(const double* x, double* gradient, double* hessian) const;
+
+	// Used by the operators of TapeValue to record operations.
+	static TapeValue record(Operation operation, const TapeValue& a, double value, double c = 0);
+	static TapeValue record(Operation operation, const TapeValue& a, const TapeValue& b, double value);
+
+private:
+	int push(Operation operation, int a, int b, double c);
+	// Returns the index of a value on this tape. Constants are
+	// added to the tape.
+	int index_of(const TapeValue& value);
+
+	// Computes the values of all instructions at x.
+	void forward(const double* x, double* values) const;
+	// Computes the directional derivatives along v of all instructions.
+	void forward_tangent(const double* values, const double* v, double* tangents) const;
+	// Propagates derivatives of the output backwards. If tangents is not
+	// null, the derivatives of the adjoints along the tangent direction
+	// are propagated as well and written to hessian_times_v.
+	void reverse(const double* values,
+	             const double* tangents,
+	             double* adjoints,
+	             double* adjoint_tangents,
+	             double* gradient,
+	             double* hessian_times_v) const;
+
+	std::vector<Instruction> instructions;
+	int inputs;
+	int output;
+};
+
+SPII_API TapeValue operator + (const TapeValue& a, const TapeValue& b);
+SPII_API TapeValue operator - (const TapeValue& a, const TapeValue& b);
+SPII_API TapeValue operator * (const TapeValue& a, const TapeValue& b);
+SPII_API TapeValue operator / (const TapeValue& a, const TapeValue& b);
+SPII_API TapeValue operator + (const TapeValue& a);
+SPII_API TapeValue operator - (const TapeValue& a);
+
+SPII_API bool operator == (const TapeValue& a, const TapeValue& b);
+SPII_API bool operator != (const TapeValue& a, const TapeValue& b);
+SPII_API bool operator <  (const TapeValue& a, const TapeValue& b);
+SPII_API bool operator <= (const TapeValue& a, const TapeValue& b);
+SPII_API bool operator >  (const TapeValue& a, const TapeValue& b);
+SPII_API bool operator >= (const TapeValue& a, const TapeValue& b);
+
+SPII_API TapeValue pow(const TapeValue& a, double b);
+SPII_API TapeValue pow(const TapeValue& a, const TapeValue& b);
+SPII_API TapeValue sqr(const TapeValue& a);
+SPII_API TapeValue sin(const TapeValue& a);
+SPII_API TapeValue cos(const TapeValue& a);
+SPII_API TapeValue tan(const TapeValue& a);
+SPII_API TapeValue asin(const TapeValue& a);
+SPII_API TapeValue acos(const TapeValue& a);
+SPII_API TapeValue atan(const TapeValue& a);
+SPII_API TapeValue exp(const TapeValue& a);
+SPII_API TapeValue log(const TapeValue& a);
+SPII_API TapeValue sqrt(const TapeValue& a);
+SPII_API TapeValue tanh(const TapeValue& a);
+SPII_API TapeValue abs(const TapeValue& a);
+
+}  // namespace spii
+
+#endif
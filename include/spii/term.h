@@ -31,6 +31,61 @@ public:
 	virtual double evaluate(double * const * const variables,
 	                        std::vector<Eigen::VectorXd>* gradient,
 	                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const = 0;
+	// Same as evaluate with a Hessian, but since the Hessian is
+	// symmetric, only the blocks (*hessian)[var0][var1] with
+	// var0 <= var1 need to be written. The default implementation
+	// calls evaluate.
+	virtual double evaluate_upper_hessian(double * const * const variables,
+	                                      std::vector<Eigen::VectorXd>* gradient,
+	                                      std::vector< std::vector<Eigen::MatrixXd> >* hessian) const;
+
+	// Evaluates the term and writes its derivatives to flat,
+	// caller-provided buffers. Let n be the sum of all variable
+	// dimensions. gradient has n elements with the variables after
+	// each other. hessian (if not null) is a column-major n × n matrix
+	// with the same ordering, so that block (var0, var1) starts at
+	// row offset(var0) and column offset(var1). If upper_only is true,
+	// only the blocks with var0 <= var1 need to be written.
+	// The default implementation is an adapter calling evaluate.
+	virtual double evaluate_flat(double * const * const variables,
+	                             double* gradient,
+	                             double* hessian,
+	                             bool upper_only) const;
+
+	// Same as evaluate_flat, but derivatives are only needed with
+	// respect to the variables var with active[var] true, e.g. because
+	// the others are constant. gradient and hessian only contain the
+	// active variables (in the same order), so n is the sum of their
+	// dimensions. The default implementation calls evaluate_flat and
+	// drops the inactive parts; AutoDiffTerm does not seed derivatives
+	// for inactive variables at all.
+	virtual double evaluate_flat_active(double * const * const variables,
+	                                    const bool* active,
+	                                    double* gradient,
+	                                    double* hessian,
+	                                    bool upper_only) const;
+
+	// Evaluates the term at several points. variables[k] holds the
+	// variables of point k, in the same format as for evaluate above.
+	// The default implementations evaluate one point at a time;
+	// overload them if the computations can be shared or vectorized
+	// across points.
+	virtual void evaluate_many(double * const * const * const variables,
+	                           int number_of_points,
+	                           double* values) const;
+	// gradients must contain (at least) number_of_points gradients,
+	// each in the same format as for evaluate above.
+	virtual void evaluate_many(double * const * const * const variables,
+	                           int number_of_points,
+	                           double* values,
+	                           std::vector<std::vector<Eigen::VectorXd>>* gradients) const;
+
+	// Returns true if the Hessian of the term does not depend on the
+	// variables, i.e. the term is linear or quadratic. Function then
+	// computes the Hessian of the term only once and evaluates its
+	// gradient with a matrix-vector product.
+	// Default: false.
+	virtual bool has_constant_hessian() const;
 
 	// This function only needs to be implemented if interval arithmetic is
 	// desired.
@@ -0,0 +1,53 @@
+#ifndef SPII_TERM_STREAM_H
+#define SPII_TERM_STREAM_H
+//
+// Terms of a Function that are not kept in memory, for problems with
+// more terms than fit in RAM. The terms are divided into chunks, and
+// every evaluation of the function walks through the chunks in order:
+//
+//    function.add_term_stream(std::make_shared<MyTermStream>(...));
+//    solver.solve(function, &results);
+//
+// Only two chunks are in memory at any time. The next chunk is loaded
+// on a background thread while the current one is evaluated. Every
+// chunk is loaded again for every evaluation, so the time to create
+// its terms is paid once per evaluation.
+//
+// Streamed terms contribute to the function value and gradient, so
+// e.g. LBFGSSolver can be used. Hessians are not supported.
+//
+// See read_binary_file_streamed in function_serializer.h for a stream
+// reading terms from a memory-mapped file.
+//
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <spii/spii.h>
+#include <spii/term.h>
+
+namespace spii {
+
+struct TermChunk
+{
+	std::vector<std::shared_ptr<const Term>> terms;
+	// The variables of all terms, after each other. All variables
+	// must have been added to the function.
+	std::vector<double*> arguments;
+};
+
+class SPII_API TermStream
+{
+public:
+	virtual ~TermStream() {};
+	virtual std::size_t number_of_chunks() const = 0;
+	// Loads chunk i into chunk, which is empty. Called from a
+	// background thread, possibly while another chunk is being
+	// evaluated.
+	virtual void load_chunk(std::size_t i, TermChunk* chunk) const = 0;
+};
+
+}  // namespace spii
+
+#endif
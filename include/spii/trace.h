@@ -0,0 +1,155 @@
+#ifndef SPII_TRACE_H
+#define SPII_TRACE_H
+//
+// Trace records timestamped spans of the phases of a solve, for
+// finding out which iteration or phase was slow:
+//
+//    Trace trace;
+//    solver.trace = &trace;
+//    solver.solve(function, &results);
+//    std::ofstream fout("trace.json");
+//    trace.write_chrome_trace(fout);
+//
+// The file can be opened in chrome://tracing or Perfetto. The solver
+// records one span per iteration and spans for its phases (evaluate,
+// factorize, line search, callback, ...). While a trace is active,
+// Function records the term loop of every thread and the assembly
+// of the gradient and Hessian.
+//
+// Nothing is recorded and almost no time is spent when no trace is
+// used.
+//
+
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include <spii/spii.h>
+
+namespace spii {
+
+class SPII_API Trace
+{
+public:
+	struct Span
+	{
+		// Names and categories are string literals.
+		const char* name;
+		const char* category;
+		// Seconds since the trace was created.
+		double start_time;
+		double duration;
+		// OpenMP thread number; the solver uses thread 0.
+		int thread;
+		// Solver iteration, or -1.
+		int iteration;
+	};
+
+	Trace();
+
+	// Can be called from several threads at once.
+	void add_span(const char* name,
+	              const char* category,
+	              double start_time,
+	              double end_time,
+	              int thread = 0,
+	              int iteration = -1);
+
+	// Not thread-safe while spans are being added.
+	const std::vector<Span>& get_spans() const;
+	void clear();
+
+	// Writes the spans in the Chrome trace event format.
+	void write_chrome_trace(std::ostream& out) const;
+
+	// Seconds from an arbitrary point; used for all time stamps.
+	static double now();
+
+	// The trace functions evaluated on this thread should record
+	// their spans to, or nullptr.
+	static Trace* active();
+
+private:
+	friend class ActiveTrace;
+	static void set_active(Trace* trace);
+
+	std::mutex spans_mutex;
+	std::vector<Span> spans;
+	double creation_time;
+};
+
+// Makes a trace active on the current thread during the lifetime
+// of this object. Solvers do this for their own trace.
+class SPII_API ActiveTrace
+{
+public:
+	ActiveTrace(Trace* trace)
+		: previous(Trace::active())
+	{
+		if (trace) {
+			Trace::set_active(trace);
+		}
+	}
+
+	~ActiveTrace()
+	{
+		Trace::set_active(previous);
+	}
+
+	ActiveTrace(const ActiveTrace&) = delete;
+	ActiveTrace& operator = (const ActiveTrace&) = delete;
+
+private:
+	Trace* previous;
+};
+
+// Records a span from construction until end() is called or the
+// span goes out of scope. Does nothing if trace is nullptr.
+class TraceSpan
+{
+public:
+	TraceSpan(Trace* trace_,
+	          const char* name_,
+	          const char* category_,
+	          int iteration_ = -1,
+	          int thread_ = 0)
+		: trace(trace_),
+		  name(name_),
+		  category(category_),
+		  iteration(iteration_),
+		  thread(thread_)
+	{
+		if (trace) {
+			start_time = Trace::now();
+		}
+	}
+
+	~TraceSpan()
+	{
+		end();
+	}
+
+	void end()
+	{
+		if (trace) {
+			trace->add_span(name, category, start_time, Trace::now(), thread, iteration);
+			trace = nullptr;
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator = (const TraceSpan&) = delete;
+
+private:
+	Trace* trace;
+	const char* name;
+	const char* category;
+	int iteration;
+	int thread;
+	double start_time = 0;
+};
+
+}  // namespace spii
+
+#endif
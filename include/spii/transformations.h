@@ -5,6 +5,8 @@
 #include <cmath>
 #include <stdexcept>
 
+#include <Eigen/Core>
+
 #include <spii/spii.h>
 
 namespace spii {
@@ -43,6 +45,14 @@ public:
 		}
 	}
 
+	// First and second derivatives of t_to_x for all elements.
+	void derivatives(double* dx, double* d2x, const double* t) const
+	{
+		Eigen::Map<const Eigen::ArrayXd> t_array(t, dimension);
+		Eigen::Map<Eigen::ArrayXd>(dx, dimension) = 2.0 * t_array;
+		Eigen::Map<Eigen::ArrayXd>(d2x, dimension).setConstant(2.0);
+	}
+
 	int x_dimension() const
 	{
 		return dimension;
@@ -88,6 +98,14 @@ public:
 		t[0] = tan(((x[0] - a) / (b - a) - 0.5) * 3.141592653589793);
 	}
 
+	// First and second derivatives of t_to_x.
+	void derivatives(double* dx, double* d2x, const double* t) const
+	{
+		double s = 1.0 / (1.0 + t[0] * t[0]);
+		dx[0]  = 0.318309886183791 * (b - a) * s;
+		d2x[0] = -2.0 * t[0] * s * dx[0];
+	}
+
 	int x_dimension() const
 	{
 		return 1;
@@ -140,6 +158,17 @@ public:
 		}
 	}
 
+	// First and second derivatives of t_to_x for all elements.
+	void derivatives(double* dx, double* d2x, const double* t) const
+	{
+		Eigen::Map<const Eigen::ArrayXd> t_array(t, dimension);
+		Eigen::Map<const Eigen::ArrayXd> a_array(a, dimension);
+		Eigen::Map<const Eigen::ArrayXd> b_array(b, dimension);
+		Eigen::Map<Eigen::ArrayXd> dx_array(dx, dimension);
+		dx_array = 0.318309886183791 * (b_array - a_array) / (1.0 + t_array.square());
+		Eigen::Map<Eigen::ArrayXd>(d2x, dimension) = -2.0 * t_array * dx_array / (1.0 + t_array.square());
+	}
+
 	int x_dimension() const
 	{
 		return dimension;
@@ -0,0 +1,647 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <tuple>
+
+#include <spii/codegen.h>
+
+namespace spii {
+
+namespace
+{
+	enum class Op : unsigned char
+	{
+		input,
+		parameter,
+		constant,
+		add,
+		subtract,
+		multiply,
+		divide,
+		power,
+		negate,
+		power_constant,
+		sin,
+		cos,
+		tan,
+		asin,
+		acos,
+		atan,
+		exp,
+		log,
+		sqrt,
+		tanh,
+		abs,
+		sign
+	};
+
+	struct Node
+	{
+		Op op;
+		int a, b;
+		// Constant value, input number or exponent.
+		double c;
+	};
+
+	// A directed acyclic graph of expressions. Every expression is only
+	// stored once (common subexpression elimination), and operations
+	// with constant operands are simplified when added.
+	class ExpressionGraph
+	{
+	public:
+		int input(int i)
+		{
+			return add_node(Op::input, -1, -1, i);
+		}
+
+		int parameter(int i)
+		{
+			return add_node(Op::parameter, -1, -1, i);
+		}
+
+		int constant(double value)
+		{
+			return add_node(Op::constant, -1, -1, value);
+		}
+
+		bool is_constant(int id) const
+		{
+			return nodes[id].op == Op::constant;
+		}
+
+		bool is_constant(int id, double value) const
+		{
+			return is_constant(id) && nodes[id].c == value;
+		}
+
+		const Node& node(int id) const
+		{
+			return nodes[id];
+		}
+
+		int add(int a, int b)
+		{
+			if (is_constant(a, 0)) return b;
+			if (is_constant(b, 0)) return a;
+			if (is_constant(a) && is_constant(b)) return constant(nodes[a].c + nodes[b].c);
+			if (a > b) std::swap(a, b);
+			return add_node(Op::add, a, b, 0);
+		}
+
+		int subtract(int a, int b)
+		{
+			if (is_constant(b, 0)) return a;
+			if (is_constant(a, 0)) return negate(b);
+			if (a == b) return constant(0);
+			if (is_constant(a) && is_constant(b)) return constant(nodes[a].c - nodes[b].c);
+			return add_node(Op::subtract, a, b, 0);
+		}
+
+		int multiply(int a, int b)
+		{
+			if (is_constant(a, 0) || is_constant(b, 0)) return constant(0);
+			if (is_constant(a, 1)) return b;
+			if (is_constant(b, 1)) return a;
+			if (is_constant(a, -1)) return negate(b);
+			if (is_constant(b, -1)) return negate(a);
+			if (is_constant(a) && is_constant(b)) return constant(nodes[a].c * nodes[b].c);
+			if (a > b) std::swap(a, b);
+			return add_node(Op::multiply, a, b, 0);
+		}
+
+		int divide(int a, int b)
+		{
+			if (is_constant(a, 0)) return constant(0);
+			if (is_constant(b, 1)) return a;
+			if (is_constant(a) && is_constant(b)) return constant(nodes[a].c / nodes[b].c);
+			return add_node(Op::divide, a, b, 0);
+		}
+
+		int power(int a, int b)
+		{
+			if (is_constant(b)) return power_constant(a, nodes[b].c);
+			return add_node(Op::power, a, b, 0);
+		}
+
+		int negate(int a)
+		{
+			if (is_constant(a)) return constant(-nodes[a].c);
+			if (nodes[a].op == Op::negate) return nodes[a].a;
+			return add_node(Op::negate, a, -1, 0);
+		}
+
+		int power_constant(int a, double c)
+		{
+			if (c == 0) return constant(1);
+			if (c == 1) return a;
+			if (is_constant(a)) return constant(std::pow(nodes[a].c, c));
+			return add_node(Op::power_constant, a, -1, c);
+		}
+
+		int unary(Op op, int a)
+		{
+			if (is_constant(a)) {
+				return constant(evaluate(op, nodes[a].c, 0, 0));
+			}
+			return add_node(op, a, -1, 0);
+		}
+
+		int size() const
+		{
+			return static_cast<int>(nodes.size());
+		}
+
+		static double evaluate(Op op, double a, double b, double c)
+		{
+			switch (op) {
+				case Op::add:            return a + b;
+				case Op::subtract:       return a - b;
+				case Op::multiply:       return a * b;
+				case Op::divide:         return a / b;
+				case Op::power:          return std::pow(a, b);
+				case Op::negate:         return -a;
+				case Op::power_constant: return std::pow(a, c);
+				case Op::sin:            return std::sin(a);
+				case Op::cos:            return std::cos(a);
+				case Op::tan:            return std::tan(a);
+				case Op::asin:           return std::asin(a);
+				case Op::acos:           return std::acos(a);
+				case Op::atan:           return std::atan(a);
+				case Op::exp:            return std::exp(a);
+				case Op::log:            return std::log(a);
+				case Op::sqrt:           return std::sqrt(a);
+				case Op::tanh:           return std::tanh(a);
+				case Op::abs:            return std::abs(a);
+				case Op::sign:           return a > 0 ? 1 : (a < 0 ? -1 : 0);
+				default:                 return c;
+			}
+		}
+
+		// Symbolic reverse mode differentiation of the expression
+		// output with respect to number_of_inputs inputs.
+		std::vector<int> differentiate(int output, int number_of_inputs)
+		{
+			std::vector<int> result(number_of_inputs, -1);
+			std::vector<int> adjoints(output + 1, -1);
+			adjoints[output] = constant(1);
+
+			auto accumulate = [&](int id, int term)
+			{
+				adjoints[id] = adjoints[id] < 0 ? term : add(adjoints[id], term);
+			};
+
+			for (int k = output; k >= 0; --k) {
+				int adjoint = adjoints[k];
+				if (adjoint < 0 || is_constant(adjoint, 0)) {
+					continue;
+				}
+				// Copy, since nodes may be reallocated below.
+				const Node n = nodes[k];
+				switch (n.op) {
+					case Op::input:
+						result[static_cast<int>(n.c)] = adjoint;
+						break;
+					case Op::parameter:
+					case Op::constant:
+					case Op::sign:
+						break;
+					case Op::add:
+						accumulate(n.a, adjoint);
+						accumulate(n.b, adjoint);
+						break;
+					case Op::subtract:
+						accumulate(n.a, adjoint);
+						accumulate(n.b, negate(adjoint));
+						break;
+					case Op::multiply:
+						accumulate(n.a, multiply(adjoint, n.b));
+						accumulate(n.b, multiply(adjoint, n.a));
+						break;
+					case Op::divide:
+						accumulate(n.a, divide(adjoint, n.b));
+						accumulate(n.b, negate(multiply(adjoint, divide(k, n.b))));
+						break;
+					case Op::power:
+						accumulate(n.a, multiply(adjoint, multiply(n.b, power(n.a, subtract(n.b, constant(1))))));
+						accumulate(n.b, multiply(adjoint, multiply(k, unary(Op::log, n.a))));
+						break;
+					case Op::negate:
+						accumulate(n.a, negate(adjoint));
+						break;
+					case Op::power_constant:
+						accumulate(n.a, multiply(adjoint, multiply(constant(n.c), power_constant(n.a, n.c - 1))));
+						break;
+					case Op::sin:
+						accumulate(n.a, multiply(adjoint, unary(Op::cos, n.a)));
+						break;
+					case Op::cos:
+						accumulate(n.a, negate(multiply(adjoint, unary(Op::sin, n.a))));
+						break;
+					case Op::tan:
+						accumulate(n.a, multiply(adjoint, add(constant(1), multiply(k, k))));
+						break;
+					case Op::asin:
+						accumulate(n.a, divide(adjoint, unary(Op::sqrt, subtract(constant(1), multiply(n.a, n.a)))));
+						break;
+					case Op::acos:
+						accumulate(n.a, negate(divide(adjoint, unary(Op::sqrt, subtract(constant(1), multiply(n.a, n.a))))));
+						break;
+					case Op::atan:
+						accumulate(n.a, divide(adjoint, add(constant(1), multiply(n.a, n.a))));
+						break;
+					case Op::exp:
+						accumulate(n.a, multiply(adjoint, k));
+						break;
+					case Op::log:
+						accumulate(n.a, divide(adjoint, n.a));
+						break;
+					case Op::sqrt:
+						accumulate(n.a, divide(adjoint, multiply(constant(2), k)));
+						break;
+					case Op::tanh:
+						accumulate(n.a, multiply(adjoint, subtract(constant(1), multiply(k, k))));
+						break;
+					case Op::abs:
+						accumulate(n.a, multiply(adjoint, unary(Op::sign, n.a)));
+						break;
+				}
+			}
+
+			for (auto& id: result) {
+				if (id < 0) {
+					id = constant(0);
+				}
+			}
+			return result;
+		}
+
+	private:
+		int add_node(Op op, int a, int b, double c)
+		{
+			std::uint64_t c_bits;
+			std::memcpy(&c_bits, &c, sizeof(c));
+			auto key = std::make_tuple(static_cast<int>(op), a, b, c_bits);
+			auto itr = lookup.find(key);
+			if (itr != lookup.end()) {
+				return itr->second;
+			}
+			nodes.push_back({op, a, b, c});
+			int id = size() - 1;
+			lookup[key] = id;
+			return id;
+		}
+
+		std::vector<Node> nodes;
+		std::map<std::tuple<int, int, int, std::uint64_t>, int> lookup;
+	};
+
+	// Converts a recorded tape to an expression graph. Returns the
+	// id of the output.
+	int tape_to_graph(const Tape& tape, int number_of_variables, ExpressionGraph* graph)
+	{
+		typedef Tape::Operation TapeOp;
+		const auto& instructions = tape.get_instructions();
+		spii_assert(! instructions.empty(), "generate_term_code: empty tape.");
+
+		std::vector<int> ids(instructions.size());
+		for (std::size_t k = 0; k < instructions.size(); ++k) {
+			const auto& instruction = instructions[k];
+			int a = instruction.a >= 0 ? ids[instruction.a] : -1;
+			int b = instruction.b >= 0 ? ids[instruction.b] : -1;
+			int& id = ids[k];
+			switch (instruction.operation) {
+				case TapeOp::input: {
+					int i = static_cast<int>(instruction.c);
+					if (i < number_of_variables) {
+						id = graph->input(i);
+					}
+					else {
+						id = graph->parameter(i - number_of_variables);
+					}
+					break;
+				}
+				case TapeOp::constant:       id = graph->constant(instruction.c); break;
+				case TapeOp::add:            id = graph->add(a, b); break;
+				case TapeOp::subtract:       id = graph->subtract(a, b); break;
+				case TapeOp::multiply:       id = graph->multiply(a, b); break;
+				case TapeOp::divide:         id = graph->divide(a, b); break;
+				case TapeOp::power:          id = graph->power(a, b); break;
+				case TapeOp::negate:         id = graph->negate(a); break;
+				case TapeOp::power_constant: id = graph->power_constant(a, instruction.c); break;
+				case TapeOp::sin:            id = graph->unary(Op::sin, a); break;
+				case TapeOp::cos:            id = graph->unary(Op::cos, a); break;
+				case TapeOp::tan:            id = graph->unary(Op::tan, a); break;
+				case TapeOp::asin:           id = graph->unary(Op::asin, a); break;
+				case TapeOp::acos:           id = graph->unary(Op::acos, a); break;
+				case TapeOp::atan:           id = graph->unary(Op::atan, a); break;
+				case TapeOp::exp:            id = graph->unary(Op::exp, a); break;
+				case TapeOp::log:            id = graph->unary(Op::log, a); break;
+				case TapeOp::sqrt:           id = graph->unary(Op::sqrt, a); break;
+				case TapeOp::tanh:           id = graph->unary(Op::tanh, a); break;
+				case TapeOp::abs:            id = graph->unary(Op::abs, a); break;
+			}
+		}
+		return ids[tape.get_output()];
+	}
+
+	std::string literal(double value)
+	{
+		if (value != value) {
+			return "std::numeric_limits<double>::quiet_NaN()";
+		}
+		else if (value == std::numeric_limits<double>::infinity()) {
+			return "std::numeric_limits<double>::infinity()";
+		}
+		else if (value == -std::numeric_limits<double>::infinity()) {
+			return "(-std::numeric_limits<double>::infinity())";
+		}
+
+		std::ostringstream out;
+		out << std::setprecision(17) << value;
+		std::string str = out.str();
+		if (str.find_first_of(".e") == std::string::npos) {
+			str += ".0";
+		}
+		if (value < 0) {
+			str = "(" + str + ")";
+		}
+		return str;
+	}
+
+	// Emits straight-line code computing the given nodes.
+	class CodeEmitter
+	{
+	public:
+		CodeEmitter(const ExpressionGraph& graph_,
+		            const std::vector<int>& dimensions)
+			: graph(graph_)
+		{
+			for (int var = 0; var < dimensions.size(); ++var) {
+				for (int i = 0; i < dimensions[var]; ++i) {
+					input_names.push_back("variables[" + std::to_string(var) + "][" + std::to_string(i) + "]");
+				}
+			}
+		}
+
+		// The expression for node id, which must already be emitted.
+		std::string name(int id) const
+		{
+			const auto& node = graph.node(id);
+			switch (node.op) {
+				case Op::constant:  return literal(node.c);
+				case Op::input:     return input_names[static_cast<int>(node.c)];
+				case Op::parameter: return "p[" + std::to_string(static_cast<int>(node.c)) + "]";
+				default:            return "t" + std::to_string(id);
+			}
+		}
+
+		// Emits statements for all nodes needed by roots.
+		void emit(const std::vector<int>& roots, std::ostream& out, const std::string& indent) const
+		{
+			std::vector<bool> needed(graph.size(), false);
+			for (auto root: roots) {
+				needed[root] = true;
+			}
+			for (int id = graph.size() - 1; id >= 0; --id) {
+				if (needed[id]) {
+					const auto& node = graph.node(id);
+					if (node.a >= 0) needed[node.a] = true;
+					if (node.b >= 0) needed[node.b] = true;
+				}
+			}
+
+			for (int id = 0; id < graph.size(); ++id) {
+				const auto& node = graph.node(id);
+				if (! needed[id] || node.op == Op::constant || node.op == Op::input || node.op == Op::parameter) {
+					continue;
+				}
+				out << indent << "const double " << name(id) << " = " << expression(node) << ";\n";
+			}
+		}
+
+	private:
+		std::string expression(const Node& node) const
+		{
+			std::string a = node.a >= 0 ? name(node.a) : "";
+			std::string b = node.b >= 0 ? name(node.b) : "";
+			switch (node.op) {
+				case Op::add:      return a + " + " + b;
+				case Op::subtract: return a + " - " + b;
+				case Op::multiply: return a + " * " + b;
+				case Op::divide:   return a + " / " + b;
+				case Op::power:    return "std::pow(" + a + ", " + b + ")";
+				case Op::negate:   return "-" + a;
+				case Op::power_constant:
+					if (node.c == 2) {
+						return a + " * " + a;
+					}
+					else if (node.c == -1) {
+						return "1.0 / " + a;
+					}
+					else if (node.c == 0.5) {
+						return "std::sqrt(" + a + ")";
+					}
+					return "std::pow(" + a + ", " + literal(node.c) + ")";
+				case Op::sin:  return "std::sin(" + a + ")";
+				case Op::cos:  return "std::cos(" + a + ")";
+				case Op::tan:  return "std::tan(" + a + ")";
+				case Op::asin: return "std::asin(" + a + ")";
+				case Op::acos: return "std::acos(" + a + ")";
+				case Op::atan: return "std::atan(" + a + ")";
+				case Op::exp:  return "std::exp(" + a + ")";
+				case Op::log:  return "std::log(" + a + ")";
+				case Op::sqrt: return "std::sqrt(" + a + ")";
+				case Op::tanh: return "std::tanh(" + a + ")";
+				case Op::abs:  return "std::abs(" + a + ")";
+				case Op::sign: return "(" + a + " > 0 ? 1.0 : (" + a + " < 0 ? -1.0 : 0.0))";
+				default:       return name(0);
+			}
+		}
+
+		const ExpressionGraph& graph;
+		std::vector<std::string> input_names;
+	};
+}
+
+std::string generate_term_code(const std::string& class_name,
+                               const Tape& tape,
+                               const std::vector<int>& dimensions,
+                               int number_of_parameters)
+{
+	int n = 0;
+	for (auto d: dimensions) {
+		spii_assert(d >= 1, "generate_term_code: invalid dimension.");
+		n += d;
+	}
+	spii_assert(n + number_of_parameters == tape.number_of_inputs(),
+	            "generate_term_code: the tape has ", tape.number_of_inputs(), " inputs; expected ",
+	            n + number_of_parameters, ".");
+
+	ExpressionGraph graph;
+	int output = tape_to_graph(tape, n, &graph);
+	auto gradient = graph.differentiate(output, n);
+	std::vector<std::vector<int>> hessian(n);
+	bool constant_hessian = true;
+	for (int i = 0; i < n; ++i) {
+		hessian[i] = graph.differentiate(gradient[i], n);
+		for (int j = i; j < n; ++j) {
+			constant_hessian = constant_hessian && graph.is_constant(hessian[i][j]);
+		}
+	}
+
+	CodeEmitter emitter(graph, dimensions);
+	std::ostringstream out;
+	const std::string N = std::to_string(n);
+
+	std::string sizes;
+	for (auto d: dimensions) {
+		sizes += (sizes.empty() ? "" : ", ") + std::to_string(d);
+	}
+
+	out << "class " << class_name << "\n";
+	out << "\t: public spii::SizedTerm<" << sizes << ">\n";
+	out << "{\n";
+	out << "public:\n";
+	if (number_of_parameters > 0) {
+		out << "\texplicit " << class_name << "(const double* parameters)\n";
+		out << "\t{\n";
+		out << "\t\tstd::copy(parameters, parameters + " << number_of_parameters << ", p);\n";
+		out << "\t}\n\n";
+	}
+
+	out << "\tvirtual double evaluate(double * const * const variables) const override\n";
+	out << "\t{\n";
+	emitter.emit({output}, out, "\t\t");
+	out << "\t\treturn " << emitter.name(output) << ";\n";
+	out << "\t}\n\n";
+
+	out << "\tvirtual double evaluate(double * const * const variables,\n";
+	out << "\t                        std::vector<Eigen::VectorXd>* gradient) const override\n";
+	out << "\t{\n";
+	out << "\t\tdouble g[" << N << "];\n";
+	out << "\t\tdouble value = evaluate_flat(variables, g, nullptr, false);\n";
+	out << "\t\tconst int dimensions[] = {" << sizes << "};\n";
+	out << "\t\tint offset = 0;\n";
+	out << "\t\tfor (int var = 0; var < " << dimensions.size() << "; ++var) {\n";
+	out << "\t\t\tfor (int i = 0; i < dimensions[var]; ++i) {\n";
+	out << "\t\t\t\t(*gradient)[var](i) = g[offset + i];\n";
+	out << "\t\t\t}\n";
+	out << "\t\t\toffset += dimensions[var];\n";
+	out << "\t\t}\n";
+	out << "\t\treturn value;\n";
+	out << "\t}\n\n";
+
+	out << "\tvirtual double evaluate(double * const * const variables,\n";
+	out << "\t                        std::vector<Eigen::VectorXd>* gradient,\n";
+	out << "\t                        std::vector< std::vector<Eigen::MatrixXd> >* hessian) const override\n";
+	out << "\t{\n";
+	out << "\t\tdouble g[" << N << "];\n";
+	out << "\t\tdouble h[" << n * n << "];\n";
+	out << "\t\tdouble value = evaluate_flat(variables, g, h, false);\n";
+	out << "\t\tconst int dimensions[] = {" << sizes << "};\n";
+	out << "\t\tint offset0 = 0;\n";
+	out << "\t\tfor (int var0 = 0; var0 < " << dimensions.size() << "; ++var0) {\n";
+	out << "\t\t\tint offset1 = 0;\n";
+	out << "\t\t\tfor (int var1 = 0; var1 < " << dimensions.size() << "; ++var1) {\n";
+	out << "\t\t\t\tfor (int i = 0; i < dimensions[var0]; ++i) {\n";
+	out << "\t\t\t\t\tfor (int j = 0; j < dimensions[var1]; ++j) {\n";
+	out << "\t\t\t\t\t\t(*hessian)[var0][var1](i, j) = h[(offset0 + i) + " << N << " * (offset1 + j)];\n";
+	out << "\t\t\t\t\t}\n";
+	out << "\t\t\t\t}\n";
+	out << "\t\t\t\toffset1 += dimensions[var1];\n";
+	out << "\t\t\t}\n";
+	out << "\t\t\tfor (int i = 0; i < dimensions[var0]; ++i) {\n";
+	out << "\t\t\t\t(*gradient)[var0](i) = g[offset0 + i];\n";
+	out << "\t\t\t}\n";
+	out << "\t\t\toffset0 += dimensions[var0];\n";
+	out << "\t\t}\n";
+	out << "\t\treturn value;\n";
+	out << "\t}\n\n";
+
+	out << "\tvirtual double evaluate_flat(double * const * const variables,\n";
+	out << "\t                             double* gradient,\n";
+	out << "\t                             double* hessian,\n";
+	out << "\t                             bool upper_only) const override\n";
+	out << "\t{\n";
+	out << "\t\tif (hessian == nullptr) {\n";
+	std::vector<int> roots = gradient;
+	roots.push_back(output);
+	emitter.emit(roots, out, "\t\t\t");
+	for (int i = 0; i < n; ++i) {
+		out << "\t\t\tgradient[" << i << "] = " << emitter.name(gradient[i]) << ";\n";
+	}
+	out << "\t\t\treturn " << emitter.name(output) << ";\n";
+	out << "\t\t}\n\n";
+	for (int i = 0; i < n; ++i) {
+		for (int j = i; j < n; ++j) {
+			roots.push_back(hessian[i][j]);
+		}
+	}
+	emitter.emit(roots, out, "\t\t");
+	for (int i = 0; i < n; ++i) {
+		out << "\t\tgradient[" << i << "] = " << emitter.name(gradient[i]) << ";\n";
+	}
+	for (int i = 0; i < n; ++i) {
+		for (int j = i; j < n; ++j) {
+			out << "\t\thessian[" << i + n * j << "] = " << emitter.name(hessian[i][j]) << ";\n";
+			if (i != j) {
+				out << "\t\thessian[" << j + n * i << "] = hessian[" << i + n * j << "];\n";
+			}
+		}
+	}
+	out << "\t\treturn " << emitter.name(output) << ";\n";
+	out << "\t}\n\n";
+
+	out << "\tvirtual bool has_constant_hessian() const override\n";
+	out << "\t{\n";
+	out << "\t\treturn " << (constant_hessian ? "true" : "false") << ";\n";
+	out << "\t}\n";
+
+	if (number_of_parameters > 0) {
+		out << "\nprivate:\n";
+		out << "\tdouble p[" << number_of_parameters << "];\n";
+	}
+	out << "};\n";
+
+	return out.str();
+}
+
+void write_generated_terms(const std::string& file_name,
+                           const std::vector<std::string>& classes)
+{
+	std::ostringstream out;
+	out << "// Generated by spii. Do not edit.\n";
+	out << "#pragma once\n\n";
+	out << "#include <algorithm>\n";
+	out << "#include <cmath>\n";
+	out << "#include <limits>\n";
+	out << "#include <vector>\n\n";
+	out << "#include <spii/term.h>\n";
+	for (const auto& code: classes) {
+		out << "\n" << code;
+	}
+
+	std::string contents = out.str();
+	{
+		std::ifstream existing(file_name, std::ios::binary);
+		if (existing) {
+			std::ostringstream existing_contents;
+			existing_contents << existing.rdbuf();
+			if (existing_contents.str() == contents) {
+				return;
+			}
+		}
+	}
+
+	std::ofstream file(file_name, std::ios::binary);
+	check(bool(file), "write_generated_terms: could not open ", file_name, ".");
+	file << contents;
+	check(bool(file), "write_generated_terms: could not write ", file_name, ".");
+}
+
+}  // namespace spii
@@ -1,12 +1,20 @@
 // Petter Strandmark 2012–2013.
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <exception>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <typeindex>
 #include <typeinfo>
-#include <unordered_set>
+#include <unordered_map>
 
 #ifdef USE_OPENMP
 	#include <omp.h>
@@ -14,6 +22,8 @@
 
 #include <spii/function.h>
 #include <spii/spii.h>
+#include <spii/term_stream.h>
+#include <spii/trace.h>
 
 namespace spii {
 
@@ -28,6 +38,11 @@ struct AddedVariable
 	bool is_constant;     // Whether this variable is (currently) constant.
 	std::shared_ptr<ChangeOfVariables> change_of_variables;
 	mutable std::vector<double>  temp_space; // Used internally during evaluation.
+	mutable std::vector<double>  batch_temp_space; // Used internally by evaluate_many.
+	std::vector<double> lower_bound; // Bounds on the scalars of the variable.
+	std::vector<double> upper_bound; // Empty if the variable is unbounded.
+	mutable std::vector<double>  change_jacobian;  // Derivatives of the change of variables,
+	mutable std::vector<double>  change_hessians;  // used when evaluating Hessians.
 };
 
 struct IntPairHash
@@ -58,6 +73,53 @@ namespace
 			return true;
 		}
 	}
+
+	// Adds the time from construction to destruction to *time. Does
+	// nothing if time is nullptr.
+	class ScopedTimer
+	{
+	public:
+		ScopedTimer(double* time_)
+			: time(time_),
+			  start_time(time_ ? wall_time() : 0.0)
+		{ }
+
+		~ScopedTimer()
+		{
+			if (time) {
+				*time += wall_time() - start_time;
+			}
+		}
+
+	private:
+		double* time;
+		double start_time;
+	};
+
+	// With lower triangular Hessian storage, only the blocks var0 <= var1
+	// of a term Hessian are computed (Term::evaluate_upper_hessian).
+	// Moves element (global_i, global_j) of block (var0, var1) to the
+	// lower triangle and returns the factor it should be multiplied
+	// with (0 if it should be skipped).
+	double to_lower_triangle(int var0, int var1, int* global_i, int* global_j)
+	{
+		if (*global_i > *global_j) {
+			return 1.0;
+		}
+		else if (*global_i == *global_j) {
+			// If var0 != var1, the same variable has been passed twice
+			// to the term and the mirrored block ends up here as well.
+			return var0 == var1 ? 1.0 : 2.0;
+		}
+		else if (var0 == var1) {
+			// The mirrored element is in the same block.
+			return 0.0;
+		}
+		else {
+			std::swap(*global_i, *global_j);
+			return 1.0;
+		}
+	}
 }
 
 class Function::Implementation
@@ -68,11 +130,16 @@ public:
 	// Implemenations of functions in the public interface.
 	double evaluate(const Eigen::VectorXd& x,
 	                Eigen::VectorXd* gradient,
-	                Eigen::MatrixXd* hessian) const;
+	                Eigen::MatrixXd* hessian,
+	                HessianStorage storage) const;
 	double evaluate(const Eigen::VectorXd& x,
 	                Eigen::VectorXd* gradient,
-	                Eigen::SparseMatrix<double>* hessian) const;
+	                Eigen::SparseMatrix<double>* hessian,
+	                HessianStorage storage) const;
 	Interval<double> evaluate(const std::vector<Interval<double>>& x) const;
+	void evaluate_many(const Eigen::MatrixXd& X,
+	                   Eigen::VectorXd* values,
+	                   Eigen::MatrixXd* gradients) const;
 
 	// Adds a variable to the function. All variables must be added
 	// before any terms containing them are added.
@@ -80,7 +147,12 @@ public:
 	                           int dimension,
 	                           std::shared_ptr<ChangeOfVariables> change_of_variables = 0);
 
-	void set_constant(double* variable, bool is_constant);
+	void set_constant(const std::vector<double*>& variables, bool is_constant);
+	// Gives all variables new global indices, with the variables
+	// that are not constant first.
+	void compute_global_indices();
+	// Returns which variables are constant.
+	std::vector<bool> constant_variables() const;
 
 	// Copies variables from a global vector x to the Function's
 	// local storage.
@@ -94,10 +166,38 @@ public:
 	// Copies variables from a the storage provided by the user
 	// to the Function's local storage.
 	void copy_user_to_local() const;
+	// Copies all columns of X to the Function's local storage
+	// for evaluate_many.
+	void copy_global_to_batch(const Eigen::MatrixXd& X) const;
 
 	// Evaluates the function at the point in the local storage.
 	double evaluate_from_local_storage() const;
 
+	// Computes the Hessians of all terms with constant Hessians
+	// at the point in the local storage.
+	void compute_constant_hessians() const;
+	// Evaluates term i, which has a constant Hessian, at the point
+	// in the local storage. The gradient is computed from the
+	// cached Hessian.
+	double evaluate_constant_hessian_term(int i, double* gradient) const;
+	// Adds the Hessians of all terms with constant Hessians to
+	// global storage.
+	void assemble_constant_dense_hessian() const;
+	void assemble_constant_sparse_hessian() const;
+
+	// Computes the derivatives of all changes of variables at the
+	// point x in solver space.
+	void compute_change_of_variables_derivatives(const Eigen::VectorXd& x) const;
+	// Applies the chain rule to the gradient and Hessian (layout
+	// given by offsets) of term i, so that they are with respect to
+	// the solver variables instead of the user variables. If lower,
+	// only the blocks var0 <= var1 of the Hessian are transformed.
+	void change_term_variables(int i,
+	                           const std::vector<int>& offsets,
+	                           double* gradient,
+	                           double* hessian,
+	                           bool lower) const;
+
 	// Clears the function to the empty function.
 	void clear();
 
@@ -115,6 +215,25 @@ public:
 
 	// All terms added to the function.
 	std::vector<AddedTerm> terms;
+	// The handle of every term, and the index of every handle in terms.
+	// Removing a term moves the last term to its place.
+	std::vector<TermHandle> term_handles;
+	std::unordered_map<TermHandle, std::size_t> term_index;
+	TermHandle next_term_handle;
+
+	// Adds a term whose variables have all been added. If the local
+	// storage and sparsity patterns are valid, they are updated with
+	// the new term instead of being recomputed.
+	TermHandle add_term(AddedTerm&& added_term);
+	void remove_term(std::size_t i);
+	// Terms that are not kept in memory.
+	std::vector<std::shared_ptr<const TermStream>> term_streams;
+
+	// Evaluates all streamed terms at the point in the local
+	// storage. If x is not null, the gradient is added to the
+	// thread's global gradients.
+	double evaluate_term_streams(const Eigen::VectorXd* x) const;
+	double evaluate_term_chunk(const TermChunk& chunk, const Eigen::VectorXd* x) const;
 
 	// Number of threads used for evaluation.
 	int number_of_threads;
@@ -122,27 +241,146 @@ public:
 	// Allocates temporary storage for gradient evaluations.
 	// Should be called automatically at first evaluate()
 	void allocate_local_storage() const;
+	// Called when variables are added, so that the local storage and
+	// all cached sparsity patterns have to be recomputed.
+	void invalidate_local_storage();
+	// Sets the offsets and the temporary storage of a term. Its
+	// active flags are written to active.
+	void prepare_term(const AddedTerm* added_term, bool* active) const;
+	// Resizes the per-thread storage after max_term_dimension or
+	// max_hessian_dimension have changed.
+	void resize_thread_scratch() const;
 
 	// If finalize has been called.
 	mutable bool local_storage_allocated;
+	// Which variables were constant when the local storage was
+	// allocated. Changing the constant variables back to this set
+	// does not require a new allocation.
+	mutable std::vector<bool> allocated_constant_variables;
+
+	// The most recently created sparsity patterns of the Hessian, for
+	// different sets of constant variables. Block-coordinate methods
+	// typically alternate between a few such sets.
+	struct SparsityPattern
+	{
+		std::vector<bool> constant_variables;
+		HessianStorage storage;
+		Eigen::SparseMatrix<double> pattern;
+		// The number of terms contributing to each non-zero element
+		// of the pattern.
+		std::vector<int> term_counts;
+	};
+	static const std::size_t max_cached_sparsity_patterns = 2;
+	mutable std::vector<SparsityPattern> sparsity_patterns;
+	// Calls f(i, j) for every element of the global Hessian that
+	// the term contributes to.
+	template<typename Callback>
+	void for_each_hessian_element(const AddedTerm& added_term,
+	                              HessianStorage storage,
+	                              Callback f) const;
+	// Adds change (±1) to the term counts of all elements of a term in
+	// the sparsity pattern for the current constant variables. The
+	// patterns for other constant variables are removed.
+	void update_sparsity_patterns(const AddedTerm& added_term, int change) const;
+	// Largest number of variables of a term and largest
+	// dimension of a variable. Set by allocate_local_storage.
+	mutable size_t max_arity;
+	mutable int max_variable_dimension;
+	// Largest sum of all variable dimensions of a term.
+	mutable int max_term_dimension;
+	// Largest dimension of a term Hessian, i.e. the sum of the active
+	// variable dimensions, or of all dimensions for terms with
+	// constant Hessians.
+	mutable int max_hessian_dimension;
+	// Storage for AddedTerm::active for all terms. Terms added after
+	// the allocation get their own storage. When that and the storage
+	// of removed terms exceeds the allocated size, the local storage is
+	// allocated again.
+	mutable std::unique_ptr<bool[]> term_active_storage;
+	mutable std::size_t allocated_active_storage;
+	mutable std::vector<std::unique_ptr<bool[]>> added_term_active_storage;
+	mutable std::size_t unused_active_storage;
 	// Has to be mutable because the temporary storage
-	// needs to be written to.
-	mutable std::vector< std::vector<Eigen::VectorXd> >
-		thread_gradient_scratch;
+	// needs to be written to. The gradient and hessian of
+	// a term are stored flat (see Term::evaluate_flat).
+	mutable std::vector<std::vector<double>> thread_gradient_scratch;
 	mutable std::vector<Eigen::VectorXd>
 		thread_gradient_storage;
 	// Temporary storage for the hessian.
-	typedef std::vector<std::vector<Eigen::MatrixXd>> HessianStorage;
-	mutable std::vector<HessianStorage> thread_hessian_scratch;
+	mutable std::vector<std::vector<double>> thread_hessian_scratch;
 	mutable std::vector<Eigen::MatrixXd> thread_dense_hessian_storage;
 
 	typedef std::vector<Eigen::Triplet<double>> SparseHessianStorage;
 	mutable std::vector<SparseHessianStorage> thread_sparse_hessian_storage;
 
+	// Temporary storage for evaluate_many. For each thread, the
+	// variable pointers of a term for all points, the values of a
+	// term at all points, the term gradients for all points and
+	// the accumulated values and gradients.
+	mutable std::vector<std::vector<double*>> thread_batch_variables;
+	mutable std::vector<std::vector<double* const*>> thread_batch_points;
+	mutable std::vector<std::vector<double>> thread_batch_term_values;
+	mutable std::vector<std::vector<std::vector<Eigen::VectorXd>>> thread_batch_gradient_scratch;
+	mutable std::vector<Eigen::VectorXd> thread_batch_values;
+	mutable std::vector<Eigen::MatrixXd> thread_batch_gradient_storage;
+
+	// Cache for terms with constant Hessians. Each term stores its
+	// Hessian and its gradient g0 at a point x0, so that the gradient
+	// at x is g0 + H(x - x0). Points and gradients are stored with all
+	// variables of the term after each other.
+	struct ConstantHessianTerm
+	{
+		Eigen::MatrixXd hessian;
+		Eigen::VectorXd x0;
+		Eigen::VectorXd g0;
+	};
+	mutable bool constant_hessians_computed;
+	// Index into constant_hessian_terms for every term, or -1 if
+	// the term does not have a constant Hessian.
+	mutable std::vector<int> constant_hessian_index;
+	mutable std::vector<ConstantHessianTerm> constant_hessian_terms;
+	// The sum of all constant Hessians. Assembled when first needed.
+	mutable bool constant_dense_hessian_assembled;
+	mutable Eigen::MatrixXd constant_dense_hessian;
+	mutable bool constant_sparse_hessian_assembled;
+	mutable SparseHessianStorage constant_sparse_hessian;
+
 	// Stored how many element were used the last time the Hessian
 	// was created.
 	mutable size_t number_of_hessian_elements;
 
+	// Statistics recorded when term_profiling_enabled is set.
+	enum TermEvaluationKind {VALUE_EVALUATION, GRADIENT_EVALUATION, HESSIAN_EVALUATION};
+	struct TermTypeCounters
+	{
+		std::uint64_t evaluations[3] = {0, 0, 0};
+		double time[3] = {0.0, 0.0, 0.0};
+	};
+	// Finds the type of every term and allocates the counters.
+	void prepare_term_profile() const;
+	void record_term_time(int t, int i, TermEvaluationKind kind, double time) const;
+	// Adds the time every thread spent in one term loop.
+	void record_term_loop(const std::vector<double>& thread_time) const;
+	// Every type seen so far. Types with the same name share an index.
+	mutable std::unordered_map<std::type_index, int> term_type_map;
+	mutable std::vector<std::string> term_type_names;
+	// The type of every term. Invalid after terms are added or removed.
+	mutable std::vector<int> term_type_index;
+	mutable bool term_types_valid = false;
+	// Indexed by thread and type.
+	mutable std::vector<std::vector<TermTypeCounters>> thread_term_counters;
+	mutable std::vector<double> thread_term_time;
+	mutable int number_of_term_loops = 0;
+	mutable double max_term_loop_time = 0.0;
+	mutable double mean_term_loop_time = 0.0;
+
+	// Records the sizes of all structures, or, if all is false, only
+	// of the per-thread evaluation storage, which is cheap enough to
+	// do after every evaluation.
+	void record_memory_usage(bool all) const;
+	mutable MemoryUsage memory_usage;
+	mutable std::size_t recorded_thread_bytes[4] = {0, 0, 0, 0};
+
 	Function* interface;
 };
 
@@ -172,6 +410,11 @@ void Function::Implementation::clear()
 	constant = 0;
 
 	terms.clear();
+	term_handles.clear();
+	term_index.clear();
+	term_types_valid = false;
+	next_term_handle = 0;
+	term_streams.clear();
 	variables.clear();
 	variables_map.clear();
 	number_of_scalars = 0;
@@ -179,7 +422,15 @@ void Function::Implementation::clear()
 
 	thread_gradient_scratch.clear();
 	thread_gradient_storage.clear();
-	local_storage_allocated = false;
+	thread_hessian_scratch.clear();
+	invalidate_local_storage();
+	constant_hessians_computed = false;
+	allocated_active_storage = 0;
+	added_term_active_storage.clear();
+	unused_active_storage = 0;
+	max_arity = 1;
+	max_variable_dimension = 1;
+	max_term_dimension = 1;
 
 	number_of_hessian_elements = 0;
 
@@ -198,32 +449,40 @@ Function& Function::operator = (const Function& org)
 	impl->clear();
 
 	this->hessian_is_enabled = org.hessian_is_enabled;
+	this->term_profiling_enabled = org.term_profiling_enabled;
 	impl->constant = org.impl->constant;
 
-	// TODO: respect global order.
-	std::map<size_t, double*> user_variables;
-	for (const auto& added_variable: org.impl->variables_map) {
-		AddedVariable& var_info = org.impl->variables[added_variable.second];
-
-		impl->add_variable_internal(added_variable.first,
+	// Adding the variables in the same order as the original
+	// function gives them the same global indices, so that a
+	// global vector x can be used with both functions.
+	for (const auto& var_info: org.impl->variables) {
+		impl->add_variable_internal(var_info.user_data,
 		                            var_info.user_dimension,
 		                            var_info.change_of_variables);
-		user_variables[var_info.global_index] = added_variable.first;
+		impl->variables.back().lower_bound = var_info.lower_bound;
+		impl->variables.back().upper_bound = var_info.upper_bound;
+	}
+	std::vector<double*> constant_variables;
+	for (const auto& var_info: org.impl->variables) {
+		if (var_info.is_constant) {
+			constant_variables.push_back(var_info.user_data);
+		}
 	}
-	spii_assert(org.impl->variables.size() == user_variables.size());
+	impl->set_constant(constant_variables, true);
 	spii_assert(get_number_of_variables() == org.get_number_of_variables());
 	spii_assert(get_number_of_scalars() == org.get_number_of_scalars());
 
 	for (const auto& added_term: org.impl->terms) {
 		std::vector<double*> vars;
 		for (auto var: added_term.added_variables_indices) {
-			auto index = org.impl->variables[var].global_index;
-			spii_assert(user_variables.find(index) != user_variables.end());
-			vars.push_back(user_variables[index]);
+			vars.push_back(org.impl->variables[var].user_data);
 		}
 		this->add_term(added_term.term, vars);
 	}
-	spii_assert(org.impl->variables.size() == user_variables.size());
+	impl->term_handles = org.impl->term_handles;
+	impl->term_index = org.impl->term_index;
+	impl->next_term_handle = org.impl->next_term_handle;
+	impl->term_streams = org.impl->term_streams;
 
 	return *this;
 }
@@ -232,6 +491,9 @@ Function& Function::operator += (const Function& org)
 {
 	impl->constant += org.impl->constant;
 
+	check(org.impl->term_streams.empty(),
+	      "Function::operator+=: Streamed terms are not supported.");
+
 	// Check that there are no change of variables involved.
 	for (const auto& added_variable: org.impl->variables) {
 		spii_assert(!added_variable.change_of_variables);
@@ -287,6 +549,48 @@ size_t Function::get_variable_global_index(double* variable) const
 	return impl->variables[itr->second].global_index;
 }
 
+void Function::set_bounds(double* variable, const double* lower, const double* upper)
+{
+	auto itr = impl->variables_map.find(variable);
+	check(itr != impl->variables_map.end(),
+	      "Function::set_bounds: variable not found.");
+	auto& var_info = impl->variables[itr->second];
+	check(var_info.change_of_variables == nullptr,
+	      "Function::set_bounds: bounded variables can not have a change of variables.");
+
+	var_info.lower_bound.assign(lower, lower + var_info.user_dimension);
+	var_info.upper_bound.assign(upper, upper + var_info.user_dimension);
+	for (int i = 0; i < var_info.user_dimension; ++i) {
+		check(var_info.lower_bound[i] <= var_info.upper_bound[i],
+		      "Function::set_bounds: lower bound larger than upper bound.");
+	}
+}
+
+bool Function::has_bounds() const
+{
+	for (const auto& var_info: impl->variables) {
+		if ( ! var_info.is_constant && ! var_info.lower_bound.empty()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Function::get_bounds(Eigen::VectorXd* lower, Eigen::VectorXd* upper) const
+{
+	lower->setConstant(impl->number_of_scalars, -std::numeric_limits<double>::infinity());
+	upper->setConstant(impl->number_of_scalars,  std::numeric_limits<double>::infinity());
+	for (const auto& var_info: impl->variables) {
+		if (var_info.is_constant || var_info.lower_bound.empty()) {
+			continue;
+		}
+		for (int i = 0; i < var_info.user_dimension; ++i) {
+			(*lower)[var_info.global_index + i] = var_info.lower_bound[i];
+			(*upper)[var_info.global_index + i] = var_info.upper_bound[i];
+		}
+	}
+}
+
 size_t Function::get_number_of_variables() const
 {
 	return impl->variables.size();
@@ -337,7 +641,7 @@ void Function::Implementation::add_variable_internal(double* variable,
                                                     int dimension,
                                                     std::shared_ptr<ChangeOfVariables> change_of_variables)
 {
-	this->local_storage_allocated = false;
+	this->invalidate_local_storage();
 
 	// Check if variable already exists, and if it
 	// does, that it still has the same dimensions.
@@ -351,6 +655,8 @@ void Function::Implementation::add_variable_internal(double* variable,
 
 		var_info.change_of_variables = change_of_variables;
 		if (change_of_variables) {
+			check(var_info.lower_bound.empty(),
+			      "Function::add_variable: bounded variables can not have a change of variables.");
 			check(var_info.user_dimension == change_of_variables->x_dimension(),
 			      "Function::add_variable: x_dimension can not change.");
 			check(var_info.solver_dimension == change_of_variables->t_dimension(),
@@ -407,16 +713,28 @@ void Function::Implementation::add_variable_internal(double* variable,
 	number_of_scalars += var_info.solver_dimension;
 }
 
-void Function::Implementation::set_constant(double* variable, bool is_constant)
+void Function::Implementation::set_constant(const std::vector<double*>& variables_to_change, bool is_constant)
 {
-	// Find the variable. This has to succeed.
-	auto itr = variables_map.find(variable);
-	check(itr != variables_map.end(), 
-	      "Function::set_constant: variable not found.");
+	for (auto variable: variables_to_change) {
+		// Find the variable. This has to succeed.
+		auto itr = variables_map.find(variable);
+		check(itr != variables_map.end(),
+		      "Function::set_constant: variable not found.");
+
+		variables[itr->second].is_constant = is_constant;
+	}
+
+	compute_global_indices();
 
-	variables[itr->second].is_constant = is_constant;
+	// Apart from the terms and variables, the local storage only
+	// depends on which variables are constant. It is still valid if
+	// they are the same as when it was allocated.
+	this->local_storage_allocated = ! this->allocated_constant_variables.empty() &&
+	                                constant_variables() == this->allocated_constant_variables;
+}
 
-	// Recompute all global indices. Expensive!
+void Function::Implementation::compute_global_indices()
+{
 	this->number_of_scalars = 0;
 	for (auto& variable: variables) {
 		if (!variable.is_constant) {
@@ -436,49 +754,143 @@ void Function::Implementation::set_constant(double* variable, bool is_constant)
 			this->number_of_constants += variable.solver_dimension;
 		}
 	}
+}
+
+std::vector<bool> Function::Implementation::constant_variables() const
+{
+	std::vector<bool> constant(variables.size());
+	for (std::size_t i = 0; i < variables.size(); ++i) {
+		constant[i] = variables[i].is_constant;
+	}
+	return constant;
+}
 
+void Function::Implementation::invalidate_local_storage()
+{
 	this->local_storage_allocated = false;
+	this->allocated_constant_variables.clear();
+	this->sparsity_patterns.clear();
+}
+
+Function::TermHandle Function::Implementation::add_term(AddedTerm&& new_term)
+{
+	terms.emplace_back(std::move(new_term));
+	auto& added_term = terms.back();
+	term_types_valid = false;
+	auto handle = next_term_handle++;
+	term_handles.push_back(handle);
+	term_index[handle] = terms.size() - 1;
+
+	auto arity = added_term.added_variables_indices.size();
+	unused_active_storage += arity;
+	if (local_storage_allocated && unused_active_storage <= allocated_active_storage) {
+		added_term_active_storage.emplace_back(new bool[arity]);
+		auto old_term_dimension = max_term_dimension;
+		auto old_hessian_dimension = max_hessian_dimension;
+		prepare_term(&added_term, added_term_active_storage.back().get());
+		max_arity = std::max(max_arity, arity);
+		if (max_term_dimension > old_term_dimension || max_hessian_dimension > old_hessian_dimension) {
+			resize_thread_scratch();
+		}
+		// The new term is evaluated normally until the constant
+		// Hessians are computed again.
+		if (constant_hessians_computed) {
+			constant_hessian_index.push_back(-1);
+		}
+	}
+	else {
+		local_storage_allocated = false;
+		allocated_constant_variables.clear();
+		constant_hessians_computed = false;
+	}
+
+	update_sparsity_patterns(added_term, 1);
+	return handle;
+}
+
+void Function::Implementation::remove_term(std::size_t i)
+{
+	update_sparsity_patterns(terms[i], -1);
+
+	// The storage of the removed term is not reused.
+	unused_active_storage += terms[i].added_variables_indices.size();
+	if (unused_active_storage > allocated_active_storage) {
+		local_storage_allocated = false;
+		allocated_constant_variables.clear();
+	}
+
+	if (constant_hessians_computed) {
+		if (constant_hessian_index[i] >= 0) {
+			constant_dense_hessian_assembled = false;
+			constant_sparse_hessian_assembled = false;
+		}
+		constant_hessian_index[i] = constant_hessian_index.back();
+		constant_hessian_index.pop_back();
+	}
+
+	term_index.erase(term_handles[i]);
+	auto last = terms.size() - 1;
+	if (i != last) {
+		terms[i] = std::move(terms[last]);
+		term_handles[i] = term_handles[last];
+		term_index[term_handles[i]] = i;
+	}
+	terms.pop_back();
+	term_handles.pop_back();
+	term_types_valid = false;
 }
 
 void Function::set_constant(double* variable, bool is_constant)
 {
-	impl->set_constant(variable, is_constant);
+	impl->set_constant(std::vector<double*>{variable}, is_constant);
 }
 
-void Function::add_term(std::shared_ptr<const Term> term, const std::vector<double*>& arguments)
+void Function::set_constant(const std::vector<double*>& variables, bool is_constant)
 {
-	impl->local_storage_allocated = false;
+	impl->set_constant(variables, is_constant);
+}
 
+Function::TermHandle Function::add_term(std::shared_ptr<const Term> term,
+                                       const std::vector<double*>& arguments)
+{
 	check(term->number_of_variables() == arguments.size(),
 	      "Function::add_term: incorrect number of arguments.");
 
-	impl->terms.emplace_back();
-	auto& added_term = impl->terms.back();
+	AddedTerm added_term;
 	added_term.term = term;
 	added_term.added_variables_indices.reserve(arguments.size());
 
-	try {
-		// Check whether the variables exist.
-		for (int var = 0; var < term->number_of_variables(); ++var) {
-			auto var_itr = impl->variables_map.find(arguments[var]);
-			if (var_itr == impl->variables_map.end()) {
-				add_variable(arguments[var], term->variable_dimension(var));
-				var_itr = impl->variables_map.find(arguments[var]);
-			}
-			// The x-dimension of the variable must match what is expected by the term.
-			else {
-				spii_assert(impl->variables[var_itr->second].user_dimension == term->variable_dimension(var),
-				            "Function::add_term: variable dimension does not match term.");
-			}
-
-			// Look up this variable.
-			auto var_index = var_itr->second;
-			added_term.added_variables_indices.emplace_back(var_index);
+	// Check whether the variables exist.
+	for (int var = 0; var < term->number_of_variables(); ++var) {
+		auto var_itr = impl->variables_map.find(arguments[var]);
+		if (var_itr == impl->variables_map.end()) {
+			add_variable(arguments[var], term->variable_dimension(var));
+			var_itr = impl->variables_map.find(arguments[var]);
+		}
+		// The x-dimension of the variable must match what is expected by the term.
+		else {
+			spii_assert(impl->variables[var_itr->second].user_dimension == term->variable_dimension(var),
+			            "Function::add_term: variable dimension does not match term.");
 		}
-	} catch(...) {
-		impl->terms.pop_back();
-		throw;
+
+		// Look up this variable.
+		auto var_index = var_itr->second;
+		added_term.added_variables_indices.emplace_back(var_index);
 	}
+
+	return impl->add_term(std::move(added_term));
+}
+
+void Function::remove_term(TermHandle term)
+{
+	auto itr = impl->term_index.find(term);
+	check(itr != impl->term_index.end(), "Function::remove_term: term not found.");
+	impl->remove_term(itr->second);
+}
+
+void Function::add_term_stream(std::shared_ptr<const TermStream> stream)
+{
+	impl->term_streams.push_back(stream);
 }
 
 size_t Function::get_number_of_terms() const
@@ -496,7 +908,7 @@ void Function::set_number_of_threads(int num)
 	#ifdef USE_OPENMP
 		spii_assert(num > 0, "Function::set_number_of_threads: "
 		                     "invalid number of threads.");
-		impl->local_storage_allocated = false;
+		impl->invalidate_local_storage();
 		impl->number_of_threads = num;
 	#endif
 }
@@ -505,8 +917,8 @@ void Function::Implementation::allocate_local_storage() const
 {
 	auto start_time = wall_time();
 
-	size_t max_arity = 1;
-	int max_variable_dimension = 1;
+	max_arity = 1;
+	max_variable_dimension = 1;
 	for (const auto& itr: variables) {
 		max_variable_dimension = std::max(max_variable_dimension,
 		                                  itr.user_dimension);
@@ -515,47 +927,90 @@ void Function::Implementation::allocate_local_storage() const
 		max_arity = std::max(max_arity, term.added_variables_indices.size());
 	}
 
-	this->thread_gradient_scratch.resize(this->number_of_threads);
-	this->thread_gradient_storage.resize(this->number_of_threads);
-	for (int t = 0; t < this->number_of_threads; ++t) {
-		this->thread_gradient_storage[t].resize(number_of_scalars + number_of_constants);
-		this->thread_gradient_scratch[t].resize(max_arity);
-		for (int var = 0; var < max_arity; ++var) {
-			this->thread_gradient_scratch[t][var].resize(max_variable_dimension);
-		}
+	std::size_t total_arity = 0;
+	for (const auto& added_term: terms) {
+		total_arity += added_term.added_variables_indices.size();
 	}
+	term_active_storage.reset(new bool[total_arity]);
+	allocated_active_storage = total_arity;
+	added_term_active_storage.clear();
+	unused_active_storage = 0;
+	bool* active = term_active_storage.get();
 
 	// Every term should have a pointer to the local space
 	// used when evaluating.
+	max_term_dimension = 1;
+	max_hessian_dimension = 1;
 	for (auto& added_term: terms) {
-		for (auto ind: added_term.added_variables_indices) {
-			// Look up this variable.
-			auto& added_variable = variables[ind];
-			// Stora a pointer to temporary storage for this variable.
-			double* temp_space = &added_variable.temp_space[0];
-			added_term.temp_variables.push_back(temp_space);
+		prepare_term(&added_term, active);
+		active += added_term.added_variables_indices.size();
+	}
+
+	resize_thread_scratch();
+
+	// The global indices may have changed, so the constant
+	// Hessians need to be computed again.
+	this->constant_hessians_computed = false;
+
+	this->allocated_constant_variables = constant_variables();
+	this->local_storage_allocated = true;
+	this->record_memory_usage(true);
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
+void Function::Implementation::prepare_term(const AddedTerm* added_term, bool* active) const
+{
+	added_term->active = active;
+	added_term->active_offsets.clear();
+	int active_dimension = 0;
+	for (auto ind: added_term->added_variables_indices) {
+		const auto& added_variable = variables[ind];
+		*active++ = ! added_variable.is_constant;
+		if (added_variable.is_constant) {
+			added_term->active_offsets.push_back(-1);
+		}
+		else {
+			added_term->active_offsets.push_back(active_dimension);
+			active_dimension += added_variable.user_dimension;
 		}
 	}
+	added_term->active_offsets.push_back(active_dimension);
+
+	added_term->temp_variables.clear();
+	added_term->flat_offsets.assign(1, 0);
+	for (auto ind: added_term->added_variables_indices) {
+		// Look up this variable.
+		auto& added_variable = variables[ind];
+		// Stora a pointer to temporary storage for this variable.
+		double* temp_space = &added_variable.temp_space[0];
+		added_term->temp_variables.push_back(temp_space);
+		added_term->flat_offsets.push_back(added_term->flat_offsets.back()
+		                                   + added_variable.user_dimension);
+	}
+	max_term_dimension = std::max(max_term_dimension, added_term->flat_offsets.back());
+	if (interface->hessian_is_enabled) {
+		int hessian_dimension = added_term->term->has_constant_hessian() ?
+			added_term->flat_offsets.back() : active_dimension;
+		max_hessian_dimension = std::max(max_hessian_dimension, hessian_dimension);
+	}
+}
+
+void Function::Implementation::resize_thread_scratch() const
+{
+	this->thread_gradient_scratch.resize(this->number_of_threads);
+	this->thread_gradient_storage.resize(this->number_of_threads);
+	for (int t = 0; t < this->number_of_threads; ++t) {
+		this->thread_gradient_storage[t].resize(number_of_scalars + number_of_constants);
+		this->thread_gradient_scratch[t].resize(max_term_dimension);
+	}
 
 	if (interface->hessian_is_enabled) {
 		this->thread_hessian_scratch.resize(this->number_of_threads);
 		for (int t = 0; t < this->number_of_threads; ++t) {
-			auto& hessian = this->thread_hessian_scratch[t];
-
-			hessian.resize(max_arity);
-			for (int var0 = 0; var0 < max_arity; ++var0) {
-				hessian[var0].resize(max_arity);
-				for (int var1 = 0; var1 < max_arity; ++var1) {
-					hessian[var0][var1].resize(max_variable_dimension,
-					                           max_variable_dimension);
-				}
-			}
+			this->thread_hessian_scratch[t].resize(max_hessian_dimension * max_hessian_dimension);
 		}
 	}
-
-	this->local_storage_allocated = true;
-
-	interface->allocation_time += wall_time() - start_time;
 }
 
 void Function::print_timing_information(std::ostream& out) const
@@ -565,10 +1020,278 @@ void Function::print_timing_information(std::ostream& out) const
 	out << "Function evaluations with gradient    : " << evaluations_with_gradient << '\n';
 	out << "Function memory allocation time   : " << allocation_time << '\n';
 	out << "Function evaluate time            : " << evaluate_time << '\n';
+	out << "Function evaluate time (with g)   : " << evaluate_with_gradient_time << '\n';
 	out << "Function evaluate time (with g/H) : " << evaluate_with_hessian_time << '\n';
 	out << "Function write g/H time           : " << write_gradient_hessian_time << '\n';
 	out << "Function copy data time           : " << copy_time << '\n';
 	out << "----------------------------------------------------\n";
+
+	auto profile = get_term_profile();
+	if (profile.number_of_loops > 0) {
+		out << "Term type evaluations (value/gradient/Hessian) and time:\n";
+		for (const auto& type: profile.term_types) {
+			out << "  " << type.name << ", " << type.number_of_terms << " terms\n";
+			out << "    evaluations : " << type.value_evaluations << " / "
+			    << type.gradient_evaluations << " / " << type.hessian_evaluations << '\n';
+			out << "    total time  : " << type.value_time << " / "
+			    << type.gradient_time << " / " << type.hessian_time << '\n';
+			out << "    mean time   : " << type.mean_time() << '\n';
+		}
+		out << "Term loop thread time             :";
+		for (auto time: profile.thread_time) {
+			out << ' ' << time;
+		}
+		out << '\n';
+		out << "Term loop load imbalance          : " << profile.load_imbalance() << '\n';
+		out << "----------------------------------------------------\n";
+	}
+}
+
+void Function::Implementation::record_memory_usage(bool all) const
+{
+	std::size_t thread_bytes[4] = {
+		heap_size(thread_gradient_storage) + heap_size(thread_gradient_scratch),
+		heap_size(thread_hessian_scratch),
+		heap_size(thread_dense_hessian_storage),
+		heap_size(thread_sparse_hessian_storage)
+	};
+	if (! all && std::equal(thread_bytes, thread_bytes + 4, recorded_thread_bytes)) {
+		return;
+	}
+	std::copy(thread_bytes, thread_bytes + 4, recorded_thread_bytes);
+	memory_usage.record("thread gradients", thread_bytes[0]);
+	memory_usage.record("thread Hessian scratch", thread_bytes[1]);
+	memory_usage.record("thread dense Hessians", thread_bytes[2]);
+	memory_usage.record("thread sparse Hessian triplets", thread_bytes[3]);
+	if (! all) {
+		return;
+	}
+
+	// Approximate size of a node in a map or hash table.
+	const std::size_t node_overhead = 3 * sizeof(void*);
+
+	std::size_t variable_bytes = variables.capacity() * sizeof(AddedVariable);
+	for (const auto& variable: variables) {
+		variable_bytes += heap_size(variable.temp_space)
+		                + heap_size(variable.batch_temp_space)
+		                + heap_size(variable.lower_bound)
+		                + heap_size(variable.upper_bound)
+		                + heap_size(variable.change_jacobian)
+		                + heap_size(variable.change_hessians);
+	}
+	variable_bytes += variables_map.size() * (sizeof(std::pair<double*, std::size_t>) + node_overhead);
+	memory_usage.record("variables", variable_bytes);
+
+	std::size_t term_bytes = terms.capacity() * sizeof(AddedTerm);
+	for (const auto& added_term: terms) {
+		term_bytes += heap_size(added_term.added_variables_indices)
+		            + heap_size(added_term.temp_variables)
+		            + heap_size(added_term.flat_offsets)
+		            + heap_size(added_term.active_offsets);
+	}
+	term_bytes += heap_size(term_handles);
+	term_bytes += term_index.size() * (sizeof(std::pair<TermHandle, std::size_t>) + node_overhead);
+	term_bytes += allocated_active_storage + unused_active_storage;
+	term_bytes += heap_size(constant_hessian_index) + heap_size(term_type_index);
+	memory_usage.record("terms", term_bytes);
+
+	std::size_t constant_hessian_bytes = constant_hessian_terms.capacity() * sizeof(ConstantHessianTerm);
+	for (const auto& cache: constant_hessian_terms) {
+		constant_hessian_bytes += heap_size(cache.hessian) + heap_size(cache.x0) + heap_size(cache.g0);
+	}
+	constant_hessian_bytes += heap_size(constant_dense_hessian) + heap_size(constant_sparse_hessian);
+	memory_usage.record("constant Hessians", constant_hessian_bytes);
+
+	std::size_t pattern_bytes = sparsity_patterns.capacity() * sizeof(SparsityPattern);
+	for (const auto& cached: sparsity_patterns) {
+		pattern_bytes += heap_size(cached.constant_variables)
+		               + heap_size(cached.pattern)
+		               + heap_size(cached.term_counts);
+	}
+	memory_usage.record("sparsity patterns", pattern_bytes);
+
+	memory_usage.record("evaluate_many storage",
+	                    heap_size(thread_batch_variables)
+	                    + heap_size(thread_batch_points)
+	                    + heap_size(thread_batch_term_values)
+	                    + heap_size(thread_batch_gradient_scratch)
+	                    + heap_size(thread_batch_values)
+	                    + heap_size(thread_batch_gradient_storage));
+}
+
+MemoryUsage Function::get_memory_usage() const
+{
+	impl->record_memory_usage(true);
+	return impl->memory_usage;
+}
+
+MemoryUsage Function::estimate_memory_usage(Evaluation evaluation) const
+{
+	impl->record_memory_usage(true);
+	const auto& current = impl->memory_usage;
+	const std::size_t n = impl->number_of_scalars + impl->number_of_constants;
+	const std::size_t threads = impl->number_of_threads;
+	const bool hessian = evaluation != Evaluation::GRADIENT;
+
+	// The term storage allocated at the first evaluation, and the
+	// sizes of the term Hessians.
+	std::size_t term_local_bytes = 0;
+	std::size_t max_term_dimension = 1;
+	std::size_t hessian_elements = 0;
+	std::size_t constant_hessian_bytes = 0;
+	for (const auto& added_term: impl->terms) {
+		std::size_t arity = added_term.added_variables_indices.size();
+		term_local_bytes += arity * (sizeof(double*) + 2 * sizeof(int) + sizeof(bool)) + 2 * sizeof(int);
+
+		std::size_t dimension = 0;
+		for (auto index: added_term.added_variables_indices) {
+			dimension += impl->variables[index].user_dimension;
+		}
+		max_term_dimension = std::max(max_term_dimension, dimension);
+		hessian_elements += dimension * dimension;
+		if (hessian && added_term.term->has_constant_hessian()) {
+			constant_hessian_bytes += (dimension * dimension + 2 * dimension) * sizeof(double);
+		}
+	}
+
+	MemoryUsage estimate;
+	estimate.record("variables", current.current("variables"));
+	estimate.record("terms", current.current("terms")
+	                         + (impl->local_storage_allocated ? 0 : term_local_bytes));
+	estimate.record("thread gradients",
+	                threads * ((n + max_term_dimension) * sizeof(double)
+	                           + sizeof(Eigen::VectorXd) + sizeof(std::vector<double>)));
+	if (this->hessian_is_enabled) {
+		estimate.record("thread Hessian scratch",
+		                threads * (max_term_dimension * max_term_dimension * sizeof(double)
+		                           + sizeof(std::vector<double>)));
+	}
+	if (evaluation == Evaluation::DENSE_HESSIAN) {
+		estimate.record("thread dense Hessians", threads * (n * n * sizeof(double) + sizeof(Eigen::MatrixXd)));
+		constant_hessian_bytes += n * n * sizeof(double);
+	}
+	if (evaluation == Evaluation::SPARSE_HESSIAN) {
+		// The first thread ends up with the elements of all threads.
+		// The storage may grow to twice the number of elements.
+		std::size_t elements = hessian_elements + (threads - 1) * (hessian_elements / threads);
+		estimate.record("thread sparse Hessian triplets",
+		                threads * sizeof(std::vector<Eigen::Triplet<double>>)
+		                + 2 * elements * sizeof(Eigen::Triplet<double>));
+		// At most one element per element of the term Hessians.
+		estimate.record("sparsity patterns",
+		                hessian_elements * (sizeof(double) + 2 * sizeof(int)) + (n + 1) * sizeof(int));
+	}
+	if (hessian) {
+		estimate.record("constant Hessians", constant_hessian_bytes);
+	}
+	return estimate;
+}
+
+void Function::Implementation::prepare_term_profile() const
+{
+	if (! term_types_valid) {
+		term_type_index.resize(terms.size());
+		for (std::size_t i = 0; i < terms.size(); ++i) {
+			const std::type_info& type = typeid(*terms[i].term);
+			auto itr = term_type_map.find(type);
+			if (itr == term_type_map.end()) {
+				auto name = TermFactory::fix_name(type.name());
+				auto name_itr = std::find(term_type_names.begin(), term_type_names.end(), name);
+				int index = static_cast<int>(name_itr - term_type_names.begin());
+				if (name_itr == term_type_names.end()) {
+					term_type_names.push_back(name);
+				}
+				itr = term_type_map.emplace(std::type_index(type), index).first;
+			}
+			term_type_index[i] = itr->second;
+		}
+		term_types_valid = true;
+	}
+
+	if (thread_term_counters.size() < this->number_of_threads) {
+		thread_term_counters.resize(this->number_of_threads);
+		thread_term_time.resize(this->number_of_threads);
+	}
+	for (auto& counters: thread_term_counters) {
+		if (counters.size() < term_type_names.size()) {
+			counters.resize(term_type_names.size());
+		}
+	}
+}
+
+void Function::Implementation::record_term_time(int t, int i, TermEvaluationKind kind, double time) const
+{
+	auto& counters = thread_term_counters[t][term_type_index[i]];
+	counters.evaluations[kind]++;
+	counters.time[kind] += time;
+}
+
+void Function::Implementation::record_term_loop(const std::vector<double>& thread_time) const
+{
+	// Threads that did not take part in the loop have no time.
+	double max_time = 0;
+	double sum_time = 0;
+	int number_of_participants = 0;
+	for (std::size_t t = 0; t < thread_time.size(); ++t) {
+		if (thread_time[t] > 0) {
+			thread_term_time[t] += thread_time[t];
+			max_time = std::max(max_time, thread_time[t]);
+			sum_time += thread_time[t];
+			number_of_participants++;
+		}
+	}
+	if (number_of_participants > 0) {
+		number_of_term_loops++;
+		max_term_loop_time  += max_time;
+		mean_term_loop_time += sum_time / number_of_participants;
+	}
+}
+
+Function::TermProfile Function::get_term_profile() const
+{
+	impl->prepare_term_profile();
+
+	TermProfile profile;
+	profile.term_types.resize(impl->term_type_names.size());
+	for (std::size_t type = 0; type < profile.term_types.size(); ++type) {
+		profile.term_types[type].name = impl->term_type_names[type];
+	}
+	for (auto type: impl->term_type_index) {
+		profile.term_types[type].number_of_terms++;
+	}
+	for (const auto& counters: impl->thread_term_counters) {
+		for (std::size_t type = 0; type < counters.size(); ++type) {
+			auto& type_profile = profile.term_types[type];
+			type_profile.value_evaluations    += counters[type].evaluations[Implementation::VALUE_EVALUATION];
+			type_profile.gradient_evaluations += counters[type].evaluations[Implementation::GRADIENT_EVALUATION];
+			type_profile.hessian_evaluations  += counters[type].evaluations[Implementation::HESSIAN_EVALUATION];
+			type_profile.value_time    += counters[type].time[Implementation::VALUE_EVALUATION];
+			type_profile.gradient_time += counters[type].time[Implementation::GRADIENT_EVALUATION];
+			type_profile.hessian_time  += counters[type].time[Implementation::HESSIAN_EVALUATION];
+		}
+	}
+	// Types of removed terms that were never evaluated are left out.
+	profile.term_types.erase(
+		std::remove_if(profile.term_types.begin(), profile.term_types.end(),
+			[](const TermTypeProfile& type) { return type.number_of_terms == 0 && type.evaluations() == 0; }),
+		profile.term_types.end());
+	std::stable_sort(profile.term_types.begin(), profile.term_types.end(),
+		[](const TermTypeProfile& a, const TermTypeProfile& b) { return a.total_time() > b.total_time(); });
+
+	profile.thread_time      = impl->thread_term_time;
+	profile.number_of_loops  = impl->number_of_term_loops;
+	profile.max_thread_time  = impl->max_term_loop_time;
+	profile.mean_thread_time = impl->mean_term_loop_time;
+	return profile;
+}
+
+void Function::clear_term_profile()
+{
+	impl->thread_term_counters.clear();
+	impl->thread_term_time.clear();
+	impl->number_of_term_loops = 0;
+	impl->max_term_loop_time   = 0.0;
+	impl->mean_term_loop_time  = 0.0;
 }
 
 double Function::Implementation::evaluate_from_local_storage() const
@@ -579,35 +1302,64 @@ double Function::Implementation::evaluate_from_local_storage() const
 	double start_time = wall_time();
 
 	double value = this->constant;
+	const bool profile = interface->term_profiling_enabled;
+	std::vector<double> loop_time;
+	if (profile) {
+		this->prepare_term_profile();
+		loop_time.resize(this->number_of_threads);
+	}
+	Trace* trace = Trace::active();
 	// Go through and evaluate each term.
 	// OpenMP requires a signed data type as the loop variable.
 	#ifdef USE_OPENMP
 		// Each thread needs to store a specific error.
 		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads) if (terms.size() > 1)
+		#pragma omp parallel num_threads(this->number_of_threads) if (terms.size() > 1)
 	#endif
-	// For loop has to be int for OpenMP.
-	for (int i = 0; i < terms.size(); ++i) {
+	{
+		// Each thread records its part of the loop when a trace is active.
 		#ifdef USE_OPENMP
-			// The thread number calling this iteration.
-			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
+			TraceSpan terms_span(trace, "terms", "function", -1, omp_get_thread_num());
+			ScopedTimer loop_timer(profile ? &loop_time[omp_get_thread_num()] : nullptr);
+			#pragma omp for reduction(+ : value) nowait
+		#else
+			TraceSpan terms_span(trace, "terms", "function");
+			ScopedTimer loop_timer(profile ? &loop_time[0] : nullptr);
 		#endif
+		// For loop has to be int for OpenMP.
+		for (int i = 0; i < terms.size(); ++i) {
+			#ifdef USE_OPENMP
+				// The thread number calling this iteration.
+				int t = omp_get_thread_num();
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#else
+				int t = 0;
+			#endif
+			const double term_start_time = profile ? wall_time() : 0.0;
 
-		// Evaluate the term .
-		value += terms[i].term->evaluate(&terms[i].temp_variables[0]);
+			// Evaluate the term .
+			value += terms[i].term->evaluate(&terms[i].temp_variables[0]);
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+			if (profile) {
+				this->record_term_time(t, i, VALUE_EVALUATION, wall_time() - term_start_time);
 			}
-		#endif
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+	}
+
+	if (profile) {
+		this->record_term_loop(loop_time);
 	}
 
 	#ifdef USE_OPENMP
@@ -622,88 +1374,561 @@ double Function::Implementation::evaluate_from_local_storage() const
 		}
 	#endif
 
+	value += this->evaluate_term_streams(nullptr);
+
 	interface->evaluate_time += wall_time() - start_time;
 	return value;
 }
 
-double Function::evaluate(const Eigen::VectorXd& x) const
+double Function::Implementation::evaluate_term_streams(const Eigen::VectorXd* x) const
 {
-	if (! impl->local_storage_allocated) {
-		impl->allocate_local_storage();
-	}
-
-	// Copy values from the global vector x to the temporary storage
-	// used for evaluating the term.
-	impl->copy_global_to_local(x);
+	double value = 0;
+	for (const auto& stream: term_streams) {
+		auto number_of_chunks = stream->number_of_chunks();
+		if (number_of_chunks == 0) {
+			continue;
+		}
 
-	return impl->evaluate_from_local_storage();
+		// Double buffering: the next chunk is loaded on a background
+		// thread while the current one is evaluated. The future is
+		// destroyed (waiting for the thread) before the chunks.
+		TermChunk chunks[2];
+		auto load_chunk = [&stream, &chunks](std::size_t c)
+		{
+			auto& chunk = chunks[c % 2];
+			chunk.terms.clear();
+			chunk.arguments.clear();
+			stream->load_chunk(c, &chunk);
+		};
+		auto next_chunk = std::async(std::launch::async, load_chunk, 0);
+		for (std::size_t c = 0; c < number_of_chunks; ++c) {
+			next_chunk.get();
+			if (c + 1 < number_of_chunks) {
+				next_chunk = std::async(std::launch::async, load_chunk, c + 1);
+			}
+			value += this->evaluate_term_chunk(chunks[c % 2], x);
+		}
+	}
+	return value;
 }
 
-double Function::evaluate() const
+double Function::Implementation::evaluate_term_chunk(const TermChunk& chunk, const Eigen::VectorXd* x) const
 {
-	if (! impl->local_storage_allocated) {
-		impl->allocate_local_storage();
+	const auto& chunk_terms = chunk.terms;
+
+	// Look up the variables of all terms.
+	std::vector<std::size_t> argument_offsets(1, 0);
+	std::vector<const AddedVariable*> chunk_variables;
+	chunk_variables.reserve(chunk.arguments.size());
+	int max_dimension = 1;
+	for (const auto& term: chunk_terms) {
+		int term_dimension = 0;
+		for (int var = 0; var < term->number_of_variables(); ++var) {
+			auto index = argument_offsets.back() + var;
+			check(index < chunk.arguments.size(),
+			      "Function::evaluate: Too few arguments in streamed chunk.");
+			auto itr = variables_map.find(chunk.arguments[index]);
+			check(itr != variables_map.end(),
+			      "Function::evaluate: Streamed term variable not found.");
+			const auto& variable = variables[itr->second];
+			check(variable.user_dimension == term->variable_dimension(var),
+			      "Function::evaluate: Streamed term variable has the wrong dimension.");
+			chunk_variables.push_back(&variable);
+			term_dimension += variable.user_dimension;
+		}
+		argument_offsets.push_back(argument_offsets.back() + term->number_of_variables());
+		max_dimension = std::max(max_dimension, term_dimension);
 	}
+	check(argument_offsets.back() == chunk.arguments.size(),
+	      "Function::evaluate: Too many arguments in streamed chunk.");
 
-	// Copy the user state to the local storage
-	// for evaluation.
-	impl->copy_user_to_local();
+	std::vector<std::vector<double*>> thread_variables(this->number_of_threads);
+	std::vector<std::vector<double>> thread_gradient(this->number_of_threads);
+	for (int t = 0; t < this->number_of_threads; ++t) {
+		thread_gradient[t].resize(max_dimension);
+	}
 
-	return impl->evaluate_from_local_storage();
-}
+	double value = 0;
+	Trace* trace = Trace::active();
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
+
+		#pragma omp parallel num_threads(this->number_of_threads)
+	#endif
+	{
+		// Each thread records its part of the loop when a trace is active.
+		#ifdef USE_OPENMP
+			TraceSpan terms_span(trace, "streamed terms", "function", -1, omp_get_thread_num());
+			#pragma omp for reduction(+ : value) nowait
+		#else
+			TraceSpan terms_span(trace, "streamed terms", "function");
+		#endif
+		for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(chunk_terms.size()); ++i) {
+			#ifdef USE_OPENMP
+				int t = omp_get_thread_num();
+				try {
+			#else
+				int t = 0;
+			#endif
+
+			const auto& term = chunk_terms[i];
+			auto& term_variables = thread_variables[t];
+			term_variables.clear();
+			for (auto j = argument_offsets[i]; j < argument_offsets[i + 1]; ++j) {
+				term_variables.push_back(&chunk_variables[j]->temp_space[0]);
+			}
+
+			if ( ! x) {
+				value += term->evaluate(&term_variables[0]);
+			}
+			else {
+				double* term_gradient = &thread_gradient[t][0];
+				value += term->evaluate_flat(&term_variables[0], term_gradient, nullptr, false);
+
+				// Put the gradient from the term into the thread's global gradient.
+				for (auto j = argument_offsets[i]; j < argument_offsets[i + 1]; ++j) {
+					const auto& variable = *chunk_variables[j];
+					if ( ! variable.is_constant) {
+						if (variable.change_of_variables == nullptr) {
+							for (int k = 0; k < variable.user_dimension; ++k) {
+								this->thread_gradient_storage[t][variable.global_index + k] += term_gradient[k];
+							}
+						}
+						else {
+							variable.change_of_variables->update_gradient(
+								&this->thread_gradient_storage[t][variable.global_index],
+								&(*x)[variable.global_index],
+								term_gradient);
+						}
+					}
+					term_gradient += variable.user_dimension;
+				}
+			}
+
+			#ifdef USE_OPENMP
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+	}
+
+	#ifdef USE_OPENMP
+		for (auto itr = evaluation_errors.begin(); itr != evaluation_errors.end(); ++itr) {
+			if ( !(*itr == std::exception_ptr())) {
+				std::rethrow_exception(*itr);
+			}
+		}
+	#endif
+
+	return value;
+}
+
+double Function::evaluate(const Eigen::VectorXd& x) const
+{
+	if (! impl->local_storage_allocated) {
+		impl->allocate_local_storage();
+	}
+
+	// Copy values from the global vector x to the temporary storage
+	// used for evaluating the term.
+	impl->copy_global_to_local(x);
+
+	return impl->evaluate_from_local_storage();
+}
 
-void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H) const
+double Function::evaluate() const
+{
+	if (! impl->local_storage_allocated) {
+		impl->allocate_local_storage();
+	}
+
+	// Copy the user state to the local storage
+	// for evaluation.
+	impl->copy_user_to_local();
+
+	return impl->evaluate_from_local_storage();
+}
+
+void Function::Implementation::compute_constant_hessians() const
 {
 	double start_time = wall_time();
 
-	Implementation::SparseHessianStorage hessian_indices;
-	//std::set<std::pair<int, int>> hessian_indices_set;
-	std::unordered_set<std::pair<int, int>, IntPairHash> hessian_indices_set;
-	impl->number_of_hessian_elements = 0;
+	constant_hessian_index.assign(terms.size(), -1);
+	constant_hessian_terms.clear();
+	constant_dense_hessian_assembled = false;
+	constant_sparse_hessian_assembled = false;
 
-	for (const auto& added_term: impl->terms) {
-		auto& indices = added_term.added_variables_indices;
-		auto& term    = added_term.term;
+	// Without Hessian storage, all terms are evaluated normally.
+	if (interface->hessian_is_enabled && ! thread_hessian_scratch.empty()) {
+		double* gradient = thread_gradient_scratch[0].data();
+		double* hessian  = thread_hessian_scratch[0].data();
+
+		for (int i = 0; i < terms.size(); ++i) {
+			const auto& term = terms[i].term;
+			if (! term->has_constant_hessian()) {
+				continue;
+			}
+			// A change of variables makes the Hessian non-constant.
+			bool has_change_of_variables = false;
+			for (auto ind: terms[i].added_variables_indices) {
+				if (variables[ind].change_of_variables) {
+					has_change_of_variables = true;
+				}
+			}
+			if (has_change_of_variables) {
+				continue;
+			}
+
+			term->evaluate_flat(&terms[i].temp_variables[0], gradient, hessian, false);
+
+			const auto& offsets = terms[i].flat_offsets;
+			int dimension = offsets.back();
+
+			ConstantHessianTerm cache;
+			cache.hessian = Eigen::Map<Eigen::MatrixXd>(hessian, dimension, dimension);
+			cache.g0 = Eigen::Map<Eigen::VectorXd>(gradient, dimension);
+			cache.x0.resize(dimension);
+			for (int var = 0; var < term->number_of_variables(); ++var) {
+				for (int j = offsets[var]; j < offsets[var + 1]; ++j) {
+					cache.x0[j] = terms[i].temp_variables[var][j - offsets[var]];
+				}
+			}
 
-		// Put the hessian into the global hessian.
+			constant_hessian_index[i] = static_cast<int>(constant_hessian_terms.size());
+			constant_hessian_terms.emplace_back(std::move(cache));
+		}
+	}
+
+	constant_hessians_computed = true;
+
+	interface->evaluate_with_hessian_time += wall_time() - start_time;
+}
+
+double Function::Implementation::evaluate_constant_hessian_term(int i, double* gradient) const
+{
+	const auto& cache = constant_hessian_terms[constant_hessian_index[i]];
+	const auto& term = terms[i].term;
+	const auto& offsets = terms[i].flat_offsets;
+	double* const* x = &terms[i].temp_variables[0];
+
+	// g = g0 + H(x - x0).
+	Eigen::Map<Eigen::VectorXd> g(gradient, offsets.back());
+	g = cache.g0;
+	for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+		for (int j = offsets[var1]; j < offsets[var1 + 1]; ++j) {
+			g += cache.hessian.col(j) * (x[var1][j - offsets[var1]] - cache.x0[j]);
+		}
+	}
+
+	return term->evaluate(x);
+}
+
+void Function::Implementation::assemble_constant_dense_hessian() const
+{
+	double start_time = wall_time();
+
+	constant_dense_hessian.setZero(static_cast<int>(this->number_of_scalars),
+	                               static_cast<int>(this->number_of_scalars));
+	for (int i = 0; i < terms.size(); ++i) {
+		if (constant_hessian_index[i] < 0) {
+			continue;
+		}
+		const auto& cache = constant_hessian_terms[constant_hessian_index[i]];
+		const auto& term = terms[i].term;
+		const auto& indices = terms[i].added_variables_indices;
+
+		int offset0 = 0;
 		for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
-			if ( ! impl->variables[indices[var0]].is_constant) {
+			const auto& variable0 = variables[indices[var0]];
+			int dim0 = term->variable_dimension(var0);
+			if ( ! variable0.is_constant) {
+				int offset1 = 0;
+				for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+					const auto& variable1 = variables[indices[var1]];
+					int dim1 = term->variable_dimension(var1);
+					if ( ! variable1.is_constant) {
+						constant_dense_hessian.block(variable0.global_index, variable1.global_index, dim0, dim1)
+							+= cache.hessian.block(offset0, offset1, dim0, dim1);
+					}
+					offset1 += dim1;
+				}
+			}
+			offset0 += dim0;
+		}
+	}
+	constant_dense_hessian_assembled = true;
 
-				size_t global_offset0 = impl->variables[indices[var0]].global_index;
+	interface->allocation_time += wall_time() - start_time;
+}
+
+void Function::Implementation::assemble_constant_sparse_hessian() const
+{
+	double start_time = wall_time();
+
+	constant_sparse_hessian.clear();
+	for (int i = 0; i < terms.size(); ++i) {
+		if (constant_hessian_index[i] < 0) {
+			continue;
+		}
+		const auto& cache = constant_hessian_terms[constant_hessian_index[i]];
+		const auto& term = terms[i].term;
+		const auto& indices = terms[i].added_variables_indices;
+
+		int offset0 = 0;
+		for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+			const auto& variable0 = variables[indices[var0]];
+			int dim0 = term->variable_dimension(var0);
+			if ( ! variable0.is_constant) {
+				int offset1 = 0;
 				for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
-					if ( ! impl->variables[indices[var1]].is_constant) {
-
-						size_t global_offset1 = impl->variables[indices[var1]].global_index;
-						for (size_t i = 0; i < term->variable_dimension(var0); ++i) {
-							for (size_t j = 0; j < term->variable_dimension(var1); ++j) {
-								int global_i = static_cast<int>(i + global_offset0);
-								int global_j = static_cast<int>(j + global_offset1);
-								
-								// Fix for old versions of libstdc++ that do not have
-								// emplace. Remove when continuous integration upgrades.
-								#ifdef __GLIBCXX__
-									#if __GLIBCXX__ <= 20120322
-										hessian_indices_set.insert(std::make_pair(global_i, global_j));
-									#else
-										hessian_indices_set.emplace(global_i, global_j);
-									#endif
-								#else
-									hessian_indices_set.emplace(global_i, global_j);
-								#endif
+					const auto& variable1 = variables[indices[var1]];
+					int dim1 = term->variable_dimension(var1);
+					if ( ! variable1.is_constant) {
+						for (int i0 = 0; i0 < dim0; ++i0) {
+							for (int i1 = 0; i1 < dim1; ++i1) {
+								constant_sparse_hessian.emplace_back(
+									static_cast<int>(variable0.global_index + i0),
+									static_cast<int>(variable1.global_index + i1),
+									cache.hessian(offset0 + i0, offset1 + i1));
 							}
 						}
+					}
+					offset1 += dim1;
+				}
+			}
+			offset0 += dim0;
+		}
+	}
+	constant_sparse_hessian_assembled = true;
+
+	interface->allocation_time += wall_time() - start_time;
+}
+
+void Function::evaluate_many(const Eigen::MatrixXd& X,
+                             Eigen::VectorXd* values,
+                             Eigen::MatrixXd* gradients) const
+{
+	impl->evaluate_many(X, values, gradients);
+}
+
+void Function::Implementation::evaluate_many(const Eigen::MatrixXd& X,
+                                             Eigen::VectorXd* values,
+                                             Eigen::MatrixXd* gradients) const
+{
+	check(X.rows() == this->number_of_scalars,
+	      "Function::evaluate_many: X has the wrong number of rows.");
+	check(term_streams.empty(),
+	      "Function::evaluate_many: Streamed terms are not supported.");
+	const int K = static_cast<int>(X.cols());
+	if (K == 0) {
+		values->resize(0);
+		if (gradients) {
+			gradients->resize(this->number_of_scalars, 0);
+		}
+		return;
+	}
+
+	if (gradients) {
+		interface->evaluations_with_gradient += K;
+	}
+	else {
+		interface->evaluations_without_gradient += K;
+	}
+
+	if (! this->local_storage_allocated) {
+		this->allocate_local_storage();
+	}
 
+	double start_time = wall_time();
+	#ifdef USE_OPENMP
+		int threads_used = this->number_of_threads;
+	#else
+		int threads_used = 1;
+	#endif
+	thread_batch_variables.resize(threads_used);
+	thread_batch_points.resize(threads_used);
+	thread_batch_term_values.resize(threads_used);
+	thread_batch_values.resize(threads_used);
+	if (gradients) {
+		thread_batch_gradient_scratch.resize(threads_used);
+		thread_batch_gradient_storage.resize(threads_used);
+	}
+	for (int t = 0; t < threads_used; ++t) {
+		thread_batch_variables[t].resize(K * max_arity);
+		thread_batch_points[t].resize(K);
+		for (int k = 0; k < K; ++k) {
+			thread_batch_points[t][k] = &thread_batch_variables[t][k * max_arity];
+		}
+		thread_batch_term_values[t].resize(K);
+		thread_batch_values[t].setZero(K);
+
+		if (gradients) {
+			auto& scratch = thread_batch_gradient_scratch[t];
+			if (scratch.size() < K) {
+				scratch.resize(K);
+			}
+			for (auto& point_scratch: scratch) {
+				if (point_scratch.size() < max_arity) {
+					point_scratch.resize(max_arity);
+				}
+				for (auto& var_scratch: point_scratch) {
+					if (var_scratch.size() < max_variable_dimension) {
+						var_scratch.resize(max_variable_dimension);
 					}
 				}
+			}
+			thread_batch_gradient_storage[t].setZero(number_of_scalars + number_of_constants, K);
+		}
+	}
+	interface->allocation_time += wall_time() - start_time;
+
+	this->copy_global_to_batch(X);
+
+	start_time = wall_time();
+
+	// Go through and evaluate each term at all points.
+	// OpenMP requires a signed data type as the loop variable.
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
+
+		#pragma omp parallel for num_threads(this->number_of_threads) if (terms.size() > 1)
+	#endif
+	for (int i = 0; i < terms.size(); ++i) {
+		#ifdef USE_OPENMP
+			// The thread number calling this iteration.
+			int t = omp_get_thread_num();
+			// We need to catch all exceptions before leaving
+			// the loop body.
+			try {
+		#else
+			int t = 0;
+		#endif
+
+		const auto& indices = terms[i].added_variables_indices;
+		auto& batch_variables = thread_batch_variables[t];
+		for (int k = 0; k < K; ++k) {
+			for (size_t var = 0; var < indices.size(); ++var) {
+				const auto& variable = variables[indices[var]];
+				batch_variables[k * max_arity + var] =
+					&variable.batch_temp_space[k * variable.user_dimension];
+			}
+		}
+
+		auto& term_values = thread_batch_term_values[t];
+		if (gradients) {
+			auto& scratch = thread_batch_gradient_scratch[t];
+			terms[i].term->evaluate_many(&thread_batch_points[t][0], K, &term_values[0], &scratch);
+
+			// Put the gradients from the term into the thread's
+			// global gradients.
+			auto& storage = thread_batch_gradient_storage[t];
+			for (size_t var = 0; var < indices.size(); ++var) {
+				const auto& variable = variables[indices[var]];
+				if (variable.is_constant) {
+					continue;
+				}
+				size_t global_offset = variable.global_index;
+				for (int k = 0; k < K; ++k) {
+					if (variable.change_of_variables == nullptr) {
+						for (int j = 0; j < variable.user_dimension; ++j) {
+							storage(global_offset + j, k) += scratch[k][var][j];
+						}
+					}
+					else {
+						variable.change_of_variables->update_gradient(
+							&storage(global_offset, k),
+							&X(global_offset, k),
+							&scratch[k][var][0]);
+					}
+				}
+			}
+		}
+		else {
+			terms[i].term->evaluate_many(&thread_batch_points[t][0], K, &term_values[0]);
+		}
+
+		for (int k = 0; k < K; ++k) {
+			thread_batch_values[t][k] += term_values[k];
+		}
 
+		#ifdef USE_OPENMP
+			// We need to catch all exceptions before leaving
+			// the loop body.
+			}
+			catch (...) {
+				evaluation_errors[t] = std::current_exception();
 			}
+		#endif
+	}
+
+	#ifdef USE_OPENMP
+		// Now that we are outside the OpenMP block, we can
+		// rethrow exceptions.
+		for (auto itr = evaluation_errors.begin(); itr != evaluation_errors.end(); ++itr) {
+			// VS 2010 does not have conversion to bool or
+			// operator !=.
+			if ( !(*itr == std::exception_ptr())) {
+				std::rethrow_exception(*itr);
+			}
+		}
+	#endif
+
+	if (gradients) {
+		interface->evaluate_with_gradient_time += wall_time() - start_time;
+	}
+	else {
+		interface->evaluate_time += wall_time() - start_time;
+	}
+	start_time = wall_time();
+
+	values->setConstant(K, this->constant);
+	for (int t = 0; t < threads_used; ++t) {
+		(*values) += thread_batch_values[t];
+	}
+
+	if (gradients) {
+		gradients->setZero(this->number_of_scalars, K);
+		for (int t = 0; t < threads_used; ++t) {
+			(*gradients) += thread_batch_gradient_storage[t].topRows(this->number_of_scalars);
 		}
+		interface->write_gradient_hessian_time += wall_time() - start_time;
+	}
+}
 
+void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H,
+                                     HessianStorage storage) const
+{
+	double start_time = wall_time();
+
+	auto constant_variables = impl->constant_variables();
+	for (const auto& cached: impl->sparsity_patterns) {
+		if (cached.storage == storage && cached.constant_variables == constant_variables) {
+			*H = cached.pattern;
+			impl->number_of_hessian_elements = cached.pattern.nonZeros();
+			this->allocation_time += wall_time() - start_time;
+			return;
+		}
 	}
 
-	hessian_indices.reserve(hessian_indices_set.size());
-	for (const auto& ij: hessian_indices_set) {
-		hessian_indices.emplace_back(ij.first, ij.second, 1.0);
+	// The number of terms contributing to each element.
+	std::unordered_map<std::pair<int, int>, int, IntPairHash> hessian_indices_map;
+	impl->number_of_hessian_elements = 0;
+
+	for (const auto& added_term: impl->terms) {
+		impl->for_each_hessian_element(added_term, storage, [&](int global_i, int global_j)
+		{
+			hessian_indices_map[std::make_pair(global_i, global_j)]++;
+		});
+	}
+
+	Implementation::SparseHessianStorage hessian_indices;
+	hessian_indices.reserve(hessian_indices_map.size());
+	for (const auto& ij: hessian_indices_map) {
+		hessian_indices.emplace_back(ij.first.first, ij.first.second, ij.second);
 	}
 
 	impl->number_of_hessian_elements = hessian_indices.size();
@@ -712,10 +1937,235 @@ void Function::create_sparse_hessian(Eigen::SparseMatrix<double>* H) const
 	H->resize(n, n);
 	H->setFromTriplets(hessian_indices.begin(), hessian_indices.end());
 	H->makeCompressed();
+	std::vector<int> term_counts(H->valuePtr(), H->valuePtr() + H->nonZeros());
+	std::fill(H->valuePtr(), H->valuePtr() + H->nonZeros(), 1.0);
+
+	if (impl->sparsity_patterns.size() >= Implementation::max_cached_sparsity_patterns) {
+		impl->sparsity_patterns.erase(impl->sparsity_patterns.begin());
+	}
+	impl->sparsity_patterns.push_back({std::move(constant_variables), storage, *H, std::move(term_counts)});
 
 	this->allocation_time += wall_time() - start_time;
 }
 
+template<typename Callback>
+void Function::Implementation::for_each_hessian_element(const AddedTerm& added_term,
+                                                        HessianStorage storage,
+                                                        Callback f) const
+{
+	auto& indices = added_term.added_variables_indices;
+	auto& term    = added_term.term;
+
+	for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+		if (variables[indices[var0]].is_constant) {
+			continue;
+		}
+		size_t global_offset0 = variables[indices[var0]].global_index;
+		for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
+			if (variables[indices[var1]].is_constant) {
+				continue;
+			}
+			size_t global_offset1 = variables[indices[var1]].global_index;
+			for (size_t i = 0; i < term->variable_dimension(var0); ++i) {
+				for (size_t j = 0; j < term->variable_dimension(var1); ++j) {
+					int global_i = static_cast<int>(i + global_offset0);
+					int global_j = static_cast<int>(j + global_offset1);
+					if (storage == HessianStorage::LOWER && global_i < global_j) {
+						continue;
+					}
+					f(global_i, global_j);
+				}
+			}
+		}
+	}
+}
+
+void Function::Implementation::update_sparsity_patterns(const AddedTerm& added_term, int change) const
+{
+	if (sparsity_patterns.empty()) {
+		return;
+	}
+
+	auto constant = constant_variables();
+	for (auto itr = sparsity_patterns.begin(); itr != sparsity_patterns.end();) {
+		if (itr->constant_variables != constant) {
+			itr = sparsity_patterns.erase(itr);
+			continue;
+		}
+
+		auto& pattern = itr->pattern;
+		auto& term_counts = itr->term_counts;
+		const int* outer = pattern.outerIndexPtr();
+		const int* inner = pattern.innerIndexPtr();
+
+		// Elements that are new or no longer used by any term require
+		// the pattern to be created again from its elements.
+		bool changed = false;
+		SparseHessianStorage new_elements;
+		for_each_hessian_element(added_term, itr->storage, [&](int i, int j)
+		{
+			auto element = std::lower_bound(inner + outer[j], inner + outer[j + 1], i);
+			if (element != inner + outer[j + 1] && *element == i) {
+				auto& count = term_counts[element - inner];
+				count += change;
+				changed = changed || count == 0;
+			}
+			else {
+				spii_assert(change > 0);
+				new_elements.emplace_back(i, j, change);
+			}
+		});
+
+		if (changed || ! new_elements.empty()) {
+			for (int j = 0; j < pattern.outerSize(); ++j) {
+				for (int k = outer[j]; k < outer[j + 1]; ++k) {
+					if (term_counts[k] > 0) {
+						new_elements.emplace_back(inner[k], j, term_counts[k]);
+					}
+				}
+			}
+			pattern.setFromTriplets(new_elements.begin(), new_elements.end());
+			pattern.makeCompressed();
+			term_counts.assign(pattern.valuePtr(), pattern.valuePtr() + pattern.nonZeros());
+			std::fill(pattern.valuePtr(), pattern.valuePtr() + pattern.nonZeros(), 1.0);
+		}
+		++itr;
+	}
+}
+
+void Function::Implementation::compute_change_of_variables_derivatives(const Eigen::VectorXd& x) const
+{
+	double start_time = wall_time();
+
+	bool has_change_of_variables = false;
+	for (const auto& var: variables) {
+		if (var.is_constant || ! var.change_of_variables) {
+			continue;
+		}
+		has_change_of_variables = true;
+
+		spii_assert(var.user_dimension == var.solver_dimension,
+		            "Change of variables with different dimensions not supported for Hessians");
+		const int n = var.solver_dimension;
+		if (var.change_of_variables->is_elementwise()) {
+			var.change_jacobian.resize(n);
+			var.change_hessians.resize(n);
+		}
+		else {
+			var.change_jacobian.resize(n * n);
+			var.change_hessians.resize(n * n * n);
+		}
+	}
+	if ( ! has_change_of_variables) {
+		return;
+	}
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(this->number_of_threads) if (variables.size() > 1000)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		const auto& var = variables[i];
+		if (var.is_constant || ! var.change_of_variables) {
+			continue;
+		}
+		var.change_of_variables->derivatives(&var.change_jacobian[0],
+		                                     &var.change_hessians[0],
+		                                     &x[var.global_index]);
+	}
+
+	interface->evaluate_with_hessian_time += wall_time() - start_time;
+}
+
+void Function::Implementation::change_term_variables(int i,
+                                                     const std::vector<int>& offsets,
+                                                     double* gradient,
+                                                     double* hessian,
+                                                     bool lower) const
+{
+	const auto& indices = terms[i].added_variables_indices;
+	const int number_of_variables = static_cast<int>(indices.size());
+
+	bool has_change_of_variables = false;
+	for (auto ind: indices) {
+		if ( ! variables[ind].is_constant && variables[ind].change_of_variables) {
+			has_change_of_variables = true;
+		}
+	}
+	if ( ! has_change_of_variables) {
+		return;
+	}
+
+	const int dimension = offsets.back();
+	Eigen::Map<Eigen::MatrixXd> H(hessian, dimension, dimension);
+
+	// The Hessian with respect to t is
+	//
+	//    J0ᵀ H01 J1 + δ01 Σ_k g_k ∇²x_k(t),
+	//
+	// where J is the Jacobian of x(t) and g the gradient with
+	// respect to x.
+	for (int var0 = 0; var0 < number_of_variables; ++var0) {
+		const auto& variable0 = variables[indices[var0]];
+		if (variable0.is_constant) {
+			continue;
+		}
+		const int dim0 = variable0.user_dimension;
+
+		for (int var1 = lower ? var0 : 0; var1 < number_of_variables; ++var1) {
+			const auto& variable1 = variables[indices[var1]];
+			if (variable1.is_constant) {
+				continue;
+			}
+			const int dim1 = variable1.user_dimension;
+			auto block = H.block(offsets[var0], offsets[var1], dim0, dim1);
+
+			if (variable0.change_of_variables) {
+				if (variable0.change_of_variables->is_elementwise()) {
+					block.array().colwise() *= Eigen::Map<const Eigen::ArrayXd>(&variable0.change_jacobian[0], dim0);
+				}
+				else {
+					Eigen::Map<const Eigen::MatrixXd> J0(&variable0.change_jacobian[0], dim0, dim0);
+					block = (J0.transpose() * block).eval();
+				}
+			}
+
+			if (variable1.change_of_variables) {
+				if (variable1.change_of_variables->is_elementwise()) {
+					block.array().rowwise() *= Eigen::Map<const Eigen::ArrayXd>(&variable1.change_jacobian[0], dim1).transpose();
+				}
+				else {
+					Eigen::Map<const Eigen::MatrixXd> J1(&variable1.change_jacobian[0], dim1, dim1);
+					block = (block * J1).eval();
+				}
+			}
+		}
+	}
+
+	for (int var = 0; var < number_of_variables; ++var) {
+		const auto& variable = variables[indices[var]];
+		if (variable.is_constant || ! variable.change_of_variables) {
+			continue;
+		}
+		const int dim = variable.user_dimension;
+		Eigen::Map<Eigen::VectorXd> g(gradient + offsets[var], dim);
+		auto block = H.block(offsets[var], offsets[var], dim, dim);
+
+		if (variable.change_of_variables->is_elementwise()) {
+			Eigen::Map<const Eigen::ArrayXd> dx(&variable.change_jacobian[0], dim);
+			Eigen::Map<const Eigen::ArrayXd> d2x(&variable.change_hessians[0], dim);
+			block.diagonal().array() += g.array() * d2x;
+			g.array() *= dx;
+		}
+		else {
+			for (int k = 0; k < dim; ++k) {
+				block += g[k] * Eigen::Map<const Eigen::MatrixXd>(&variable.change_hessians[dim * dim * k], dim, dim);
+			}
+			Eigen::Map<const Eigen::MatrixXd> J(&variable.change_jacobian[0], dim, dim);
+			g = (J.transpose() * g).eval();
+		}
+	}
+}
+
 void Function::Implementation::copy_global_to_local(const Eigen::VectorXd& x) const
 {
 	double start_time = wall_time();
@@ -751,6 +2201,44 @@ void Function::Implementation::copy_global_to_local(const Eigen::VectorXd& x) co
 	interface->copy_time += wall_time() - start_time;
 }
 
+void Function::Implementation::copy_global_to_batch(const Eigen::MatrixXd& X) const
+{
+	double start_time = wall_time();
+	const int K = static_cast<int>(X.cols());
+
+	#ifdef USE_OPENMP
+		#pragma omp parallel for num_threads(this->number_of_threads) if (variables.size() > 1000)
+	#endif
+	for (std::ptrdiff_t i = 0; i < std::ptrdiff_t(variables.size()); ++i) {
+		const auto& var = variables[i];
+		var.batch_temp_space.resize(K * var.user_dimension);
+
+		for (int k = 0; k < K; ++k) {
+			double* temp_space = &var.batch_temp_space[k * var.user_dimension];
+			if ( ! var.is_constant) {
+				if (var.change_of_variables == nullptr) {
+					for (int i = 0; i < var.user_dimension; ++i) {
+						temp_space[i] = X(var.global_index + i, k);
+					}
+				}
+				else {
+					var.change_of_variables->t_to_x(
+						temp_space,
+						&X(var.global_index, k));
+				}
+			}
+			else {
+				// Constants are not present in X.
+				for (int i = 0; i < var.user_dimension; ++i) {
+					temp_space[i] = var.user_data[i];
+				}
+			}
+		}
+	}
+
+	interface->copy_time += wall_time() - start_time;
+}
+
 void Function::copy_user_to_global(Eigen::VectorXd* x) const
 {
 	impl->copy_user_to_global(x);
@@ -840,19 +2328,24 @@ double Function::evaluate(const Eigen::VectorXd& x,
 
 double Function::evaluate(const Eigen::VectorXd& x,
                           Eigen::VectorXd* gradient,
-						  Eigen::MatrixXd* hessian) const
+						  Eigen::MatrixXd* hessian,
+                          HessianStorage storage) const
 {
-	return impl->evaluate(x, gradient, hessian);
+	return impl->evaluate(x, gradient, hessian, storage);
 }
 
 double Function::Implementation::evaluate(const Eigen::VectorXd& x,
                                           Eigen::VectorXd* gradient,
-						                  Eigen::MatrixXd* hessian) const
+						                  Eigen::MatrixXd* hessian,
+                                          HessianStorage storage) const
 {
+	const bool lower = storage == HessianStorage::LOWER;
 	interface->evaluations_with_gradient++;
 
 	spii_assert(!hessian || interface->hessian_is_enabled,
 	            "Function::evaluate: Hessian computation is not enabled.");
+	check(hessian == nullptr || term_streams.empty(),
+	      "Function::evaluate: Hessians are not supported for streamed terms.");
 
 	if (! this->local_storage_allocated) {
 		this->allocate_local_storage();
@@ -877,6 +2370,16 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	// used for evaluating the term.
 	this->copy_global_to_local(x);
 
+	if (! this->constant_hessians_computed) {
+		this->compute_constant_hessians();
+	}
+	if (hessian && ! this->constant_dense_hessian_assembled) {
+		this->assemble_constant_dense_hessian();
+	}
+	if (hessian) {
+		this->compute_change_of_variables_derivatives(x);
+	}
+
 	start_time = wall_time();
 
 	// Initialize each thread's global gradient.
@@ -884,107 +2387,164 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		this->thread_gradient_storage[t].setZero();
 	}
 
-	double value = this->constant;
-
-	// Go through and evaluate each term.
-	// OpenMP requires a signed data type as the loop variable.
-	#ifdef USE_OPENMP
-		// Each thread needs to store a specific error.
-		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
-
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads)
-	#endif
-	for (int i = 0; i < terms.size(); ++i) {
-		#ifdef USE_OPENMP
-			// The thread number calling this iteration.
-			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
-		#else
-			int t = 0;
-		#endif
-
-		if (hessian) {
-			// Evaluate the term and put its gradient and hessian
-			// into local storage.
-			value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-											 &this->thread_gradient_scratch[t],
-											 &this->thread_hessian_scratch[t]);
-
-
-			const auto& term = terms[i].term;
-			const auto& indices = terms[i].added_variables_indices;
-			// Put the hessian into the global hessian.
-			for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
-
-				if ( ! variables[indices[var0]].is_constant) {
-					spii_assert(!variables[indices[var0]].change_of_variables,
-					            "Change of variables not supported for Hessians");
-
-					size_t global_offset0 = variables[indices[var0]].global_index;
-					for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
-						size_t global_offset1 = variables[indices[var1]].global_index;
+	double value = this->constant;
 
-						if ( ! variables[indices[var1]].is_constant) {
+	const bool profile = interface->term_profiling_enabled;
+	std::vector<double> loop_time;
+	if (profile) {
+		this->prepare_term_profile();
+		loop_time.resize(this->number_of_threads);
+	}
+	Trace* trace = Trace::active();
+	// Go through and evaluate each term.
+	// OpenMP requires a signed data type as the loop variable.
+	#ifdef USE_OPENMP
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-							const Eigen::MatrixXd& part_hessian = this->thread_hessian_scratch[t][var0][var1];
-							for (int i = 0; i < term->variable_dimension(var0); ++i) {
-								for (int j = 0; j < term->variable_dimension(var1); ++j) {
-									thread_dense_hessian_storage[t]
-										.coeffRef(i + global_offset0, j + global_offset1)
-									+= part_hessian(i, j);
+		#pragma omp parallel num_threads(this->number_of_threads)
+	#endif
+	{
+		// Each thread records its part of the loop when a trace is active.
+		#ifdef USE_OPENMP
+			TraceSpan terms_span(trace, "terms", "function", -1, omp_get_thread_num());
+			ScopedTimer loop_timer(profile ? &loop_time[omp_get_thread_num()] : nullptr);
+			#pragma omp for reduction(+ : value) nowait
+		#else
+			TraceSpan terms_span(trace, "terms", "function");
+			ScopedTimer loop_timer(profile ? &loop_time[0] : nullptr);
+		#endif
+		for (int i = 0; i < terms.size(); ++i) {
+			#ifdef USE_OPENMP
+				// The thread number calling this iteration.
+				int t = omp_get_thread_num();
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#else
+				int t = 0;
+			#endif
+			const double term_start_time = profile ? wall_time() : 0.0;
+
+			// Terms with constant Hessians write all variables to the
+			// gradient; other terms only the active ones.
+			const bool constant_hessian = constant_hessian_index[i] >= 0;
+			const auto& offsets = constant_hessian ? terms[i].flat_offsets : terms[i].active_offsets;
+			double* term_gradient = this->thread_gradient_scratch[t].data();
+
+			if (constant_hessian) {
+				// The Hessian of this term is already part of the
+				// constant global Hessian.
+				value += this->evaluate_constant_hessian_term(i, term_gradient);
+			}
+			else if (hessian) {
+				// Evaluate the term and put its gradient and hessian
+				// into local storage.
+				double* term_hessian = this->thread_hessian_scratch[t].data();
+				value += terms[i].term->evaluate_flat_active(&terms[i].temp_variables[0],
+				                                             terms[i].active,
+				                                             term_gradient,
+				                                             term_hessian,
+				                                             lower);
+				this->change_term_variables(i, offsets, term_gradient, term_hessian, lower);
+
+				const auto& term = terms[i].term;
+				const auto& indices = terms[i].added_variables_indices;
+				const int dimension = offsets.back();
+				// Put the hessian into the global hessian.
+				for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
+
+					if ( ! variables[indices[var0]].is_constant) {
+						size_t global_offset0 = variables[indices[var0]].global_index;
+						int dim0 = variables[indices[var0]].user_dimension;
+						for (int var1 = lower ? var0 : 0; var1 < term->number_of_variables(); ++var1) {
+							size_t global_offset1 = variables[indices[var1]].global_index;
+
+							if ( ! variables[indices[var1]].is_constant) {
+
+								int dim1 = variables[indices[var1]].user_dimension;
+								for (int j = 0; j < dim1; ++j) {
+									const double* column = &term_hessian[offsets[var0] + dimension * (offsets[var1] + j)];
+									for (int i = 0; i < dim0; ++i) {
+										if (lower) {
+											int global_i = static_cast<int>(i + global_offset0);
+											int global_j = static_cast<int>(j + global_offset1);
+											double factor = to_lower_triangle(var0, var1, &global_i, &global_j);
+											if (factor != 0.0) {
+												thread_dense_hessian_storage[t].coeffRef(global_i, global_j)
+													+= factor * column[i];
+											}
+										}
+										else {
+											thread_dense_hessian_storage[t]
+												.coeffRef(i + global_offset0, j + global_offset1)
+											+= column[i];
+										}
+									}
 								}
-							}
 
+							}
 						}
 					}
 				}
-			}
 
 
-		}
-		else {
-			// Evaluate the term and put its gradient into local
-			// storage.
-			value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-											 &this->thread_gradient_scratch[t]);
-		}
-
-		// Put the gradient from the term into the thread's global gradient.
-		const auto& indices = terms[i].added_variables_indices;
-		for (int var = 0; var < indices.size(); ++var) {
+			}
+			else {
+				// Evaluate the term and put its gradient into local
+				// storage.
+				value += terms[i].term->evaluate_flat_active(&terms[i].temp_variables[0],
+				                                             terms[i].active,
+				                                             term_gradient,
+				                                             nullptr,
+				                                             false);
+			}
 
-			if ( ! variables[indices[var]].is_constant) {
-				if (variables[indices[var]].change_of_variables == nullptr) {
-					// No change of variables, just copy the gradient.
-					size_t global_offset = variables[indices[var]].global_index;
-					for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
-						this->thread_gradient_storage[t][global_offset + i] +=
-							this->thread_gradient_scratch[t][var][i];
+			// Put the gradient from the term into the thread's global gradient.
+			const auto& indices = terms[i].added_variables_indices;
+			for (int var = 0; var < indices.size(); ++var) {
+
+				if ( ! variables[indices[var]].is_constant) {
+					if (variables[indices[var]].change_of_variables == nullptr || hessian) {
+						// No change of variables (or the gradient is already
+						// transformed together with the Hessian), just copy
+						// the gradient.
+						size_t global_offset = variables[indices[var]].global_index;
+						for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+							this->thread_gradient_storage[t][global_offset + i] +=
+								term_gradient[offsets[var] + i];
+						}
 					}
-				}
-				else {
-					// Transform the gradient from user space to solver space.
-					size_t global_offset = variables[indices[var]].global_index;
-					if (global_offset < this->number_of_scalars) {
-						variables[indices[var]].change_of_variables->update_gradient(
-							&this->thread_gradient_storage[t][global_offset],
-							&x[global_offset],
-							&this->thread_gradient_scratch[t][var][0]);
+					else {
+						// Transform the gradient from user space to solver space.
+						size_t global_offset = variables[indices[var]].global_index;
+						if (global_offset < this->number_of_scalars) {
+							variables[indices[var]].change_of_variables->update_gradient(
+								&this->thread_gradient_storage[t][global_offset],
+								&x[global_offset],
+								&term_gradient[offsets[var]]);
+						}
 					}
 				}
 			}
-		}
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+			if (profile) {
+				this->record_term_time(t, i, hessian && ! constant_hessian ? HESSIAN_EVALUATION : GRADIENT_EVALUATION, wall_time() - term_start_time);
 			}
-		#endif
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+	}
+
+	if (profile) {
+		this->record_term_loop(loop_time);
 	}
 
 	#ifdef USE_OPENMP
@@ -999,8 +2559,18 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		}
 	#endif
 
-	interface->evaluate_with_hessian_time += wall_time() - start_time;
+	if ( ! term_streams.empty()) {
+		value += this->evaluate_term_streams(&x);
+	}
+
+	if (hessian) {
+		interface->evaluate_with_hessian_time += wall_time() - start_time;
+	}
+	else {
+		interface->evaluate_with_gradient_time += wall_time() - start_time;
+	}
 	start_time = wall_time();
+	TraceSpan assemble_span(trace, "assemble", "function");
 
 	// Create the global gradient.
 	if (gradient->size() != this->number_of_scalars) {
@@ -1016,32 +2586,42 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		// Create the global (dense) hessian.
 		hessian->resize( static_cast<int>(this->number_of_scalars),
 						 static_cast<int>(this->number_of_scalars));
-		hessian->setZero();
+		if (lower) {
+			*hessian = this->constant_dense_hessian.triangularView<Eigen::Lower>();
+		}
+		else {
+			*hessian = this->constant_dense_hessian;
+		}
 		for (int t = 0; t < this->number_of_threads; ++t) {
 			(*hessian) += this->thread_dense_hessian_storage[t];
 		}
 	}
 
 	interface->write_gradient_hessian_time += wall_time() - start_time;
+	this->record_memory_usage(false);
 	return value;
 }
 
 double Function::evaluate(const Eigen::VectorXd& x,
                           Eigen::VectorXd* gradient,
-						  Eigen::SparseMatrix<double>* hessian) const
+						  Eigen::SparseMatrix<double>* hessian,
+                          HessianStorage storage) const
 {
-	return impl->evaluate(x, gradient, hessian);
+	return impl->evaluate(x, gradient, hessian, storage);
 }
 
 double Function::Implementation::evaluate(const Eigen::VectorXd& x,
                                           Eigen::VectorXd* gradient,
-						                  Eigen::SparseMatrix<double>* hessian) const
+						                  Eigen::SparseMatrix<double>* hessian,
+                                          HessianStorage storage) const
 {
+	const bool lower = storage == HessianStorage::LOWER;
 	interface->evaluations_with_gradient++;
 
 	spii_assert(hessian);
 	spii_assert(interface->hessian_is_enabled,
 	            "Function::evaluate: Hessian computation is not enabled.");
+	check(term_streams.empty(), "Function::evaluate: Hessians are not supported for streamed terms.");
 
 	if (! this->local_storage_allocated) {
 		this->allocate_local_storage();
@@ -1054,8 +2634,14 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 		thread_sparse_hessian_storage.resize(1);
 	#endif
 	for (int t = 0; t < this->number_of_threads; ++t) {
-		// TODO: Most likely too much space per thread here.
-		thread_sparse_hessian_storage[t].reserve(this->number_of_hessian_elements);
+		// Each thread gets its share of the elements. The elements
+		// of all threads are later moved to the storage of the first
+		// thread. The capacities from earlier evaluations are kept.
+		auto elements = this->number_of_hessian_elements;
+		if (t > 0) {
+			elements /= this->number_of_threads;
+		}
+		thread_sparse_hessian_storage[t].reserve(elements);
 		thread_sparse_hessian_storage[t].clear();
 	}
 	this->number_of_hessian_elements = 0;
@@ -1066,6 +2652,14 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	// used for evaluating the term.
 	this->copy_global_to_local(x);
 
+	if (! this->constant_hessians_computed) {
+		this->compute_constant_hessians();
+	}
+	if (! this->constant_sparse_hessian_assembled) {
+		this->assemble_constant_sparse_hessian();
+	}
+	this->compute_change_of_variables_derivatives(x);
+
 	start_time = wall_time();
 
 	interface->write_gradient_hessian_time += wall_time() - start_time;
@@ -1077,82 +2671,132 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 	}
 
 	double value = this->constant;
+	const bool profile = interface->term_profiling_enabled;
+	std::vector<double> loop_time;
+	if (profile) {
+		this->prepare_term_profile();
+		loop_time.resize(this->number_of_threads);
+	}
+	Trace* trace = Trace::active();
 	// Go through and evaluate each term.
 	// OpenMP requires a signed data type as the loop variable.
 	#ifdef USE_OPENMP
 		// Each thread needs to store a specific error.
 		std::vector<std::exception_ptr> evaluation_errors(this->number_of_threads);
 
-		#pragma omp parallel for reduction(+ : value) num_threads(this->number_of_threads)
+		#pragma omp parallel num_threads(this->number_of_threads)
 	#endif
-	for (int i = 0; i < terms.size(); ++i) {
+	{
+		// Each thread records its part of the loop when a trace is active.
 		#ifdef USE_OPENMP
-			// The thread number calling this iteration.
-			int t = omp_get_thread_num();
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			try {
+			TraceSpan terms_span(trace, "terms", "function", -1, omp_get_thread_num());
+			ScopedTimer loop_timer(profile ? &loop_time[omp_get_thread_num()] : nullptr);
+			#pragma omp for reduction(+ : value) nowait
 		#else
-			int t = 0;
+			TraceSpan terms_span(trace, "terms", "function");
+			ScopedTimer loop_timer(profile ? &loop_time[0] : nullptr);
 		#endif
+		for (int i = 0; i < terms.size(); ++i) {
+			#ifdef USE_OPENMP
+				// The thread number calling this iteration.
+				int t = omp_get_thread_num();
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				try {
+			#else
+				int t = 0;
+			#endif
+			const double term_start_time = profile ? wall_time() : 0.0;
+
+			// Whether the Hessian of this term is already part of the
+			// constant global Hessian.
+			bool constant_hessian = constant_hessian_index[i] >= 0;
+
+			// Terms with constant Hessians write all variables to the
+			// gradient; other terms only the active ones.
+			const auto& offsets = constant_hessian ? terms[i].flat_offsets : terms[i].active_offsets;
+			const int dimension = offsets.back();
+			double* term_gradient = this->thread_gradient_scratch[t].data();
+			double* term_hessian = this->thread_hessian_scratch[t].data();
+
+			if (constant_hessian) {
+				value += this->evaluate_constant_hessian_term(i, term_gradient);
+			}
+			else {
+				// Evaluate the term and put its gradient and hessian (only
+				// the upper blocks if lower) into local storage.
+				value += terms[i].term->evaluate_flat_active(&terms[i].temp_variables[0],
+				                                             terms[i].active,
+				                                             term_gradient,
+				                                             term_hessian,
+				                                             lower);
+				this->change_term_variables(i, offsets, term_gradient, term_hessian, lower);
+			}
 
-		// Evaluate the term and put its gradient and hessian
-		// into local storage.
-		value += terms[i].term->evaluate(&terms[i].temp_variables[0],
-		                                 &this->thread_gradient_scratch[t],
-		                                 &this->thread_hessian_scratch[t]);
-
-		// Put the gradient from the term into the thread's global gradient.
-		const auto& indices = terms[i].added_variables_indices;
-		for (int var = 0; var < indices.size(); ++var) {
-
-			if ( ! variables[indices[var]].is_constant) {
-				spii_assert(!variables[indices[var]].change_of_variables,
-				            "Change of variables not supported for sparse Hessian");
+			// Put the gradient from the term into the thread's global gradient.
+			const auto& indices = terms[i].added_variables_indices;
+			for (int var = 0; var < indices.size(); ++var) {
 
-				size_t global_offset = variables[indices[var]].global_index;
-				for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
-					this->thread_gradient_storage[t][global_offset + i] +=
-						this->thread_gradient_scratch[t][var][i];
+				if ( ! variables[indices[var]].is_constant) {
+					size_t global_offset = variables[indices[var]].global_index;
+					for (int i = 0; i < variables[indices[var]].user_dimension; ++i) {
+						this->thread_gradient_storage[t][global_offset + i] +=
+							term_gradient[offsets[var] + i];
+					}
 				}
 			}
-		}
 
-		// Put the hessian from the term into the thread's global hessian.
-		const auto& term = terms[i].term;
-		for (int var0 = 0; var0 < term->number_of_variables(); ++var0) {
-			if ( ! variables[indices[var0]].is_constant) {
+			// Put the hessian from the term into the thread's global hessian.
+			const auto& term = terms[i].term;
+			for (int var0 = 0; var0 < term->number_of_variables() && ! constant_hessian; ++var0) {
+				if ( ! variables[indices[var0]].is_constant) {
 
-				size_t global_offset0 = variables[indices[var0]].global_index;
-				for (int var1 = 0; var1 < term->number_of_variables(); ++var1) {
-					if ( ! variables[indices[var1]].is_constant) {
-
-						size_t global_offset1 = variables[indices[var1]].global_index;
-						const Eigen::MatrixXd& part_hessian = this->thread_hessian_scratch[t][var0][var1];
-						for (int i = 0; i < term->variable_dimension(var0); ++i) {
-							for (int j = 0; j < term->variable_dimension(var1); ++j) {
-
-								int global_i = static_cast<int>(i + global_offset0);
-								int global_j = static_cast<int>(j + global_offset1);
-								thread_sparse_hessian_storage[t].push_back(Eigen::Triplet<double>(global_i,
-								                                                                  global_j,
-								                                                                  part_hessian(i, j)));
+					size_t global_offset0 = variables[indices[var0]].global_index;
+					for (int var1 = lower ? var0 : 0; var1 < term->number_of_variables(); ++var1) {
+						if ( ! variables[indices[var1]].is_constant) {
+
+							size_t global_offset1 = variables[indices[var1]].global_index;
+							for (int j = 0; j < variables[indices[var1]].user_dimension; ++j) {
+								const double* column = &term_hessian[offsets[var0] + dimension * (offsets[var1] + j)];
+								for (int i = 0; i < variables[indices[var0]].user_dimension; ++i) {
+
+									int global_i = static_cast<int>(i + global_offset0);
+									int global_j = static_cast<int>(j + global_offset1);
+									double factor = 1.0;
+									if (lower) {
+										factor = to_lower_triangle(var0, var1, &global_i, &global_j);
+										if (factor == 0.0) {
+											continue;
+										}
+									}
+									thread_sparse_hessian_storage[t].push_back(Eigen::Triplet<double>(global_i,
+									                                                                  global_j,
+									                                                                  factor * column[i]));
+								}
 							}
 						}
-					}
 
+					}
 				}
 			}
-		}
 
-		#ifdef USE_OPENMP
-			// We need to catch all exceptions before leaving
-			// the loop body.
-			}
-			catch (...) {
-				evaluation_errors[t] = std::current_exception();
+			if (profile) {
+				this->record_term_time(t, i, constant_hessian ? GRADIENT_EVALUATION : HESSIAN_EVALUATION, wall_time() - term_start_time);
 			}
-		#endif
+
+			#ifdef USE_OPENMP
+				// We need to catch all exceptions before leaving
+				// the loop body.
+				}
+				catch (...) {
+					evaluation_errors[t] = std::current_exception();
+				}
+			#endif
+		}
+	}
+
+	if (profile) {
+		this->record_term_loop(loop_time);
 	}
 
 	#ifdef USE_OPENMP
@@ -1169,6 +2813,7 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 
 	interface->evaluate_with_hessian_time += wall_time() - start_time;
 	start_time = wall_time();
+	TraceSpan assemble_span(trace, "assemble", "function");
 
 	// Create the global gradient.
 	if (gradient->size() != this->number_of_scalars) {
@@ -1185,12 +2830,18 @@ double Function::Implementation::evaluate(const Eigen::VectorXd& x,
 			thread_sparse_hessian_storage[0].emplace_back(triple);
 		}
 	}
+	for (const auto& triple: constant_sparse_hessian) {
+		if ( ! lower || triple.row() >= triple.col()) {
+			thread_sparse_hessian_storage[0].emplace_back(triple);
+		}
+	}
 
 	hessian->setFromTriplets(thread_sparse_hessian_storage[0].begin(),
 	                         thread_sparse_hessian_storage[0].end());
 	//hessian->makeCompressed();
 
 	interface->write_gradient_hessian_time += wall_time() - start_time;
+	this->record_memory_usage(false);
 
 	return value;
 }
@@ -1209,6 +2860,8 @@ Interval<double>  Function::Implementation::evaluate(const std::vector<Interval<
 	this->copy_user_to_local();
 
 	spii_assert(x.size() == this->number_of_scalars);
+	check(term_streams.empty(),
+	      "Function::evaluate: Streamed terms are not supported for intervals.");
 
 	interface->evaluations_without_gradient++;
 	double start_time = wall_time();
@@ -1425,4 +3078,559 @@ void Function::read_from_stream(std::istream& in, std::vector<double>* user_spac
 	#undef read_and_check
 }
 
-}  // namespace spii
\ No newline at end of file
+namespace
+{
+	const char binary_magic[8] = {'s', 'p', 'i', 'i', '-', 'b', 'i', 'n'};
+	const std::uint32_t binary_version = 1;
+
+	bool is_little_endian()
+	{
+		const std::uint16_t one = 1;
+		unsigned char first_byte;
+		std::memcpy(&first_byte, &one, 1);
+		return first_byte == 1;
+	}
+
+	// Converts between host and little-endian byte order.
+	template<typename T>
+	T little_endian(T value)
+	{
+		if ( ! is_little_endian()) {
+			unsigned char bytes[sizeof(T)];
+			std::memcpy(bytes, &value, sizeof(T));
+			std::reverse(bytes, bytes + sizeof(T));
+			std::memcpy(&value, bytes, sizeof(T));
+		}
+		return value;
+	}
+
+	// Writes the binary format. All sections start at multiples
+	// of 8 bytes.
+	class BinaryWriter
+	{
+	public:
+		BinaryWriter(std::ostream& out_)
+			: out(out_), position(0)
+		{ }
+
+		template<typename T>
+		void write(T value)
+		{
+			value = little_endian(value);
+			write_bytes(&value, sizeof(T));
+		}
+
+		template<typename T>
+		void write_array(const T* values, std::size_t n)
+		{
+			if (is_little_endian()) {
+				write_bytes(values, n * sizeof(T));
+			}
+			else {
+				for (std::size_t i = 0; i < n; ++i) {
+					write(values[i]);
+				}
+			}
+			align();
+		}
+
+		void write_string(const std::string& str)
+		{
+			write<std::uint64_t>(str.size());
+			write_array(str.data(), str.size());
+		}
+
+		void align()
+		{
+			const char zeros[8] = {0};
+			write_bytes(zeros, (8 - position % 8) % 8);
+		}
+
+	private:
+		void write_bytes(const void* bytes, std::size_t size)
+		{
+			out.write(static_cast<const char*>(bytes), size);
+			position += size;
+		}
+
+		std::ostream& out;
+		std::size_t position;
+	};
+
+	class BinaryReader
+	{
+	public:
+		BinaryReader(const char* data_, std::size_t size_)
+			: data(data_), size(size_), position(0)
+		{ }
+
+		template<typename T>
+		T read()
+		{
+			T value;
+			std::memcpy(&value, read_bytes(sizeof(T)), sizeof(T));
+			return little_endian(value);
+		}
+
+		template<typename T>
+		void read_array(T* values, std::size_t n)
+		{
+			check_remaining(n, sizeof(T));
+			const char* bytes = read_bytes(n * sizeof(T));
+			if (is_little_endian()) {
+				std::memcpy(values, bytes, n * sizeof(T));
+			}
+			else {
+				for (std::size_t i = 0; i < n; ++i) {
+					std::memcpy(&values[i], bytes + i * sizeof(T), sizeof(T));
+					values[i] = little_endian(values[i]);
+				}
+			}
+			align();
+		}
+
+		// Returns a pointer to a section of n elements without
+		// copying it.
+		const char* skip_array(std::uint64_t n, std::size_t element_size)
+		{
+			check_remaining(n, element_size);
+			const char* bytes = read_bytes(n * element_size);
+			align();
+			return bytes;
+		}
+
+		std::string read_string()
+		{
+			auto length = read<std::uint64_t>();
+			return std::string(skip_array(length, 1), length);
+		}
+
+		void align()
+		{
+			read_bytes((8 - position % 8) % 8);
+		}
+
+		// Checks that n elements remain, e.g. before allocating
+		// memory for a count read from the data.
+		void check_remaining(std::uint64_t n, std::size_t element_size) const
+		{
+			check(n <= (size - position) / element_size,
+			      "Function::read_from_binary: Unexpected end of data.");
+		}
+
+	private:
+		const char* read_bytes(std::size_t n)
+		{
+			check(n <= size - position, "Function::read_from_binary: Unexpected end of data.");
+			const char* bytes = data + position;
+			position += n;
+			return bytes;
+		}
+
+		const char* data;
+		std::size_t size;
+		std::size_t position;
+	};
+
+	template<typename T>
+	T element(const char* array, std::size_t i)
+	{
+		T value;
+		std::memcpy(&value, array + i * sizeof(T), sizeof(T));
+		return little_endian(value);
+	}
+}
+
+void Function::write_to_binary_stream(std::ostream& out) const
+{
+	using namespace std;
+
+	for (const auto& variable: impl->variables) {
+		spii_assert(variable.change_of_variables == nullptr,
+		            "Function::write_to_binary_stream: Change of variables not allowed.");
+	}
+
+	// Variables are written in global order.
+	vector<size_t> order(impl->variables.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	sort(order.begin(), order.end(), [this](size_t a, size_t b)
+	{
+		return impl->variables[a].global_index < impl->variables[b].global_index;
+	});
+	vector<uint64_t> position_of_variable(order.size());
+	vector<uint64_t> variable_dimensions;
+	vector<uint8_t> variable_is_constant;
+	vector<double> values;
+	for (size_t i = 0; i < order.size(); ++i) {
+		const auto& variable = impl->variables[order[i]];
+		position_of_variable[order[i]] = i;
+		variable_dimensions.push_back(variable.user_dimension);
+		variable_is_constant.push_back(variable.is_constant);
+		values.insert(values.end(), variable.user_data, variable.user_data + variable.user_dimension);
+	}
+
+	// The term types are interned, so that each name is only
+	// written once.
+	vector<string> term_types;
+	map<string, uint32_t> term_type_index;
+	vector<uint32_t> term_type_of_term;
+	vector<uint64_t> connectivity_offsets = {0};
+	vector<uint64_t> connectivity;
+	vector<uint64_t> data_offsets = {0};
+	string term_data;
+	ostringstream term_out;
+	term_out << setprecision(17);
+	for (const auto& added_term: impl->terms) {
+		string term_name = TermFactory::fix_name(typeid(*added_term.term).name());
+		auto itr = term_type_index.find(term_name);
+		if (itr == term_type_index.end()) {
+			itr = term_type_index.emplace(term_name, static_cast<uint32_t>(term_types.size())).first;
+			term_types.push_back(term_name);
+		}
+		term_type_of_term.push_back(itr->second);
+
+		for (auto index: added_term.added_variables_indices) {
+			connectivity.push_back(position_of_variable[index]);
+		}
+		connectivity_offsets.push_back(connectivity.size());
+
+		term_out.str("");
+		term_out << *added_term.term;
+		term_data += term_out.str();
+		data_offsets.push_back(term_data.size());
+	}
+
+	BinaryWriter writer(out);
+	writer.write_array(binary_magic, sizeof(binary_magic));
+	writer.write<uint32_t>(binary_version);
+	writer.write<uint32_t>(0);
+	writer.write_string(TermFactory::fix_name(typeid(std::vector<std::map<double,int>>).name()));
+	writer.write<uint64_t>(term_types.size());
+	writer.write<uint64_t>(variable_dimensions.size());
+	writer.write<uint64_t>(values.size());
+	writer.write<uint64_t>(impl->terms.size());
+	writer.write<uint64_t>(connectivity.size());
+	writer.write<uint64_t>(term_data.size());
+	writer.write<double>(impl->constant);
+
+	for (const auto& name: term_types) {
+		writer.write_string(name);
+	}
+	writer.write_array(variable_dimensions.data(), variable_dimensions.size());
+	writer.write_array(variable_is_constant.data(), variable_is_constant.size());
+	writer.write_array(values.data(), values.size());
+	writer.write_array(term_type_of_term.data(), term_type_of_term.size());
+	writer.write_array(connectivity_offsets.data(), connectivity_offsets.size());
+	writer.write_array(connectivity.data(), connectivity.size());
+	writer.write_array(data_offsets.data(), data_offsets.size());
+	writer.write_array(term_data.data(), term_data.size());
+}
+
+namespace
+{
+	// The term sections of the binary format, which are used directly
+	// from the data.
+	struct BinaryTerms
+	{
+		std::vector<std::string> term_types;
+		std::uint64_t number_of_terms;
+		std::uint64_t connectivity_size;
+		std::uint64_t term_data_size;
+		const char* term_type_of_term;
+		const char* connectivity_offsets;
+		const char* connectivity;
+		const char* data_offsets;
+		const char* term_data;
+		// The user data of the variables, in the order of the file.
+		std::vector<double*> variables;
+	};
+
+	// Reads everything but the terms from the binary format and
+	// adds the variables and constant to function.
+	BinaryTerms read_binary_variables(const char* data,
+	                                  std::size_t size,
+	                                  Function* function,
+	                                  std::vector<double>* user_space)
+	{
+		using namespace std;
+
+		BinaryReader reader(data, size);
+		check(memcmp(reader.skip_array(sizeof(binary_magic), 1), binary_magic, sizeof(binary_magic)) == 0,
+		      "Function::read_from_binary: Not a binary spii function.");
+		auto version = reader.read<uint32_t>();
+		check(version == binary_version,
+		      "Function::read_from_binary: Unsupported version ", version, ".");
+		reader.read<uint32_t>();
+		if (reader.read_string()
+		    != TermFactory::fix_name(typeid(std::vector<std::map<double,int>>).name()))
+		{
+			throw runtime_error("Function::read_from_binary: Type format does not match. "
+			                    "Files can not be shared between compilers.");
+		}
+
+		BinaryTerms terms;
+		auto number_of_term_types = reader.read<uint64_t>();
+		auto number_of_variables  = reader.read<uint64_t>();
+		auto number_of_scalars    = reader.read<uint64_t>();
+		terms.number_of_terms     = reader.read<uint64_t>();
+		terms.connectivity_size   = reader.read<uint64_t>();
+		terms.term_data_size      = reader.read<uint64_t>();
+		*function += reader.read<double>();
+
+		// Every string has its length first.
+		reader.check_remaining(number_of_term_types, sizeof(uint64_t));
+		for (uint64_t i = 0; i < number_of_term_types; ++i) {
+			terms.term_types.push_back(reader.read_string());
+		}
+
+		// Every variable has a dimension and a constant flag.
+		reader.check_remaining(number_of_variables, sizeof(uint64_t) + sizeof(uint8_t));
+		vector<uint64_t> variable_dimensions(number_of_variables);
+		reader.read_array(variable_dimensions.data(), variable_dimensions.size());
+		vector<uint8_t> variable_is_constant(number_of_variables);
+		reader.read_array(variable_is_constant.data(), variable_is_constant.size());
+		reader.check_remaining(number_of_scalars, sizeof(double));
+		user_space->resize(number_of_scalars);
+		reader.read_array(user_space->data(), user_space->size());
+
+		vector<double*> constant_variables;
+		uint64_t offset = 0;
+		for (uint64_t i = 0; i < number_of_variables; ++i) {
+			check(offset + variable_dimensions[i] <= number_of_scalars,
+			      "Function::read_from_binary: Invalid variable dimensions.");
+			double* variable = user_space->data() + offset;
+			function->add_variable(variable, static_cast<int>(variable_dimensions[i]));
+			terms.variables.push_back(variable);
+			if (variable_is_constant[i]) {
+				constant_variables.push_back(variable);
+			}
+			offset += variable_dimensions[i];
+		}
+		check(offset == number_of_scalars, "Function::read_from_binary: Invalid variable dimensions.");
+		function->set_constant(constant_variables, true);
+
+		terms.term_type_of_term    = reader.skip_array(terms.number_of_terms, sizeof(uint32_t));
+		terms.connectivity_offsets = reader.skip_array(terms.number_of_terms + 1, sizeof(uint64_t));
+		terms.connectivity         = reader.skip_array(terms.connectivity_size, sizeof(uint64_t));
+		terms.data_offsets         = reader.skip_array(terms.number_of_terms + 1, sizeof(uint64_t));
+		terms.term_data            = reader.skip_array(terms.term_data_size, 1);
+		return terms;
+	}
+
+	// Terms without data are only created once per type. The mutex
+	// is only taken the first time a type is needed.
+	class BinaryTermCache
+	{
+	public:
+		BinaryTermCache(std::size_t number_of_types)
+			: terms_without_data(new Entry[number_of_types])
+		{ }
+
+		std::shared_ptr<const Term> get(const BinaryTerms& terms,
+		                                std::uint32_t type,
+		                                const TermFactory& factory)
+		{
+			auto& entry = terms_without_data[type];
+			if ( ! entry.created.load(std::memory_order_acquire)) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if ( ! entry.created.load(std::memory_order_relaxed)) {
+					std::istringstream in;
+					entry.term = factory.create(terms.term_types[type], in);
+					entry.created.store(true, std::memory_order_release);
+				}
+			}
+			return entry.term;
+		}
+
+	private:
+		// term is never changed after created is set.
+		struct Entry
+		{
+			std::atomic<bool> created{false};
+			std::shared_ptr<const Term> term;
+		};
+
+		std::mutex mutex;
+		std::unique_ptr<Entry[]> terms_without_data;
+	};
+
+	// Shares terms with the same type and data. The terms are
+	// looked up by a hash of their data, which is compared with the
+	// data in the file, so no copy of the data is kept. Only used if
+	// requested, since hashing is wasted work for unique data.
+	class BinaryTermsWithData
+	{
+	public:
+		template<typename Create>
+		std::shared_ptr<const Term> get(std::uint32_t type,
+		                                const char* data,
+		                                std::size_t size,
+		                                Create create)
+		{
+			// FNV-1a.
+			std::uint64_t hash = 14695981039346656037ull ^ type;
+			for (std::size_t i = 0; i < size; ++i) {
+				hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+			}
+
+			auto& bucket = terms[hash];
+			for (const auto& shared: bucket) {
+				if (shared.type == type && shared.size == size
+				    && std::memcmp(shared.data, data, size) == 0) {
+					return shared.term;
+				}
+			}
+			bucket.push_back({type, data, size, create()});
+			return bucket.back().term;
+		}
+
+	private:
+		struct SharedTerm
+		{
+			std::uint32_t type;
+			const char* data;
+			std::size_t size;
+			std::shared_ptr<const Term> term;
+		};
+		std::unordered_map<std::uint64_t, std::vector<SharedTerm>> terms;
+	};
+
+	// Creates term i of the binary format and appends its variables
+	// to arguments. If terms_with_data is not null, terms with the
+	// same type and data are shared.
+	std::shared_ptr<const Term> read_binary_term(const BinaryTerms& terms,
+	                                             std::uint64_t i,
+	                                             const TermFactory& factory,
+	                                             BinaryTermCache* cache,
+	                                             BinaryTermsWithData* terms_with_data,
+	                                             std::vector<double*>* arguments)
+	{
+		using namespace std;
+
+		auto type = element<uint32_t>(terms.term_type_of_term, i);
+		check(type < terms.term_types.size(), "Function::read_from_binary: Invalid term type.");
+		auto data_begin = element<uint64_t>(terms.data_offsets, i);
+		auto data_end   = element<uint64_t>(terms.data_offsets, i + 1);
+		check(data_begin <= data_end && data_end <= terms.term_data_size,
+		      "Function::read_from_binary: Invalid term data.");
+
+		auto begin = element<uint64_t>(terms.connectivity_offsets, i);
+		auto end   = element<uint64_t>(terms.connectivity_offsets, i + 1);
+		check(begin <= end && end <= terms.connectivity_size,
+		      "Function::read_from_binary: Invalid term connectivity.");
+		for (auto j = begin; j < end; ++j) {
+			auto variable = element<uint64_t>(terms.connectivity, j);
+			check(variable < terms.variables.size(), "Function::read_from_binary: Invalid variable.");
+			arguments->push_back(terms.variables[variable]);
+		}
+
+		const char* term_data = terms.term_data + data_begin;
+		auto term_size = data_end - data_begin;
+		if (term_size == 0) {
+			return cache->get(terms, type, factory);
+		}
+
+		auto create = [&]()
+		{
+			istringstream in(string(term_data, term_size));
+			return factory.create(terms.term_types[type], in);
+		};
+		if (terms_with_data) {
+			return terms_with_data->get(type, term_data, term_size, create);
+		}
+		else {
+			return create();
+		}
+	}
+
+	// Streams the terms of the binary format. Terms with data are
+	// parsed again every time their chunk is loaded, i.e. once per
+	// evaluation. If share_terms_with_data is set, terms with the
+	// same type and data are only parsed once per chunk.
+	class BinaryTermStream :
+		public TermStream
+	{
+	public:
+		BinaryTermStream(std::shared_ptr<const char> data_,
+		                 BinaryTerms terms_,
+		                 const TermFactory& factory_,
+		                 std::size_t terms_per_chunk_,
+		                 bool share_terms_with_data_)
+			: data(data_),
+			  terms(std::move(terms_)),
+			  factory(factory_),
+			  terms_per_chunk(terms_per_chunk_),
+			  share_terms_with_data(share_terms_with_data_),
+			  cache(terms.term_types.size())
+		{
+			check(terms_per_chunk > 0, "Function::read_from_binary_streamed: Invalid chunk size.");
+		}
+
+		virtual std::size_t number_of_chunks() const override
+		{
+			return (terms.number_of_terms + terms_per_chunk - 1) / terms_per_chunk;
+		}
+
+		virtual void load_chunk(std::size_t c, TermChunk* chunk) const override
+		{
+			auto begin = c * terms_per_chunk;
+			auto end = std::min<std::uint64_t>(begin + terms_per_chunk, terms.number_of_terms);
+			BinaryTermsWithData terms_with_data;
+			auto shared = share_terms_with_data ? &terms_with_data : nullptr;
+			for (auto i = begin; i < end; ++i) {
+				chunk->terms.push_back(read_binary_term(terms, i, factory, &cache, shared, &chunk->arguments));
+			}
+		}
+
+	private:
+		std::shared_ptr<const char> data;
+		BinaryTerms terms;
+		const TermFactory& factory;
+		std::size_t terms_per_chunk;
+		bool share_terms_with_data;
+		mutable BinaryTermCache cache;
+	};
+}
+
+void Function::read_from_binary(const char* data,
+                                std::size_t size,
+                                std::vector<double>* user_space,
+                                const TermFactory& factory,
+                                bool share_terms_with_data)
+{
+	impl->clear();
+	auto terms = read_binary_variables(data, size, this, user_space);
+
+	// Terms without data are created once per type. Terms with data
+	// are created once per combination of type and data if
+	// share_terms_with_data is set.
+	BinaryTermCache cache(terms.term_types.size());
+	BinaryTermsWithData terms_with_data;
+	auto shared = share_terms_with_data ? &terms_with_data : nullptr;
+	std::vector<double*> arguments;
+	for (std::uint64_t i = 0; i < terms.number_of_terms; ++i) {
+		arguments.clear();
+		auto term = read_binary_term(terms, i, factory, &cache, shared, &arguments);
+		this->add_term(term, arguments);
+	}
+}
+
+void Function::read_from_binary_streamed(std::shared_ptr<const char> data,
+                                         std::size_t size,
+                                         std::vector<double>* user_space,
+                                         const TermFactory& factory,
+                                         std::size_t terms_per_chunk,
+                                         bool share_terms_with_data)
+{
+	impl->clear();
+	auto terms = read_binary_variables(data.get(), size, this, user_space);
+	this->add_term_stream(std::make_shared<BinaryTermStream>(data,
+	                                                         std::move(terms),
+	                                                         factory,
+	                                                         terms_per_chunk,
+	                                                         share_terms_with_data));
+}
+
+}  // namespace spii
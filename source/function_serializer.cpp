@@ -1,8 +1,18 @@
 // Petter Strandmark 2013.
+#include <fstream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <vector>
 
+#ifndef _WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
 #include <spii/function_serializer.h>
 
 using namespace std;
@@ -30,4 +40,70 @@ std::istream& operator >> (std::istream& in,  const Serialize& serializer)
 	return in;
 }
 
+void write_binary_file(const std::string& file_name, const Function& function)
+{
+	ofstream out(file_name, ios::binary);
+	check(bool(out), "write_binary_file: Could not open ", file_name, ".");
+	function.write_to_binary_stream(out);
+	check(bool(out), "write_binary_file: Writing ", file_name, " failed.");
+}
+
+namespace
+{
+	// Maps a file into memory. The file is unmapped when the
+	// last copy of the returned pointer is destroyed.
+	shared_ptr<const char> map_binary_file(const std::string& file_name, size_t* size)
+	{
+		#ifdef _WIN32
+			ifstream in(file_name, ios::binary);
+			check(bool(in), "read_binary_file: Could not open ", file_name, ".");
+			auto data = make_shared<vector<char>>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+			*size = data->size();
+			return shared_ptr<const char>(data, data->data());
+		#else
+			int file = open(file_name.c_str(), O_RDONLY);
+			check(file >= 0, "read_binary_file: Could not open ", file_name, ".");
+			struct stat file_status;
+			if (fstat(file, &file_status) != 0) {
+				close(file);
+				check(false, "read_binary_file: Could not read the size of ", file_name, ".");
+			}
+			size_t mapped_size = file_status.st_size;
+			void* data = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE, file, 0);
+			close(file);
+			check(data != MAP_FAILED, "read_binary_file: Could not map ", file_name, ".");
+			madvise(data, mapped_size, MADV_SEQUENTIAL);
+			*size = mapped_size;
+			return shared_ptr<const char>(static_cast<const char*>(data),
+			                              [mapped_size](const char* data)
+			                              {
+			                                  munmap(const_cast<char*>(data), mapped_size);
+			                              });
+		#endif
+	}
+}
+
+void read_binary_file(const std::string& file_name,
+                      Function* function,
+                      std::vector<double>* user_space,
+                      const TermFactory& factory,
+                      bool share_terms_with_data)
+{
+	size_t size = 0;
+	auto data = map_binary_file(file_name, &size);
+	function->read_from_binary(data.get(), size, user_space, factory, share_terms_with_data);
+}
+
+void read_binary_file_streamed(const std::string& file_name,
+                               Function* function,
+                               std::vector<double>* user_space,
+                               const TermFactory& factory,
+                               std::size_t terms_per_chunk,
+                               bool share_terms_with_data)
+{
+	size_t size = 0;
+	auto data = map_binary_file(file_name, &size);
+	function->read_from_binary_streamed(data, size, user_space, factory, terms_per_chunk, share_terms_with_data);
+}
+
 }
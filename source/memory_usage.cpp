@@ -0,0 +1,94 @@
+#include <iomanip>
+
+#include <spii/memory_usage.h>
+
+namespace spii {
+
+void MemoryUsage::record(const std::string& name, std::size_t bytes)
+{
+	Structure* structure = nullptr;
+	for (auto& s: structures) {
+		if (s.name == name) {
+			structure = &s;
+			break;
+		}
+	}
+	if (! structure) {
+		structures.emplace_back();
+		structure = &structures.back();
+		structure->name = name;
+	}
+
+	structure->current = bytes;
+	if (bytes > structure->peak) {
+		structure->peak = bytes;
+	}
+	auto total = current_total();
+	if (total > peak_total) {
+		peak_total = total;
+	}
+}
+
+void MemoryUsage::add(const MemoryUsage& other, const std::string& prefix)
+{
+	for (const auto& s: other.structures) {
+		structures.push_back(s);
+		structures.back().name = prefix + s.name;
+	}
+	peak_total += other.peak_total;
+}
+
+std::size_t MemoryUsage::current_total() const
+{
+	std::size_t total = 0;
+	for (const auto& s: structures) {
+		total += s.current;
+	}
+	return total;
+}
+
+std::size_t MemoryUsage::current(const std::string& name) const
+{
+	for (const auto& s: structures) {
+		if (s.name == name) {
+			return s.current;
+		}
+	}
+	return 0;
+}
+
+std::size_t MemoryUsage::peak(const std::string& name) const
+{
+	for (const auto& s: structures) {
+		if (s.name == name) {
+			return s.peak;
+		}
+	}
+	return 0;
+}
+
+std::ostream& operator<<(std::ostream& out, const MemoryUsage& usage)
+{
+	auto flags = out.flags();
+	auto precision = out.precision(1);
+	out.setf(std::ios::fixed, std::ios::floatfield);
+
+	const double MB = 1024.0 * 1024.0;
+	out << "----------------------------------------------------\n";
+	out << "Memory (MB)                          current      peak\n";
+	for (const auto& s: usage.structures) {
+		out << std::left << std::setw(36) << s.name << std::right
+		    << std::setw(8) << s.current / MB << "  "
+		    << std::setw(8) << s.peak / MB << '\n';
+	}
+	out << std::left << std::setw(36) << "Total" << std::right
+	    << std::setw(8) << usage.current_total() / MB << "  "
+	    << std::setw(8) << usage.peak_total / MB << '\n';
+	out << "----------------------------------------------------\n";
+
+	out.precision(precision);
+	out.flags(flags);
+	return out;
+}
+
+}  // namespace spii
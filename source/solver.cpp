@@ -21,6 +21,7 @@ std::ostream& operator<<(std::ostream& out, const SolverResults& results)
 	EXIT_ENUM_IF(INTERNAL_ERROR);
 	EXIT_ENUM_IF(NA);
 	out << "----------------------------------------------\n";
+	out << "Iterations                : " << results.iterations << '\n';
 	out << "Startup time              : " << results.startup_time << '\n';
 	out << "Function evaluation time  : " << results.function_evaluation_time << '\n';
 	out << "Stopping criteria time    : " << results.stopping_criteria_time << '\n';
@@ -28,8 +29,10 @@ std::ostream& operator<<(std::ostream& out, const SolverResults& results)
 	out << "L-BFGS update time        : " << results.lbfgs_update_time << '\n';
 	out << "Linear solver time        : " << results.linear_solver_time << '\n';
 	out << "Backtracking time         : " << results.backtracking_time << '\n';
+	out << "Checkpoint time           : " << results.checkpoint_time << '\n';
 	out << "Log time                  : " << results.log_time << '\n';
 	out << "Total time (without log)  : " << results.total_time - results.log_time << '\n';
+	out << "Peak memory (MB)          : " << results.memory_usage.peak_total / (1024.0 * 1024.0) << '\n';
 	out << "----------------------------------------------\n";
 	return out;
 }
@@ -58,6 +61,24 @@ Solver::Solver()
 Solver::~Solver()
 { }
 
+void Solver::solve(const Function& function, SolverResults* results, SolverState*) const
+{
+	solve(function, results);
+}
+
+MemoryUsage Solver::estimate_memory_usage(const Function& function) const
+{
+	MemoryUsage estimate;
+	estimate.record("vectors", 2 * function.get_number_of_scalars() * sizeof(double));
+	estimate.add(function.estimate_memory_usage(Function::Evaluation::GRADIENT), "Function: ");
+	return estimate;
+}
+
+void SolverState::clear()
+{
+	*this = SolverState();
+}
+
 
 }  // namespace spii
 
@@ -0,0 +1,192 @@
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
+#include <spii/spii.h>
+#include <spii/solver.h>
+
+namespace spii {
+
+namespace
+{
+	const char checkpoint_magic[8] = {'s', 'p', 'i', 'i', '-', 'c', 'h', 'k'};
+	const std::uint32_t checkpoint_version = 1;
+	// Written in the byte order of the machine.
+	const std::uint32_t checkpoint_byte_order = 0x01020304;
+}
+
+Checkpoint::Checkpoint(SolverType solver_type)
+	: position(0)
+{
+	for (auto c: checkpoint_magic) {
+		write(c);
+	}
+	write(checkpoint_version);
+	write(checkpoint_byte_order);
+	write(std::uint32_t(solver_type));
+}
+
+Checkpoint::Checkpoint(const std::string& file_name, SolverType solver_type)
+	: position(0)
+{
+	std::ifstream in(file_name, std::ios::binary);
+	check(bool(in), "Checkpoint: Could not open ", file_name, ".");
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+	char magic[sizeof(checkpoint_magic)];
+	read_bytes(magic, sizeof(magic));
+	check(std::memcmp(magic, checkpoint_magic, sizeof(magic)) == 0,
+	      "Checkpoint: ", file_name, " is not a checkpoint.");
+	auto version = read<std::uint32_t>();
+	check(version == checkpoint_version, "Checkpoint: Unsupported version ", version, ".");
+	check(read<std::uint32_t>() == checkpoint_byte_order,
+	      "Checkpoint: ", file_name, " was written on another architecture.");
+	check(read<std::uint32_t>() == std::uint32_t(solver_type),
+	      "Checkpoint: ", file_name, " was written by another solver.");
+}
+
+void Checkpoint::write(const Eigen::VectorXd& vector)
+{
+	write(std::uint64_t(vector.size()));
+	auto bytes = reinterpret_cast<const char*>(vector.data());
+	data.insert(data.end(), bytes, bytes + vector.size() * sizeof(double));
+}
+
+void Checkpoint::read(Eigen::VectorXd* vector)
+{
+	auto size = read<std::uint64_t>();
+	check(size <= (data.size() - position) / sizeof(double), "Checkpoint: Invalid data.");
+	vector->resize(size);
+	read_bytes(reinterpret_cast<char*>(vector->data()), size * sizeof(double));
+}
+
+void Checkpoint::read_bytes(char* destination, std::size_t size)
+{
+	check(size <= data.size() - position, "Checkpoint: Invalid data.");
+	std::memcpy(destination, data.data() + position, size);
+	position += size;
+}
+
+void Checkpoint::finish_reading() const
+{
+	check(position == data.size(), "Checkpoint: Invalid data.");
+}
+
+struct CheckpointWriterInternal
+{
+	std::string file_name;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	// The next checkpoint to write, if has_pending.
+	std::vector<char> pending;
+	bool has_pending = false;
+	bool writing = false;
+	bool stop = false;
+	std::exception_ptr error;
+
+	void write_file(const std::vector<char>& data) const
+	{
+		// The old checkpoint is only replaced once the new one has been
+		// written completely.
+		auto temporary_name = file_name + ".tmp";
+		auto file = std::fopen(temporary_name.c_str(), "wb");
+		check(file != nullptr, "CheckpointWriter: Could not open ", temporary_name, ".");
+		bool success = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+		success = std::fflush(file) == 0 && success;
+		#ifndef _WIN32
+			success = fsync(fileno(file)) == 0 && success;
+		#endif
+		success = std::fclose(file) == 0 && success;
+		check(success, "CheckpointWriter: Writing ", temporary_name, " failed.");
+
+		#ifdef _WIN32
+			std::remove(file_name.c_str());
+		#endif
+		check(std::rename(temporary_name.c_str(), file_name.c_str()) == 0,
+		      "CheckpointWriter: Could not replace ", file_name, ".");
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			condition.wait(lock, [this] { return has_pending || stop; });
+			if ( ! has_pending) {
+				return;
+			}
+			std::vector<char> data;
+			data.swap(pending);
+			has_pending = false;
+			writing = true;
+
+			lock.unlock();
+			try {
+				write_file(data);
+			}
+			catch (...) {
+				lock.lock();
+				error = std::current_exception();
+				writing = false;
+				condition.notify_all();
+				continue;
+			}
+			lock.lock();
+
+			writing = false;
+			condition.notify_all();
+		}
+	}
+};
+
+CheckpointWriter::CheckpointWriter(const std::string& file_name)
+{
+	data = new CheckpointWriterInternal;
+	data->file_name = file_name;
+	data->thread = std::thread([this] { data->run(); });
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		data->stop = true;
+	}
+	data->condition.notify_all();
+	data->thread.join();
+	delete data;
+}
+
+void CheckpointWriter::write(Checkpoint&& checkpoint)
+{
+	{
+		std::unique_lock<std::mutex> lock(data->mutex);
+		if (data->error) {
+			std::rethrow_exception(data->error);
+		}
+		data->pending.swap(checkpoint.data);
+		data->has_pending = true;
+	}
+	data->condition.notify_all();
+}
+
+void CheckpointWriter::finish()
+{
+	std::unique_lock<std::mutex> lock(data->mutex);
+	data->condition.wait(lock, [this] { return ! data->has_pending && ! data->writing; });
+	if (data->error) {
+		std::rethrow_exception(data->error);
+	}
+}
+
+}  // namespace spii
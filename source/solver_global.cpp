@@ -3,13 +3,19 @@
 // [1] Stig Skelboe, Computation of Rational Interval Functions, BIT 14, 1974.
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
 #include <queue>
 #include <set>
 #include <sstream>
 
 #include <spii/solver.h>
 #include <spii/spii.h>
+#include <spii/trace.h>
 
 namespace spii {
 
@@ -221,7 +227,10 @@ IntervalVector GlobalSolver::solve_global(const Function& function,
                                           SolverResults* results) const
 {
 	using namespace std;
+	check(! function.has_bounds(), "GlobalSolver::solve_global: bounds are only supported by LBFGSSolver.");
+
 	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
 
 	check(x_interval.size() == function.get_number_of_scalars(),
 		"solve_global: input vector does not match the function's number of scalars");
@@ -242,9 +251,78 @@ IntervalVector GlobalSolver::solve_global(const Function& function,
 
 	int number_of_function_evaluations = 0;
 	int iterations = 0;
+	MemoryUsage memory_usage;
+
+	auto write_box = [](Checkpoint* checkpoint, const IntervalVector& box)
+	{
+		checkpoint->write(std::uint64_t(box.size()));
+		for (const auto& interval: box) {
+			checkpoint->write(interval.get_lower());
+			checkpoint->write(interval.get_upper());
+		}
+	};
+	auto read_box = [](Checkpoint* checkpoint, IntervalVector* box)
+	{
+		box->resize(checkpoint->read<std::uint64_t>());
+		for (auto& interval: *box) {
+			auto lower = checkpoint->read<double>();
+			auto upper = checkpoint->read<double>();
+			interval = Interval<double>(lower, upper);
+		}
+	};
+
+	// A checkpoint contains the queue of boxes and the best point
+	// found so far.
+	std::unique_ptr<CheckpointWriter> checkpoint_writer;
+	int resumed_iteration = -1;
+	if (! this->checkpoint_file.empty()) {
+		if (this->resume_from_checkpoint && ifstream(this->checkpoint_file).good()) {
+			Checkpoint checkpoint(this->checkpoint_file, Checkpoint::GLOBAL);
+			check(checkpoint.read<uint64_t>() == n,
+			      "GlobalSolver::solve_global: The checkpoint does not match the function.");
+			iterations = checkpoint.read<int32_t>();
+			number_of_function_evaluations = checkpoint.read<int32_t>();
+			upper_bound = checkpoint.read<double>();
+			checkpoint.read(&best_x);
+			read_box(&checkpoint, &best_interval);
+			queue.resize(checkpoint.read<uint64_t>());
+			for (auto& queue_entry: queue) {
+				read_box(&checkpoint, &queue_entry.box);
+				auto lower = checkpoint.read<double>();
+				auto upper = checkpoint.read<double>();
+				queue_entry.bounds = Interval<double>(lower, upper);
+			}
+			checkpoint.finish_reading();
+			resumed_iteration = iterations;
+		}
+		check(this->checkpoint_interval > 0, "GlobalSolver::solve_global: Invalid checkpoint interval.");
+		checkpoint_writer.reset(new CheckpointWriter(this->checkpoint_file));
+	}
+
 	results->exit_condition = SolverResults::INTERNAL_ERROR;
 
 	while (!queue.empty()) {
+		if (checkpoint_writer && iterations > 0 && iterations != resumed_iteration
+		    && iterations % this->checkpoint_interval == 0) {
+			double start_time = wall_time();
+			Checkpoint checkpoint(Checkpoint::GLOBAL);
+			checkpoint.write(uint64_t(n));
+			checkpoint.write(int32_t(iterations));
+			checkpoint.write(int32_t(number_of_function_evaluations));
+			checkpoint.write(upper_bound);
+			checkpoint.write(best_x);
+			write_box(&checkpoint, best_interval);
+			checkpoint.write(uint64_t(queue.size()));
+			for (const auto& queue_entry: queue) {
+				write_box(&checkpoint, queue_entry.box);
+				checkpoint.write(queue_entry.bounds.get_lower());
+				checkpoint.write(queue_entry.bounds.get_upper());
+			}
+			checkpoint_writer->write(std::move(checkpoint));
+			results->checkpoint_time += wall_time() - start_time;
+		}
+
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iterations);
 		double start_time = wall_time();
 
 		const auto box = queue.front().box;
@@ -273,6 +351,9 @@ IntervalVector GlobalSolver::solve_global(const Function& function,
 		}
 		results->function_evaluation_time += wall_time() - start_time;
 
+		memory_usage.record("box queue", queue.capacity() * sizeof(GlobalQueueEntry)
+		                                 + queue.size() * n * sizeof(Interval<double>));
+
 		iterations++;
 
 		start_time = wall_time();
@@ -359,6 +440,12 @@ IntervalVector GlobalSolver::solve_global(const Function& function,
 		}
 	}
 
+	if (checkpoint_writer) {
+		double start_time = wall_time();
+		checkpoint_writer->finish();
+		results->checkpoint_time += wall_time() - start_time;
+	}
+
 	double tmp = 0;
 	double lower_bound = upper_bound;
 	auto bounding_box = get_bounding_box(queue, &lower_bound, &tmp);
@@ -374,8 +461,29 @@ IntervalVector GlobalSolver::solve_global(const Function& function,
 
 	function.copy_global_to_user(best_x);
 
+	results->iterations = iterations;
 	results->total_time = wall_time() - global_start_time;
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
 	return bounding_box;
 }
 
+MemoryUsage GlobalSolver::estimate_memory_usage(const Function& function) const
+{
+	size_t n = function.get_number_of_scalars();
+
+	// Every iteration splits a box into 2^n boxes. The estimate
+	// assumes that no box is discarded.
+	double boxes = 2.0 * this->maximum_iterations;
+	boxes = std::max(boxes, 1.0 + this->maximum_iterations * (std::pow(2.0, double(n)) - 1.0));
+	double bytes = boxes * (sizeof(GlobalQueueEntry) + n * sizeof(Interval<double>));
+
+	// Capped so that the totals do not overflow.
+	const size_t max_bytes = std::numeric_limits<size_t>::max() / 4;
+	MemoryUsage estimate;
+	estimate.record("box queue", bytes < max_bytes ? size_t(bytes) : max_bytes);
+	estimate.add(function.estimate_memory_usage(Function::Evaluation::GRADIENT), "Function: ");
+	return estimate;
+}
+
 }  // namespace spii
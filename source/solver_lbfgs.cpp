@@ -1,22 +1,43 @@
 // Petter Strandmark 2012.
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdint>
+#include <deque>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <Eigen/Dense>
 
 #include <spii/spii.h>
 #include <spii/solver.h>
+#include <spii/trace.h>
 
 namespace spii {
 
 void LBFGSSolver::solve(const Function& function,
                         SolverResults* results) const
 {
+	solve(function, results, nullptr);
+}
+
+void LBFGSSolver::solve(const Function& function,
+                        SolverResults* results,
+                        SolverState* state) const
+{
+	if (function.has_bounds()) {
+		solve_with_bounds(function, results);
+		return;
+	}
+
 	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
 
 	// Dimension of problem.
 	size_t n = function.get_number_of_scalars();
@@ -26,6 +47,11 @@ void LBFGSSolver::solve(const Function& function,
 		return;
 	}
 
+	if (state && state->number_of_scalars != n) {
+		state->clear();
+		state->number_of_scalars = n;
+	}
+
 	// Current point, gradient and Hessian.
 	double fval   = std::numeric_limits<double>::quiet_NaN();
 	double fprev  = std::numeric_limits<double>::quiet_NaN();
@@ -56,6 +82,19 @@ void LBFGSSolver::solve(const Function& function,
 	Eigen::VectorXd rho(this->lbfgs_history_size);
 	rho.setZero();
 
+	// Continue from the curvature pairs of the last solve instead of
+	// a steepest descent step.
+	bool warm_start = false;
+	if (state) {
+		for (int h = 0; h < this->lbfgs_history_size && h < int(state->lbfgs_s.size()); ++h) {
+			*s[h] = state->lbfgs_s[h];
+			*y[h] = state->lbfgs_y[h];
+			rho[h] = 1.0 / s[h]->dot(*y[h]);
+			warm_start = true;
+		}
+	}
+	double last_step_length = std::numeric_limits<double>::quiet_NaN();
+
 	Eigen::VectorXd alpha(this->lbfgs_history_size);
 	alpha.setZero();
 	Eigen::VectorXd q(n);
@@ -66,21 +105,99 @@ void LBFGSSolver::solve(const Function& function,
 
 	CheckExitConditionsCache exit_condition_cache;
 
+	MemoryUsage memory_usage;
+	memory_usage.record("vectors", 8 * n * sizeof(double));
+	memory_usage.record("history", heap_size(s_data) + heap_size(y_data) + heap_size(rho) + heap_size(alpha));
+
+	int iter = 0;
+	bool last_iteration_successful = true;
+	int number_of_line_search_failures = 0;
+	int number_of_restarts = 0;
+
+	// A checkpoint contains everything carried over from one
+	// iteration to the next.
+	std::unique_ptr<CheckpointWriter> checkpoint_writer;
+	int resumed_iteration = -1;
+	if (! this->checkpoint_file.empty()) {
+		if (this->resume_from_checkpoint && std::ifstream(this->checkpoint_file).good()) {
+			Checkpoint checkpoint(this->checkpoint_file, Checkpoint::LBFGS);
+			check(checkpoint.read<std::uint64_t>() == n &&
+			      checkpoint.read<std::int32_t>() == this->lbfgs_history_size,
+			      "LBFGSSolver::solve: The checkpoint does not match the function and solver.");
+			iter = checkpoint.read<std::int32_t>();
+			checkpoint.read(&x);
+			checkpoint.read(&g);
+			checkpoint.read(&x_prev);
+			for (int h = 0; h < this->lbfgs_history_size; ++h) {
+				checkpoint.read(s[h]);
+				checkpoint.read(y[h]);
+			}
+			checkpoint.read(&rho);
+			fprev  = checkpoint.read<double>();
+			normg0 = checkpoint.read<double>();
+			normdx = checkpoint.read<double>();
+			last_iteration_successful      = checkpoint.read<std::uint8_t>() != 0;
+			number_of_line_search_failures = checkpoint.read<std::int32_t>();
+			number_of_restarts             = checkpoint.read<std::int32_t>();
+			last_step_length               = checkpoint.read<double>();
+			exit_condition_cache.norm_g_history_pos = checkpoint.read<std::int32_t>();
+			for (auto& ng: exit_condition_cache.normg_history) {
+				ng = checkpoint.read<double>();
+			}
+			checkpoint.finish_reading();
+			check(x.size() == n && g.size() == n && x_prev.size() == n && rho.size() == this->lbfgs_history_size,
+			      "LBFGSSolver::solve: The checkpoint does not match the function and solver.");
+
+			resumed_iteration = iter;
+			warm_start = false;
+		}
+		check(this->checkpoint_interval > 0, "LBFGSSolver::solve: Invalid checkpoint interval.");
+		checkpoint_writer.reset(new CheckpointWriter(this->checkpoint_file));
+	}
+
 	//
 	// START MAIN ITERATION
 	//
 	results->startup_time   += wall_time() - global_start_time;
 	results->exit_condition = SolverResults::INTERNAL_ERROR;
-	int iter = 0;
-	bool last_iteration_successful = true;
-	int number_of_line_search_failures = 0;
-	int number_of_restarts = 0;
 	while (true) {
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iter);
+
+		if (checkpoint_writer && iter > 0 && iter != resumed_iteration
+		    && iter % this->checkpoint_interval == 0) {
+			double start_time = wall_time();
+			Checkpoint checkpoint(Checkpoint::LBFGS);
+			checkpoint.write(std::uint64_t(n));
+			checkpoint.write(std::int32_t(this->lbfgs_history_size));
+			checkpoint.write(std::int32_t(iter));
+			checkpoint.write(x);
+			checkpoint.write(g);
+			checkpoint.write(x_prev);
+			for (int h = 0; h < this->lbfgs_history_size; ++h) {
+				checkpoint.write(*s[h]);
+				checkpoint.write(*y[h]);
+			}
+			checkpoint.write(rho);
+			checkpoint.write(fprev);
+			checkpoint.write(normg0);
+			checkpoint.write(normdx);
+			checkpoint.write(std::uint8_t(last_iteration_successful));
+			checkpoint.write(std::int32_t(number_of_line_search_failures));
+			checkpoint.write(std::int32_t(number_of_restarts));
+			checkpoint.write(last_step_length);
+			checkpoint.write(std::int32_t(exit_condition_cache.norm_g_history_pos));
+			for (auto ng: exit_condition_cache.normg_history) {
+				checkpoint.write(ng);
+			}
+			checkpoint_writer->write(std::move(checkpoint));
+			results->checkpoint_time += wall_time() - start_time;
+		}
 
 		//
 		// Evaluate function and derivatives.
 		//
 		double start_time = wall_time();
+		TraceSpan evaluate_span(this->trace, "evaluate", "solver", iter);
 		// y[0] should contain the difference between the gradient
 		// in this iteration and the gradient from the previous.
 		// Therefore, update y before and after evaluating the
@@ -93,8 +210,15 @@ void LBFGSSolver::solve(const Function& function,
 		normg = std::max(g.maxCoeff(), -g.minCoeff());
 		if (iter == 0) {
 			normg0 = normg;
+			if (state) {
+				if (state->initial_gradient_norm != state->initial_gradient_norm) {
+					state->initial_gradient_norm = normg;
+				}
+				normg0 = std::max(normg0, state->initial_gradient_norm);
+			}
 		}
 		results->function_evaluation_time += wall_time() - start_time;
+		evaluate_span.end();
 
 		//
 		// Update history
@@ -143,6 +267,7 @@ void LBFGSSolver::solve(const Function& function,
 		}
 
 		if (this->callback_function) {
+			TraceSpan callback_span(this->trace, "callback", "solver", iter);
 			CallbackInformation information;
 			information.objective_value = fval;
 			information.x = &x;
@@ -160,10 +285,11 @@ void LBFGSSolver::solve(const Function& function,
 		// Compute search direction via L-BGFS two-loop recursion.
 		//
 		start_time = wall_time();
+		TraceSpan direction_span(this->trace, "search direction", "solver", iter);
 		bool should_restart = false;
 
 		double H0 = 1.0;
-		if (iter > 0) {
+		if (iter > 0 || warm_start) {
 			// If the gradient is identical two iterations in a row,
 			// y will be the zero vector and H0 will be NaN. In this
 			// case the line search will fail and L-BFGS will be restarted
@@ -231,15 +357,24 @@ void LBFGSSolver::solve(const Function& function,
 		}
 
 		results->lbfgs_update_time += wall_time() - start_time;
+		direction_span.end();
 
 		//
 		// Perform line search.
 		//
 		start_time = wall_time();
+		TraceSpan line_search_span(this->trace, "line search", "solver", iter);
 		double start_alpha = 1.0;
 		// In the first iteration, start with a much smaller step
 		// length. (heuristic used by e.g. minFunc)
-		if (iter == 0) {
+		// With curvature pairs from the last solve, start at most
+		// twice as long as the last step.
+		if (iter == 0 && warm_start && ! should_restart) {
+			if (state->lbfgs_step_length > 0) {
+				start_alpha = std::min(1.0, 2.0 * state->lbfgs_step_length);
+			}
+		}
+		else if (iter == 0) {
 			double sumabsg = 0.0;
 			for (size_t i = 0; i < n; ++i) {
 				sumabsg += std::fabs(g[i]);
@@ -269,6 +404,7 @@ void LBFGSSolver::solve(const Function& function,
 		else {
 			// Record length of this step.
 			normdx = alpha_step * r.norm();
+			last_step_length = alpha_step;
 			// Compute new point.
 			x_prev = x;
 			x = x + alpha_step * r;
@@ -277,6 +413,7 @@ void LBFGSSolver::solve(const Function& function,
 		}
 
 		results->backtracking_time += wall_time() - start_time;
+		line_search_span.end();
 
 		//
 		// Log the results of this iteration.
@@ -316,8 +453,29 @@ void LBFGSSolver::solve(const Function& function,
 		iter++;
 	}
 
+	if (checkpoint_writer) {
+		double start_time = wall_time();
+		checkpoint_writer->finish();
+		results->checkpoint_time += wall_time() - start_time;
+	}
+
+	if (state) {
+		state->lbfgs_s.clear();
+		state->lbfgs_y.clear();
+		for (int h = 0; h < this->lbfgs_history_size && rho[h] > 0; ++h) {
+			state->lbfgs_s.push_back(*s[h]);
+			state->lbfgs_y.push_back(*y[h]);
+		}
+		if (last_step_length > 0) {
+			state->lbfgs_step_length = last_step_length;
+		}
+	}
+
 	function.copy_global_to_user(x);
+	results->iterations = iter;
 	results->total_time += wall_time() - global_start_time;
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
 
 	if (this->log_function) {
 		char str[1024];
@@ -326,4 +484,486 @@ void LBFGSSolver::solve(const Function& function,
 	}
 }
 
-}  // namespace spii
\ No newline at end of file
+namespace {
+
+// The L-BFGS matrix in compact form (Byrd, Nocedal and Schnabel, 1994):
+//
+//    B = θI - W M Wᵀ,   W = [Y θS].
+//
+struct CompactLBFGS
+{
+	double theta;
+	Eigen::MatrixXd W;
+	Eigen::MatrixXd M;
+};
+
+// Forms the compact representation from the history (oldest first).
+void form_compact_lbfgs(const std::deque<Eigen::VectorXd>& s,
+                        const std::deque<Eigen::VectorXd>& y,
+                        int n,
+                        CompactLBFGS* B)
+{
+	const int k = static_cast<int>(s.size());
+	B->theta = 1.0;
+	B->W.resize(n, 2 * k);
+	B->M.resize(2 * k, 2 * k);
+	if (k == 0) {
+		return;
+	}
+
+	B->theta = y.back().squaredNorm() / s.back().dot(y.back());
+
+	Eigen::MatrixXd S(n, k);
+	for (int h = 0; h < k; ++h) {
+		S.col(h) = s[h];
+		B->W.col(h) = y[h];
+	}
+	B->W.rightCols(k) = B->theta * S;
+
+	// The middle matrix is
+	//
+	//    M = [-D      Lᵀ  ]⁻¹
+	//        [ L    θSᵀS ]
+	//
+	// where D is the diagonal and L the strictly lower triangle of SᵀY.
+	Eigen::MatrixXd StY = S.transpose() * B->W.leftCols(k);
+	Eigen::MatrixXd M_inverse = Eigen::MatrixXd::Zero(2 * k, 2 * k);
+	M_inverse.topLeftCorner(k, k).diagonal() = -StY.diagonal();
+	M_inverse.bottomLeftCorner(k, k) = StY.triangularView<Eigen::StrictlyLower>();
+	M_inverse.topRightCorner(k, k) = M_inverse.bottomLeftCorner(k, k).transpose();
+	M_inverse.bottomRightCorner(k, k) = B->theta * S.transpose() * S;
+	B->M = M_inverse.partialPivLu().inverse();
+}
+
+// Computes the generalized Cauchy point, the first local minimizer of
+// the quadratic model along the projected steepest descent path
+// P(x - tg). Also computes c = Wᵀ(x_cp - x), needed for the subspace
+// minimization. Algorithm CP in Byrd, Lu, Nocedal and Zhu (1995).
+void generalized_cauchy_point(const Eigen::VectorXd& x,
+                              const Eigen::VectorXd& g,
+                              const Eigen::VectorXd& lower,
+                              const Eigen::VectorXd& upper,
+                              const CompactLBFGS& B,
+                              Eigen::VectorXd* x_cp,
+                              Eigen::VectorXd* c)
+{
+	const auto n = x.size();
+	const double inf = std::numeric_limits<double>::infinity();
+
+	Eigen::VectorXd d(n);
+	std::vector<std::pair<double, int>> breakpoints;
+	for (int i = 0; i < n; ++i) {
+		double t = inf;
+		if (g[i] < 0) {
+			t = (x[i] - upper[i]) / g[i];
+		}
+		else if (g[i] > 0) {
+			t = (x[i] - lower[i]) / g[i];
+		}
+
+		d[i] = t > 0 ? -g[i] : 0.0;
+		if (t > 0 && t < inf) {
+			breakpoints.emplace_back(t, i);
+		}
+	}
+	std::sort(breakpoints.begin(), breakpoints.end());
+
+	*x_cp = x;
+	c->setZero(B.W.cols());
+
+	Eigen::VectorXd p = B.W.transpose() * d;
+	double f1 = -d.squaredNorm();
+	if (f1 >= 0) {
+		// The projected gradient is zero.
+		return;
+	}
+	double f2 = -B.theta * f1 - p.dot(B.M * p);
+	const double f2_original = f2;
+	double dt_min = -f1 / f2;
+	double t_old = 0;
+
+	std::size_t b = 0;
+	double dt = breakpoints.empty() ? inf : breakpoints[0].first;
+	while (b < breakpoints.size() && dt_min >= dt) {
+		// Move to the next breakpoint, where variable i hits its bound.
+		int i = breakpoints[b].second;
+		(*x_cp)[i] = d[i] > 0 ? upper[i] : lower[i];
+		double z = (*x_cp)[i] - x[i];
+		*c += dt * p;
+
+		Eigen::VectorXd w = B.W.row(i).transpose();
+		double gi = g[i];
+		f1 += dt * f2 + gi * gi + B.theta * gi * z - gi * w.dot(B.M * (*c));
+		f2 -= B.theta * gi * gi + 2 * gi * w.dot(B.M * p) + gi * gi * w.dot(B.M * w);
+		f2 = std::max(std::numeric_limits<double>::epsilon() * f2_original, f2);
+		p += gi * w;
+		d[i] = 0;
+
+		dt_min = -f1 / f2;
+		t_old = breakpoints[b].first;
+		++b;
+		dt = b < breakpoints.size() ? breakpoints[b].first - t_old : inf;
+	}
+
+	dt_min = std::max(dt_min, 0.0);
+	t_old += dt_min;
+	for (int i = 0; i < n; ++i) {
+		if (d[i] != 0) {
+			(*x_cp)[i] = x[i] + t_old * d[i];
+		}
+	}
+	*c += dt_min * p;
+}
+
+// Minimizes the quadratic model over the variables that are free at
+// the Cauchy point, with the other variables fixed at their bounds
+// (direct primal method). The step is projected onto the box, and
+// truncated instead if the projection is not a descent direction
+// (Morales and Nocedal, 2011).
+void subspace_minimization(const Eigen::VectorXd& x,
+                           const Eigen::VectorXd& g,
+                           const Eigen::VectorXd& lower,
+                           const Eigen::VectorXd& upper,
+                           const CompactLBFGS& B,
+                           const Eigen::VectorXd& x_cp,
+                           const Eigen::VectorXd& c,
+                           Eigen::VectorXd* x_bar,
+                           int* number_of_free)
+{
+	std::vector<int> free;
+	for (int i = 0; i < x.size(); ++i) {
+		if (x_cp[i] > lower[i] && x_cp[i] < upper[i]) {
+			free.push_back(i);
+		}
+	}
+	*number_of_free = static_cast<int>(free.size());
+	*x_bar = x_cp;
+	if (free.empty()) {
+		return;
+	}
+
+	const int m2 = static_cast<int>(B.W.cols());
+	const int nf = static_cast<int>(free.size());
+	Eigen::MatrixXd WZ(nf, m2);
+	Eigen::VectorXd r(nf);
+	const Eigen::VectorXd Mc = B.M * c;
+	for (int j = 0; j < nf; ++j) {
+		int i = free[j];
+		WZ.row(j) = B.W.row(i);
+		r[j] = g[i] + B.theta * (x_cp[i] - x[i]) - B.W.row(i).dot(Mc);
+	}
+
+	// Solves (θI - WZ M WZᵀ) du = -r with the Sherman–Morrison–Woodbury
+	// formula.
+	Eigen::VectorXd du = -r / B.theta;
+	if (m2 > 0) {
+		Eigen::VectorXd v = B.M * (WZ.transpose() * r);
+		Eigen::MatrixXd N = Eigen::MatrixXd::Identity(m2, m2) - B.M * (WZ.transpose() * WZ) / B.theta;
+		v = N.partialPivLu().solve(v);
+		du -= WZ * v / (B.theta * B.theta);
+	}
+
+	Eigen::VectorXd x_projected = x_cp;
+	for (int j = 0; j < nf; ++j) {
+		int i = free[j];
+		x_projected[i] = std::min(upper[i], std::max(lower[i], x_cp[i] + du[j]));
+	}
+	if (g.dot(x_projected - x) < 0) {
+		*x_bar = x_projected;
+		return;
+	}
+
+	double alpha = 1.0;
+	for (int j = 0; j < nf; ++j) {
+		int i = free[j];
+		if (du[j] > 0) {
+			alpha = std::min(alpha, (upper[i] - x_cp[i]) / du[j]);
+		}
+		else if (du[j] < 0) {
+			alpha = std::min(alpha, (lower[i] - x_cp[i]) / du[j]);
+		}
+	}
+	for (int j = 0; j < nf; ++j) {
+		(*x_bar)[free[j]] += alpha * du[j];
+	}
+}
+
+}  // anonymous namespace
+
+void LBFGSSolver::solve_with_bounds(const Function& function,
+                                    SolverResults* results) const
+{
+	check(this->checkpoint_file.empty(),
+	      "LBFGSSolver::solve: Checkpoints are not supported for functions with bounds.");
+
+	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
+
+	// Dimension of problem.
+	int n = static_cast<int>(function.get_number_of_scalars());
+
+	if (n == 0) {
+		results->exit_condition = SolverResults::FUNCTION_TOLERANCE;
+		return;
+	}
+
+	double fval   = std::numeric_limits<double>::quiet_NaN();
+	double fprev  = std::numeric_limits<double>::quiet_NaN();
+	double normg0 = std::numeric_limits<double>::quiet_NaN();
+	double normg  = std::numeric_limits<double>::quiet_NaN();
+	double normdx = std::numeric_limits<double>::quiet_NaN();
+
+	Eigen::VectorXd lower, upper;
+	function.get_bounds(&lower, &upper);
+
+	// Copy the user state to the current point and make it feasible.
+	Eigen::VectorXd x, g;
+	function.copy_user_to_global(&x);
+	x = x.cwiseMax(lower).cwiseMin(upper);
+	Eigen::VectorXd x_prev(n), g_prev(n), x_cp(n), x_bar(n), x2(n), c;
+
+	// L-BFGS history, oldest first.
+	std::deque<Eigen::VectorXd> s, y;
+	CompactLBFGS B;
+
+	CheckExitConditionsCache exit_condition_cache;
+
+	MemoryUsage memory_usage;
+	memory_usage.record("vectors", 10 * n * sizeof(double));
+
+	//
+	// START MAIN ITERATION
+	//
+	results->startup_time   += wall_time() - global_start_time;
+	results->exit_condition = SolverResults::INTERNAL_ERROR;
+	int iter = 0;
+	bool last_iteration_successful = true;
+	int number_of_line_search_failures = 0;
+	while (true) {
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iter);
+
+		//
+		// Evaluate function and derivatives.
+		//
+		double start_time = wall_time();
+		TraceSpan evaluate_span(this->trace, "evaluate", "solver", iter);
+		fval = function.evaluate(x, &g);
+
+		// Maximum norm of the projected gradient P(x - g) - x.
+		normg = ((x - g).cwiseMax(lower).cwiseMin(upper) - x).lpNorm<Eigen::Infinity>();
+		if (iter == 0) {
+			normg0 = normg;
+		}
+		results->function_evaluation_time += wall_time() - start_time;
+		evaluate_span.end();
+
+		//
+		// Update history
+		//
+		start_time = wall_time();
+
+		if (iter > 0 && last_iteration_successful) {
+			Eigen::VectorXd s_new = x - x_prev;
+			Eigen::VectorXd y_new = g - g_prev;
+			// Skip the update if the curvature condition does not hold,
+			// so that B stays positive definite.
+			if (s_new.dot(y_new) > std::numeric_limits<double>::epsilon() * y_new.squaredNorm()) {
+				if (static_cast<int>(s.size()) >= this->lbfgs_history_size) {
+					s.pop_front();
+					y.pop_front();
+				}
+				s.emplace_back(std::move(s_new));
+				y.emplace_back(std::move(y_new));
+			}
+		}
+
+		results->lbfgs_update_time += wall_time() - start_time;
+
+		//
+		// Test stopping criteriea
+		//
+		start_time = wall_time();
+		if (normg == 0) {
+			results->exit_condition = SolverResults::GRADIENT_TOLERANCE;
+			break;
+		}
+		if (iter > 1 && this->check_exit_conditions(fval, fprev, normg,
+		                                            normg0, x.norm(), normdx,
+		                                            last_iteration_successful,
+		                                            &exit_condition_cache, results)) {
+			break;
+		}
+		if (iter >= this->maximum_iterations) {
+			results->exit_condition = SolverResults::NO_CONVERGENCE;
+			break;
+		}
+
+		if (this->callback_function) {
+			TraceSpan callback_span(this->trace, "callback", "solver", iter);
+			CallbackInformation information;
+			information.objective_value = fval;
+			information.x = &x;
+			information.g = &g;
+
+			if (!callback_function(information)) {
+				results->exit_condition = SolverResults::USER_ABORT;
+				break;
+			}
+		}
+
+		results->stopping_criteria_time += wall_time() - start_time;
+
+		//
+		// Compute the search direction from the generalized Cauchy
+		// point and a subspace minimization over the free variables.
+		//
+		start_time = wall_time();
+		TraceSpan direction_span(this->trace, "search direction", "solver", iter);
+
+		if (! last_iteration_successful) {
+			s.clear();
+			y.clear();
+		}
+
+		int number_of_free = 0;
+		Eigen::VectorXd p;
+		while (true) {
+			form_compact_lbfgs(s, y, n, &B);
+			generalized_cauchy_point(x, g, lower, upper, B, &x_cp, &c);
+			subspace_minimization(x, g, lower, upper, B, x_cp, c, &x_bar, &number_of_free);
+			p = x_bar - x;
+			memory_usage.record("history", 2 * s.size() * n * sizeof(double));
+			memory_usage.record("compact representation", heap_size(B.W) + heap_size(B.M));
+
+			// With a poor model, p might not be a descent direction.
+			// Discarding the history gives a projected steepest
+			// descent step.
+			if (g.dot(p) < 0 || s.empty()) {
+				break;
+			}
+			s.clear();
+			y.clear();
+		}
+
+		results->lbfgs_update_time += wall_time() - start_time;
+		direction_span.end();
+
+		//
+		// Perform a projected backtracking line search.
+		//
+		start_time = wall_time();
+		TraceSpan line_search_span(this->trace, "line search", "solver", iter);
+		double alpha_step = 1.0;
+		// In the first iteration, start with a much smaller step
+		// length. (heuristic used by e.g. minFunc)
+		if (iter == 0) {
+			alpha_step = std::min(1.0, 1.0 / p.lpNorm<1>());
+		}
+		bool line_search_successful = false;
+		if (g.dot(p) < 0) {
+			while (alpha_step >= 1e-20) {
+				x2 = (x + alpha_step * p).cwiseMax(lower).cwiseMin(upper);
+				double f_new = function.evaluate(x2);
+				if (f_new <= fval + this->line_search_c * g.dot(x2 - x)) {
+					line_search_successful = true;
+					break;
+				}
+				alpha_step *= this->line_search_rho;
+			}
+		}
+
+		if (! line_search_successful) {
+			alpha_step = 0;
+			if (this->log_function) {
+				this->log_function("Line search failed.");
+			}
+			if (! last_iteration_successful || number_of_line_search_failures++ > 10) {
+				results->exit_condition = SolverResults::GRADIENT_TOLERANCE;
+				break;
+			}
+
+			last_iteration_successful = false;
+		}
+		else {
+			x_prev = x;
+			g_prev = g;
+			x = x2;
+			normdx = (x - x_prev).norm();
+
+			last_iteration_successful = true;
+		}
+
+		results->backtracking_time += wall_time() - start_time;
+		line_search_span.end();
+
+		//
+		// Log the results of this iteration.
+		//
+		start_time = wall_time();
+
+		int log_interval = 1;
+		if (iter > 30) {
+			log_interval = 10;
+		}
+		if (iter > 200) {
+			log_interval = 100;
+		}
+		if (iter > 2000) {
+			log_interval = 1000;
+		}
+		if (this->log_function && iter % log_interval == 0) {
+			if (iter == 0) {
+				this->log_function("Itr       f       deltaf   max|g_i|   alpha    theta     free");
+			}
+
+			this->log_function(
+				to_string(
+					std::setw(4), iter, " ",
+					std::setw(10), std::setprecision(3), std::scientific, std::showpos, fval, std::noshowpos, " ",
+					std::setw(9),  std::setprecision(3), std::scientific, std::fabs(fval - fprev), " ",
+					std::setw(9),  std::setprecision(3), std::scientific, normg, " ",
+					std::setw(9),  std::setprecision(3), std::scientific, alpha_step, " ",
+					std::setw(9),  std::setprecision(3), std::scientific, B.theta, " ",
+					std::setw(6),  number_of_free
+				)
+			);
+		}
+		results->log_time += wall_time() - start_time;
+
+		fprev = fval;
+		iter++;
+	}
+
+	function.copy_global_to_user(x);
+	results->iterations = iter;
+	results->total_time += wall_time() - global_start_time;
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
+
+	if (this->log_function) {
+		char str[1024];
+		std::sprintf(str, " end %+.3e           %.3e", fval, normg);
+		this->log_function(str);
+	}
+}
+
+MemoryUsage LBFGSSolver::estimate_memory_usage(const Function& function) const
+{
+	size_t n = function.get_number_of_scalars();
+	size_t m = this->lbfgs_history_size;
+
+	MemoryUsage estimate;
+	if (function.has_bounds()) {
+		estimate.record("vectors", 10 * n * sizeof(double));
+		estimate.record("history", 2 * m * n * sizeof(double));
+		estimate.record("compact representation", (2 * m * n + 4 * m * m) * sizeof(double));
+	}
+	else {
+		estimate.record("vectors", 8 * n * sizeof(double));
+		estimate.record("history", 2 * m * (n * sizeof(double) + sizeof(Eigen::VectorXd)) + 2 * m * sizeof(double));
+	}
+	estimate.add(function.estimate_memory_usage(Function::Evaluation::GRADIENT), "Function: ");
+	return estimate;
+}
+
+}  // namespace spii
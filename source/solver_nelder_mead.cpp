@@ -11,6 +11,7 @@
 
 #include <spii/spii.h>
 #include <spii/solver.h>
+#include <spii/trace.h>
 
 namespace spii {
 
@@ -48,11 +49,11 @@ namespace std
 
 namespace spii {
 
-void initialize_simplex(const Function& function,
+void initialize_simplex(const ParallelEvaluator& evaluator,
                         const Eigen::VectorXd& x0,
                         std::vector<SimplexPoint>* simplex)
 {
-	size_t n = function.get_number_of_scalars();
+	size_t n = x0.size();
 	Eigen::VectorXd absx0 = x0;
 	for (size_t i = 0; i < n; ++i) {
 		absx0[i] = std::abs(x0[i]);
@@ -70,17 +71,40 @@ void initialize_simplex(const Function& function,
 		simplex->at(i).x[i-1] = x0[i-1] + alpha1;
 	}
 
+	// The n + 1 points are independent and can be evaluated
+	// concurrently.
+	std::vector<const Eigen::VectorXd*> points;
+	for (size_t i = 0; i < n + 1; ++i) {
+		points.push_back(&simplex->at(i).x);
+	}
+	std::vector<double> values;
+	evaluator.evaluate(points, &values);
 	for (size_t i = 0; i < n + 1; ++i) {
-		simplex->at(i).value = function.evaluate(simplex->at(i).x);
+		simplex->at(i).value = values[i];
 	}
 
 	std::sort(simplex->begin(), simplex->end());
 }
 
+// Sum of all points in the simplex. Used to update the
+// centroid in O(n) operations per iteration.
+void compute_simplex_sum(const std::vector<SimplexPoint>& simplex,
+                         Eigen::VectorXd* simplex_sum)
+{
+	simplex_sum->setZero();
+	for (const auto& point: simplex) {
+		*simplex_sum += point.x;
+	}
+}
+
 void NelderMeadSolver::solve(const Function& function,
                              SolverResults* results) const
 {
+	check(! function.has_bounds(), "NelderMeadSolver::solve: bounds are only supported by LBFGSSolver.");
+	check(this->checkpoint_file.empty(), "NelderMeadSolver::solve: Checkpoints are not supported.");
+
 	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
 
 	// Dimension of problem.
 	size_t n = function.get_number_of_scalars();
@@ -97,7 +121,16 @@ void NelderMeadSolver::solve(const Function& function,
 	Eigen::VectorXd x;
 	function.copy_user_to_global(&x);
 
-	initialize_simplex(function, x, &simplex);
+	// Evaluates several points concurrently if requested.
+	ParallelEvaluator evaluator(function, std::max(this->number_of_threads, 1));
+	const size_t number_of_replaced =
+		std::min(size_t(std::max(this->number_of_replaced_vertices, 1)), n);
+	// Evaluating trial points concurrently requires all of them
+	// to be computed before it is known which ones are needed.
+	const bool speculative = evaluator.get_number_of_threads() > 1 ||
+	                         number_of_replaced > 1;
+
+	initialize_simplex(evaluator, x, &simplex);
 
 	SimplexPoint mean_point;
 	SimplexPoint reflection_point;
@@ -106,6 +139,26 @@ void NelderMeadSolver::solve(const Function& function,
 	reflection_point.x.resize(n);
 	expansion_point.x.resize(n);
 
+	// The sum of all points, updated whenever a vertex is replaced.
+	Eigen::VectorXd simplex_sum(n);
+	compute_simplex_sum(simplex, &simplex_sum);
+	// Replaces the worst point with point.
+	auto replace_worst = [&](SimplexPoint* point)
+	{
+		simplex_sum += point->x - simplex[n].x;
+		std::swap(*point, simplex[n]);
+	};
+
+	// Used when trial points are evaluated speculatively. Each
+	// replaced vertex has four trial points: reflection, expansion,
+	// outside contraction and inside contraction.
+	std::vector<SimplexPoint> trial_points;
+	if (speculative) {
+		trial_points.resize(4 * number_of_replaced);
+	}
+	std::vector<const Eigen::VectorXd*> points;
+	std::vector<double> values;
+
 	double fmin  = std::numeric_limits<double>::quiet_NaN();
 	double fmax  = std::numeric_limits<double>::quiet_NaN();
 	double fval  = std::numeric_limits<double>::quiet_NaN();
@@ -116,6 +169,17 @@ void NelderMeadSolver::solve(const Function& function,
 
 	Eigen::MatrixXd area_mat(n, n);
 
+	// The copies of the function have not been evaluated yet and are
+	// counted with the size of the original.
+	MemoryUsage memory_usage;
+	memory_usage.record("simplex and trial points",
+	                    (simplex.size() + trial_points.size() + 4) * n * sizeof(double));
+	memory_usage.record("area matrix", heap_size(area_mat));
+	if (evaluator.get_number_of_threads() > 1) {
+		memory_usage.record("function copies",
+		                    evaluator.get_number_of_threads() * function.get_memory_usage().current_total());
+	}
+
 	//
 	// START MAIN ITERATION
 	//
@@ -124,6 +188,7 @@ void NelderMeadSolver::solve(const Function& function,
 	int iter = 0;
 	int n_shrink_in_a_row = 0;
 	while (true) {
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iter);
 
 		//
 		// In each iteration, the worst point in the simplex
@@ -131,86 +196,183 @@ void NelderMeadSolver::solve(const Function& function,
 		//
 		double start_time = wall_time();
 
-		mean_point.x.setZero();
 		fval = 0;
-		// Compute the mean of the best n points.
 		for (size_t i = 0; i < n; ++i) {
-			mean_point.x += simplex[i].x;
-			fval         += simplex[i].value;
+			fval += simplex[i].value;
 		}
-		fval         /= double(n);
-		mean_point.x /= double(n);
+		fval /= double(n);
 		fmin = simplex[0].value;
 		fmax = simplex[n].value;
 
 		const char* iteration_type = "n/a";
+		bool is_shrink = false;
 
-		// Compute the reflexion point and evaluate it.
-		reflection_point.x = 2.0 * mean_point.x - simplex[n].x;
-		reflection_point.value = function.evaluate(reflection_point.x);
+		// Recompute the sum once in a while, so that rounding
+		// errors do not accumulate.
+		if (iter % n == 0) {
+			compute_simplex_sum(simplex, &simplex_sum);
+		}
 
-		bool is_shrink = false;
-		if (simplex[0].value <= reflection_point.value &&
-			reflection_point.value < simplex[n - 1].value) {
-			// Reflected point is neither better nor worst in the
-			// new simplex.
-			std::swap(reflection_point, simplex[n]);
-			iteration_type = "Reflect 1";
+		// The mean of the points that are kept is obtained from the
+		// sum of all points in O(kn).
+		const size_t m = n + 1 - number_of_replaced;
+		mean_point.x = simplex_sum;
+		for (size_t j = m; j < n + 1; ++j) {
+			mean_point.x -= simplex[j].x;
 		}
-		else if (reflection_point.value < simplex[0].value) {
-			// Reflected point is better than the current best; try
-			// to go farther along this direction.
+		mean_point.x /= double(m);
+
+		if ( ! speculative) {
+			// Compute the reflexion point and evaluate it.
+			reflection_point.x = 2.0 * mean_point.x - simplex[n].x;
+			reflection_point.value = function.evaluate(reflection_point.x);
+
+			if (simplex[0].value <= reflection_point.value &&
+				reflection_point.value < simplex[n - 1].value) {
+				// Reflected point is neither better nor worst in the
+				// new simplex.
+				replace_worst(&reflection_point);
+				iteration_type = "Reflect 1";
+			}
+			else if (reflection_point.value < simplex[0].value) {
+				// Reflected point is better than the current best; try
+				// to go farther along this direction.
 
-			// Compute expansion point.
-			expansion_point.x = 3.0 * mean_point.x - 2.0 * simplex[n].x;
-			expansion_point.value = function.evaluate(expansion_point.x);
+				// Compute expansion point.
+				expansion_point.x = 3.0 * mean_point.x - 2.0 * simplex[n].x;
+				expansion_point.value = function.evaluate(expansion_point.x);
 
-			if (expansion_point.value < reflection_point.value) {
-				std::swap(expansion_point, simplex[n]);
-				iteration_type = "Expansion";
+				if (expansion_point.value < reflection_point.value) {
+					replace_worst(&expansion_point);
+					iteration_type = "Expansion";
+				}
+				else {
+					replace_worst(&reflection_point);
+					iteration_type = "Reflect 2";
+				}
 			}
 			else {
-				std::swap(reflection_point, simplex[n]);
-				iteration_type = "Reflect 2";
+				// Reflected point is still worse than x[n]; contract.
+				bool success = false;
+
+				if (simplex[n - 1].value <= reflection_point.value &&
+				    reflection_point.value < simplex[n].value) {
+					// Try to perform "outside" contraction.
+					expansion_point.x = 1.5 * mean_point.x - 0.5 * simplex[n].x;
+					expansion_point.value = function.evaluate(expansion_point.x);
+
+					if (expansion_point.value <= reflection_point.value) {
+						replace_worst(&expansion_point);
+						success = true;
+						iteration_type = "Outside contraction";
+					}
+				}
+				else {
+					// Try to perform "inside" contraction.
+					expansion_point.x = 0.5 * mean_point.x + 0.5 * simplex[n].x;
+					expansion_point.value = function.evaluate(expansion_point.x);
+
+					if (expansion_point.value < simplex[n].value) {
+						replace_worst(&expansion_point);
+						success = true;
+						iteration_type = "Inside contraction";
+					}
+				}
+
+				if (! success) {
+					// Neither outside nor inside contraction was acceptable;
+					// shrink the simplex toward the best point.
+					for (size_t i = 1; i < n + 1; ++i) {
+						simplex[i].x = 0.5 * (simplex[0].x + simplex[i].x);
+						simplex[i].value = function.evaluate(simplex[i].x);
+						iteration_type = "Shrink";
+						is_shrink = true;
+					}
+					compute_simplex_sum(simplex, &simplex_sum);
+				}
 			}
 		}
 		else {
-			// Reflected point is still worse than x[n]; contract.
-			bool success = false;
-
-			if (simplex[n - 1].value <= reflection_point.value &&
-			    reflection_point.value < simplex[n].value) {
-				// Try to perform "outside" contraction.
-				expansion_point.x = 1.5 * mean_point.x - 0.5 * simplex[n].x;
-				expansion_point.value = function.evaluate(expansion_point.x);
-
-				if (expansion_point.value <= reflection_point.value) {
-					std::swap(expansion_point, simplex[n]);
-					success = true;
-					iteration_type = "Outside contraction";
+			// Compute the trial points for all replaced vertices and
+			// evaluate them concurrently.
+			points.clear();
+			for (size_t k = 0; k < number_of_replaced; ++k) {
+				const Eigen::VectorXd& worst = simplex[m + k].x;
+				SimplexPoint* trial = &trial_points[4 * k];
+				trial[0].x = 2.0 * mean_point.x - worst;
+				trial[1].x = 3.0 * mean_point.x - 2.0 * worst;
+				trial[2].x = 1.5 * mean_point.x - 0.5 * worst;
+				trial[3].x = 0.5 * mean_point.x + 0.5 * worst;
+				for (int i = 0; i < 4; ++i) {
+					points.push_back(&trial[i].x);
 				}
 			}
-			else {
-				// Try to perform "inside" contraction.
-				expansion_point.x = 0.5 * mean_point.x + 0.5 * simplex[n].x;
-				expansion_point.value = function.evaluate(expansion_point.x);
+			evaluator.evaluate(points, &values);
+			for (size_t i = 0; i < values.size(); ++i) {
+				trial_points[i].value = values[i];
+			}
 
-				if (expansion_point.value < simplex[n].value) {
-					std::swap(expansion_point, simplex[n]);
-					success = true;
+			// Apply the same rules as above to every replaced vertex.
+			bool any_success = false;
+			const double best_value = simplex[0].value;
+			const double kept_worst_value = simplex[m - 1].value;
+			for (size_t k = 0; k < number_of_replaced; ++k) {
+				SimplexPoint& vertex     = simplex[m + k];
+				SimplexPoint& reflection = trial_points[4 * k];
+				SimplexPoint& expansion  = trial_points[4 * k + 1];
+				SimplexPoint& outside    = trial_points[4 * k + 2];
+				SimplexPoint& inside     = trial_points[4 * k + 3];
+
+				SimplexPoint* replacement = nullptr;
+				if (best_value <= reflection.value &&
+				    reflection.value < kept_worst_value) {
+					replacement = &reflection;
+					iteration_type = "Reflect 1";
+				}
+				else if (reflection.value < best_value) {
+					if (expansion.value < reflection.value) {
+						replacement = &expansion;
+						iteration_type = "Expansion";
+					}
+					else {
+						replacement = &reflection;
+						iteration_type = "Reflect 2";
+					}
+				}
+				else if (kept_worst_value <= reflection.value &&
+				         reflection.value < vertex.value) {
+					if (outside.value <= reflection.value) {
+						replacement = &outside;
+						iteration_type = "Outside contraction";
+					}
+				}
+				else if (inside.value < vertex.value) {
+					replacement = &inside;
 					iteration_type = "Inside contraction";
 				}
+
+				if (replacement) {
+					simplex_sum += replacement->x - vertex.x;
+					std::swap(*replacement, vertex);
+					any_success = true;
+				}
 			}
 
-			if (! success) {
-				// Neither outside nor inside contraction was acceptable;
-				// shrink the simplex toward the best point.
+			if (! any_success) {
+				// No vertex could be replaced; shrink the simplex
+				// toward the best point.
+				points.clear();
 				for (size_t i = 1; i < n + 1; ++i) {
 					simplex[i].x = 0.5 * (simplex[0].x + simplex[i].x);
-					simplex[i].value = function.evaluate(simplex[i].x);
-					iteration_type = "Shrink";
-					is_shrink = true;
+					points.push_back(&simplex[i].x);
+				}
+				evaluator.evaluate(points, &values);
+				for (size_t i = 1; i < n + 1; ++i) {
+					simplex[i].value = values[i - 1];
 				}
+				compute_simplex_sum(simplex, &simplex_sum);
+				iteration_type = "Shrink";
+				is_shrink = true;
 			}
 		}
 
@@ -321,7 +483,10 @@ void NelderMeadSolver::solve(const Function& function,
 
 	// Return the best point as solution.
 	function.copy_global_to_user(simplex[0].x);
+	results->iterations = iter;
 	results->total_time += wall_time() - global_start_time;
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
 
 	if (this->log_function) {
 		char str[1024];
@@ -330,4 +495,27 @@ void NelderMeadSolver::solve(const Function& function,
 	}
 }
 
+MemoryUsage NelderMeadSolver::estimate_memory_usage(const Function& function) const
+{
+	size_t n = function.get_number_of_scalars();
+	size_t number_of_replaced = std::min(size_t(std::max(this->number_of_replaced_vertices, 1)), n);
+	size_t number_of_trial_points = 4 * number_of_replaced;
+	#ifdef USE_OPENMP
+		size_t number_of_threads = std::max(this->number_of_threads, 1);
+	#else
+		size_t number_of_threads = 1;
+	#endif
+
+	MemoryUsage estimate;
+	estimate.record("simplex and trial points",
+	                (n + 1 + number_of_trial_points + 4) * n * sizeof(double));
+	estimate.record("area matrix", n * n * sizeof(double));
+	auto function_estimate = function.estimate_memory_usage(Function::Evaluation::GRADIENT);
+	if (number_of_threads > 1) {
+		estimate.record("function copies", number_of_threads * function_estimate.peak_total);
+	}
+	estimate.add(function_estimate, "Function: ");
+	return estimate;
+}
+
 }  // namespace spii
@@ -1,5 +1,6 @@
 // Petter Strandmark 2012.
 
+#include <algorithm>
 #include <cstdio>
 #include <iomanip>
 #include <iostream>
@@ -20,13 +21,66 @@
 
 #include <spii/spii.h>
 #include <spii/solver.h>
+#include <spii/trace.h>
 
 namespace spii {
 
+struct SolverState::SparseFactorization
+{
+	Eigen::SimplicialLLT<Eigen::SparseMatrix<double>> factorization;
+	// The pattern analyzed by the factorization.
+	Eigen::SparseMatrix<double> pattern;
+};
+
+namespace
+{
+	bool same_pattern(const Eigen::SparseMatrix<double>& A, const Eigen::SparseMatrix<double>& B)
+	{
+		spii_assert(A.isCompressed() && B.isCompressed());
+		return A.rows() == B.rows() && A.cols() == B.cols() && A.nonZeros() == B.nonZeros()
+		    && std::equal(A.outerIndexPtr(), A.outerIndexPtr() + A.outerSize() + 1, B.outerIndexPtr())
+		    && std::equal(A.innerIndexPtr(), A.innerIndexPtr() + A.nonZeros(), B.innerIndexPtr());
+	}
+
+	// Whether a sparse Hessian is used for a function with n scalars.
+	bool use_sparse_hessian(NewtonSolver::SparsityMode mode, size_t n)
+	{
+		if (mode == NewtonSolver::SparsityMode::DENSE) {
+			return false;
+		}
+		else if (mode == NewtonSolver::SparsityMode::SPARSE) {
+			return true;
+		}
+		else {
+			return n > 50;
+		}
+	}
+
+	// The Cholesky factor, the pattern it was computed for and the
+	// permutation.
+	size_t sparse_factorization_size(const SolverState::SparseFactorization& factorization)
+	{
+		return heap_size(factorization.factorization.matrixL().nestedExpression())
+		     + heap_size(factorization.pattern)
+		     + 2 * factorization.pattern.rows() * sizeof(int);
+	}
+}
+
 void NewtonSolver::solve(const Function& function,
                          SolverResults* results) const
 {
+	solve(function, results, nullptr);
+}
+
+void NewtonSolver::solve(const Function& function,
+                         SolverResults* results,
+                         SolverState* state) const
+{
+	check(! function.has_bounds(), "NewtonSolver::solve: bounds are only supported by LBFGSSolver.");
+	check(this->checkpoint_file.empty(), "NewtonSolver::solve: Checkpoints are not supported.");
+
 	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
 
 	// Random number engine for random pertubation.
 	std::mt19937 prng(unsigned(1));
@@ -41,23 +95,14 @@ void NewtonSolver::solve(const Function& function,
 		return;
 	}
 
+	if (state && state->number_of_scalars != n) {
+		state->clear();
+		state->number_of_scalars = n;
+	}
+
 	// Determine whether to use sparse representation
 	// and matrix factorization.
-	bool use_sparsity;
-	if (this->sparsity_mode == SparsityMode::DENSE) {
-		use_sparsity = false;
-	}
-	else if (this->sparsity_mode == SparsityMode::SPARSE) {
-		use_sparsity = true;
-	}
-	else {
-		if (n <= 50) {
-			use_sparsity = false;
-		}
-		else {
-			use_sparsity = true;
-		}
-	}
+	bool use_sparsity = use_sparse_hessian(this->sparsity_mode, n);
 
 	auto factorization_method = this->factorization_method;
 	if (use_sparsity && this->factorization_method == FactorizationMethod::MESCHACH) {
@@ -67,6 +112,13 @@ void NewtonSolver::solve(const Function& function,
 		factorization_method = FactorizationMethod::ITERATIVE;
 	}
 
+	// The Cholesky factorizations used by the iterative method only
+	// read the lower triangle of H, so only that part is computed.
+	auto hessian_storage = Function::HessianStorage::FULL;
+	if (factorization_method == FactorizationMethod::ITERATIVE) {
+		hessian_storage = Function::HessianStorage::LOWER;
+	}
+
 	// Current point, gradient and Hessian.
 	double fval   = std::numeric_limits<double>::quiet_NaN();;
 	double fprev  = std::numeric_limits<double>::quiet_NaN();
@@ -79,7 +131,7 @@ void NewtonSolver::solve(const Function& function,
 	Eigen::SparseMatrix<double> sparse_H;
 	if (use_sparsity) {
 		// Create sparsity pattern for H.
-		function.create_sparse_hessian(&sparse_H);
+		function.create_sparse_hessian(&sparse_H, hessian_storage);
 		if (this->log_function) {
 			double nnz = double(sparse_H.nonZeros()) / double(n * n);
 			char str[1024];
@@ -100,20 +152,54 @@ void NewtonSolver::solve(const Function& function,
 	typedef Eigen::LLT<Eigen::MatrixXd> LLT;
 	typedef Eigen::SimplicialLLT<Eigen::SparseMatrix<double> > SparseLLT;
 	std::unique_ptr<LLT> factorization;
-	std::unique_ptr<SparseLLT> sparse_factorization;
+	std::shared_ptr<SolverState::SparseFactorization> sparse_state;
+	SparseLLT* sparse_factorization = nullptr;
 	if (!use_sparsity) {
-		factorization.reset(new LLT(n));
+		// Only used by the iterative method.
+		if (factorization_method == FactorizationMethod::ITERATIVE) {
+			factorization.reset(new LLT(n));
+		}
 	}
 	else {
-		sparse_factorization.reset(new SparseLLT);
 		// The sparsity pattern of H is always the same. Therefore, it is enough
-		// to analyze it once.
-		sparse_factorization->analyzePattern(sparse_H);
+		// to analyze it once. The analysis in the state is reused if the
+		// pattern has not changed since the last solve.
+		if (state && state->sparse_factorization
+		    && same_pattern(state->sparse_factorization->pattern, sparse_H)) {
+			sparse_state = state->sparse_factorization;
+		}
+		else {
+			sparse_state = std::make_shared<SolverState::SparseFactorization>();
+			sparse_state->factorization.analyzePattern(sparse_H);
+			sparse_state->pattern = sparse_H;
+			if (state) {
+				state->sparse_factorization = sparse_state;
+			}
+		}
+		sparse_factorization = &sparse_state->factorization;
 	}
 
-	FactorizationCache factorization_cache((int)n);
+	// Only needed by BKP_dense.
+	std::unique_ptr<FactorizationCache> factorization_cache;
+	if (factorization_method == FactorizationMethod::MESCHACH) {
+		factorization_cache.reset(new FactorizationCache((int)n));
+	}
 	CheckExitConditionsCache exit_condition_cache;
 
+	// x, g, x2 and p.
+	MemoryUsage memory_usage;
+	memory_usage.record("vectors", 4 * n * sizeof(double));
+	if (use_sparsity) {
+		memory_usage.record("Cholesky factor", sparse_factorization_size(*sparse_state));
+	}
+	else if (factorization) {
+		memory_usage.record("Cholesky factor", heap_size(factorization->matrixLLT()));
+	}
+	if (factorization_cache) {
+		// The Meschach copy of H and the matrices B and Q.
+		memory_usage.record("BKP workspace", 3 * n * n * sizeof(double));
+	}
+
 	//
 	// START MAIN ITERATION
 	//
@@ -121,6 +207,7 @@ void NewtonSolver::solve(const Function& function,
 	results->exit_condition = SolverResults::INTERNAL_ERROR;
 	int iter = 0;
 	while (true) {
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iter);
 
 		int log_interval = 1;
 		if (iter > 30) {
@@ -137,16 +224,23 @@ void NewtonSolver::solve(const Function& function,
 		// Evaluate function and derivatives.
 		//
 		double start_time = wall_time();
+		TraceSpan evaluate_span(this->trace, "evaluate", "solver", iter);
 		if (use_sparsity) {
-			fval = function.evaluate(x, &g, &sparse_H);
+			fval = function.evaluate(x, &g, &sparse_H, hessian_storage);
 		}
 		else {
-			fval = function.evaluate(x, &g, &H);
+			fval = function.evaluate(x, &g, &H, hessian_storage);
 		}
 
 		normg = std::max(g.maxCoeff(), -g.minCoeff());
 		if (iter == 0) {
 			normg0 = normg;
+			if (state) {
+				if (state->initial_gradient_norm != state->initial_gradient_norm) {
+					state->initial_gradient_norm = normg;
+				}
+				normg0 = std::max(normg0, state->initial_gradient_norm);
+			}
 		}
 
 		// Check for NaN.
@@ -156,6 +250,8 @@ void NewtonSolver::solve(const Function& function,
 		}
 
 		results->function_evaluation_time += wall_time() - start_time;
+		evaluate_span.end();
+		memory_usage.record("Hessian", use_sparsity ? heap_size(sparse_H) : heap_size(H));
 
 		//
 		// Test stopping criteriea
@@ -171,6 +267,7 @@ void NewtonSolver::solve(const Function& function,
 			break;
 		}
 		if (this->callback_function) {
+			TraceSpan callback_span(this->trace, "callback", "solver", iter);
 			CallbackInformation information;
 			information.objective_value = fval;
 			information.x = &x;
@@ -208,6 +305,7 @@ void NewtonSolver::solve(const Function& function,
 			// becomes positive semidefinite.
 			//
 			//start_time = wall_time();
+			TraceSpan factorize_span(this->trace, "factorize", "solver", iter);
 			double beta = 1.0;
 
 			if (mindiag > 0) {
@@ -216,6 +314,11 @@ void NewtonSolver::solve(const Function& function,
 			else {
 				tau = -mindiag + beta;
 			}
+			// Start from the shift needed at the end of the last solve,
+			// which avoids failed factorizations.
+			if (iter == 0 && state) {
+				tau = std::max(tau, state->newton_tau);
+			}
 			while (true) {
 				// Add tau*I to the Hessian.
 				if (tau > 0) {
@@ -249,14 +352,19 @@ void NewtonSolver::solve(const Function& function,
 				spii_assert(factorizations <= 100,
 				            "Solver::solve: factorization failed.");
 			}
+			if (state) {
+				state->newton_tau = tau;
+			}
 		
 
 			results->matrix_factorization_time += wall_time() - start_time;
+			factorize_span.end();
 
 			//
 			// Solve linear system to obtain search direction.
 			//
 			start_time = wall_time();
+			TraceSpan solve_span(this->trace, "linear solve", "solver", iter);
 
 			if (use_sparsity) {
 				p = sparse_factorization->solve(-g);
@@ -272,11 +380,13 @@ void NewtonSolver::solve(const Function& function,
 
 			// Performs a BKP block diagonal factorization, modifies it, and
 			// solvers the linear system.
-			this->BKP_dense(H, g, factorization_cache, &p, results);
+			TraceSpan factorize_span(this->trace, "factorize", "solver", iter);
+			this->BKP_dense(H, g, *factorization_cache, &p, results);
 			factorizations = 1;
 		}
 		else if (factorization_method == FactorizationMethod::SYM_ILDL) {
 			factorizations = 1;
+			TraceSpan factorize_span(this->trace, "factorize", "solver", iter);
 			if (use_sparsity) {
 				this->BKP_sym_ildl(sparse_H, g, &p, results);
 			}
@@ -292,6 +402,7 @@ void NewtonSolver::solve(const Function& function,
 		// Perform line search.
 		//
 		start_time = wall_time();
+		TraceSpan line_search_span(this->trace, "line search", "solver", iter);
 		double start_alpha = 1.0;
 		double alpha = this->perform_linesearch(function, x, fval, g, p, &x2,
 		                                        start_alpha);
@@ -326,6 +437,7 @@ void NewtonSolver::solve(const Function& function,
 		x = x + alpha * p;
 
 		results->backtracking_time += wall_time() - start_time;
+		line_search_span.end();
 
 		//
 		// Log the results of this iteration.
@@ -348,8 +460,16 @@ void NewtonSolver::solve(const Function& function,
 					);
 			}
 			else {
-				double detH = H.determinant();
-				double normH = H.norm();
+				double detH, normH;
+				if (hessian_storage == Function::HessianStorage::LOWER) {
+					Eigen::MatrixXd H_full = H.selfadjointView<Eigen::Lower>();
+					detH = H_full.determinant();
+					normH = H_full.norm();
+				}
+				else {
+					detH = H.determinant();
+					normH = H.norm();
+				}
 
 				if (iter == 0) {
 					this->log_function("Itr        f        max|g_i|   ||H||     det(H)    min(H_ii)  alpha    fac");
@@ -374,7 +494,10 @@ void NewtonSolver::solve(const Function& function,
 	}
 
 	function.copy_global_to_user(x);
+	results->iterations = iter;
 	results->total_time += wall_time() - global_start_time;
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
 
 	if (this->log_function) {
 		char str[1024];
@@ -383,4 +506,40 @@ void NewtonSolver::solve(const Function& function,
 	}
 }
 
+MemoryUsage NewtonSolver::estimate_memory_usage(const Function& function) const
+{
+	size_t n = function.get_number_of_scalars();
+	bool use_sparsity = use_sparse_hessian(this->sparsity_mode, n);
+	auto factorization_method = this->factorization_method;
+	if (use_sparsity && factorization_method == FactorizationMethod::MESCHACH) {
+		factorization_method = FactorizationMethod::ITERATIVE;
+	}
+
+	MemoryUsage estimate;
+	estimate.record("vectors", 4 * n * sizeof(double));
+	if (use_sparsity) {
+		auto hessian_storage = Function::HessianStorage::FULL;
+		if (factorization_method == FactorizationMethod::ITERATIVE) {
+			hessian_storage = Function::HessianStorage::LOWER;
+		}
+		SolverState::SparseFactorization factorization;
+		function.create_sparse_hessian(&factorization.pattern, hessian_storage);
+		factorization.factorization.analyzePattern(factorization.pattern);
+		estimate.record("Cholesky factor", sparse_factorization_size(factorization));
+		estimate.record("Hessian", heap_size(factorization.pattern));
+		estimate.add(function.estimate_memory_usage(Function::Evaluation::SPARSE_HESSIAN), "Function: ");
+	}
+	else {
+		if (factorization_method == FactorizationMethod::ITERATIVE) {
+			estimate.record("Cholesky factor", n * n * sizeof(double));
+		}
+		if (factorization_method == FactorizationMethod::MESCHACH) {
+			estimate.record("BKP workspace", 3 * n * n * sizeof(double));
+		}
+		estimate.record("Hessian", n * n * sizeof(double));
+		estimate.add(function.estimate_memory_usage(Function::Evaluation::DENSE_HESSIAN), "Function: ");
+	}
+	return estimate;
+}
+
 }  // namespace spii
@@ -0,0 +1,147 @@
+#include <atomic>
+#include <exception>
+#include <limits>
+#include <vector>
+
+#ifdef USE_OPENMP
+	#include <omp.h>
+#endif
+
+#include <spii/spii.h>
+#include <spii/solver.h>
+
+namespace spii {
+
+struct ParallelEvaluatorInternal
+{
+	const Function* function;
+	// One copy of the function per thread. Empty if only
+	// one thread is used.
+	std::vector<Function*> thread_functions;
+};
+
+ParallelEvaluator::ParallelEvaluator(const Function& function, int number_of_threads)
+{
+	spii_assert(number_of_threads > 0, "ParallelEvaluator: invalid number of threads.");
+
+	auto internal = new ParallelEvaluatorInternal;
+	internal->function = &function;
+
+	#ifdef USE_OPENMP
+		if (number_of_threads > 1) {
+			for (int t = 0; t < number_of_threads; ++t) {
+				auto thread_function = new Function(function);
+				// The evaluations are already parallel; no need
+				// to start more threads for each of them.
+				thread_function->set_number_of_threads(1);
+				internal->thread_functions.push_back(thread_function);
+			}
+		}
+	#endif
+
+	this->data = internal;
+}
+
+ParallelEvaluator::~ParallelEvaluator()
+{
+	const Function& function = *this->data->function;
+	for (auto thread_function: this->data->thread_functions) {
+		function.evaluations_without_gradient += thread_function->evaluations_without_gradient;
+		function.evaluations_with_gradient    += thread_function->evaluations_with_gradient;
+		function.allocation_time              += thread_function->allocation_time;
+		function.evaluate_time                += thread_function->evaluate_time;
+		function.evaluate_with_gradient_time  += thread_function->evaluate_with_gradient_time;
+		function.copy_time                    += thread_function->copy_time;
+		delete thread_function;
+	}
+	delete this->data;
+}
+
+int ParallelEvaluator::get_number_of_threads() const
+{
+	if (this->data->thread_functions.empty()) {
+		return 1;
+	}
+	return static_cast<int>(this->data->thread_functions.size());
+}
+
+void ParallelEvaluator::evaluate(const std::vector<const Eigen::VectorXd*>& points,
+                                 std::vector<double>* values) const
+{
+	evaluate(points, values, nullptr);
+}
+
+void ParallelEvaluator::evaluate(const std::vector<const Eigen::VectorXd*>& points,
+                                 std::vector<double>* values,
+                                 const std::function<bool(double)>& stop) const
+{
+	values->clear();
+	values->resize(points.size(), std::numeric_limits<double>::quiet_NaN());
+	const auto& thread_functions = this->data->thread_functions;
+
+	if (thread_functions.empty() && points.size() > 1 && !stop) {
+		// All points are needed, so they can be evaluated in a
+		// single pass over the terms.
+		auto n = this->data->function->get_number_of_scalars();
+		Eigen::MatrixXd X(n, points.size());
+		for (size_t i = 0; i < points.size(); ++i) {
+			X.col(i) = *points[i];
+		}
+		Eigen::VectorXd batch_values;
+		this->data->function->evaluate_many(X, &batch_values);
+		for (size_t i = 0; i < points.size(); ++i) {
+			(*values)[i] = batch_values[i];
+		}
+		return;
+	}
+
+	if (thread_functions.empty() || points.size() <= 1) {
+		for (size_t i = 0; i < points.size(); ++i) {
+			(*values)[i] = this->data->function->evaluate(*points[i]);
+			if (stop && stop((*values)[i])) {
+				break;
+			}
+		}
+		return;
+	}
+
+	#ifdef USE_OPENMP
+		int number_of_threads = static_cast<int>(thread_functions.size());
+		// Each thread needs to store a specific error.
+		std::vector<std::exception_ptr> evaluation_errors(number_of_threads);
+		// Set when stop has returned true. Evaluations that have
+		// already started are allowed to finish.
+		std::atomic<bool> stopped(false);
+
+		#pragma omp parallel for schedule(dynamic) num_threads(number_of_threads)
+		for (int i = 0; i < int(points.size()); ++i) {
+			if (stopped) {
+				continue;
+			}
+			// The thread number calling this iteration.
+			int t = omp_get_thread_num();
+			// We need to catch all exceptions before leaving
+			// the loop body.
+			try {
+				double value = thread_functions[t]->evaluate(*points[i]);
+				(*values)[i] = value;
+				if (stop && stop(value)) {
+					stopped = true;
+				}
+			}
+			catch (...) {
+				evaluation_errors[t] = std::current_exception();
+			}
+		}
+
+		// Now that we are outside the OpenMP block, we can
+		// rethrow exceptions.
+		for (auto itr = evaluation_errors.begin(); itr != evaluation_errors.end(); ++itr) {
+			if ( !(*itr == std::exception_ptr())) {
+				std::rethrow_exception(*itr);
+			}
+		}
+	#endif
+}
+
+}  // namespace spii
@@ -1,21 +1,80 @@
 // Petter Strandmark 2012.
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
 #include <Eigen/Dense>
 
 #include <spii/spii.h>
 #include <spii/solver.h>
+#include <spii/trace.h>
 
 namespace spii {
 
+namespace {
+
+// A point on the mesh, stored as integer coordinates relative to
+// the starting point in units of pattern_size0 / 2^level, followed
+// by the level. Common factors of two are removed, so a point gets
+// the same key regardless of the pattern size it was visited with.
+typedef std::vector<long long> MeshKey;
+
+struct MeshKeyHash
+{
+	size_t operator()(const MeshKey& key) const
+	{
+		size_t h = 0;
+		for (auto k: key) {
+			h ^= std::hash<long long>()(k) + 0x9e3779b9 + (h << 6) + (h >> 2);
+		}
+		return h;
+	}
+};
+
+// The key of the mesh point position + d * e_i.
+MeshKey mesh_key(const std::vector<long long>& position, size_t i, long long d, int level)
+{
+	MeshKey key(position);
+	key[i] += d;
+
+	// Negative numbers have the same trailing zeros as their
+	// absolute values.
+	unsigned long long bits = 0;
+	for (auto k: key) {
+		bits |= static_cast<unsigned long long>(k);
+	}
+	int shift = 0;
+	while (shift < level && (bits & 1) == 0) {
+		bits >>= 1;
+		shift++;
+	}
+	if (shift > 0) {
+		for (auto& k: key) {
+			k /= (1LL << shift);
+		}
+	}
+
+	key.push_back(level - shift);
+	return key;
+}
+
+}  // anonymous namespace
+
 void PatternSolver::solve(const Function& function,
                           SolverResults* results) const
 {
+	check(! function.has_bounds(), "PatternSolver::solve: bounds are only supported by LBFGSSolver.");
+	check(this->checkpoint_file.empty(), "PatternSolver::solve: Checkpoints are not supported.");
+
 	double global_start_time = wall_time();
+	ActiveTrace active_trace(this->trace);
 
 	// Dimension of problem.
 	size_t n = function.get_number_of_scalars();
@@ -32,7 +91,6 @@ void PatternSolver::solve(const Function& function,
 	Eigen::VectorXd x;
 	// Copy the user state to the current point.
 	function.copy_user_to_global(&x);
-	Eigen::VectorXd dx(n);
 
 	// Size of the pattern.
 	double pattern_size = 1.0;
@@ -45,6 +103,37 @@ void PatternSolver::solve(const Function& function,
 	// Sufficient decrease.
 	auto rho = [](double t) -> double { return 1e-4 * std::pow(t ,1.5); };
 
+	ParallelEvaluator evaluator(function, std::max(this->number_of_threads, 1));
+	int number_of_threads = evaluator.get_number_of_threads();
+
+	// The trial points are evaluated in batches. A serial poll
+	// evaluates one point at a time; with several threads, twice
+	// as many points as threads are started at once, so that an
+	// opportunistic poll can cancel the ones not yet started.
+	size_t batch_size = 1;
+	if (number_of_threads > 1) {
+		batch_size = std::min(2 * size_t(number_of_threads), 2 * n);
+	}
+	std::vector<Eigen::VectorXd> trial_points(batch_size, Eigen::VectorXd(n));
+	std::vector<const Eigen::VectorXd*> batch_points;
+	std::vector<size_t> batch_directions;
+	std::vector<MeshKey> batch_keys;
+	std::vector<double> batch_values;
+
+	// Position of x on the mesh and the function values of all
+	// evaluated mesh points.
+	bool use_cache = this->cache_mesh_points;
+	std::vector<long long> mesh_x(n, 0);
+	int mesh_level = 0;
+	std::unordered_map<MeshKey, double, MeshKeyHash> visited_points;
+
+	MemoryUsage memory_usage;
+	memory_usage.record("trial points", heap_size(trial_points) + heap_size(mesh_x));
+	if (number_of_threads > 1) {
+		memory_usage.record("function copies",
+		                    number_of_threads * function.get_memory_usage().current_total());
+	}
+
 
 	//
 	// START MAIN ITERATION
@@ -53,6 +142,7 @@ void PatternSolver::solve(const Function& function,
 	results->exit_condition = SolverResults::INTERNAL_ERROR;
 	int iter = 0;
 	while (true) {
+		TraceSpan iteration_span(this->trace, "iteration", "solver", iter);
 
 		//
 		// Search along all coordinate directions
@@ -61,36 +151,113 @@ void PatternSolver::solve(const Function& function,
 
 		if (iter == 0) {
 			fval = function.evaluate(x);
+			if (use_cache) {
+				visited_points[mesh_key(mesh_x, 0, 0, mesh_level)] = fval;
+			}
 		}
 
+		// Trial point j is x + d * pattern_size * e_i, where
+		// i = j / 2 and d = -1 for even j and d = 1 for odd j.
+		const double required_value = fval - rho(pattern_size);
 		bool success = false;
-		for (size_t i = 0; i < n; ++i) {
-			dx.setZero();
-			//for d in {-1, 1}
-			for (double d = -1; d <= 1; d += 2) {
-				// Search along this coordinate axis in
-				// direction d.
-				dx[i] = d * pattern_size;
-				// Evaluate function in new point.
-				double fval_new = function.evaluate(x + dx);
-
-				// If we have sufficient decrease.
-				if (fval_new < fval - rho(pattern_size)) {
-					success = true;
-					x = x + dx;
-					fval = fval_new;
-					break;
-				}
+		size_t best_direction = 0;
+		double best_value = required_value;
+		// Records a trial point value. Returns true if the poll
+		// step should stop.
+		auto add_value = [&](size_t j, double value) -> bool
+		{
+			if (value < best_value) {
+				success = true;
+				best_direction = j;
+				best_value = value;
 			}
+			return success && this->opportunistic_polling;
+		};
+
+		bool poll_done = false;
+		for (size_t start = 0; start < 2 * n && !poll_done; start += batch_size) {
+			size_t end = std::min(start + batch_size, 2 * n);
 
-			if (success) {
+			batch_points.clear();
+			batch_directions.clear();
+			batch_keys.clear();
+			for (size_t j = start; j < end && !poll_done; ++j) {
+				size_t i = j / 2;
+				double d = j % 2 == 0 ? -1 : 1;
+
+				if (use_cache) {
+					auto key = mesh_key(mesh_x, i, static_cast<long long>(d), mesh_level);
+					auto itr = visited_points.find(key);
+					if (itr != visited_points.end()) {
+						poll_done = add_value(j, itr->second);
+						continue;
+					}
+					batch_keys.emplace_back(std::move(key));
+				}
+
+				auto& trial_point = trial_points[batch_points.size()];
+				trial_point = x;
+				trial_point[i] += d * pattern_size;
+				batch_points.push_back(&trial_point);
+				batch_directions.push_back(j);
+			}
+			if (poll_done) {
 				break;
 			}
+
+			if (this->opportunistic_polling) {
+				evaluator.evaluate(batch_points, &batch_values,
+				                   [required_value](double value) { return value < required_value; });
+			}
+			else {
+				evaluator.evaluate(batch_points, &batch_values);
+			}
+
+			// Go through the points in poll order. An opportunistic
+			// poll picks the first point with sufficient decrease
+			// even if a later one happens to be better.
+			for (size_t k = 0; k < batch_points.size(); ++k) {
+				double value = batch_values[k];
+				if (value != value) {
+					// Not evaluated.
+					continue;
+				}
+				if (use_cache) {
+					visited_points[batch_keys[k]] = value;
+				}
+				if (add_value(batch_directions[k], value)) {
+					poll_done = true;
+					break;
+				}
+			}
 		}
 
-		// If no point was found, decrease pattern size.
-		if (! success) {
+		if (success) {
+			size_t i = best_direction / 2;
+			double d = best_direction % 2 == 0 ? -1 : 1;
+			x[i] += d * pattern_size;
+			fval = best_value;
+			mesh_x[i] += static_cast<long long>(d);
+		}
+		else {
+			// If no point was found, decrease pattern size.
 			pattern_size /= 2.0;
+
+			if (use_cache) {
+				mesh_level++;
+				for (auto& k: mesh_x) {
+					k *= 2;
+					if (std::llabs(k) > (1LL << 52)) {
+						use_cache = false;
+					}
+				}
+				// Stop caching before the integer coordinates
+				// can overflow.
+				if (mesh_level > 60 || !use_cache) {
+					use_cache = false;
+					visited_points.clear();
+				}
+			}
 		}
 
 		results->function_evaluation_time += wall_time() - start_time;
@@ -152,7 +319,15 @@ void PatternSolver::solve(const Function& function,
 	}
 
 	function.copy_global_to_user(x);
+	results->iterations = iter;
 	results->total_time += wall_time() - global_start_time;
+	if (use_cache) {
+		// A key of n mesh coordinates and a value in each node.
+		memory_usage.record("mesh point cache",
+		                    visited_points.size() * (n * sizeof(long long) + 4 * sizeof(void*) + sizeof(double)));
+	}
+	memory_usage.add(function.get_memory_usage(), "Function: ");
+	results->memory_usage = memory_usage;
 
 	if (this->log_function) {
 		char str[1024];
@@ -161,4 +336,32 @@ void PatternSolver::solve(const Function& function,
 	}
 }
 
-}  // namespace spii
\ No newline at end of file
+MemoryUsage PatternSolver::estimate_memory_usage(const Function& function) const
+{
+	size_t n = function.get_number_of_scalars();
+	#ifdef USE_OPENMP
+		size_t number_of_threads = std::max(this->number_of_threads, 1);
+	#else
+		size_t number_of_threads = 1;
+	#endif
+	size_t batch_size = 1;
+	if (number_of_threads > 1) {
+		batch_size = std::min(2 * number_of_threads, 2 * n);
+	}
+
+	MemoryUsage estimate;
+	estimate.record("trial points", (batch_size + 1) * n * sizeof(double) + n * sizeof(long long));
+	if (this->cache_mesh_points) {
+		estimate.record("mesh point cache",
+		                size_t(this->maximum_iterations) * 2 * n
+		                * (n * sizeof(long long) + 4 * sizeof(void*) + sizeof(double)));
+	}
+	auto function_estimate = function.estimate_memory_usage(Function::Evaluation::GRADIENT);
+	if (number_of_threads > 1) {
+		estimate.record("function copies", number_of_threads * function_estimate.peak_total);
+	}
+	estimate.add(function_estimate, "Function: ");
+	return estimate;
+}
+
+}  // namespace spii
@@ -0,0 +1,573 @@
+#include <algorithm>
+#include <cmath>
+
+#include <spii/tape.h>
+
+namespace spii {
+
+namespace
+{
+	// First and second partial derivatives of an instruction
+	// with respect to its operands a and b.
+	struct Partials
+	{
+		double a = 0, b = 0;
+		double aa = 0, ab = 0, bb = 0;
+	};
+
+	bool is_binary(Tape::Operation operation)
+	{
+		return operation >= Tape::Operation::add && operation <= Tape::Operation::power;
+	}
+
+	// Partials of pow(a, c) with respect to a. The partials that
+	// vanish are exactly zero; otherwise, c * pow(a, c - 1) would be
+	// 0 * inf = NaN at a = 0.
+	void power_partials(double a, double c, Partials* p)
+	{
+		if (c == 0) {
+			return;
+		}
+		else if (c == 1) {
+			p->a = 1;
+		}
+		else if (c == 2) {
+			p->a = 2 * a;
+			p->aa = 2;
+		}
+		else {
+			p->a = c * std::pow(a, c - 1);
+			p->aa = c * (c - 1) * std::pow(a, c - 2);
+		}
+	}
+
+	// y is the value of the instruction.
+	Partials compute_partials(const Tape::Instruction& instruction,
+	                          const double* values,
+	                          double y)
+	{
+		typedef Tape::Operation Op;
+		Partials p;
+		double a = values[instruction.a];
+		double b = is_binary(instruction.operation) ? values[instruction.b] : 0.0;
+
+		switch (instruction.operation) {
+			case Op::input:
+			case Op::constant:
+				break;
+			case Op::add:
+				p.a = 1;
+				p.b = 1;
+				break;
+			case Op::subtract:
+				p.a = 1;
+				p.b = -1;
+				break;
+			case Op::multiply:
+				p.a = b;
+				p.b = a;
+				p.ab = 1;
+				break;
+			case Op::divide:
+				p.a = 1 / b;
+				p.b = -a / (b * b);
+				p.ab = -1 / (b * b);
+				p.bb = 2 * a / (b * b * b);
+				break;
+			case Op::power: {
+				power_partials(a, b, &p);
+				// The partials with respect to b have a factor
+				// log(a), but vanish at a = 0 for b > 0.
+				if (a != 0 || b <= 0) {
+					double log_a = std::log(a);
+					p.b = y * log_a;
+					p.ab = std::pow(a, b - 1) * (1 + b * log_a);
+					p.bb = y * log_a * log_a;
+				}
+				break;
+			}
+			case Op::negate:
+				p.a = -1;
+				break;
+			case Op::power_constant:
+				power_partials(a, instruction.c, &p);
+				break;
+			case Op::sin:
+				p.a = std::cos(a);
+				p.aa = -y;
+				break;
+			case Op::cos:
+				p.a = -std::sin(a);
+				p.aa = -y;
+				break;
+			case Op::tan:
+				p.a = 1 + y * y;
+				p.aa = 2 * y * p.a;
+				break;
+			case Op::asin:
+				p.a = 1 / std::sqrt(1 - a * a);
+				p.aa = a * p.a * p.a * p.a;
+				break;
+			case Op::acos:
+				p.a = -1 / std::sqrt(1 - a * a);
+				p.aa = a * p.a * p.a * p.a;
+				break;
+			case Op::atan:
+				p.a = 1 / (1 + a * a);
+				p.aa = -2 * a * p.a * p.a;
+				break;
+			case Op::exp:
+				p.a = y;
+				p.aa = y;
+				break;
+			case Op::log:
+				p.a = 1 / a;
+				p.aa = -1 / (a * a);
+				break;
+			case Op::sqrt:
+				p.a = 0.5 / y;
+				p.aa = -0.25 / (y * a);
+				break;
+			case Op::tanh:
+				p.a = 1 - y * y;
+				p.aa = -2 * y * p.a;
+				break;
+			case Op::abs:
+				p.a = a < 0 ? -1 : 1;
+				break;
+		}
+		return p;
+	}
+
+	double compute_value(const Tape::Instruction& instruction, const double* values)
+	{
+		typedef Tape::Operation Op;
+		double a = instruction.a >= 0 ? values[instruction.a] : 0.0;
+		double b = is_binary(instruction.operation) ? values[instruction.b] : 0.0;
+
+		switch (instruction.operation) {
+			case Op::input:          return 0;  // Set by the caller.
+			case Op::constant:       return instruction.c;
+			case Op::add:            return a + b;
+			case Op::subtract:       return a - b;
+			case Op::multiply:       return a * b;
+			case Op::divide:         return a / b;
+			case Op::power:          return std::pow(a, b);
+			case Op::negate:         return -a;
+			case Op::power_constant: return std::pow(a, instruction.c);
+			case Op::sin:            return std::sin(a);
+			case Op::cos:            return std::cos(a);
+			case Op::tan:            return std::tan(a);
+			case Op::asin:           return std::asin(a);
+			case Op::acos:           return std::acos(a);
+			case Op::atan:           return std::atan(a);
+			case Op::exp:            return std::exp(a);
+			case Op::log:            return std::log(a);
+			case Op::sqrt:           return std::sqrt(a);
+			case Op::tanh:           return std::tanh(a);
+			case Op::abs:            return std::abs(a);
+		}
+		return 0;
+	}
+
+	// Returns storage with at least n elements. Each thread has
+	// its own storage, so that tapes can be evaluated from
+	// several threads at once.
+	double* thread_storage(std::vector<double>* storage, std::size_t n)
+	{
+		if (storage->size() < n) {
+			storage->resize(n);
+		}
+		return storage->data();
+	}
+
+	thread_local std::vector<double> values_storage;
+	thread_local std::vector<double> tangents_storage;
+	thread_local std::vector<double> adjoints_storage;
+	thread_local std::vector<double> adjoint_tangents_storage;
+	thread_local std::vector<double> unit_vector_storage;
+}
+
+Tape::Tape()
+	: inputs(0), output(-1)
+{ }
+
+TapeValue Tape::add_input(double value)
+{
+	spii_assert(output < 0, "Tape::add_input: the output is already set.");
+	TapeValue result(value);
+	result.tape = this;
+	result.index = push(Operation::input, -1, -1, inputs);
+	inputs++;
+	return result;
+}
+
+void Tape::set_output(const TapeValue& value)
+{
+	output = index_of(value);
+}
+
+int Tape::number_of_inputs() const
+{
+	return inputs;
+}
+
+int Tape::get_output() const
+{
+	spii_assert(output >= 0, "Tape: no output set.");
+	return output;
+}
+
+std::size_t Tape::number_of_instructions() const
+{
+	return instructions.size();
+}
+
+const std::vector<Tape::Instruction>& Tape::get_instructions() const
+{
+	return instructions;
+}
+
+int Tape::push(Operation operation, int a, int b, double c)
+{
+	instructions.push_back({operation, a, b, c});
+	return static_cast<int>(instructions.size() - 1);
+}
+
+int Tape::index_of(const TapeValue& value)
+{
+	if (value.tape == nullptr) {
+		return push(Operation::constant, -1, -1, value.value);
+	}
+	spii_assert(value.tape == this, "Tape: value recorded on another tape.");
+	return value.index;
+}
+
+TapeValue Tape::record(Operation operation, const TapeValue& a, double value, double c)
+{
+	TapeValue result(value);
+	if (a.tape) {
+		result.tape = a.tape;
+		result.index = a.tape->push(operation, a.index, -1, c);
+	}
+	return result;
+}
+
+TapeValue Tape::record(Operation operation, const TapeValue& a, const TapeValue& b, double value)
+{
+	TapeValue result(value);
+	Tape* tape = a.tape ? a.tape : b.tape;
+	if (tape) {
+		int index_a = tape->index_of(a);
+		int index_b = tape->index_of(b);
+		result.tape = tape;
+		result.index = tape->push(operation, index_a, index_b, 0);
+	}
+	return result;
+}
+
+void Tape::forward(const double* x, double* values) const
+{
+	for (std::size_t k = 0; k < instructions.size(); ++k) {
+		const auto& instruction = instructions[k];
+		if (instruction.operation == Operation::input) {
+			values[k] = x[static_cast<int>(instruction.c)];
+		}
+		else {
+			values[k] = compute_value(instruction, values);
+		}
+	}
+}
+
+void Tape::forward_tangent(const double* values, const double* v, double* tangents) const
+{
+	for (std::size_t k = 0; k < instructions.size(); ++k) {
+		const auto& instruction = instructions[k];
+		if (instruction.operation == Operation::input) {
+			tangents[k] = v[static_cast<int>(instruction.c)];
+		}
+		else if (instruction.operation == Operation::constant) {
+			tangents[k] = 0;
+		}
+		else {
+			auto p = compute_partials(instruction, values, values[k]);
+			tangents[k] = p.a * tangents[instruction.a];
+			if (is_binary(instruction.operation)) {
+				tangents[k] += p.b * tangents[instruction.b];
+			}
+		}
+	}
+}
+
+void Tape::reverse(const double* values,
+                   const double* tangents,
+                   double* adjoints,
+                   double* adjoint_tangents,
+                   double* gradient,
+                   double* hessian_times_v) const
+{
+	std::fill(adjoints, adjoints + instructions.size(), 0.0);
+	adjoints[output] = 1;
+	if (tangents) {
+		std::fill(adjoint_tangents, adjoint_tangents + instructions.size(), 0.0);
+	}
+
+	for (int k = static_cast<int>(instructions.size()) - 1; k >= 0; --k) {
+		const auto& instruction = instructions[k];
+		if (instruction.operation == Operation::input) {
+			int i = static_cast<int>(instruction.c);
+			gradient[i] = adjoints[k];
+			if (tangents) {
+				hessian_times_v[i] = adjoint_tangents[k];
+			}
+			continue;
+		}
+		else if (instruction.operation == Operation::constant) {
+			continue;
+		}
+
+		double adjoint = adjoints[k];
+		if (! tangents) {
+			if (adjoint == 0) {
+				continue;
+			}
+			auto p = compute_partials(instruction, values, values[k]);
+			adjoints[instruction.a] += adjoint * p.a;
+			if (is_binary(instruction.operation)) {
+				adjoints[instruction.b] += adjoint * p.b;
+			}
+		}
+		else {
+			double adjoint_tangent = adjoint_tangents[k];
+			if (adjoint == 0 && adjoint_tangent == 0) {
+				continue;
+			}
+			auto p = compute_partials(instruction, values, values[k]);
+			double tangent_a = tangents[instruction.a];
+			if (is_binary(instruction.operation)) {
+				double tangent_b = tangents[instruction.b];
+				adjoints[instruction.a] += adjoint * p.a;
+				adjoints[instruction.b] += adjoint * p.b;
+				adjoint_tangents[instruction.a] += adjoint_tangent * p.a
+					+ adjoint * (p.aa * tangent_a + p.ab * tangent_b);
+				adjoint_tangents[instruction.b] += adjoint_tangent * p.b
+					+ adjoint * (p.ab * tangent_a + p.bb * tangent_b);
+			}
+			else {
+				adjoints[instruction.a] += adjoint * p.a;
+				adjoint_tangents[instruction.a] += adjoint_tangent * p.a
+					+ adjoint * p.aa * tangent_a;
+			}
+		}
+	}
+}
+
+double Tape::evaluate(const double* x) const
+{
+	spii_assert(output >= 0, "Tape: no output set.");
+	double* values = thread_storage(&values_storage, instructions.size());
+	forward(x, values);
+	return values[output];
+}
+
+double Tape::gradient(const double* x, double* gradient) const
+{
+	spii_assert(output >= 0, "Tape: no output set.");
+	double* values   = thread_storage(&values_storage, instructions.size());
+	double* adjoints = thread_storage(&adjoints_storage, instructions.size());
+	forward(x, values);
+	reverse(values, nullptr, adjoints, nullptr, gradient, nullptr);
+	return values[output];
+}
+
+double Tape::hessian_vector_product(const double* x,
+                                    const double* v,
+                                    double* gradient,
+                                    double* hessian_times_v) const
+{
+	spii_assert(output >= 0, "Tape: no output set.");
+	double* values           = thread_storage(&values_storage, instructions.size());
+	double* tangents         = thread_storage(&tangents_storage, instructions.size());
+	double* adjoints         = thread_storage(&adjoints_storage, instructions.size());
+	double* adjoint_tangents = thread_storage(&adjoint_tangents_storage, instructions.size());
+	forward(x, values);
+	forward_tangent(values, v, tangents);
+	reverse(values, tangents, adjoints, adjoint_tangents, gradient, hessian_times_v);
+	return values[output];
+}
+
+double Tape::hessian(const double* x, double* gradient, double* hessian) const
+{
+	spii_assert(output >= 0, "Tape: no output set.");
+	double* values           = thread_storage(&values_storage, instructions.size());
+	double* tangents         = thread_storage(&tangents_storage, instructions.size());
+	double* adjoints         = thread_storage(&adjoints_storage, instructions.size());
+	double* adjoint_tangents = thread_storage(&adjoint_tangents_storage, instructions.size());
+	double* unit_vector      = thread_storage(&unit_vector_storage, inputs);
+	std::fill(unit_vector, unit_vector + inputs, 0.0);
+
+	forward(x, values);
+	for (int j = 0; j < inputs; ++j) {
+		unit_vector[j] = 1;
+		forward_tangent(values, unit_vector, tangents);
+		reverse(values, tangents, adjoints, adjoint_tangents, gradient, &hessian[j * inputs]);
+		unit_vector[j] = 0;
+	}
+	return values[output];
+}
+
+TapeValue& TapeValue::operator += (const TapeValue& rhs)
+{
+	return *this = *this + rhs;
+}
+
+TapeValue& TapeValue::operator -= (const TapeValue& rhs)
+{
+	return *this = *this - rhs;
+}
+
+TapeValue& TapeValue::operator *= (const TapeValue& rhs)
+{
+	return *this = *this * rhs;
+}
+
+TapeValue& TapeValue::operator /= (const TapeValue& rhs)
+{
+	return *this = *this / rhs;
+}
+
+TapeValue operator + (const TapeValue& a, const TapeValue& b)
+{
+	return Tape::record(Tape::Operation::add, a, b, a.get_value() + b.get_value());
+}
+
+TapeValue operator - (const TapeValue& a, const TapeValue& b)
+{
+	return Tape::record(Tape::Operation::subtract, a, b, a.get_value() - b.get_value());
+}
+
+TapeValue operator * (const TapeValue& a, const TapeValue& b)
+{
+	return Tape::record(Tape::Operation::multiply, a, b, a.get_value() * b.get_value());
+}
+
+TapeValue operator / (const TapeValue& a, const TapeValue& b)
+{
+	return Tape::record(Tape::Operation::divide, a, b, a.get_value() / b.get_value());
+}
+
+TapeValue operator + (const TapeValue& a)
+{
+	return a;
+}
+
+TapeValue operator - (const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::negate, a, -a.get_value());
+}
+
+bool operator == (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() == b.get_value();
+}
+
+bool operator != (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() != b.get_value();
+}
+
+bool operator < (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() < b.get_value();
+}
+
+bool operator <= (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() <= b.get_value();
+}
+
+bool operator > (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() > b.get_value();
+}
+
+bool operator >= (const TapeValue& a, const TapeValue& b)
+{
+	return a.get_value() >= b.get_value();
+}
+
+TapeValue pow(const TapeValue& a, double b)
+{
+	return Tape::record(Tape::Operation::power_constant, a, std::pow(a.get_value(), b), b);
+}
+
+TapeValue pow(const TapeValue& a, const TapeValue& b)
+{
+	// A constant exponent does not need log(a).
+	if (b.is_constant()) {
+		return pow(a, b.get_value());
+	}
+	return Tape::record(Tape::Operation::power, a, b, std::pow(a.get_value(), b.get_value()));
+}
+
+TapeValue sqr(const TapeValue& a)
+{
+	return a * a;
+}
+
+TapeValue sin(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::sin, a, std::sin(a.get_value()));
+}
+
+TapeValue cos(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::cos, a, std::cos(a.get_value()));
+}
+
+TapeValue tan(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::tan, a, std::tan(a.get_value()));
+}
+
+TapeValue asin(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::asin, a, std::asin(a.get_value()));
+}
+
+TapeValue acos(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::acos, a, std::acos(a.get_value()));
+}
+
+TapeValue atan(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::atan, a, std::atan(a.get_value()));
+}
+
+TapeValue exp(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::exp, a, std::exp(a.get_value()));
+}
+
+TapeValue log(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::log, a, std::log(a.get_value()));
+}
+
+TapeValue sqrt(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::sqrt, a, std::sqrt(a.get_value()));
+}
+
+TapeValue tanh(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::tanh, a, std::tanh(a.get_value()));
+}
+
+TapeValue abs(const TapeValue& a)
+{
+	return Tape::record(Tape::Operation::abs, a, std::abs(a.get_value()));
+}
+
+}  // namespace spii
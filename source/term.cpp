@@ -1,9 +1,184 @@
 
+#include <algorithm>
+
 #include <spii/term.h>
 
 namespace spii
 {
 
+double Term::evaluate_upper_hessian(double * const * const variables,
+                                    std::vector<Eigen::VectorXd>* gradient,
+                                    std::vector< std::vector<Eigen::MatrixXd> >* hessian) const
+{
+	return evaluate(variables, gradient, hessian);
+}
+
+double Term::evaluate_flat(double * const * const variables,
+                           double* gradient,
+                           double* hessian,
+                           bool upper_only) const
+{
+	// Storage for the old interface. One per thread, since
+	// terms are evaluated from several threads at once.
+	static thread_local std::vector<Eigen::VectorXd> gradient_blocks;
+	static thread_local std::vector<std::vector<Eigen::MatrixXd>> hessian_blocks;
+
+	int n = number_of_variables();
+	gradient_blocks.resize(n);
+	for (int var = 0; var < n; ++var) {
+		gradient_blocks[var].resize(variable_dimension(var));
+	}
+
+	double value;
+	if (hessian) {
+		hessian_blocks.resize(n);
+		for (int var0 = 0; var0 < n; ++var0) {
+			hessian_blocks[var0].resize(n);
+			for (int var1 = 0; var1 < n; ++var1) {
+				hessian_blocks[var0][var1].resize(variable_dimension(var0),
+				                                  variable_dimension(var1));
+			}
+		}
+		if (upper_only) {
+			value = evaluate_upper_hessian(variables, &gradient_blocks, &hessian_blocks);
+		}
+		else {
+			value = evaluate(variables, &gradient_blocks, &hessian_blocks);
+		}
+	}
+	else {
+		value = evaluate(variables, &gradient_blocks);
+	}
+
+	int dimension = 0;
+	for (int var = 0; var < n; ++var) {
+		dimension += variable_dimension(var);
+	}
+
+	int offset0 = 0;
+	for (int var0 = 0; var0 < n; ++var0) {
+		int dim0 = variable_dimension(var0);
+		for (int i = 0; i < dim0; ++i) {
+			gradient[offset0 + i] = gradient_blocks[var0][i];
+		}
+
+		if (hessian) {
+			int offset1 = 0;
+			for (int var1 = 0; var1 < n; ++var1) {
+				int dim1 = variable_dimension(var1);
+				if ( ! upper_only || var0 <= var1) {
+					const auto& block = hessian_blocks[var0][var1];
+					for (int j = 0; j < dim1; ++j) {
+						for (int i = 0; i < dim0; ++i) {
+							hessian[(offset0 + i) + dimension * (offset1 + j)] = block(i, j);
+						}
+					}
+				}
+				offset1 += dim1;
+			}
+		}
+		offset0 += dim0;
+	}
+
+	return value;
+}
+
+double Term::evaluate_flat_active(double * const * const variables,
+                                  const bool* active,
+                                  double* gradient,
+                                  double* hessian,
+                                  bool upper_only) const
+{
+	int n = number_of_variables();
+	if (std::all_of(active, active + n, [](bool a) { return a; })) {
+		return evaluate_flat(variables, gradient, hessian, upper_only);
+	}
+
+	static thread_local std::vector<double> full_gradient;
+	static thread_local std::vector<double> full_hessian;
+	// Offsets of all variables in the full layout.
+	static thread_local std::vector<int> full_offsets;
+
+	full_offsets.assign(1, 0);
+	for (int var = 0; var < n; ++var) {
+		full_offsets.push_back(full_offsets.back() + variable_dimension(var));
+	}
+	int dimension = full_offsets.back();
+	full_gradient.resize(dimension);
+	if (hessian) {
+		full_hessian.resize(dimension * dimension);
+	}
+
+	double value = evaluate_flat(variables,
+	                             full_gradient.data(),
+	                             hessian ? full_hessian.data() : nullptr,
+	                             upper_only);
+
+	int active_dimension = 0;
+	for (int var = 0; var < n; ++var) {
+		if (active[var]) {
+			active_dimension += variable_dimension(var);
+		}
+	}
+
+	int offset0 = 0;
+	for (int var0 = 0; var0 < n; ++var0) {
+		if ( ! active[var0]) {
+			continue;
+		}
+		int dim0 = variable_dimension(var0);
+		for (int i = 0; i < dim0; ++i) {
+			gradient[offset0 + i] = full_gradient[full_offsets[var0] + i];
+		}
+
+		if (hessian) {
+			int offset1 = 0;
+			for (int var1 = 0; var1 < n; ++var1) {
+				if ( ! active[var1]) {
+					continue;
+				}
+				int dim1 = variable_dimension(var1);
+				if ( ! upper_only || var0 <= var1) {
+					for (int j = 0; j < dim1; ++j) {
+						for (int i = 0; i < dim0; ++i) {
+							hessian[(offset0 + i) + active_dimension * (offset1 + j)] =
+								full_hessian[(full_offsets[var0] + i) + dimension * (full_offsets[var1] + j)];
+						}
+					}
+				}
+				offset1 += dim1;
+			}
+		}
+		offset0 += dim0;
+	}
+
+	return value;
+}
+
+void Term::evaluate_many(double * const * const * const variables,
+                         int number_of_points,
+                         double* values) const
+{
+	for (int k = 0; k < number_of_points; ++k) {
+		values[k] = evaluate(variables[k]);
+	}
+}
+
+void Term::evaluate_many(double * const * const * const variables,
+                         int number_of_points,
+                         double* values,
+                         std::vector<std::vector<Eigen::VectorXd>>* gradients) const
+{
+	for (int k = 0; k < number_of_points; ++k) {
+		values[k] = evaluate(variables[k], &(*gradients)[k]);
+	}
+}
+
+bool Term::has_constant_hessian() const
+{
+	return false;
+}
+
 // This function only needs to be implemented if interval arithmetic is
 // desired.
 Interval<double> Term::evaluate_interval(const Interval<double> * const * const variables) const
@@ -0,0 +1,104 @@
+#include <chrono>
+#include <set>
+
+#include <spii/trace.h>
+
+namespace spii {
+
+namespace {
+thread_local Trace* active_trace = nullptr;
+}
+
+Trace::Trace()
+	: creation_time(now())
+{ }
+
+double Trace::now()
+{
+	typedef std::chrono::steady_clock Clock;
+	return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+Trace* Trace::active()
+{
+	return active_trace;
+}
+
+void Trace::set_active(Trace* trace)
+{
+	active_trace = trace;
+}
+
+void Trace::add_span(const char* name,
+                     const char* category,
+                     double start_time,
+                     double end_time,
+                     int thread,
+                     int iteration)
+{
+	Span span;
+	span.name       = name;
+	span.category   = category;
+	span.start_time = start_time - creation_time;
+	span.duration   = end_time - start_time;
+	span.thread     = thread;
+	span.iteration  = iteration;
+
+	std::lock_guard<std::mutex> lock(spans_mutex);
+	spans.push_back(span);
+}
+
+const std::vector<Trace::Span>& Trace::get_spans() const
+{
+	return spans;
+}
+
+void Trace::clear()
+{
+	std::lock_guard<std::mutex> lock(spans_mutex);
+	spans.clear();
+}
+
+void Trace::write_chrome_trace(std::ostream& out) const
+{
+	// Time stamps are in microseconds.
+	auto precision = out.precision(3);
+	auto flags = out.setf(std::ios::fixed, std::ios::floatfield);
+
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	std::set<int> threads;
+	bool first = true;
+	for (const auto& span: spans) {
+		if (!first) {
+			out << ",\n";
+		}
+		first = false;
+		threads.insert(span.thread);
+
+		out << "{\"name\": \"" << span.name << "\""
+		    << ", \"cat\": \"" << span.category << "\""
+		    << ", \"ph\": \"X\""
+		    << ", \"ts\": " << 1e6 * span.start_time
+		    << ", \"dur\": " << 1e6 * span.duration
+		    << ", \"pid\": 1"
+		    << ", \"tid\": " << span.thread;
+		if (span.iteration >= 0) {
+			out << ", \"args\": {\"iteration\": " << span.iteration << "}";
+		}
+		out << "}";
+	}
+	for (int thread: threads) {
+		if (!first) {
+			out << ",\n";
+		}
+		first = false;
+		out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+		    << ", \"args\": {\"name\": \"thread " << thread << "\"}}";
+	}
+	out << "\n]}\n";
+
+	out.precision(precision);
+	out.flags(flags);
+}
+
+}  // namespace spii
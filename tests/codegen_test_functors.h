@@ -0,0 +1,68 @@
+#ifndef SPII_CODEGEN_TEST_FUNCTORS_H
+#define SPII_CODEGEN_TEST_FUNCTORS_H
+//
+// Functors used by generate_test_terms.cpp and test_codegen.cpp.
+//
+
+#include <cmath>
+
+struct RosenbrockExp
+{
+	template<typename R>
+	R operator()(const R* x, const R* y) const
+	{
+		using std::exp;
+		using std::sin;
+		R d0 = 1.0 - x[0];
+		R d1 = y[0] - x[0]*x[0];
+		return d0*d0 + 100.0*d1*d1 + sin(y[1]) * exp(x[0] * y[1]);
+	}
+};
+
+struct Quadratic
+{
+	template<typename R>
+	R operator()(const R* x) const
+	{
+		return 2.0*x[0]*x[0] + x[1]*x[1] + 3.0*x[2]*x[2] + x[0]*x[1] - x[2];
+	}
+};
+
+struct Rational
+{
+	template<typename R>
+	R operator()(const R* x, const R* y, const R* z) const
+	{
+		using std::atan;
+		using std::sqrt;
+		using std::pow;
+		R r = sqrt(x[0]*x[0] + y[0]*y[0] + 1.0);
+		return atan(z[0] / r) + pow(x[0] + 2.0, 3.0) / (y[0]*y[0] + 1.0);
+	}
+};
+
+// a and b are recorded as parameters when generating code.
+struct Scaled
+{
+	Scaled(double a_, double b_)
+		: a(a_), b(b_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* x) const
+	{
+		return residual(x, R(a), R(b));
+	}
+
+	template<typename R>
+	static R residual(const R* x, const R& a, const R& b)
+	{
+		using std::log;
+		R r = a*x[0] - b;
+		return r*r + a * log(1.0 + x[1]*x[1]);
+	}
+
+	double a, b;
+};
+
+#endif
@@ -0,0 +1,43 @@
+// Generates the terms used by test_codegen.cpp. Run at build time by
+// spii_generate_terms.
+//
+
+#include <iostream>
+
+#include <spii/codegen.h>
+
+#include "codegen_test_functors.h"
+
+using namespace spii;
+
+int main_function(int argc, char* argv[])
+{
+	check(argc == 2, "Usage: ", argv[0], " <output header>");
+
+	std::vector<std::string> classes;
+	classes.push_back(generate_auto_diff_term_code<1, 2>("GeneratedRosenbrockExp", RosenbrockExp()));
+	classes.push_back(generate_auto_diff_term_code<3>("GeneratedQuadratic", Quadratic()));
+	classes.push_back(generate_auto_diff_term_code<1, 1, 1>("GeneratedRational", Rational()));
+
+	// The constants of Scaled are recorded as parameters.
+	Tape tape;
+	TapeValue x[2] = {tape.add_input(1.0), tape.add_input(1.0)};
+	TapeValue a = tape.add_input(1.0);
+	TapeValue b = tape.add_input(1.0);
+	tape.set_output(Scaled::residual(x, a, b));
+	classes.push_back(generate_term_code("GeneratedScaled", tape, {2}, 2));
+
+	write_generated_terms(argv[1], classes);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		return main_function(argc, argv);
+	}
+	catch (std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,144 @@
+// Petter Strandmark 2013
+//
+// Loads a problem from the NIST data files. The code has been
+// adapted from Ceres, see http://code.google.com/ceres-solver .
+//
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+void skip_lines(std::istream* in, int num_lines)
+{
+	std::string str;
+	for (int i = 0; i < num_lines; ++i) {
+		std::getline(*in, str);
+	}
+}
+
+void split_string(const std::string& str, std::vector<std::string>* tokens)
+{
+	std::stringstream sin(str);
+	tokens->clear();
+	while (true) {
+		std::string s;
+		sin >> s;
+		if (sin) {
+			tokens->push_back(s);
+		}
+		else {
+			break;
+		}
+	}
+}
+
+template<typename T>
+T convert(const std::string& str)
+{
+	std::stringstream sin(str);
+	T t;
+	sin >> t;
+	if (!sin) {
+		throw std::runtime_error("Conversion failed.");
+	}
+	return t;
+}
+
+void get_and_split_line(std::istream* in, std::vector<std::string>* tokens)
+{
+	std::string str;
+	std::getline(*in, str);
+	split_string(str, tokens);
+}
+
+class NISTProblem
+{
+public:
+	NISTProblem(std::string filename)
+	{
+		std::ifstream fin(filename);
+		if (!fin) {
+			// Perhaps we are running the command from the root
+			// project folder.
+			filename = "bin/" + filename;
+			fin.open(filename);
+			if (!fin) {
+				// Perhaps we are running the command from the test
+				// project folder.
+				filename = "../" + filename;
+				fin.open(filename);
+				if (!fin) {
+					std::string error = "Failed to open ";
+					error += filename;
+					throw std::runtime_error(error.c_str());
+				}
+			}
+		}
+		std::vector<std::string> tokens;
+
+		skip_lines(&fin, 24);
+		get_and_split_line(&fin, &tokens);
+		const int num_responses = convert<int>(tokens.at(1));
+
+		get_and_split_line(&fin, &tokens);
+		const int num_predictors = convert<int>(tokens.at(0));
+
+		get_and_split_line(&fin, &tokens);
+		const int num_observations = convert<int>(tokens.at(0));
+
+		skip_lines(&fin, 4);
+		get_and_split_line(&fin, &tokens);
+		const int num_parameters = convert<int>(tokens.at(0));
+		skip_lines(&fin, 8);
+
+		get_and_split_line(&fin, &tokens);
+		const int num_tries = static_cast<int>(tokens.size() - 4);
+
+		this->predictor.resize(num_observations, num_predictors);
+		this->response.resize(num_observations, num_responses);
+		this->initial_parameters.resize(num_tries, num_parameters);
+		this->final_parameters.resize(1, num_parameters);
+
+		int parameter_id = 0;
+		for (int i = 0; i < num_tries; ++i) {
+			this->initial_parameters(i, parameter_id) =
+				convert<double>(tokens.at(i + 2));
+		}
+		final_parameters(0, parameter_id) =
+			convert<double>(tokens.at(2 + num_tries));
+
+		for (parameter_id = 1; parameter_id < num_parameters; ++parameter_id) {
+			get_and_split_line(&fin, &tokens);
+				for (int i = 0; i < num_tries; ++i) {
+				this->initial_parameters(i, parameter_id) =
+					convert<double>(tokens.at(i + 2));
+			}
+			final_parameters(0, parameter_id) =
+				convert<double>(tokens.at(2 + num_tries));
+		}
+
+		skip_lines(&fin, 1);
+		get_and_split_line(&fin, &tokens);
+		this->certified_cost = convert<double>(tokens.at(4));
+
+		skip_lines(&fin, 18 - num_parameters);
+		for (int i = 0; i < num_observations; ++i) {
+			get_and_split_line(&fin, &tokens);
+			for (int j = 0; j < num_responses; ++j) {
+				this->response(i, j) = convert<double>(tokens.at(j));
+			}
+
+			for (int j = 0; j < num_predictors; ++j) {
+				this->predictor(i, j) =
+					convert<double>(tokens.at(j + num_responses));
+			}
+		}
+	}
+
+	Eigen::MatrixXd predictor, response, initial_parameters, final_parameters;
+	double certified_cost;
+};
@@ -0,0 +1,147 @@
+// Include this file in a file defining the macro
+// NIST_PROBLEM(Category, Problem, num_variables), which is
+// expanded once for every problem after its model has been
+// defined. The data are loaded with NISTProblem in nist_problem.h
+// from "nist/" #Problem ".dat".
+//
+// Petter Strandmark 2013
+//
+
+#define NIST_TEST_START(Problem)         \
+struct Problem                           \
+{                                        \
+	double x_param, y_param;             \
+	Problem(double x, double y)          \
+	{                                    \
+		this->x_param = x;               \
+		this->y_param = y;               \
+	}                                    \
+	template<typename R>                 \
+	R operator()(const R* const b) const \
+	{                                    \
+		const R x(x_param);              \
+		const R y(y_param);              \
+		R d = y - (                      \
+
+#define NIST_TEST_END(Category, Problem, n) \
+		);                               \
+		return d*d;                      \
+	}                                    \
+};                                       \
+NIST_PROBLEM(Category, Problem, n)
+
+const double kPi = 3.141592653589793238462643383279;
+
+NIST_TEST_START(Bennett5)
+	b[0] * pow(b[1] + x, R(-1.0) / b[2])
+NIST_TEST_END(Hard, Bennett5, 3)
+
+NIST_TEST_START(BoxBOD)
+  b[0] * (R(1.0) - exp(-b[1] * x))
+NIST_TEST_END(Hard, BoxBOD, 2)
+
+NIST_TEST_START(Chwirut1)
+  exp(-b[0] * x) / (b[1] + b[2] * x)
+NIST_TEST_END(Easy, Chwirut1, 3)
+
+NIST_TEST_START(Chwirut2)
+  exp(-b[0] * x) / (b[1] + b[2] * x)
+NIST_TEST_END(Easy, Chwirut2, 3)
+
+NIST_TEST_START(DanWood)
+  b[0] * pow(x, b[1])
+NIST_TEST_END(Easy, DanWood, 2)
+
+NIST_TEST_START(Gauss1)
+  b[0] * exp(-b[1] * x) +
+  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
+  b[5] * exp(-pow((x - b[6])/b[7],2))
+NIST_TEST_END(Easy, Gauss1, 8)
+
+NIST_TEST_START(Gauss2)
+  b[0] * exp(-b[1] * x) +
+  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
+  b[5] * exp(-pow((x - b[6])/b[7],2))
+NIST_TEST_END(Medium, Gauss2, 8)
+
+NIST_TEST_START(Gauss3)
+  b[0] * exp(-b[1] * x) +
+  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
+  b[5] * exp(-pow((x - b[6])/b[7],2))
+NIST_TEST_END(Medium, Gauss3, 8)
+
+NIST_TEST_START(Lanczos1)
+  b[0] * exp(-b[1] * x) + b[2] * exp(-b[3] * x) + b[4] * exp(-b[5] * x)
+NIST_TEST_END(Medium, Lanczos1, 6)
+
+NIST_TEST_START(Lanczos2)
+  b[0] * exp(-b[1] * x) + b[2] * exp(-b[3] * x) + b[4] * exp(-b[5] * x)
+NIST_TEST_END(Medium, Lanczos2, 6)
+
+NIST_TEST_START(Hahn1)
+  (b[0] + b[1] * x + b[2] * x * x + b[3] * x * x * x) /
+  (R(1.0) + b[4] * x + b[5] * x * x + b[6] * x * x * x)
+NIST_TEST_END(Medium, Hahn1, 7)
+
+NIST_TEST_START(Kirby2)
+  (b[0] + b[1] * x + b[2] * x * x) /
+  (R(1.0) + b[3] * x + b[4] * x * x)
+NIST_TEST_END(Medium, Kirby2, 5)
+
+NIST_TEST_START(MGH09)
+  b[0] * (x * x + x * b[1]) / (x * x + x * b[2] + b[3])
+NIST_TEST_END(Hard, MGH09, 4)
+
+NIST_TEST_START(MGH10)
+  b[0] * exp(b[1] / (x + b[2]))
+NIST_TEST_END(Hard, MGH10, 3)
+
+NIST_TEST_START(MGH17)
+  b[0] + b[1] * exp(-x * b[3]) + b[2] * exp(-x * b[4])
+NIST_TEST_END(Medium, MGH17, 5)
+
+NIST_TEST_START(Misra1a)
+  b[0] * (R(1.0) - exp(-b[1] * x))
+NIST_TEST_END(Easy, Misra1a, 2)
+
+NIST_TEST_START(Misra1b)
+  b[0] * (R(1.0) - R(1.0)/ ((R(1.0) + b[1] * x / 2.0) * (R(1.0) + b[1] * x / 2.0)))
+NIST_TEST_END(Easy, Misra1b, 2)
+
+NIST_TEST_START(Misra1c)
+  b[0] * (R(1.0) - pow(R(1.0) + R(2.0) * b[1] * x, -0.5))
+NIST_TEST_END(Medium, Misra1c, 2)
+
+NIST_TEST_START(Misra1d)
+  b[0] * b[1] * x / (R(1.0) + b[1] * x)
+NIST_TEST_END(Medium, Misra1d, 2)
+
+NIST_TEST_START(Roszman1)
+  b[0] - b[1] * x - atan(b[2] / (x - b[3]))/R(kPi)
+NIST_TEST_END(Medium, Roszman1, 4)
+
+NIST_TEST_START(Rat42)
+  b[0] / (R(1.0) + exp(b[1] - b[2] * x))
+NIST_TEST_END(Hard, Rat42, 3)
+
+NIST_TEST_START(Rat43)
+  b[0] / pow(R(1.0) + exp(b[1] - b[2] * x), R(1.0) / b[3])
+NIST_TEST_END(Hard, Rat43, 4)
+
+NIST_TEST_START(Thurber)
+  (b[0] + b[1] * x + b[2] * x * x  + b[3] * x * x * x) /
+  (R(1.0) + b[4] * x + b[5] * x * x + b[6] * x * x * x)
+NIST_TEST_END(Hard, Thurber, 7)
+
+NIST_TEST_START(ENSO)
+  b[0] + b[1] * cos(R(2.0 * kPi) * x / R(12.0)) +
+         b[2] * sin(R(2.0 * kPi) * x / R(12.0)) +
+         b[4] * cos(R(2.0 * kPi) * x / b[3]) +
+         b[5] * sin(R(2.0 * kPi) * x / b[3]) +
+         b[7] * cos(R(2.0 * kPi) * x / b[6]) +
+         b[8] * sin(R(2.0 * kPi) * x / b[6])
+NIST_TEST_END(Medium, ENSO, 9)
+
+NIST_TEST_START(Eckerle4)
+  b[0] / b[1] * exp(R(-0.5) * pow((x - b[2])/b[1], 2))
+NIST_TEST_END(Hard, Eckerle4, 3)
@@ -0,0 +1,142 @@
+#include <random>
+
+#include <catch.hpp>
+
+#include <spii/auto_diff_term.h>
+#include <spii/codegen.h>
+#include <spii/function.h>
+
+#include "codegen_test_functors.h"
+#include "test_terms.h"
+
+using namespace spii;
+
+namespace
+{
+	void check_terms_equal(const Term& expected, const Term& term, std::vector<Eigen::VectorXd> x)
+	{
+		REQUIRE(expected.number_of_variables() == term.number_of_variables());
+		std::vector<double*> variables;
+		std::vector<Eigen::VectorXd> g1, g2;
+		std::vector<std::vector<Eigen::MatrixXd>> H1, H2;
+		int n = 0;
+		for (int var = 0; var < term.number_of_variables(); ++var) {
+			int d = term.variable_dimension(var);
+			REQUIRE(expected.variable_dimension(var) == d);
+			variables.push_back(x[var].data());
+			g1.emplace_back(d);
+			g2.emplace_back(d);
+			n += d;
+		}
+		H1.resize(term.number_of_variables());
+		H2.resize(term.number_of_variables());
+		for (int var0 = 0; var0 < term.number_of_variables(); ++var0) {
+			for (int var1 = 0; var1 < term.number_of_variables(); ++var1) {
+				H1[var0].emplace_back(term.variable_dimension(var0), term.variable_dimension(var1));
+				H2[var0].emplace_back(term.variable_dimension(var0), term.variable_dimension(var1));
+			}
+		}
+
+		CHECK(Approx(expected.evaluate(variables.data())) == term.evaluate(variables.data()));
+
+		double value1 = expected.evaluate(variables.data(), &g1);
+		double value2 = term.evaluate(variables.data(), &g2);
+		CHECK(Approx(value1) == value2);
+		for (int var = 0; var < term.number_of_variables(); ++var) {
+			CHECK((g1[var] - g2[var]).norm() <= 1e-10 * (1 + g1[var].norm()));
+		}
+
+		value1 = expected.evaluate(variables.data(), &g1, &H1);
+		value2 = term.evaluate(variables.data(), &g2, &H2);
+		CHECK(Approx(value1) == value2);
+		for (int var0 = 0; var0 < term.number_of_variables(); ++var0) {
+			CHECK((g1[var0] - g2[var0]).norm() <= 1e-10 * (1 + g1[var0].norm()));
+			for (int var1 = 0; var1 < term.number_of_variables(); ++var1) {
+				CHECK((H1[var0][var1] - H2[var0][var1]).norm() <= 1e-10 * (1 + H1[var0][var1].norm()));
+			}
+		}
+
+		// The flat interface should agree with the generic adapter.
+		std::vector<double> flat_gradient1(n), flat_gradient2(n);
+		std::vector<double> flat_hessian1(n * n), flat_hessian2(n * n);
+		value1 = term.Term::evaluate_flat(variables.data(), flat_gradient1.data(), flat_hessian1.data(), false);
+		value2 = term.evaluate_flat(variables.data(), flat_gradient2.data(), flat_hessian2.data(), false);
+		CHECK(Approx(value1) == value2);
+		for (int i = 0; i < n; ++i) {
+			CHECK(Approx(flat_gradient1[i]) == flat_gradient2[i]);
+		}
+		for (int i = 0; i < n * n; ++i) {
+			CHECK(Approx(flat_hessian1[i]) == flat_hessian2[i]);
+		}
+	}
+}
+
+TEST_CASE("Codegen/matches_auto_diff_term")
+{
+	std::mt19937 engine(0);
+	std::uniform_real_distribution<double> rand(0.1, 2.0);
+	auto random_vector = [&](int n)
+	{
+		Eigen::VectorXd v(n);
+		for (int i = 0; i < n; ++i) {
+			v[i] = rand(engine);
+		}
+		return v;
+	};
+
+	for (int iter = 0; iter < 5; ++iter) {
+		check_terms_equal(AutoDiffTerm<RosenbrockExp, 1, 2>(),
+		                  GeneratedRosenbrockExp(),
+		                  {random_vector(1), random_vector(2)});
+		check_terms_equal(AutoDiffTerm<Quadratic, 3>(),
+		                  GeneratedQuadratic(),
+		                  {random_vector(3)});
+		check_terms_equal(AutoDiffTerm<Rational, 1, 1, 1>(),
+		                  GeneratedRational(),
+		                  {random_vector(1), random_vector(1), random_vector(1)});
+
+		double parameters[] = {rand(engine), rand(engine)};
+		check_terms_equal(AutoDiffTerm<Scaled, 2>(parameters[0], parameters[1]),
+		                  GeneratedScaled(parameters),
+		                  {random_vector(2)});
+	}
+}
+
+TEST_CASE("Codegen/constant_hessian")
+{
+	CHECK(GeneratedQuadratic().has_constant_hessian());
+	CHECK(! GeneratedRosenbrockExp().has_constant_hessian());
+	CHECK(! GeneratedScaled(std::vector<double>{1, 2}.data()).has_constant_hessian());
+}
+
+TEST_CASE("Codegen/structural_zeros")
+{
+	// The Hessian of Quadratic only contains constants.
+	auto code = generate_auto_diff_term_code<3>("Test", Quadratic());
+	CHECK(code.find("hessian[6] = 0.0;") != std::string::npos);
+	CHECK(code.find("hessian[0] = 4.0;") != std::string::npos);
+}
+
+TEST_CASE("Codegen/in_function")
+{
+	Function f1, f2;
+	double x1[1] = {0.5}, y1[2] = {0.3, 0.7};
+	double x2[1] = {0.5}, y2[2] = {0.3, 0.7};
+	f1.add_term(std::make_shared<AutoDiffTerm<RosenbrockExp, 1, 2>>(), x1, y1);
+	f2.add_term(std::make_shared<GeneratedRosenbrockExp>(), x2, y2);
+
+	Eigen::VectorXd x(3), g1, g2;
+	x << 0.5, 0.3, 0.7;
+	Eigen::MatrixXd H1, H2;
+	CHECK(Approx(f1.evaluate(x, &g1, &H1)) == f2.evaluate(x, &g2, &H2));
+	CHECK((g1 - g2).norm() <= 1e-10 * (1 + g1.norm()));
+	CHECK((H1 - H2).norm() <= 1e-10 * (1 + H1.norm()));
+}
+
+TEST_CASE("Codegen/wrong_number_of_inputs")
+{
+	Tape tape;
+	TapeValue x = tape.add_input(1.0);
+	tape.set_output(x * x);
+	CHECK_THROWS(generate_term_code("Test", tape, {2}));
+}
@@ -354,3 +354,85 @@ TEST_CASE("AutoDiffTerm/MyFunctor4")
 	CHECK(Approx(hessian[3][2](1,2)) == 0.0);
 }
 
+
+class SumOfProducts
+{
+public:
+	SumOfProducts(int d0_, int d1_)
+		: d0(d0_), d1(d1_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R value = 0.0;
+		for (int i = 0; i < d0; ++i) {
+			for (int j = 0; j < d1; ++j) {
+				value += sin(x[i] * y[j]) + double(i + 1) * x[i] * x[i] * y[j];
+			}
+		}
+		return value;
+	}
+
+private:
+	int d0, d1;
+};
+
+// Terms of different sizes are evaluated with stack storage or
+// with the arena. All should agree with the Hessian evaluation.
+TEST_CASE("AutoDiffTerm/dynamic_evaluate_flat")
+{
+	const int sizes[][2] = {{1, 2}, {3, 4}, {4, 6}, {10, 12}, {3, 4}, {10, 12}};
+	for (auto& size: sizes) {
+		int d0 = size[0];
+		int d1 = size[1];
+		int n = d0 + d1;
+		AutoDiffTerm<SumOfProducts, Dynamic, Dynamic> term(d0, d1, d0, d1);
+
+		std::vector<double> x(d0), y(d1);
+		for (int i = 0; i < d0; ++i) {
+			x[i] = 0.1 * i + 0.3;
+		}
+		for (int j = 0; j < d1; ++j) {
+			y[j] = 0.2 * j - 0.5;
+		}
+		std::vector<double*> variables = {x.data(), y.data()};
+
+		std::vector<Eigen::VectorXd> gradient = {Eigen::VectorXd(d0), Eigen::VectorXd(d1)};
+		std::vector< std::vector<Eigen::MatrixXd> > hessian(2);
+		for (int var0 = 0; var0 < 2; ++var0) {
+			hessian[var0].resize(2);
+			for (int var1 = 0; var1 < 2; ++var1) {
+				hessian[var0][var1].resize(size[var0], size[var1]);
+			}
+		}
+		double value = term.evaluate(variables.data(), &gradient, &hessian);
+
+		std::vector<double> flat_gradient(n), flat_hessian(n * n);
+		CHECK(Approx(term.evaluate_flat(variables.data(), flat_gradient.data(), nullptr, false)) == value);
+		for (int i = 0; i < d0; ++i) {
+			CHECK(Approx(flat_gradient[i]) == gradient[0](i));
+		}
+		for (int j = 0; j < d1; ++j) {
+			CHECK(Approx(flat_gradient[d0 + j]) == gradient[1](j));
+		}
+
+		CHECK(Approx(term.evaluate_flat(variables.data(), flat_gradient.data(), flat_hessian.data(), false)) == value);
+		const int offsets[] = {0, d0};
+		for (int var0 = 0; var0 < 2; ++var0) {
+			for (int var1 = 0; var1 < 2; ++var1) {
+				for (int i = 0; i < size[var0]; ++i) {
+					for (int j = 0; j < size[var1]; ++j) {
+						CHECK(Approx(flat_hessian[(offsets[var0] + i) + n * (offsets[var1] + j)])
+						      == hessian[var0][var1](i, j));
+					}
+				}
+			}
+		}
+
+		std::vector<Eigen::VectorXd> gradient2 = {Eigen::VectorXd(d0), Eigen::VectorXd(d1)};
+		CHECK(Approx(term.evaluate(variables.data(), &gradient2)) == value);
+		CHECK((gradient2[0] - gradient[0]).norm() < 1e-10);
+		CHECK((gradient2[1] - gradient[1]).norm() < 1e-10);
+	}
+}
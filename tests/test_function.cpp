@@ -1,5 +1,9 @@
 // Petter Strandmark 2012-2013.
 
+#include <limits>
+#include <sstream>
+#include <string>
+
 #include <catch.hpp>
 #include <spii/google_test_compatibility.h>
 
@@ -376,6 +380,192 @@ TEST(Function, copy_and_assignment)
 	REQUIRE(counter == 1);
 }
 
+TEST(Function, copy_keeps_global_indices_and_constants)
+{
+	double data[4] = {1.0, 2.0, 3.0, 4.0};
+	double* x = &data[2];
+	double* y = &data[0];
+	double* z = &data[1];
+
+	Function f;
+	// Not added in memory order.
+	f.add_variable(x, 2);
+	f.add_variable(y, 1);
+	f.add_variable(z, 1);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, z);
+	f.set_constant(y, true);
+
+	Function f_copy(f);
+	EXPECT_EQ(f_copy.get_number_of_scalars(), f.get_number_of_scalars());
+	EXPECT_EQ(f_copy.get_variable_global_index(x), f.get_variable_global_index(x));
+	EXPECT_EQ(f_copy.get_variable_global_index(z), f.get_variable_global_index(z));
+
+	Eigen::VectorXd xg(3);
+	xg << 6.0, 7.0, 8.0;
+	EXPECT_EQ(f_copy.evaluate(xg), f.evaluate(xg));
+}
+
+
+TEST(Function, set_constant_batched)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {3.0};
+	double z[1] = {4.0};
+
+	Function f, f_ref;
+	for (auto function: {&f, &f_ref}) {
+		function->add_variable(x, 2);
+		function->add_variable(y, 1);
+		function->add_variable(z, 1);
+		function->add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+		function->add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, z);
+	}
+
+	f.set_constant({x, z}, true);
+	f_ref.set_constant(x, true);
+	f_ref.set_constant(z, true);
+	EXPECT_EQ(f.get_number_of_scalars(), 1);
+	EXPECT_EQ(f.get_variable_global_index(y), f_ref.get_variable_global_index(y));
+
+	// Alternate between two sets of constant variables, as in
+	// block-coordinate descent. The sparsity patterns are reused
+	// when a set repeats. The storage is not, since it is only kept
+	// when the set is the same as at the last evaluation.
+	for (int iteration = 0; iteration < 3; ++iteration) {
+		for (int set = 0; set < 2; ++set) {
+			f.set_constant({x, y, z}, false);
+			f.set_constant(set == 0 ? std::vector<double*>{x} : std::vector<double*>{y, z}, true);
+			Function f_fresh;
+			f_fresh.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+			f_fresh.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, z);
+			f_fresh.set_constant(set == 0 ? std::vector<double*>{x} : std::vector<double*>{y, z}, true);
+			EXPECT_EQ(f.get_number_of_scalars(), f_fresh.get_number_of_scalars());
+
+			Eigen::VectorXd xg(f.get_number_of_scalars());
+			f.copy_user_to_global(&xg);
+			Eigen::VectorXd gradient, gradient_fresh;
+			Eigen::SparseMatrix<double> H, H_fresh;
+			f.create_sparse_hessian(&H);
+			f_fresh.create_sparse_hessian(&H_fresh);
+			EXPECT_EQ(H.nonZeros(), H_fresh.nonZeros());
+			EXPECT_EQ(f.evaluate(xg, &gradient, &H), f_fresh.evaluate(xg, &gradient_fresh, &H_fresh));
+			CHECK((gradient - gradient_fresh).norm() == 0);
+			CHECK((Eigen::MatrixXd(H) - Eigen::MatrixXd(H_fresh)).norm() == 0);
+		}
+	}
+}
+
+class WindowTerm
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		return (x[0] - y[0]) * (x[0] - y[0]) + 0.1 * x[0] * x[0] * y[0] * y[0];
+	}
+};
+
+TEST(Function, remove_term)
+{
+	const int n = 8;
+	const int window = 3;
+	double x[n];
+	for (int i = 0; i < n; ++i) {
+		x[i] = 1.0 + 0.1 * i;
+	}
+
+	Function f;
+	for (int i = 0; i < n; ++i) {
+		f.add_variable(&x[i], 1);
+	}
+	f.set_constant(&x[0], true);
+
+	// A sliding window of terms between consecutive variables. The
+	// function is evaluated between every change, so that the storage
+	// and the sparsity pattern are updated instead of recomputed.
+	std::vector<Function::TermHandle> handles;
+	for (int i = 0; i + 1 < n; ++i) {
+		handles.push_back(f.add_term(std::make_shared<AutoDiffTerm<WindowTerm, 1, 1>>(), &x[i], &x[i + 1]));
+		if (handles.size() > window) {
+			f.remove_term(handles[handles.size() - window - 1]);
+		}
+		EXPECT_EQ(f.get_number_of_terms(), std::min<std::size_t>(handles.size(), window));
+
+		Function f_fresh;
+		for (int j = 0; j < n; ++j) {
+			f_fresh.add_variable(&x[j], 1);
+		}
+		f_fresh.set_constant(&x[0], true);
+		for (int j = std::max(0, i + 1 - window); j <= i; ++j) {
+			f_fresh.add_term(std::make_shared<AutoDiffTerm<WindowTerm, 1, 1>>(), &x[j], &x[j + 1]);
+		}
+
+		Eigen::VectorXd xg;
+		f.copy_user_to_global(&xg);
+		Eigen::VectorXd gradient, gradient_fresh;
+		Eigen::SparseMatrix<double> H, H_fresh;
+		f.create_sparse_hessian(&H);
+		f_fresh.create_sparse_hessian(&H_fresh);
+		EXPECT_EQ(H.nonZeros(), H_fresh.nonZeros());
+		CHECK((Eigen::MatrixXd(H) - Eigen::MatrixXd(H_fresh)).norm() == 0);
+
+		double value = f.evaluate(xg, &gradient, &H);
+		double value_fresh = f_fresh.evaluate(xg, &gradient_fresh, &H_fresh);
+		EXPECT_LT(std::abs(value - value_fresh), 1e-12);
+		EXPECT_LT((gradient - gradient_fresh).norm(), 1e-12);
+		EXPECT_LT((Eigen::MatrixXd(H) - Eigen::MatrixXd(H_fresh)).norm(), 1e-12);
+
+		Eigen::MatrixXd dense_H, dense_H_fresh;
+		f.evaluate(xg, &gradient, &dense_H);
+		f_fresh.evaluate(xg, &gradient_fresh, &dense_H_fresh);
+		EXPECT_LT((dense_H - dense_H_fresh).norm(), 1e-12);
+	}
+
+	// Removed terms can not be removed again.
+	CHECK_THROWS(f.remove_term(handles[0]));
+
+	// Handles are kept when copying.
+	Function f_copy = f;
+	f_copy.remove_term(handles.back());
+	EXPECT_EQ(f_copy.get_number_of_terms(), window - 1);
+}
+
+TEST(Function, bounds)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {3.0};
+	double lower[2] = {0.0, -1.0};
+	double upper[2] = {5.0, std::numeric_limits<double>::infinity()};
+
+	Function f;
+	f.add_variable(y, 1);
+	f.add_variable(x, 2);
+	EXPECT_TRUE(!f.has_bounds());
+	f.set_bounds(x, lower, upper);
+	EXPECT_TRUE(f.has_bounds());
+
+	Eigen::VectorXd l, u;
+	f.get_bounds(&l, &u);
+	ASSERT_EQ(l.size(), 3);
+	EXPECT_EQ(l[0], -std::numeric_limits<double>::infinity());
+	EXPECT_EQ(u[0],  std::numeric_limits<double>::infinity());
+	EXPECT_EQ(l[1], 0.0);
+	EXPECT_EQ(u[1], 5.0);
+	EXPECT_EQ(l[2], -1.0);
+	EXPECT_EQ(u[2], std::numeric_limits<double>::infinity());
+
+	Function f_copy(f);
+	EXPECT_TRUE(f_copy.has_bounds());
+
+	f.set_constant(x, true);
+	EXPECT_TRUE(!f.has_bounds());
+	f.get_bounds(&l, &u);
+	EXPECT_EQ(l.size(), 1);
+
+	EXPECT_THROW(f.set_bounds(y, upper, lower), std::runtime_error);
+	EXPECT_THROW(f.add_variable_with_change<GreaterThanZero>(x, 2, 2), std::runtime_error);
+}
 
 TEST(Function, evaluate_gradient)
 {
@@ -585,6 +775,136 @@ TEST(Function, evaluate_hessian)
 	}}
 }
 
+template<bool constant>
+class Quadratic2_1
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		return 5.0 * x[0]*x[0] + 6.0 * x[0]*y[0] - 2.0 * x[1]*y[0] + 3.0 * x[1] + 1.0;
+	}
+
+	bool has_constant_hessian() const
+	{
+		return constant;
+	}
+};
+
+TEST(Function, constant_hessian)
+{
+	double x[3] = {1.0, 2.0, 3.0};
+	double y[2] = {3.0, 4.0};
+	double z[2] = {5.0, 6.0};
+	double w[1] = {7.0};
+
+	Function f_ref, f;
+	for (auto function: {&f_ref, &f}) {
+		function->add_variable(x, 3);
+		function->add_variable(y, 2);
+		function->add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x);
+		function->add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+	}
+	f_ref.add_term(std::make_shared<AutoDiffTerm<Quadratic2_1<false>, 2, 1>>(), z, w);
+	f_ref.add_term(std::make_shared<AutoDiffTerm<Single2, 2>>(), z);
+	f.add_term(std::make_shared<AutoDiffTerm<Quadratic2_1<true>, 2, 1>>(), z, w);
+	f.add_term(std::make_shared<AutoDiffTerm<Single2, 2>>(), z);
+	EXPECT_TRUE( ! f_ref.terms().begin()[2].term->has_constant_hessian());
+	EXPECT_TRUE(f.terms().begin()[2].term->has_constant_hessian());
+
+	for (int b = 0; b <= 1; ++b) {
+		f_ref.set_constant(w, b == 1);
+		f.set_constant(w, b == 1);
+		auto n = f.get_number_of_scalars();
+
+		// The Hessian is computed at the first point and reused
+		// for the others.
+		for (int iter = 0; iter < 3; ++iter) {
+			Eigen::VectorXd xg(n);
+			for (int i = 0; i < n; ++i) {
+				xg[i] = 0.5 + i + 0.7 * iter;
+			}
+
+			Eigen::VectorXd g_ref, g;
+			Eigen::MatrixXd H_ref, H;
+			Eigen::SparseMatrix<double> H_sparse;
+			f.create_sparse_hessian(&H_sparse);
+			EXPECT_DOUBLE_EQ(f.evaluate(xg, &g, &H), f_ref.evaluate(xg, &g_ref, &H_ref));
+			EXPECT_DOUBLE_EQ(f.evaluate(xg, &g, &H_sparse), f_ref.evaluate(xg));
+			for (int i = 0; i < n; ++i) {
+				EXPECT_NEAR(g[i], g_ref[i], 1e-10);
+				for (int j = 0; j < n; ++j) {
+					EXPECT_NEAR(H(i, j), H_ref(i, j), 1e-10);
+					EXPECT_NEAR(H_sparse.coeff(i, j), H_ref(i, j), 1e-10);
+				}
+			}
+		}
+	}
+}
+
+class Mixed2_2
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		return 2.0 * x[0]*y[0] + 3.0 * x[0]*y[1] + x[1]*y[1]*y[1] + 5.0 * x[1]*y[0];
+	}
+};
+
+TEST(Function, lower_triangular_hessian)
+{
+	double x[3] = {1.0, 2.0, 3.0};
+	double y[2] = {3.0, 4.0};
+	double z[2] = {5.0, 6.0};
+	double w[1] = {7.0};
+
+	Function f;
+	f.add_variable(y, 2);
+	f.add_variable(x, 3);
+	f.add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x);
+	// The variables of the term are in the opposite order compared
+	// to the global order.
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+	f.add_term(std::make_shared<AutoDiffTerm<Quadratic2_1<true>, 2, 1>>(), z, w);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, z);
+	// The same variable twice.
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed2_2, 2, 2>>(), z, z);
+	f.add_term(std::make_shared<AutoDiffTerm<Single2, 2>>(), z);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+
+	for (int b = 0; b <= 1; ++b) {
+		f.set_constant(y, b == 1);
+		auto n = f.get_number_of_scalars();
+		Eigen::VectorXd xg(n);
+		for (int i = 0; i < n; ++i) {
+			xg[i] = 0.5 + 0.3 * i;
+		}
+
+		Eigen::VectorXd g, g_lower;
+		Eigen::MatrixXd H, H_lower;
+		Eigen::SparseMatrix<double> H_sparse, H_sparse_lower;
+		f.create_sparse_hessian(&H_sparse);
+		f.create_sparse_hessian(&H_sparse_lower, Function::HessianStorage::LOWER);
+		EXPECT_EQ(H_sparse_lower.rows(), n);
+		EXPECT_EQ(H_sparse_lower.cols(), n);
+
+		double value = f.evaluate(xg, &g, &H);
+		f.evaluate(xg, &g, &H_sparse);
+		EXPECT_EQ(f.evaluate(xg, &g_lower, &H_lower, Function::HessianStorage::LOWER), value);
+		f.evaluate(xg, &g_lower, &H_sparse_lower, Function::HessianStorage::LOWER);
+		EXPECT_TRUE(H_sparse_lower.nonZeros() < H_sparse.nonZeros());
+
+		for (int i = 0; i < n; ++i) {
+			EXPECT_NEAR(g_lower[i], g[i], 1e-10);
+			for (int j = 0; j < n; ++j) {
+				double expected = i >= j ? H(i, j) : 0.0;
+				EXPECT_NEAR(H_lower(i, j), expected, 1e-10);
+				EXPECT_NEAR(H_sparse_lower.coeff(i, j), expected, 1e-10);
+			}
+		}
+	}
+}
 
 TEST(Function, evaluation_count)
 {
@@ -619,6 +939,110 @@ TEST(Function, evaluation_count)
 	EXPECT_EQ(f.evaluations_with_gradient, 3);
 }
 
+TEST(Function, memory_usage)
+{
+	double x[3] = {1.0, 2.0, 3.0};
+	double y[2] = {3.0, 4.0};
+
+	Function f;
+	f.add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x, y);
+
+	auto dense_estimate = f.estimate_memory_usage(Function::Evaluation::DENSE_HESSIAN);
+	auto sparse_estimate = f.estimate_memory_usage(Function::Evaluation::SPARSE_HESSIAN);
+	EXPECT_GT(dense_estimate.peak("thread dense Hessians"), 0);
+	EXPECT_GT(sparse_estimate.peak("thread sparse Hessian triplets"), 0);
+	EXPECT_EQ(sparse_estimate.peak("thread dense Hessians"), 0);
+
+	Eigen::VectorXd xg(5);
+	xg.setZero();
+	Eigen::VectorXd gradient;
+	Eigen::MatrixXd hessian;
+	Eigen::SparseMatrix<double> sparse_hessian;
+	f.evaluate(xg, &gradient, &hessian);
+	f.create_sparse_hessian(&sparse_hessian);
+	f.evaluate(xg, &gradient, &sparse_hessian);
+
+	auto usage = f.get_memory_usage();
+	EXPECT_GT(usage.current("variables"), 0);
+	EXPECT_GT(usage.current("terms"), 0);
+	EXPECT_GT(usage.current("thread gradients"), 0);
+	EXPECT_GT(usage.current("thread dense Hessians"), 0);
+	EXPECT_GT(usage.current("thread sparse Hessian triplets"), 0);
+	EXPECT_GE(usage.peak_total, usage.current_total());
+	for (const auto& structure: usage.structures) {
+		EXPECT_GE(structure.peak, structure.current);
+	}
+	EXPECT_LE(usage.peak("thread gradients"), dense_estimate.peak("thread gradients"));
+	EXPECT_LE(usage.peak("thread Hessian scratch"), dense_estimate.peak("thread Hessian scratch"));
+	EXPECT_LE(usage.peak("thread dense Hessians"), dense_estimate.peak("thread dense Hessians"));
+	EXPECT_LE(usage.peak("thread sparse Hessian triplets"),
+	          sparse_estimate.peak("thread sparse Hessian triplets"));
+
+	std::stringstream sout;
+	sout << usage;
+	EXPECT_TRUE(sout.str().find("thread dense Hessians") != std::string::npos);
+}
+
+TEST(Function, term_profile)
+{
+	double x1[3] = {1.0, 2.0, 3.0};
+	double x2[3] = {4.0, 5.0, 6.0};
+	double y[2] = {3.0, 4.0};
+
+	Function f;
+	f.term_profiling_enabled = true;
+	auto handle = f.add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x1);
+	f.add_term(std::make_shared<AutoDiffTerm<Single3, 3>>(), x2);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed3_2, 3, 2>>(), x1, y);
+
+	Eigen::VectorXd xg(8);
+	xg.setZero();
+	Eigen::VectorXd gradient;
+	Eigen::MatrixXd hessian;
+	Eigen::SparseMatrix<double> sparse_hessian;
+	f.create_sparse_hessian(&sparse_hessian);
+
+	f.evaluate();
+	f.evaluate(xg, &gradient);
+	f.evaluate(xg, &gradient, &hessian);
+	f.evaluate(xg, &gradient, &sparse_hessian);
+
+	auto profile = f.get_term_profile();
+	ASSERT_EQ(profile.term_types.size(), 2);
+	EXPECT_EQ(profile.number_of_loops, 4);
+	EXPECT_GE(profile.load_imbalance(), 1.0);
+	for (const auto& type: profile.term_types) {
+		int terms = type.name.find("Single3") != std::string::npos ? 2 : 1;
+		EXPECT_TRUE(type.name.find("AutoDiffTerm") != std::string::npos);
+		EXPECT_EQ(type.number_of_terms, terms);
+		EXPECT_EQ(type.value_evaluations, terms);
+		EXPECT_EQ(type.gradient_evaluations, terms);
+		EXPECT_EQ(type.hessian_evaluations, 2 * terms);
+		EXPECT_GE(type.total_time(), 0.0);
+	}
+
+	std::stringstream sout;
+	f.print_timing_information(sout);
+	EXPECT_TRUE(sout.str().find(profile.term_types[0].name) != std::string::npos);
+
+	// Removed terms are no longer counted.
+	f.remove_term(handle);
+	f.clear_term_profile();
+	f.evaluate();
+	profile = f.get_term_profile();
+	EXPECT_EQ(profile.number_of_loops, 1);
+	for (const auto& type: profile.term_types) {
+		EXPECT_EQ(type.number_of_terms, 1);
+		EXPECT_EQ(type.value_evaluations, 1);
+	}
+
+	// Nothing is recorded when profiling is disabled.
+	f.term_profiling_enabled = false;
+	f.evaluate();
+	EXPECT_EQ(f.get_term_profile().number_of_loops, 1);
+}
+
 //
 //	x_i = exp(t_i)
 //  t_i = log(x_i)
@@ -703,6 +1127,48 @@ TEST(Function, Parametrization_2_to_2)
 	EXPECT_NEAR(t_gradient[1], -sin(exp(t[1]))*exp(t[1]) + 1.4 * exp(t[0]) * exp(t[1]), 1e-12);
 }
 
+TEST(Function, evaluate_many)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {3.0};
+	double z[1] = {4.0};
+
+	Function f;
+	f.add_variable_with_change<ExpTransform<2>>(x, 2);
+	f.add_variable(y, 1);
+	f.add_variable(z, 1);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, z);
+	f += 5.0;
+	f.set_constant(z, true);
+	ASSERT_EQ(f.get_number_of_scalars(), 3);
+
+	Eigen::MatrixXd X(3, 4);
+	X << 0.1, 0.2, 0.3, 0.4,
+	     0.5, 0.6, 0.7, 0.8,
+	     1.0, 2.0, 3.0, 4.0;
+
+	Eigen::VectorXd values;
+	Eigen::MatrixXd gradients;
+	f.evaluate_many(X, &values);
+	EXPECT_EQ(values.size(), 4);
+	EXPECT_EQ(f.evaluations_without_gradient, 4);
+	f.evaluate_many(X, &values, &gradients);
+	EXPECT_EQ(gradients.rows(), 3);
+	EXPECT_EQ(gradients.cols(), 4);
+	EXPECT_EQ(f.evaluations_with_gradient, 4);
+
+	for (int k = 0; k < 4; ++k) {
+		Eigen::VectorXd xk = X.col(k);
+		Eigen::VectorXd gradient;
+		double value = f.evaluate(xk, &gradient);
+		EXPECT_NEAR(values[k], value, 1e-12);
+		for (int i = 0; i < 3; ++i) {
+			EXPECT_NEAR(gradients(i, k), gradient[i], 1e-12);
+		}
+	}
+}
+
 TEST(Function, Parametrization_1_1_to_1_1)
 {
 	Function f1, f2;
@@ -803,6 +1269,156 @@ TEST(Function, Parametrization_2_to_1)
 	}
 }
 
+TEST(Function, Parametrization_hessian)
+{
+	double x[2] = {1.0, 2.0};
+	double y[1] = {2.0};
+	double z[2] = {0.5, 1.5};
+	double w[1] = {3.0};
+	double a[2] = {0.0, 1.0};
+	double b[2] = {1.0, 2.0};
+
+	Function f;
+	// ExpTransform uses automatic differentiation for its
+	// derivatives; IntervalConstraint and Box compute them
+	// elementwise.
+	f.add_variable_with_change<ExpTransform<2>>(x, 2);
+	f.add_variable_with_change<IntervalConstraint>(y, 1, 1.0, 3.0);
+	f.add_variable_with_change<Box>(z, 2, 2, a, b);
+	f.add_variable(w, 1);
+	f.add_term(std::make_shared<AutoDiffTerm<Term1, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed2_2, 2, 2>>(), x, z);
+	f.add_term(std::make_shared<AutoDiffTerm<Mixed2_2, 2, 2>>(), z, z);
+	f.add_term(std::make_shared<AutoDiffTerm<Term2, 1, 1>>(), y, w);
+
+	for (int c = 0; c <= 1; ++c) {
+		f.set_constant(x, c == 1);
+		auto n = f.get_number_of_scalars();
+		Eigen::VectorXd t(n);
+		for (int i = 0; i < n; ++i) {
+			t[i] = 0.1 + 0.1 * i;
+		}
+
+		Eigen::VectorXd g, g_sparse, g_lower;
+		Eigen::MatrixXd H, H_lower;
+		Eigen::SparseMatrix<double> H_sparse, H_sparse_lower;
+		f.create_sparse_hessian(&H_sparse);
+		f.create_sparse_hessian(&H_sparse_lower, Function::HessianStorage::LOWER);
+		double value = f.evaluate(t, &g, &H);
+		EXPECT_NEAR(f.evaluate(t, &g_sparse, &H_sparse), value, 1e-12);
+		f.evaluate(t, &g_lower, &H_lower, Function::HessianStorage::LOWER);
+		f.evaluate(t, &g_lower, &H_sparse_lower, Function::HessianStorage::LOWER);
+
+		// The gradient must agree with the gradient-only path, and
+		// the Hessian with finite differences of the gradient.
+		Eigen::VectorXd g_only;
+		EXPECT_NEAR(f.evaluate(t, &g_only), value, 1e-12);
+		const double h = 1e-6;
+		for (int j = 0; j < n; ++j) {
+			EXPECT_NEAR(g[j], g_only[j], 1e-12);
+			EXPECT_NEAR(g_sparse[j], g_only[j], 1e-12);
+			Eigen::VectorXd t_plus = t, t_minus = t;
+			t_plus[j] += h;
+			t_minus[j] -= h;
+			Eigen::VectorXd g_plus, g_minus;
+			f.evaluate(t_plus, &g_plus);
+			f.evaluate(t_minus, &g_minus);
+			for (int i = 0; i < n; ++i) {
+				double expected = (g_plus[i] - g_minus[i]) / (2 * h);
+				EXPECT_NEAR(H(i, j), expected, 1e-6);
+				EXPECT_NEAR(H_sparse.coeff(i, j), H(i, j), 1e-12);
+				double expected_lower = i >= j ? H(i, j) : 0.0;
+				EXPECT_NEAR(H_lower(i, j), expected_lower, 1e-12);
+				EXPECT_NEAR(H_sparse_lower.coeff(i, j), expected_lower, 1e-12);
+			}
+		}
+	}
+}
+
+// x = (t0 t1, exp(t0) + t1²).
+class ProductTransform
+{
+public:
+	template<typename R>
+	void t_to_x(R* x, const R* t) const
+	{
+		using std::exp;
+		x[0] = t[0] * t[1];
+		x[1] = exp(t[0]) + t[1] * t[1];
+	}
+
+	template<typename R>
+	void x_to_t(R* t, const R* x) const
+	{
+		spii_assert(false);
+	}
+
+	int x_dimension() const
+	{
+		return 2;
+	}
+
+	int t_dimension() const
+	{
+		return 2;
+	}
+};
+
+// Derives directly from ChangeOfVariables without implementing
+// derivatives().
+class ProductChangeOfVariables :
+	public ChangeOfVariables
+{
+public:
+	virtual void t_to_x(double* x, const double* t) const override
+	{
+		transform.t_to_x(x, t);
+	}
+
+	virtual void x_to_t(double* t, const double* x) const override
+	{
+		transform.x_to_t(t, x);
+	}
+
+	virtual int x_dimension() const override
+	{
+		return 2;
+	}
+
+	virtual int t_dimension() const override
+	{
+		return 2;
+	}
+
+	virtual void update_gradient(double* t_gradient,
+	                             const double* t,
+	                             const double* x_gradient) const override
+	{
+		spii_assert(false);
+	}
+
+private:
+	ProductTransform transform;
+};
+
+TEST(Function, ChangeOfVariables_default_derivatives)
+{
+	AutoDiffChangeOfVariables<ProductTransform> auto_diff(new ProductTransform);
+	ProductChangeOfVariables finite_differences;
+
+	const double t[2] = {0.7, -1.3};
+	double jacobian1[4], jacobian2[4];
+	double hessians1[8], hessians2[8];
+	auto_diff.derivatives(jacobian1, hessians1, t);
+	finite_differences.derivatives(jacobian2, hessians2, t);
+	for (int i = 0; i < 4; ++i) {
+		EXPECT_NEAR(jacobian1[i], jacobian2[i], 1e-7);
+	}
+	for (int i = 0; i < 8; ++i) {
+		EXPECT_NEAR(hessians1[i], hessians2[i], 1e-6);
+	}
+}
+
 class ThrowsRuntimeError
 {
 public:
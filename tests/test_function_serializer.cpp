@@ -1,4 +1,8 @@
 // Petter Strandmark 2013.
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <string>
 #include <sstream>
 #include <random>
@@ -189,16 +193,58 @@ TEST_CASE("Serialize/minimization", "")
 
 // One term in the negative log-likelihood function for
 // a one-dimensional Gaussian distribution.
+// Smooth, for solving to convergence.
+template<int dim1, int dim2>
+struct SquaredDistance
+{
+	SquaredDistance()
+	{
+		global_number_of_terms++;
+	}
+
+	~SquaredDistance()
+	{
+		global_number_of_terms--;
+	}
+
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R d = 0;
+		for (int i = 0; i < dim1; ++i) {
+			d += (x[i] - y[0]) * (x[i] - y[0]);
+		}
+
+		for (int i = 0; i < dim2; ++i) {
+			d += (y[i] - 1.0) * (y[i] - 1.0);
+		}
+		return d;
+	}
+};
+
+int global_number_of_likelihoods = 0;
+
 struct NegLogLikelihood
 {
 	double sample;
 	NegLogLikelihood(double sample)
 	{
 		this->sample = sample;
+		global_number_of_likelihoods++;
 	}
 	NegLogLikelihood()
 	{
 		this->sample = 0;
+		global_number_of_likelihoods++;
+	}
+	NegLogLikelihood(const NegLogLikelihood& other)
+	{
+		this->sample = other.sample;
+		global_number_of_likelihoods++;
+	}
+	~NegLogLikelihood()
+	{
+		global_number_of_likelihoods--;
 	}
 
 	template<typename R>
@@ -275,3 +321,198 @@ TEST_CASE("Serialize/FunctorData", "")
 		CHECK(user_space[1] == sigma_result);
 	}
 }
+
+TEST_CASE("Serialize/binary", "")
+{
+	REQUIRE(global_number_of_terms == 0);
+
+	string file;
+	double f_value = 0;
+	Eigen::VectorXd gradient;
+
+	{
+		Function f;
+		double x1[1] = {10.0};
+		double x2[3] = {20.0, 30.0, 40.0};
+		double x3[2] = {1.0 / 3.0, -2.5};
+		double mu = 1.0;
+		double sigma = 2.0;
+		f.add_variable(x1, 1);
+		f.add_variable(x2, 3);
+		f.add_variable(x3, 2);
+		for (int i = 0; i < 10; ++i) {
+			f.add_term<AutoDiffTerm<Norm<1>, 1>>(x1);
+		}
+		f.add_term<AutoDiffTerm<Norm<3>, 3>>(x2);
+		f.add_term<AutoDiffTerm<NormTwo<3, 1>, 3, 1>>(x2, x1);
+		f.add_term<AutoDiffTerm<NormTwo<2, 3>, 2, 3>>(x3, x2);
+		for (int i = 0; i < 5; ++i) {
+			f.add_term(std::make_shared<AutoDiffTerm<NegLogLikelihood, 1, 1>>(0.1 * (i % 2)), &mu, &sigma);
+		}
+		f += 1.5;
+		f.set_constant(x2, true);
+
+		stringstream fout;
+		f.write_to_binary_stream(fout);
+		file = fout.str();
+
+		f_value = f.evaluate();
+		Eigen::VectorXd x;
+		f.copy_user_to_global(&x);
+		f.evaluate(x, &gradient);
+	}
+
+	CHECK(global_number_of_terms == 0);
+
+	TermFactory factory;
+	factory.teach_term<AutoDiffTerm<Norm<1>, 1>>();
+	factory.teach_term<AutoDiffTerm<Norm<3>, 3>>();
+	factory.teach_term<AutoDiffTerm<NormTwo<3,1>, 3, 1>>();
+	factory.teach_term<AutoDiffTerm<NormTwo<2,3>, 2, 3>>();
+	factory.teach_term<AutoDiffTerm<NegLogLikelihood, 1, 1>>();
+
+	{
+		Function f2;
+		vector<double> user_space;
+		f2.read_from_binary(file.data(), file.size(), &user_space, factory);
+
+		CHECK(f2.get_number_of_variables() == 5);
+		CHECK(f2.get_number_of_terms() == 18);
+		CHECK(f2.get_number_of_scalars() == 5);
+		CHECK(user_space.size() == 8);
+		CHECK(f_value == f2.evaluate());
+		Eigen::VectorXd x, gradient2;
+		f2.copy_user_to_global(&x);
+		f2.evaluate(x, &gradient2);
+		CHECK((gradient - gradient2).norm() == 0);
+
+		// Terms without data are shared, but terms with data are
+		// not by default.
+		CHECK(global_number_of_terms == 4);
+		CHECK(global_number_of_likelihoods == 5);
+	}
+
+	// Terms with the same type and data are shared on request.
+	{
+		Function f2;
+		vector<double> user_space;
+		f2.read_from_binary(file.data(), file.size(), &user_space, factory, true);
+		CHECK(global_number_of_likelihoods == 2);
+		CHECK(f_value == f2.evaluate());
+	}
+
+	// Through a memory-mapped file.
+	{
+		string file_name = "test_function_serializer_binary.spii";
+		{
+			ofstream fout(file_name, ios::binary);
+			fout << file;
+		}
+		Function f2;
+		vector<double> user_space;
+		read_binary_file(file_name, &f2, &user_space, factory);
+		std::remove(file_name.c_str());
+		CHECK(f_value == f2.evaluate());
+	}
+
+	// Truncated data is detected.
+	{
+		Function f2;
+		vector<double> user_space;
+		CHECK_THROWS(f2.read_from_binary(file.data(), file.size() - 8, &user_space, factory));
+		CHECK_THROWS(f2.read_from_binary(file.data() + 1, file.size() - 1, &user_space, factory));
+	}
+
+	// Counts larger than the data are detected before anything is
+	// allocated for them.
+	{
+		// The header has the number of variables, scalars and terms
+		// next to each other.
+		const uint64_t counts[3] = {5, 8, 18};
+		auto position = file.find(string(reinterpret_cast<const char*>(counts), sizeof(counts)));
+		REQUIRE(position != string::npos);
+		for (int i = 0; i < 3; ++i) {
+			string corrupt_file = file;
+			const uint64_t huge = uint64_t(1) << 60;
+			std::memcpy(&corrupt_file[position + i * sizeof(uint64_t)], &huge, sizeof(huge));
+			Function f2;
+			vector<double> user_space;
+			CHECK_THROWS(f2.read_from_binary(corrupt_file.data(), corrupt_file.size(), &user_space, factory));
+		}
+	}
+}
+
+TEST_CASE("Serialize/binary_streamed", "")
+{
+	REQUIRE(global_number_of_terms == 0);
+
+	TermFactory factory;
+	factory.teach_term<AutoDiffTerm<Norm<1>, 1>>();
+	factory.teach_term<AutoDiffTerm<SquaredDistance<2,1>, 2, 1>>();
+
+	mt19937 engine(0u);
+	uniform_real_distribution<double> rand(-1, 1);
+
+	Function f;
+	vector<double> x(2 * 50);
+	for (int i = 0; i < 50; ++i) {
+		x[2*i] = rand(engine);
+		x[2*i + 1] = rand(engine);
+		f.add_variable(&x[2*i], 2);
+	}
+	double y = 0.5;
+	f.add_variable(&y, 1);
+	f.add_term<AutoDiffTerm<Norm<1>, 1>>(&y);
+	for (int i = 0; i < 50; ++i) {
+		f.add_term<AutoDiffTerm<SquaredDistance<2, 1>, 2, 1>>(&x[2*i], &y);
+	}
+	f += 2.0;
+
+	string file_name = "test_function_serializer_binary_streamed.spii";
+	write_binary_file(file_name, f);
+
+	Eigen::VectorXd x0, gradient;
+	f.copy_user_to_global(&x0);
+	double f_value = f.evaluate(x0, &gradient);
+
+	{
+		Function f2;
+		vector<double> user_space;
+		read_binary_file_streamed(file_name, &f2, &user_space, factory, 7);
+		CHECK(f2.get_number_of_variables() == 51);
+		CHECK(f2.get_number_of_terms() == 0);
+		// Terms are not kept in memory.
+		CHECK(global_number_of_terms == 51);
+
+		Eigen::VectorXd x2, gradient2;
+		f2.copy_user_to_global(&x2);
+		CHECK((x0 - x2).norm() == 0);
+		double f_value2 = f2.evaluate(x2, &gradient2);
+		CHECK(abs(f_value - f_value2) <= 1e-12 * abs(f_value));
+		CHECK((gradient - gradient2).norm() <= 1e-12 * gradient.norm());
+		CHECK(f_value2 == f2.evaluate());
+
+		// Hessians are not available for streamed terms.
+		Eigen::MatrixXd hessian;
+		CHECK_THROWS(f2.evaluate(x2, &gradient2, &hessian));
+
+		// The streamed function has the same minimum as the function
+		// in memory.
+		LBFGSSolver solver;
+		solver.log_function = nullptr;
+		SolverResults results;
+		solver.solve(f2, &results);
+		CHECK(results.exit_success());
+		solver.solve(f, &results);
+		CHECK(results.exit_success());
+
+		Eigen::VectorXd solution, streamed_solution;
+		f.copy_user_to_global(&solution);
+		f2.copy_user_to_global(&streamed_solution);
+		CHECK((solution - streamed_solution).norm() <= 1e-6 * solution.norm());
+		CHECK(abs(f.evaluate() - f2.evaluate()) <= 1e-10 * abs(f.evaluate()));
+	}
+
+	std::remove(file_name.c_str());
+	CHECK(global_number_of_terms == 51);
+}
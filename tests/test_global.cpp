@@ -1,6 +1,8 @@
 // Petter Strandmark 2013.
 
+#include <cstdio>
 #include <queue>
+#include <string>
 
 #include <catch.hpp>
 
@@ -65,6 +67,24 @@ TEST_CASE("global_optimization/simple_function1", "Petter")
 	CHECK(opt.get_lower() <= val); CHECK(val <= opt.get_upper());
 }
 
+TEST_CASE("global_optimization/bounds_not_supported", "")
+{
+	double x = 2.0;
+	double lower = -1.0;
+	double upper = 1.0;
+	Function f;
+	f.add_variable(&x, 1);
+	f.add_term(std::make_shared<IntervalTerm<SimpleFunction1, 1>>(), &x);
+	f.set_bounds(&x, &lower, &upper);
+
+	GlobalSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	std::vector<Interval<double>> x_interval;
+	x_interval.push_back(Interval<double>(-10.0, 9.0));
+	CHECK_THROWS(solver.solve_global(f, x_interval, &results));
+}
+
 TEST_CASE("global_optimization/simple_function2", "Petter")
 {
 	double x[] = {2.0, 2.0};
@@ -418,3 +438,53 @@ TEST_CASE("PowellSingular")
 	CHECK(abs(x[2]) <= 1e-1);
 	CHECK(abs(x[3]) <= 1e-1);
 }
+
+TEST_CASE("global_optimization/checkpoint_resume", "")
+{
+	std::string checkpoint_file = "test_global_checkpoint.chk";
+	std::remove(checkpoint_file.c_str());
+
+	double x[] = {2.0, 2.0};
+	Function f;
+	f.add_variable(x, 2);
+	f.add_term(std::make_shared<IntervalTerm<SimpleFunction2, 2>>(), x);
+	// Evaluations with one thread are deterministic.
+	f.set_number_of_threads(1);
+
+	std::vector<Interval<double>> x_interval;
+	x_interval.push_back(Interval<double>(-10.0, 9.0));
+	x_interval.push_back(Interval<double>(-8.0, 8.0));
+
+	GlobalSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 1000;
+	solver.argument_improvement_tolerance = 0;
+	solver.function_improvement_tolerance = 1e-12;
+	SolverResults results_full;
+	auto interval_full = solver.solve_global(f, x_interval, &results_full);
+	double x_full[] = {x[0], x[1]};
+
+	// Interrupt the solve by limiting the number of evaluations.
+	solver.checkpoint_file = checkpoint_file;
+	solver.checkpoint_interval = 3;
+	solver.maximum_iterations = 100;
+	SolverResults results;
+	solver.solve_global(f, x_interval, &results);
+	CHECK(results.exit_condition == SolverResults::NO_CONVERGENCE);
+
+	solver.maximum_iterations = 1000;
+	solver.resume_from_checkpoint = true;
+	auto interval = solver.solve_global(f, x_interval, &results);
+	CHECK(results.exit_condition == results_full.exit_condition);
+	CHECK(results.optimum_lower == results_full.optimum_lower);
+	CHECK(results.optimum_upper == results_full.optimum_upper);
+	REQUIRE(interval.size() == interval_full.size());
+	for (std::size_t i = 0; i < interval.size(); ++i) {
+		CHECK(interval[i].get_lower() == interval_full[i].get_lower());
+		CHECK(interval[i].get_upper() == interval_full[i].get_upper());
+	}
+	CHECK(x[0] == x_full[0]);
+	CHECK(x[1] == x_full[1]);
+
+	std::remove(checkpoint_file.c_str());
+}
@@ -155,3 +155,181 @@ TEST_CASE("LargeAutoDiffTerm/LargeTerms") {
 	double f_val = f.evaluate(x_vector, &gradient);
 	CHECK(f_val == f_val);  // Check for NaN.
 }
+
+class NetworkFunctor {
+ public:
+	template <typename R>
+	R operator()(const std::vector<int>& dimensions, const R* const* const vars) const {
+		auto x = vars[0];
+		auto y = vars[1];
+		R value = 0;
+		for (int j = 0; j < dimensions[1]; ++j) {
+			R a = y[j];
+			for (int i = 0; i < dimensions[0]; ++i) {
+				a += x[i] * y[(i + j) % dimensions[1]] / (1.0 + x[i] * x[i]);
+			}
+			value += 1.0 / (1.0 + exp(-a)) + exp(-a * a) + pow(1.0 + a * a, 1.5);
+		}
+		value += log(1.0 + x[0] * x[0]) + sqrt(2.0 + y[0] * y[0]) - x[1] / (2.0 + y[1]);
+		value += pow(2.0 + x[2] * x[2], 0.5 * y[2]) + atan(x[0] * y[3]) + sin(x[1]) * cos(y[2]);
+		return value;
+	}
+};
+
+TEST_CASE("LargeAutoDiffTerm/recorded_tape") {
+	LargeAutoDiffTerm<NetworkFunctor> term({3, 4});
+	LargeAutoDiffTerm<NetworkFunctor> tape_term({3, 4});
+	tape_term.use_recorded_tape();
+
+	double x[3] = {0.3, -0.2, 0.7};
+	double y[4] = {0.1, 0.5, -0.4, 0.9};
+	std::vector<double*> variables = {x, y};
+
+	std::vector<Eigen::VectorXd> gradient = {Eigen::VectorXd(3), Eigen::VectorXd(4)};
+	std::vector<Eigen::VectorXd> tape_gradient = {Eigen::VectorXd(3), Eigen::VectorXd(4)};
+
+	// Evaluate at several points with the same recording.
+	for (int k = 0; k < 3; ++k) {
+		x[k] += 0.25;
+		y[k + 1] -= 0.125;
+
+		double value = term.evaluate(variables.data(), &gradient);
+		double tape_value = tape_term.evaluate(variables.data(), &tape_gradient);
+		CHECK(Approx(tape_value) == value);
+		CHECK(Approx(tape_value) == term.evaluate(variables.data()));
+		for (int var = 0; var < 2; ++var) {
+			for (int i = 0; i < gradient[var].size(); ++i) {
+				CHECK(Approx(tape_gradient[var][i]) == gradient[var][i]);
+			}
+		}
+
+		// The Hessian should agree with finite differences of the gradient.
+		double flat_gradient[7];
+		double flat_hessian[49];
+		tape_term.evaluate_flat(variables.data(), flat_gradient, flat_hessian, false);
+		const double h = 1e-6;
+		for (int j = 0; j < 7; ++j) {
+			double* scalar = j < 3 ? &x[j] : &y[j - 3];
+			double original = *scalar;
+			double plus_gradient[7];
+			double minus_gradient[7];
+			*scalar = original + h;
+			tape_term.evaluate_flat(variables.data(), plus_gradient, nullptr, false);
+			*scalar = original - h;
+			tape_term.evaluate_flat(variables.data(), minus_gradient, nullptr, false);
+			*scalar = original;
+			for (int i = 0; i < 7; ++i) {
+				double finite_difference = (plus_gradient[i] - minus_gradient[i]) / (2 * h);
+				CHECK(Approx(flat_hessian[i + 7 * j]).epsilon(1e-5) == finite_difference);
+				CHECK(Approx(flat_hessian[i + 7 * j]) == flat_hessian[j + 7 * i]);
+			}
+		}
+
+		// Hessian-vector product.
+		double v[7] = {1.0, -2.0, 0.5, 0.25, 3.0, -1.0, 2.0};
+		double hv[7];
+		double hvp_gradient[7];
+		tape_term.hessian_vector_product(variables.data(), v, hvp_gradient, hv);
+		for (int i = 0; i < 7; ++i) {
+			double expected = 0;
+			for (int j = 0; j < 7; ++j) {
+				expected += flat_hessian[i + 7 * j] * v[j];
+			}
+			CHECK(Approx(hv[i]) == expected);
+			CHECK(Approx(hvp_gradient[i]) == flat_gradient[i]);
+		}
+	}
+
+	std::vector<std::vector<Eigen::MatrixXd>> hessian;
+	CHECK_THROWS(term.evaluate(variables.data(), &gradient, &hessian));
+}
+
+TEST_CASE("LargeAutoDiffTerm/recorded_tape_in_function") {
+	double x[3] = {0.3, -0.2, 0.7};
+	double y[4] = {0.1, 0.5, -0.4, 0.9};
+
+	Function f;
+	f.add_term(std::make_shared<LargeAutoDiffTerm<NetworkFunctor>>(std::vector<int>{3, 4}), x, y);
+	Function tape_f;
+	auto tape_term = std::make_shared<LargeAutoDiffTerm<NetworkFunctor>>(std::vector<int>{3, 4});
+	tape_term->use_recorded_tape();
+	tape_f.add_term(tape_term, x, y);
+
+	Eigen::VectorXd point;
+	f.copy_user_to_global(&point);
+	Eigen::VectorXd gradient, tape_gradient;
+	double value = f.evaluate(point, &gradient);
+	Eigen::MatrixXd tape_hessian;
+	double tape_value = tape_f.evaluate(point, &tape_gradient, &tape_hessian);
+	CHECK(Approx(tape_value) == value);
+	CHECK((tape_gradient - gradient).norm() < 1e-10);
+	CHECK((tape_hessian - tape_hessian.transpose()).norm() < 1e-10);
+}
+
+TEST_CASE("Tape/tanh") {
+	Tape tape;
+	double x0[2] = {0.5, -1.5};
+	auto a = tape.add_input(x0[0]);
+	auto b = tape.add_input(x0[1]);
+	tape.set_output(tanh(a * b));
+	CHECK(tape.number_of_inputs() == 2);
+
+	double x[2] = {0.3, 0.8};
+	double gradient[2];
+	double hessian[4];
+	double value = tape.hessian(x, gradient, hessian);
+	double t = std::tanh(x[0] * x[1]);
+	double dt = 1 - t * t;
+	CHECK(Approx(value) == t);
+	CHECK(Approx(gradient[0]) == dt * x[1]);
+	CHECK(Approx(gradient[1]) == dt * x[0]);
+	CHECK(Approx(hessian[0]) == -2 * t * dt * x[1] * x[1]);
+	CHECK(Approx(hessian[1]) == dt - 2 * t * dt * x[0] * x[1]);
+	CHECK(Approx(hessian[2]) == hessian[1]);
+	CHECK(Approx(hessian[3]) == -2 * t * dt * x[0] * x[0]);
+}
+
+TEST_CASE("Tape/pow_at_zero") {
+	double x[2] = {0.0, 3.0};
+	double gradient[2];
+	double hessian[4];
+
+	// Derivatives that vanish are exactly zero, not NaN.
+	for (double c: {0.0, 1.0, 2.0}) {
+		Tape tape;
+		auto a = tape.add_input(1.0);
+		tape.set_output(pow(a, c));
+		double value = tape.hessian(x, gradient, hessian);
+		CHECK(value == std::pow(0.0, c));
+		CHECK(gradient[0] == (c == 1.0 ? 1.0 : 0.0));
+		CHECK(hessian[0] == (c == 2.0 ? 2.0 : 0.0));
+	}
+
+	// A constant exponent is recorded without log(a).
+	{
+		Tape tape;
+		auto a = tape.add_input(1.0);
+		tape.set_output(pow(a, TapeValue(2.0)));
+		CHECK(tape.get_instructions().back().operation == Tape::Operation::power_constant);
+		tape.hessian(x, gradient, hessian);
+		CHECK(gradient[0] == 0.0);
+		CHECK(hessian[0] == 2.0);
+	}
+
+	// The derivatives with respect to a recorded exponent vanish at
+	// a = 0.
+	{
+		Tape tape;
+		auto a = tape.add_input(1.0);
+		auto b = tape.add_input(3.0);
+		tape.set_output(pow(a, b));
+		double value = tape.hessian(x, gradient, hessian);
+		CHECK(value == 0.0);
+		for (int i = 0; i < 2; ++i) {
+			CHECK(gradient[i] == 0.0);
+		}
+		for (int i = 0; i < 4; ++i) {
+			CHECK(hessian[i] == 0.0);
+		}
+	}
+}
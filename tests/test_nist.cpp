@@ -33,136 +33,8 @@ using namespace spii;
 
 std::ofstream output_file("nist.log");
 
-void skip_lines(std::istream* in, int num_lines)
-{
-	std::string str;
-	for (int i = 0; i < num_lines; ++i) {
-		std::getline(*in, str);
-	}
-}
-
-void split_string(const std::string& str, std::vector<std::string>* tokens)
-{
-	std::stringstream sin(str);
-	tokens->clear();
-	while (true) {
-		std::string s;
-		sin >> s;
-		if (sin) {
-			tokens->push_back(s);
-		}
-		else {
-			break;
-		}
-	}
-}
+#include "nist_problem.h"
 
-template<typename T>
-T convert(const std::string& str)
-{
-	std::stringstream sin(str);
-	T t;
-	sin >> t;
-	if (!sin) {
-		throw std::runtime_error("Conversion failed.");
-	}
-	return t;
-}
-
-void get_and_split_line(std::istream* in, std::vector<std::string>* tokens)
-{
-	std::string str;
-	std::getline(*in, str);
-	split_string(str, tokens);
-}
-
-class NISTProblem
-{
-public:
-	NISTProblem(std::string filename)
-	{
-		std::ifstream fin(filename);
-		if (!fin) {
-			// Perhaps we are running the command from the root
-			// project folder.
-			filename = "bin/" + filename;
-			fin.open(filename);
-			if (!fin) {
-				// Perhaps we are running the command from the test
-				// project folder.
-				filename = "../" + filename;
-				fin.open(filename);
-				if (!fin) {
-					std::string error = "Failed to open ";
-					error += filename;
-					throw std::runtime_error(error.c_str());
-				}
-			}
-		}
-		std::vector<std::string> tokens;
-
-		skip_lines(&fin, 24);
-		get_and_split_line(&fin, &tokens);
-		const int num_responses = convert<int>(tokens.at(1));
-
-		get_and_split_line(&fin, &tokens);
-		const int num_predictors = convert<int>(tokens.at(0));
-
-		get_and_split_line(&fin, &tokens);
-		const int num_observations = convert<int>(tokens.at(0));
-
-		skip_lines(&fin, 4);
-		get_and_split_line(&fin, &tokens);
-		const int num_parameters = convert<int>(tokens.at(0));
-		skip_lines(&fin, 8);
-
-		get_and_split_line(&fin, &tokens);
-		const int num_tries = static_cast<int>(tokens.size() - 4);
-
-		this->predictor.resize(num_observations, num_predictors);
-		this->response.resize(num_observations, num_responses);
-		this->initial_parameters.resize(num_tries, num_parameters);
-		this->final_parameters.resize(1, num_parameters);
-
-		int parameter_id = 0;
-		for (int i = 0; i < num_tries; ++i) {
-			this->initial_parameters(i, parameter_id) =
-				convert<double>(tokens.at(i + 2));
-		}
-		final_parameters(0, parameter_id) =
-			convert<double>(tokens.at(2 + num_tries));
-
-		for (parameter_id = 1; parameter_id < num_parameters; ++parameter_id) {
-			get_and_split_line(&fin, &tokens);
-				for (int i = 0; i < num_tries; ++i) {
-				this->initial_parameters(i, parameter_id) =
-					convert<double>(tokens.at(i + 2));
-			}
-			final_parameters(0, parameter_id) =
-				convert<double>(tokens.at(2 + num_tries));
-		}
-
-		skip_lines(&fin, 1);
-		get_and_split_line(&fin, &tokens);
-		this->certified_cost = convert<double>(tokens.at(4));
-
-		skip_lines(&fin, 18 - num_parameters);
-		for (int i = 0; i < num_observations; ++i) {
-			get_and_split_line(&fin, &tokens);
-			for (int j = 0; j < num_responses; ++j) {
-				this->response(i, j) = convert<double>(tokens.at(j));
-			}
-
-			for (int j = 0; j < num_predictors; ++j) {
-				this->predictor(i, j) =
-					convert<double>(tokens.at(j + num_responses));
-			}
-		}
-	}
-
-	Eigen::MatrixXd predictor, response, initial_parameters, final_parameters;
-	double certified_cost;
-};
 
 template<typename SolverClass>
 SolverClass create_solver()
@@ -330,27 +202,7 @@ void run_problem_main(const std::string& filename)
 	}
 }
 
-#define NIST_TEST_START(Problem)         \
-struct Problem                           \
-{                                        \
-	double x_param, y_param;             \
-	Problem(double x, double y)          \
-	{                                    \
-		this->x_param = x;               \
-		this->y_param = y;               \
-	}                                    \
-	template<typename R>                 \
-	R operator()(const R* const b) const \
-	{                                    \
-		const R x(x_param);              \
-		const R y(y_param);              \
-		R d = y - (                      \
-
-#define NIST_TEST_END(Category, Problem, n) \
-		);                               \
-		return d*d;                      \
-	}                                    \
-};                                       \
+#define NIST_PROBLEM(Category, Problem, n) \
 TEST_CASE(#Category "/" #Problem, "")    \
 {                                        \
 	SECTION("Newton") {					 \
@@ -369,118 +221,4 @@ TEST_CASE(#Category "/" #Problem, "")    \
 	}                                    \
 }
 
-const double kPi = 3.141592653589793238462643383279;
-
-NIST_TEST_START(Bennett5)
-	b[0] * pow(b[1] + x, R(-1.0) / b[2])
-NIST_TEST_END(Hard, Bennett5, 3)
-
-NIST_TEST_START(BoxBOD)
-  b[0] * (R(1.0) - exp(-b[1] * x))
-NIST_TEST_END(Hard, BoxBOD, 2)
-
-NIST_TEST_START(Chwirut1)
-  exp(-b[0] * x) / (b[1] + b[2] * x)
-NIST_TEST_END(Easy, Chwirut1, 3)
-
-NIST_TEST_START(Chwirut2)
-  exp(-b[0] * x) / (b[1] + b[2] * x)
-NIST_TEST_END(Easy, Chwirut2, 3)
-
-NIST_TEST_START(DanWood)
-  b[0] * pow(x, b[1])
-NIST_TEST_END(Easy, DanWood, 2)
-
-NIST_TEST_START(Gauss1)
-  b[0] * exp(-b[1] * x) +
-  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
-  b[5] * exp(-pow((x - b[6])/b[7],2))
-NIST_TEST_END(Easy, Gauss1, 8)
-
-NIST_TEST_START(Gauss2)
-  b[0] * exp(-b[1] * x) +
-  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
-  b[5] * exp(-pow((x - b[6])/b[7],2))
-NIST_TEST_END(Medium, Gauss2, 8)
-
-NIST_TEST_START(Gauss3)
-  b[0] * exp(-b[1] * x) +
-  b[2] * exp(-pow((x - b[3])/b[4], 2)) +
-  b[5] * exp(-pow((x - b[6])/b[7],2))
-NIST_TEST_END(Medium, Gauss3, 8)
-
-NIST_TEST_START(Lanczos1)
-  b[0] * exp(-b[1] * x) + b[2] * exp(-b[3] * x) + b[4] * exp(-b[5] * x)
-NIST_TEST_END(Medium, Lanczos1, 6)
-
-NIST_TEST_START(Lanczos2)
-  b[0] * exp(-b[1] * x) + b[2] * exp(-b[3] * x) + b[4] * exp(-b[5] * x)
-NIST_TEST_END(Medium, Lanczos2, 6)
-
-NIST_TEST_START(Hahn1)
-  (b[0] + b[1] * x + b[2] * x * x + b[3] * x * x * x) /
-  (R(1.0) + b[4] * x + b[5] * x * x + b[6] * x * x * x)
-NIST_TEST_END(Medium, Hahn1, 7)
-
-NIST_TEST_START(Kirby2)
-  (b[0] + b[1] * x + b[2] * x * x) /
-  (R(1.0) + b[3] * x + b[4] * x * x)
-NIST_TEST_END(Medium, Kirby2, 5)
-
-NIST_TEST_START(MGH09)
-  b[0] * (x * x + x * b[1]) / (x * x + x * b[2] + b[3])
-NIST_TEST_END(Hard, MGH09, 4)
-
-NIST_TEST_START(MGH10)
-  b[0] * exp(b[1] / (x + b[2]))
-NIST_TEST_END(Hard, MGH10, 3)
-
-NIST_TEST_START(MGH17)
-  b[0] + b[1] * exp(-x * b[3]) + b[2] * exp(-x * b[4])
-NIST_TEST_END(Medium, MGH17, 5)
-
-NIST_TEST_START(Misra1a)
-  b[0] * (R(1.0) - exp(-b[1] * x))
-NIST_TEST_END(Easy, Misra1a, 2)
-
-NIST_TEST_START(Misra1b)
-  b[0] * (R(1.0) - R(1.0)/ ((R(1.0) + b[1] * x / 2.0) * (R(1.0) + b[1] * x / 2.0)))
-NIST_TEST_END(Easy, Misra1b, 2)
-
-NIST_TEST_START(Misra1c)
-  b[0] * (R(1.0) - pow(R(1.0) + R(2.0) * b[1] * x, -0.5))
-NIST_TEST_END(Medium, Misra1c, 2)
-
-NIST_TEST_START(Misra1d)
-  b[0] * b[1] * x / (R(1.0) + b[1] * x)
-NIST_TEST_END(Medium, Misra1d, 2)
-
-NIST_TEST_START(Roszman1)
-  b[0] - b[1] * x - atan(b[2] / (x - b[3]))/R(kPi)
-NIST_TEST_END(Medium, Roszman1, 4)
-
-NIST_TEST_START(Rat42)
-  b[0] / (R(1.0) + exp(b[1] - b[2] * x))
-NIST_TEST_END(Hard, Rat42, 3)
-
-NIST_TEST_START(Rat43)
-  b[0] / pow(R(1.0) + exp(b[1] - b[2] * x), R(1.0) / b[3])
-NIST_TEST_END(Hard, Rat43, 4)
-
-NIST_TEST_START(Thurber)
-  (b[0] + b[1] * x + b[2] * x * x  + b[3] * x * x * x) /
-  (R(1.0) + b[4] * x + b[5] * x * x + b[6] * x * x * x)
-NIST_TEST_END(Hard, Thurber, 7)
-
-NIST_TEST_START(ENSO)
-  b[0] + b[1] * cos(R(2.0 * kPi) * x / R(12.0)) +
-         b[2] * sin(R(2.0 * kPi) * x / R(12.0)) +
-         b[4] * cos(R(2.0 * kPi) * x / b[3]) +
-         b[5] * sin(R(2.0 * kPi) * x / b[3]) +
-         b[7] * cos(R(2.0 * kPi) * x / b[6]) +
-         b[8] * sin(R(2.0 * kPi) * x / b[6])
-NIST_TEST_END(Medium, ENSO, 9)
-
-NIST_TEST_START(Eckerle4)
-  b[0] / b[1] * exp(R(-0.5) * pow((x - b[2])/b[1], 2))
-NIST_TEST_END(Hard, Eckerle4, 3)
+#include "suite_nist.h"
@@ -1,14 +1,19 @@
 // Petter Strandmark 2012-2013.
 
 #include <cmath>
+#include <cstdio>
 #include <limits>
 #include <random>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include <catch.hpp>
 #include <spii/google_test_compatibility.h>
 
 #include <spii/auto_diff_term.h>
 #include <spii/solver.h>
+#include <spii/trace.h>
 #include <spii/transformations.h>
 
 using namespace spii;
@@ -39,6 +44,8 @@ void test_method(const Solver& solver)
 	EXPECT_LT( std::fabs(x[0] - 1.0), 1e-9);
 	EXPECT_LT( std::fabs(x[1] - 1.0), 1e-9);
 	EXPECT_LT( std::fabs(f.evaluate()), 1e-9);
+	EXPECT_GT(results.iterations, 0);
+	EXPECT_LE(results.iterations, solver.maximum_iterations);
 }
 
 TEST(Solver, NEWTON)
@@ -64,6 +71,41 @@ TEST(Solver, NELDER_MEAD)
 	test_method(solver);
 }
 
+TEST(Solver, NELDER_MEAD_parallel)
+{
+	NelderMeadSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 10000;
+	solver.area_tolerance = 1e-40;
+	solver.number_of_threads = 4;
+	test_method(solver);
+}
+
+TEST(Solver, NELDER_MEAD_replace_several_vertices)
+{
+	Function f;
+	double x[6] = {-1.2, 1.0, -1.2, 1.0, 0.5, 0.5};
+	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x + 2);
+	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x + 4);
+
+	NelderMeadSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 100000;
+	solver.area_tolerance = 1e-40;
+	solver.number_of_threads = 2;
+	solver.number_of_replaced_vertices = 2;
+	SolverResults results;
+	solver.solve(f, &results);
+
+	EXPECT_TRUE(results.exit_success());
+	for (int i = 0; i < 6; ++i) {
+		EXPECT_LT(std::fabs(x[i] - 1.0), 1e-6);
+	}
+	// The evaluations of the per-thread copies are counted.
+	EXPECT_GT(f.evaluations_without_gradient, 100);
+}
+
 TEST(Solver, PATTERN_SEARCH)
 {
 	PatternSolver solver;
@@ -72,6 +114,48 @@ TEST(Solver, PATTERN_SEARCH)
 	test_method(solver);
 }
 
+TEST(Solver, PATTERN_SEARCH_parallel)
+{
+	PatternSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 100000;
+	solver.number_of_threads = 4;
+	test_method(solver);
+
+	solver.opportunistic_polling = false;
+	test_method(solver);
+}
+
+TEST(Solver, PATTERN_SEARCH_mesh_point_cache)
+{
+	PatternSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 100000;
+
+	int evaluations[2];
+	double solutions[2][2];
+	for (int cache = 0; cache <= 1; ++cache) {
+		solver.cache_mesh_points = cache == 1;
+
+		Function f;
+		double* x = solutions[cache];
+		x[0] = -1.2;
+		x[1] =  1.0;
+		f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+
+		SolverResults results;
+		solver.solve(f, &results);
+		EXPECT_TRUE(results.exit_success());
+		evaluations[cache] = f.evaluations_without_gradient;
+	}
+
+	// The cache does not change the path taken by the solver, only
+	// the number of evaluations.
+	EXPECT_EQ(solutions[0][0], solutions[1][0]);
+	EXPECT_EQ(solutions[0][1], solutions[1][1]);
+	EXPECT_LT(evaluations[1], evaluations[0]);
+}
+
 TEST(Solver, function_tolerance)
 {
 	Function f;
@@ -600,6 +684,133 @@ TEST(Solver, BoxConstraint)
 	EXPECT_NEAR(x[1], -0.5, 1e-4);
 }
 
+TEST(Solver, BoxConstraintSparseNewton)
+{
+	double x[2] = {1, 1};
+	Function function;
+	double a[2] = {0.0, -0.5};
+	double b[2] = {6.0, 10.0};
+	function.add_variable_with_change<Box>(x, 2, 2, a, b);
+	function.add_term(
+		std::make_shared<AutoDiffTerm<Quadratic2, 2>>(),
+		x);
+
+	NewtonSolver solver;
+	solver.sparsity_mode = NewtonSolver::SparsityMode::SPARSE;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	EXPECT_NEAR(x[0],  2.0, 1e-4);
+	EXPECT_NEAR(x[1], -0.5, 1e-4);
+}
+
+TEST(LBFGSSolver, bounds)
+{
+	double x[2] = {1, 1};
+	Function function;
+	double lower[2] = {0.0, -0.5};
+	double upper[2] = {6.0, std::numeric_limits<double>::infinity()};
+	function.add_variable(x, 2);
+	function.set_bounds(x, lower, upper);
+	function.add_term(
+		std::make_shared<AutoDiffTerm<Quadratic2, 2>>(),
+		x);
+
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_NEAR(x[0],  2.0, 1e-8);
+	EXPECT_EQ(x[1], -0.5);
+
+	// Bounds are not supported by the other solvers.
+	NewtonSolver newton;
+	newton.log_function = nullptr;
+	EXPECT_THROW(newton.solve(function, &results), std::runtime_error);
+}
+
+TEST(LBFGSSolver, bounds_rosenbrock)
+{
+	double x[2] = {-1.2, 1.0};
+	Function function;
+	double lower[2] = {-2.0, -2.0};
+	double upper[2] = { 0.5,  2.0};
+	function.add_variable(x, 2);
+	function.set_bounds(x, lower, upper);
+	function.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 1000;
+	SolverResults results;
+	solver.solve(function, &results);
+
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_EQ(x[0], 0.5);
+	EXPECT_NEAR(x[1], 0.25, 1e-6);
+}
+
+struct CoupledQuadratic
+{
+	CoupledQuadratic(double c_)
+		: c(c_)
+	{ }
+
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R d0 = x[0] - c;
+		R d1 = x[0] - y[0];
+		return d0*d0 + 0.5 * d1*d1;
+	}
+
+	double c;
+};
+
+TEST(LBFGSSolver, bounds_many_active)
+{
+	const int n = 100;
+	std::mt19937 prng(0);
+	std::uniform_real_distribution<double> uniform(-2.0, 2.0);
+
+	std::vector<double> x(n, 0.0), lower(n, -1.0), upper(n, 1.0);
+	Function function;
+	for (int i = 0; i < n; ++i) {
+		function.add_variable(&x[i], 1);
+		function.set_bounds(&x[i], &lower[i], &upper[i]);
+	}
+	for (int i = 0; i < n; ++i) {
+		function.add_term(std::make_shared<AutoDiffTerm<CoupledQuadratic, 1, 1>>(uniform(prng)),
+		                  &x[i], &x[(i + 1) % n]);
+	}
+
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 1000;
+	SolverResults results;
+	solver.solve(function, &results);
+	EXPECT_TRUE(results.exit_success());
+
+	// The projected gradient vanishes at the solution.
+	Eigen::VectorXd xg, g, l, u;
+	function.copy_user_to_global(&xg);
+	function.evaluate(xg, &g);
+	function.get_bounds(&l, &u);
+	int number_of_active = 0;
+	for (int i = 0; i < n; ++i) {
+		EXPECT_TRUE(l[i] <= xg[i] && xg[i] <= u[i]);
+		double projected = std::min(u[i], std::max(l[i], xg[i] - g[i])) - xg[i];
+		EXPECT_LT(std::abs(projected), 1e-5);
+		if (xg[i] == l[i] || xg[i] == u[i]) {
+			number_of_active++;
+		}
+	}
+	EXPECT_GT(number_of_active, 0);
+}
+
 template<typename SolverClass>
 void test_constant_variables()
 {
@@ -752,3 +963,313 @@ TEST(PatternSolver, empty_function_crash_bug)
 {
 	test_empty_function_crash_bug<PatternSolver>();
 }
+
+struct RosenbrockChain
+{
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R d0 =  y[0] - x[0]*x[0];
+		R d1 =  1 - x[0];
+		return 100 * d0*d0 + d1*d1;
+	}
+};
+
+template<typename SolverClass>
+void test_warm_start(SolverClass& solver, bool fewer_evaluations)
+{
+	const int n = 20;
+	std::vector<double> x_cold(n), x_warm(n);
+	Function f_cold, f_warm;
+	for (auto function: {&f_cold, &f_warm}) {
+		auto& x = function == &f_cold ? x_cold : x_warm;
+		for (int i = 0; i < n; ++i) {
+			x[i] = i % 2 == 0 ? -1.2 : 1.0;
+		}
+		for (int i = 0; i + 1 < n; ++i) {
+			function->add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &x[i], &x[i + 1]);
+		}
+	}
+
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 1000;
+	SolverState state;
+	SolverResults results;
+	solver.solve(f_warm, &results, &state);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_EQ(state.number_of_scalars, n);
+
+	// A slightly different starting point, solved with and without
+	// the state from the first solve.
+	for (int i = 0; i < n; ++i) {
+		x_warm[i] += 0.01 * (i % 3 - 1);
+		x_cold[i] = x_warm[i];
+	}
+	int evaluations_warm = f_warm.evaluations_with_gradient;
+	solver.solve(f_warm, &results, &state);
+	EXPECT_TRUE(results.exit_success());
+	evaluations_warm = f_warm.evaluations_with_gradient - evaluations_warm;
+
+	solver.solve(f_cold, &results);
+	EXPECT_TRUE(results.exit_success());
+	int evaluations_cold = f_cold.evaluations_with_gradient;
+
+	if (fewer_evaluations) {
+		EXPECT_LT(evaluations_warm, evaluations_cold);
+	}
+	else {
+		EXPECT_LE(evaluations_warm, evaluations_cold);
+	}
+	EXPECT_LT(std::fabs(f_warm.evaluate() - f_cold.evaluate()), 1e-8);
+}
+
+TEST(LBFGSSolver, warm_start)
+{
+	LBFGSSolver solver;
+	test_warm_start(solver, true);
+}
+
+TEST(NewtonSolver, warm_start)
+{
+	NewtonSolver solver;
+	solver.sparsity_mode = NewtonSolver::SparsityMode::SPARSE;
+	solver.factorization_method = NewtonSolver::FactorizationMethod::ITERATIVE;
+	// Newton's method converges quickly from nearby points anyway.
+	test_warm_start(solver, false);
+}
+
+TEST(NewtonSolver, warm_start_keeps_factorization)
+{
+	double x[2] = {-1.2, 1.0};
+	Function f;
+	f.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &x[0], &x[1]);
+
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	solver.sparsity_mode = NewtonSolver::SparsityMode::SPARSE;
+	solver.factorization_method = NewtonSolver::FactorizationMethod::ITERATIVE;
+	SolverState state;
+	SolverResults results;
+	solver.solve(f, &results, &state);
+	auto factorization = state.sparse_factorization;
+	ASSERT_TRUE(factorization);
+
+	x[0] = 0.5;
+	solver.solve(f, &results, &state);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_TRUE(state.sparse_factorization == factorization);
+
+	// A function with another number of scalars clears the state.
+	double y[3] = {0.0, 0.0, 0.0};
+	Function f2;
+	f2.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &y[0], &y[1]);
+	f2.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &y[1], &y[2]);
+	solver.solve(f2, &results, &state);
+	EXPECT_TRUE(results.exit_success());
+	EXPECT_EQ(state.number_of_scalars, 3);
+	EXPECT_TRUE(state.sparse_factorization != factorization);
+}
+
+TEST(LBFGSSolver, checkpoint_resume)
+{
+	const int n = 10;
+	std::string checkpoint_file = "test_solver_checkpoint.chk";
+	std::remove(checkpoint_file.c_str());
+
+	auto create_function = [](std::vector<double>* x, Function* f)
+	{
+		x->resize(n);
+		for (int i = 0; i < n; ++i) {
+			(*x)[i] = i % 2 == 0 ? -1.2 : 1.0;
+		}
+		for (int i = 0; i + 1 < n; ++i) {
+			f->add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &(*x)[i], &(*x)[i + 1]);
+		}
+		// Evaluations with one thread are deterministic.
+		f->set_number_of_threads(1);
+	};
+
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 1000;
+	SolverResults results;
+
+	// Uninterrupted solve.
+	std::vector<double> x_full;
+	Function f_full;
+	create_function(&x_full, &f_full);
+	solver.solve(f_full, &results);
+	auto exit_condition = results.exit_condition;
+
+	// A solve that is interrupted after 27 iterations. The last
+	// checkpoint is from iteration 25.
+	std::vector<double> x;
+	Function f;
+	create_function(&x, &f);
+	solver.checkpoint_file = checkpoint_file;
+	solver.checkpoint_interval = 5;
+	solver.maximum_iterations = 27;
+	solver.solve(f, &results);
+	EXPECT_TRUE(results.exit_condition == SolverResults::NO_CONVERGENCE);
+
+	// Resuming from a different point gives the same result as the
+	// uninterrupted solve.
+	std::vector<double> x_resumed;
+	Function f_resumed;
+	create_function(&x_resumed, &f_resumed);
+	solver.maximum_iterations = 1000;
+	solver.resume_from_checkpoint = true;
+	solver.solve(f_resumed, &results);
+	EXPECT_TRUE(results.exit_condition == exit_condition);
+	for (int i = 0; i < n; ++i) {
+		EXPECT_EQ(x_resumed[i], x_full[i]);
+	}
+
+	// The checkpoint does not fit another function.
+	double y[2] = {0, 0};
+	Function f_other;
+	f_other.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &y[0], &y[1]);
+	EXPECT_THROW(solver.solve(f_other, &results), std::runtime_error);
+
+	std::remove(checkpoint_file.c_str());
+}
+
+TEST(Solver, checkpoint_not_supported)
+{
+	double x[2] = {-1.2, 1.0};
+	Function f;
+	f.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &x[0], &x[1]);
+	SolverResults results;
+
+	NewtonSolver newton;
+	NelderMeadSolver nelder_mead;
+	PatternSolver pattern;
+	for (Solver* solver: std::vector<Solver*>{&newton, &nelder_mead, &pattern}) {
+		solver->log_function = nullptr;
+		solver->checkpoint_file = "test_solver_checkpoint_not_supported.chk";
+		EXPECT_THROW(solver->solve(f, &results), std::runtime_error);
+	}
+}
+
+int count_spans(const Trace& trace, const std::string& name)
+{
+	int count = 0;
+	for (const auto& span: trace.get_spans()) {
+		if (name == span.name) {
+			count++;
+		}
+	}
+	return count;
+}
+
+void test_trace(Solver* solver)
+{
+	Function f;
+	double x[2] = {-1.2, 1.0};
+	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+
+	Trace trace;
+	solver->log_function = nullptr;
+	solver->trace = &trace;
+	SolverResults results;
+	solver->solve(f, &results);
+
+	EXPECT_GE(count_spans(trace, "iteration"), results.iterations);
+	EXPECT_GE(count_spans(trace, "evaluate"), results.iterations);
+	EXPECT_GE(count_spans(trace, "line search"), results.iterations - 1);
+	EXPECT_GE(count_spans(trace, "terms"), count_spans(trace, "evaluate"));
+	EXPECT_GE(count_spans(trace, "assemble"), count_spans(trace, "evaluate"));
+	for (const auto& span: trace.get_spans()) {
+		EXPECT_GE(span.start_time, 0);
+		EXPECT_GE(span.duration, 0);
+	}
+
+	std::stringstream sout;
+	trace.write_chrome_trace(sout);
+	EXPECT_TRUE(sout.str().find("\"traceEvents\"") != std::string::npos);
+	EXPECT_TRUE(sout.str().find("\"name\": \"line search\", \"cat\": \"solver\", \"ph\": \"X\"") != std::string::npos);
+
+	// Nothing is recorded once the trace is removed.
+	auto number_of_spans = trace.get_spans().size();
+	solver->trace = nullptr;
+	x[0] = -1.2;
+	x[1] = 1.0;
+	solver->solve(f, &results);
+	EXPECT_EQ(trace.get_spans().size(), number_of_spans);
+	EXPECT_TRUE(Trace::active() == nullptr);
+}
+
+TEST(NewtonSolver, trace)
+{
+	NewtonSolver solver;
+	test_trace(&solver);
+
+	Trace trace;
+	solver.trace = &trace;
+	Function f;
+	double x[2] = {-1.2, 1.0};
+	f.add_term(std::make_shared<AutoDiffTerm<Rosenbrock, 2>>(), x);
+	SolverResults results;
+	solver.solve(f, &results);
+	EXPECT_GE(count_spans(trace, "factorize"), results.iterations);
+}
+
+TEST(LBFGSSolver, trace)
+{
+	LBFGSSolver solver;
+	test_trace(&solver);
+}
+
+void test_memory_usage(const Solver& solver, const std::vector<std::string>& structures)
+{
+	const int n = 100;
+	std::vector<double> x(n);
+	Function f;
+	for (int i = 0; i < n; ++i) {
+		x[i] = i % 2 == 0 ? -1.2 : 1.0;
+	}
+	for (int i = 0; i + 1 < n; ++i) {
+		f.add_term(std::make_shared<AutoDiffTerm<RosenbrockChain, 1, 1>>(), &x[i], &x[i + 1]);
+	}
+
+	auto estimate = solver.estimate_memory_usage(f);
+	SolverResults results;
+	solver.solve(f, &results);
+
+	const auto& usage = results.memory_usage;
+	EXPECT_GT(usage.peak_total, 0);
+	EXPECT_GT(usage.peak("Function: thread gradients"), 0);
+	for (const auto& name: structures) {
+		EXPECT_GT(usage.peak(name), 0);
+		EXPECT_LE(usage.peak(name), estimate.peak(name));
+	}
+	EXPECT_LE(usage.peak("Function: thread gradients"), estimate.peak("Function: thread gradients"));
+}
+
+TEST(NewtonSolver, memory_usage)
+{
+	NewtonSolver solver;
+	solver.log_function = nullptr;
+	solver.sparsity_mode = NewtonSolver::SparsityMode::SPARSE;
+	test_memory_usage(solver, {"vectors", "Hessian", "Cholesky factor",
+	                           "Function: thread sparse Hessian triplets"});
+
+	solver.sparsity_mode = NewtonSolver::SparsityMode::DENSE;
+	test_memory_usage(solver, {"vectors", "Hessian", "BKP workspace",
+	                           "Function: thread dense Hessians"});
+}
+
+TEST(LBFGSSolver, memory_usage)
+{
+	LBFGSSolver solver;
+	solver.log_function = nullptr;
+	test_memory_usage(solver, {"vectors", "history"});
+}
+
+TEST(NelderMeadSolver, memory_usage)
+{
+	NelderMeadSolver solver;
+	solver.log_function = nullptr;
+	solver.maximum_iterations = 10;
+	test_memory_usage(solver, {"simplex and trial points", "area matrix"});
+}
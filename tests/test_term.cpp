@@ -1,4 +1,7 @@
 // Petter Strandmark 2012.
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <sstream>
 
 #include <catch.hpp>
@@ -371,6 +374,120 @@ TEST_CASE("AutoDiffTerm/MyFunctor3")
 	CHECK(Approx(hessian[2][2](2,2)) == 2.0 * 4.0);
 }
 
+class NonlinearFunctor3
+{
+public:
+	template<typename R>
+	R operator()(const R* const x,
+	             const R* const y,
+	             const R* const z) const
+	{
+		return x[0]*y[0]*y[1] + sin(x[0]*z[2]) + y[1]*z[0]*z[1] + exp(y[0]*z[1]);
+	}
+};
+
+TEST_CASE("AutoDiffTerm/evaluate_flat")
+{
+	AutoDiffTerm<NonlinearFunctor3, 1, 2, 3> term;
+
+	double x[1] = {0.3};
+	double y[2] = {0.1, 0.5};
+	double z[3] = {0.5, 1.1, 0.2};
+	std::vector<double*> variables = {x, y, z};
+	const int dims[3] = {1, 2, 3};
+	const int offsets[3] = {0, 1, 3};
+
+	std::vector<Eigen::VectorXd> gradient(3);
+	std::vector< std::vector<Eigen::MatrixXd> > hessian(3);
+	for (int var0 = 0; var0 < 3; ++var0) {
+		gradient[var0].resize(dims[var0]);
+		hessian[var0].resize(3);
+		for (int var1 = 0; var1 < 3; ++var1) {
+			hessian[var0][var1].resize(dims[var0], dims[var1]);
+		}
+	}
+	double value = term.evaluate(&variables[0], &gradient, &hessian);
+
+	// The AutoDiffTerm implementation and the adapter in Term
+	// should both give the same result as the old interface.
+	for (int adapter = 0; adapter <= 1; ++adapter) {
+		double flat_gradient[6];
+		double flat_hessian[36];
+		double flat_value;
+		if (adapter) {
+			flat_value = term.Term::evaluate_flat(&variables[0], flat_gradient, flat_hessian, false);
+		}
+		else {
+			flat_value = term.evaluate_flat(&variables[0], flat_gradient, flat_hessian, false);
+		}
+		CHECK(Approx(flat_value) == value);
+
+		for (int var0 = 0; var0 < 3; ++var0) {
+			for (int i = 0; i < dims[var0]; ++i) {
+				CHECK(Approx(flat_gradient[offsets[var0] + i]) == gradient[var0](i));
+				for (int var1 = 0; var1 < 3; ++var1) {
+					for (int j = 0; j < dims[var1]; ++j) {
+						CHECK(Approx(flat_hessian[(offsets[var0] + i) + 6 * (offsets[var1] + j)])
+						      == hessian[var0][var1](i, j));
+					}
+				}
+			}
+		}
+
+		double gradient_only[6];
+		double gradient_only_value;
+		if (adapter) {
+			gradient_only_value = term.Term::evaluate_flat(&variables[0], gradient_only, nullptr, false);
+		}
+		else {
+			gradient_only_value = term.evaluate_flat(&variables[0], gradient_only, nullptr, false);
+		}
+		CHECK(Approx(gradient_only_value) == value);
+		for (int i = 0; i < 6; ++i) {
+			CHECK(Approx(gradient_only[i]) == flat_gradient[i]);
+		}
+	}
+}
+
+TEST_CASE("AutoDiffTerm/evaluate_flat_upper_only")
+{
+	AutoDiffTerm<NonlinearFunctor3, 1, 2, 3> term;
+
+	double x[1] = {0.3};
+	double y[2] = {0.1, 0.5};
+	double z[3] = {0.5, 1.1, 0.2};
+	std::vector<double*> variables = {x, y, z};
+	const int dims[3] = {1, 2, 3};
+	const int offsets[3] = {0, 1, 3};
+
+	double flat_gradient[6];
+	double full_hessian[36];
+	double value = term.evaluate_flat(&variables[0], flat_gradient, full_hessian, false);
+
+	double upper_hessian[36];
+	std::fill(upper_hessian, upper_hessian + 36, std::numeric_limits<double>::quiet_NaN());
+	double upper_value = term.evaluate_flat(&variables[0], flat_gradient, upper_hessian, true);
+	CHECK(Approx(upper_value) == value);
+
+	// Blocks on and above the diagonal are computed; the ones below
+	// are left untouched.
+	for (int var0 = 0; var0 < 3; ++var0) {
+		for (int var1 = 0; var1 < 3; ++var1) {
+			for (int i = 0; i < dims[var0]; ++i) {
+				for (int j = 0; j < dims[var1]; ++j) {
+					int index = (offsets[var0] + i) + 6 * (offsets[var1] + j);
+					if (var0 <= var1) {
+						CHECK(Approx(upper_hessian[index]) == full_hessian[index]);
+					}
+					else {
+						CHECK(std::isnan(upper_hessian[index]));
+					}
+				}
+			}
+		}
+	}
+}
+
 class MyFunctor4
 {
 public:
@@ -721,8 +838,116 @@ TEST_CASE("AutoDiffTerm/MyFunctor_1_1_1_2_2_4_4", "")
 	CHECK(gradient[6][2] == 8);
 	CHECK(gradient[6][3] == 9);
 
-	std::vector< std::vector<Eigen::MatrixXd>> empty_hessians;
-	CHECK_THROWS(term.evaluate(variables.data(), &gradient, &empty_hessians));
+	double flat_gradient[15];
+	auto value3 = term.evaluate_flat(variables.data(), flat_gradient, nullptr, false);
+	CHECK(value3 == value2);
+	int offset = 0;
+	for (int var = 0; var < 7; ++var) {
+		for (int i = 0; i < gradient[var].size(); ++i) {
+			CHECK(flat_gradient[offset + i] == gradient[var][i]);
+		}
+		offset += static_cast<int>(gradient[var].size());
+	}
+
+	// The function is linear, so the Hessian is zero.
+	std::vector< std::vector<Eigen::MatrixXd>> hessian(7);
+	for (int var0 = 0; var0 < 7; ++var0) {
+		for (int var1 = 0; var1 < 7; ++var1) {
+			hessian[var0].emplace_back(gradient[var0].size(), gradient[var1].size());
+		}
+	}
+	auto value4 = term.evaluate(variables.data(), &gradient, &hessian);
+	CHECK(value4 == value2);
+	CHECK(gradient[6][3] == 9);
+	for (int var0 = 0; var0 < 7; ++var0) {
+		for (int var1 = 0; var1 < 7; ++var1) {
+			CHECK(hessian[var0][var1].norm() == 0);
+		}
+	}
+}
+
+class Functor_2_1_3_1_2
+{
+public:
+	template<typename R>
+	R operator()(
+		const R* const x1,
+		const R* const x2,
+		const R* const x3,
+		const R* const x4,
+		const R* const x5) const
+	{
+		return
+			x1[0] * x2[0] * x3[2] +
+			sin(x1[1] * x5[0]) +
+			x3[0] * x3[1] / (x4[0] * x4[0] + 1.0) +
+			exp(0.1 * x5[1] * x1[0]);
+	}
+};
+
+// The same function with all scalars in one variable.
+class Functor_9
+{
+public:
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return Functor_2_1_3_1_2()(x, x + 2, x + 3, x + 6, x + 7);
+	}
+};
+
+TEST_CASE("AutoDiffTerm/Functor_2_1_3_1_2", "")
+{
+	AutoDiffTerm<Functor_2_1_3_1_2, 2, 1, 3, 1, 2> term;
+	AutoDiffTerm<Functor_9, 9> reference_term;
+	CHECK(term.number_of_variables() == 5);
+
+	double x[9] = {0.5, -1.2, 2.0, 0.3, 0.7, -0.4, 1.5, 0.9, -0.8};
+	std::vector<double*> variables = {x, x + 2, x + 3, x + 6, x + 7};
+	double* reference_variables[] = {x};
+
+	std::vector<Eigen::VectorXd> gradient(5), reference_gradient(1);
+	std::vector<std::vector<Eigen::MatrixXd>> hessian(5), reference_hessian(1);
+	for (int var0 = 0; var0 < 5; ++var0) {
+		gradient[var0].resize(term.variable_dimension(var0));
+		for (int var1 = 0; var1 < 5; ++var1) {
+			hessian[var0].emplace_back(term.variable_dimension(var0), term.variable_dimension(var1));
+		}
+	}
+	reference_gradient[0].resize(9);
+	reference_hessian[0].emplace_back(9, 9);
+
+	double value = term.evaluate(variables.data(), &gradient, &hessian);
+	double reference_value = reference_term.evaluate(reference_variables, &reference_gradient, &reference_hessian);
+	CHECK(Approx(value) == reference_value);
+
+	int offset0 = 0;
+	for (int var0 = 0; var0 < 5; ++var0) {
+		int offset1 = 0;
+		for (int var1 = 0; var1 < 5; ++var1) {
+			for (int i = 0; i < term.variable_dimension(var0); ++i) {
+				for (int j = 0; j < term.variable_dimension(var1); ++j) {
+					CHECK(Approx(hessian[var0][var1](i, j)) == reference_hessian[0][0](offset0 + i, offset1 + j));
+				}
+			}
+			offset1 += term.variable_dimension(var1);
+		}
+		for (int i = 0; i < term.variable_dimension(var0); ++i) {
+			CHECK(Approx(gradient[var0][i]) == reference_gradient[0][offset0 + i]);
+		}
+		offset0 += term.variable_dimension(var0);
+	}
+
+	double flat_gradient[9];
+	double flat_hessian[81];
+	value = term.evaluate_flat(variables.data(), flat_gradient, flat_hessian, false);
+	CHECK(Approx(value) == reference_value);
+	for (int i = 0; i < 9; ++i) {
+		CHECK(Approx(flat_gradient[i]) == reference_gradient[0][i]);
+		for (int j = 0; j < 9; ++j) {
+			CHECK(Approx(flat_hessian[i + 9 * j]) == reference_hessian[0][0](i, j));
+		}
+	}
 }
 
 struct DetectCopyFunctor
@@ -809,3 +1034,180 @@ TEST_CASE("AutoDiffTerm/CopiesMade")
 	CHECK(DetectCopyFunctor::num_copies == 2);
 	CHECK(DetectCopyFunctor::num_moves == 2);
 }
+
+class ElementaryFunctions
+{
+public:
+	template<typename R>
+	R operator()(const R* const x, const R* const y) const
+	{
+		R r = 0;
+		for (int i = 0; i < 9; ++i) {
+			r += x[i % 3] * y[i] - y[i] / (x[(i + 1) % 3] + 2.0);
+		}
+		r += x[0] * x[0] * sin(y[1]) + cos(x[1] * y[2]) + tan(0.1 * y[3]);
+		r += exp(0.5 * x[2]) * log(y[4] + 3.0) + sqrt(y[5] + 1.0);
+		r += asin(0.3 * y[6]) + acos(0.2 * x[0]) + atan(y[7] - x[1]);
+		r += pow(y[8] + 2.0, 2.5) + pow(x[1] + 2.0, y[0] + 1.0) + 2.0 / (y[2] + 4.0);
+		r *= 0.5;
+		r -= x[0] * 2;
+		if (r > x[0]) {
+			r /= 1.0 + y[1] * y[1];
+		}
+		return -r;
+	}
+};
+
+class SimdElementaryFunctions
+	: public ElementaryFunctions
+{
+public:
+	static const bool use_simd_dual = true;
+};
+
+TEST_CASE("AutoDiffTerm/simd_dual", "")
+{
+	AutoDiffTerm<ElementaryFunctions, 3, 9> fadbad_term;
+	AutoDiffTerm<SimdElementaryFunctions, 3, 9> simd_term;
+
+	double x[3] = {0.3, -0.7, 1.1};
+	double y[9] = {0.4, 1.3, -0.2, 0.9, 1.7, 0.5, -1.2, 0.8, 0.1};
+	double* variables[2] = {x, y};
+
+	double fadbad_gradient[12], simd_gradient[12];
+	double fadbad_hessian[144], simd_hessian[144];
+
+	double value1 = fadbad_term.evaluate_flat(variables, fadbad_gradient, nullptr, false);
+	double value2 = simd_term.evaluate_flat(variables, simd_gradient, nullptr, false);
+	CHECK(Approx(value1) == value2);
+	for (int i = 0; i < 12; ++i) {
+		CHECK(Approx(fadbad_gradient[i]) == simd_gradient[i]);
+	}
+
+	value1 = fadbad_term.evaluate_flat(variables, fadbad_gradient, fadbad_hessian, false);
+	value2 = simd_term.evaluate_flat(variables, simd_gradient, simd_hessian, false);
+	CHECK(Approx(value1) == value2);
+	for (int i = 0; i < 12; ++i) {
+		CHECK(Approx(fadbad_gradient[i]) == simd_gradient[i]);
+	}
+	for (int i = 0; i < 144; ++i) {
+		CHECK(Approx(fadbad_hessian[i]) == simd_hessian[i]);
+	}
+
+	// With upper_only, the (y, x) block is left untouched.
+	std::fill(simd_hessian, simd_hessian + 144, std::numeric_limits<double>::quiet_NaN());
+	simd_term.evaluate_flat(variables, simd_gradient, simd_hessian, true);
+	for (int s = 0; s < 12; ++s) {
+		for (int t = 0; t < 12; ++t) {
+			if (s >= 3 && t < 3) {
+				CHECK(std::isnan(simd_hessian[s + 12 * t]));
+			}
+			else {
+				CHECK(Approx(fadbad_hessian[s + 12 * t]) == simd_hessian[s + 12 * t]);
+			}
+		}
+	}
+}
+
+template<typename TermType>
+void check_evaluate_flat_active(const TermType& term, double* const* variables)
+{
+	int n = term.number_of_variables();
+	int dimension = 0;
+	for (int var = 0; var < n; ++var) {
+		dimension += term.variable_dimension(var);
+	}
+	std::vector<double> gradient1(dimension), gradient2(dimension);
+	std::vector<double> hessian1(dimension * dimension), hessian2(dimension * dimension);
+
+	for (int mask = 0; mask < (1 << n); ++mask) {
+		std::unique_ptr<bool[]> active(new bool[n]);
+		int active_dimension = 0;
+		for (int var = 0; var < n; ++var) {
+			active[var] = (mask & (1 << var)) != 0;
+			if (active[var]) {
+				active_dimension += term.variable_dimension(var);
+			}
+		}
+
+		// The default implementation in Term computes everything and
+		// drops the inactive parts.
+		double value1 = term.Term::evaluate_flat_active(variables, active.get(), gradient1.data(), nullptr, false);
+		double value2 = term.evaluate_flat_active(variables, active.get(), gradient2.data(), nullptr, false);
+		CHECK(Approx(value1) == value2);
+		for (int i = 0; i < active_dimension; ++i) {
+			CHECK(Approx(gradient1[i]) == gradient2[i]);
+		}
+
+		value1 = term.Term::evaluate_flat_active(variables, active.get(), gradient1.data(), hessian1.data(), false);
+		value2 = term.evaluate_flat_active(variables, active.get(), gradient2.data(), hessian2.data(), false);
+		CHECK(Approx(value1) == value2);
+		for (int i = 0; i < active_dimension; ++i) {
+			CHECK(Approx(gradient1[i]) == gradient2[i]);
+		}
+		for (int i = 0; i < active_dimension * active_dimension; ++i) {
+			CHECK(Approx(hessian1[i]) == hessian2[i]);
+		}
+	}
+}
+
+TEST_CASE("AutoDiffTerm/evaluate_flat_active", "")
+{
+	double x[9] = {0.5, -1.2, 2.0, 0.3, 0.7, -0.4, 1.5, 0.9, -0.8};
+	std::vector<double*> variables = {x, x + 2, x + 3, x + 6, x + 7};
+	check_evaluate_flat_active(AutoDiffTerm<Functor_2_1_3_1_2, 2, 1, 3, 1, 2>(), variables.data());
+	check_evaluate_flat_active(AutoDiffTerm<Functor_9, 9>(), variables.data());
+
+	double y[9] = {0.4, 1.3, -0.2, 0.9, 1.7, 0.5, -1.2, 0.8, 0.1};
+	double* variables2[] = {x, y};
+	check_evaluate_flat_active(AutoDiffTerm<ElementaryFunctions, 3, 9>(), variables2);
+	check_evaluate_flat_active(AutoDiffTerm<SimdElementaryFunctions, 3, 9>(), variables2);
+}
+
+template<int exponent_times_two>
+class SimdPowAtZero
+{
+public:
+	static const bool use_simd_dual = true;
+
+	template<typename R>
+	R operator()(const R* const x) const
+	{
+		return pow(x[0], exponent_times_two / 2.0);
+	}
+};
+
+TEST_CASE("AutoDiffTerm/simd_dual_pow_at_zero", "")
+{
+	double x[1] = {0.0};
+	double* variables[1] = {x};
+	double gradient[1];
+	double hessian[1];
+
+	// pow(x, 0.5) has an infinite derivative at 0.
+	AutoDiffTerm<SimdPowAtZero<1>, 1> sqrt_term;
+	CHECK(sqrt_term.evaluate_flat(variables, gradient, nullptr, false) == 0.0);
+	CHECK(gradient[0] == std::numeric_limits<double>::infinity());
+
+	// pow(x, 1.5) has an infinite second derivative at 0.
+	AutoDiffTerm<SimdPowAtZero<3>, 1> pow_term;
+	CHECK(pow_term.evaluate_flat(variables, gradient, hessian, false) == 0.0);
+	CHECK(gradient[0] == 0.0);
+	CHECK(hessian[0] == std::numeric_limits<double>::infinity());
+
+	// Derivatives that vanish are exactly zero, not NaN.
+	AutoDiffTerm<SimdPowAtZero<0>, 1> constant_term;
+	CHECK(constant_term.evaluate_flat(variables, gradient, hessian, false) == 1.0);
+	CHECK(gradient[0] == 0.0);
+	CHECK(hessian[0] == 0.0);
+
+	AutoDiffTerm<SimdPowAtZero<2>, 1> linear_term;
+	CHECK(linear_term.evaluate_flat(variables, gradient, hessian, false) == 0.0);
+	CHECK(gradient[0] == 1.0);
+	CHECK(hessian[0] == 0.0);
+
+	AutoDiffTerm<SimdPowAtZero<4>, 1> square_term;
+	CHECK(square_term.evaluate_flat(variables, gradient, hessian, false) == 0.0);
+	CHECK(gradient[0] == 0.0);
+	CHECK(hessian[0] == 2.0);
+}